@@ -11,8 +11,12 @@ $(ANON_ROOT)/examples/echo/main.cpp\
 $(ANON_ROOT)/src/cpp/io_dispatch.cpp\
 $(ANON_ROOT)/src/cpp/fiber.cpp\
 $(ANON_ROOT)/src/cpp/tcp_server.cpp\
+$(ANON_ROOT)/src/cpp/ip_rate_limiter.cpp\
 $(ANON_ROOT)/src/cpp/lock_checker.cpp\
 $(ANON_ROOT)/src/cpp/http_server.cpp\
+$(ANON_ROOT)/src/cpp/access_log.cpp\
+$(ANON_ROOT)/src/cpp/http_request_parser.cpp\
+$(ANON_ROOT)/src/cpp/http_compression.cpp\
 $(ANON_ROOT)/src/cpp/tls_context.cpp\
 $(ANON_ROOT)/src/cpp/tls_pipe.cpp\
 $(ANON_PARENT)/http-parser/http_parser.c
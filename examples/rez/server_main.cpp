@@ -62,35 +62,11 @@ void add_mapping(const std::string &method, const std::string &path, T t)
   response_map[method][path] = new c_helper_t<T>(t);
 }
 
-// simple hack
+// the resources are gzip'ed at build time, so that is the only
+// encoding we can offer
 static bool permits_gzip(const string_len &s)
 {
-  if (s.len() == 0)
-    return false;
-  auto p = s.ptr();
-  auto ep = p + s.len();
-  while (p < ep)
-  {
-    auto c = (const char *)memchr(p, ',', ep - p);
-    if (!c)
-      c = ep;
-    if (((c >= p + 4 /*strlen("gzip")*/) && !memcmp(p, "gzip", 4)) || *p == '*')
-    {
-      p += *p == '*' ? 1 : 4;
-      if (p < ep && *p == ';')
-      {
-        ++p;
-        auto len = c - p;
-        if (len >= 3 /*strlen("q=0")*/ && memmem(p, len, "q=0", 3))
-          return false;
-      }
-      return true;
-    }
-    p = c;
-    while (p < ep && *p == ' ')
-      ++p;
-  }
-  return false;
+  return http_compression::choose(s, http_compression::k_gzip) == http_compression::k_gzip;
 }
 
 void server_init(bool is_live_reload)
@@ -118,6 +94,7 @@ void server_init(bool is_live_reload)
         http_response response;
         response.add_header("etag", ent->etag);
         response.add_header("content-type", ent->content_type);
+        response.add_header("vary", "accept-encoding");
         if (permits_gzip(request.headers.get_header("accept-encoding")))
         {
           response.add_header("content-encoding", "gzip");
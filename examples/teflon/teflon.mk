@@ -11,9 +11,14 @@ $(ANON_ROOT)/examples/teflon/main.cpp\
 $(ANON_ROOT)/src/cpp/io_dispatch.cpp\
 $(ANON_ROOT)/src/cpp/fiber.cpp\
 $(ANON_ROOT)/src/cpp/tcp_server.cpp\
+$(ANON_ROOT)/src/cpp/ip_rate_limiter.cpp\
 $(ANON_ROOT)/src/cpp/tcp_client.cpp\
 $(ANON_ROOT)/src/cpp/lock_checker.cpp\
 $(ANON_ROOT)/src/cpp/http_server.cpp\
+$(ANON_ROOT)/src/cpp/access_log.cpp\
+$(ANON_ROOT)/src/cpp/http_request_parser.cpp\
+$(ANON_ROOT)/src/cpp/http_compression.cpp\
+$(ANON_ROOT)/src/cpp/file_server.cpp\
 $(ANON_ROOT)/src/cpp/http_client.cpp\
 $(ANON_ROOT)/src/cpp/udp_dispatch.cpp\
 $(ANON_ROOT)/src/cpp/tls_context.cpp\
@@ -110,9 +115,12 @@ cflags+=-DANON_AWS_APPLICATION_AUTOSCALING
 endif
 
 ifneq ($(TEFLON_REQUEST_DISPATCHER),)
-LIBS:=-lpcrecpp $(LIBS)
 SOURCES+=\
 $(ANON_ROOT)/src/cpp/request_dispatcher.cpp\
+$(ANON_ROOT)/src/cpp/path_router.cpp\
+$(ANON_ROOT)/src/cpp/json_reader.cpp\
+$(ANON_ROOT)/src/cpp/json_writer.cpp\
+$(ANON_ROOT)/src/cpp/response_cache.cpp\
 $(ANON_ROOT)/src/cpp/http_error.cpp
 cflags+=-DTEFLON_REQUEST_DISPATCHER
 endif
@@ -22,25 +22,124 @@
 
 #include "http2_test.h"
 #include "http2_client.h"
+#include "tcp_client.h"
+#include "time_utils.h"
+#include <string.h>
 
+namespace
+{
+
+const int k_concurrency = 256;
+const int k_num_requests = 50000;
+const int k_h2_connections = 4;
+
+// one HTTP/1.1 keep-alive connection, sending its next request
+// when it has read the response to the previous one
+int http1_client(const char *host, int port, int num_requests)
+{
+  auto conn = tcp_client::connect(host, port);
+  if (conn.first != 0)
+    anon_throw(std::runtime_error, "connect to " << host << ":" << port << " failed: " << error_string(conn.first));
+  auto &pipe = conn.second;
+  std::string req = std::string("GET / HTTP/1.1\r\nhost: ") + host + "\r\n\r\n";
+  std::vector<char> buf(16384);
+  size_t have = 0;
+  int completed = 0;
+  while (completed < num_requests)
+  {
+    pipe->write(req.data(), req.size());
+    char *hdr_end;
+    while (true)
+    {
+      hdr_end = (char *)memmem(&buf[0], have, "\r\n\r\n", 4);
+      if (hdr_end)
+        break;
+      if (have == buf.size())
+        anon_throw(std::runtime_error, "response headers too large");
+      have += pipe->read(&buf[have], buf.size() - have);
+    }
+    hdr_end += 4;
+    size_t body_len = 0;
+    auto cl = (char *)memmem(&buf[0], hdr_end - &buf[0], "content-length:", 15);
+    if (cl)
+      body_len = strtoul(cl + 15, 0, 10);
+    size_t total = (hdr_end - &buf[0]) + body_len;
+    if (total > buf.size())
+      anon_throw(std::runtime_error, "response too large");
+    while (have < total)
+      have += pipe->read(&buf[have], buf.size() - have);
+    memmove(&buf[0], &buf[total], have - total);
+    have -= total;
+    ++completed;
+  }
+  return completed;
+}
+
+void report(const std::string &name, int completed, double secs)
+{
+  anon_log(name << ": " << completed << " requests in " << secs << " seconds, " << (int)(completed / secs) << " requests/sec");
+}
+
+} // namespace
+
+// GET / from the http_server running on localhost:http_port, with
+// k_concurrency requests outstanding at a time, first as HTTP/2
+// streams multiplexed over a few connections, then with one HTTP/1.1
+// keep-alive connection per outstanding request
 void run_http2_test(int http_port)
 {
-  anon_log("sending http/2 upgrade to localhost:" << http_port);
-  http2_client::connect_and_run("localhost", http_port, [](http_server::pipe_t &pipe) {
-    anon_log("upgrade request succeeded!");
-
-    http2 h2(true, [](std::unique_ptr<fiber_pipe> &&read_pipe, http_server::pipe_t &write_pipe, uint32_t stream_id) {
-      anon_log("new HEADERS or PUSH_PROMISE for stream_id: " << stream_id);
-    });
-
-    fiber cf([&h2, &pipe] {
-      h2.run(pipe);
-    });
-
-    std::vector<http2::hpack_header> req_headers;
-    req_headers.push_back(http2::hpack_header(":method", "GET"));
-    req_headers.push_back(http2::hpack_header(":scheme", "http"));
-    req_headers.push_back(http2::hpack_header(":path", "/"));
-    h2.open_stream(pipe, req_headers, true);
-  });
+  fiber::run_in_fiber([http_port] {
+    const char *host = "localhost";
+    anon_log("benchmarking " << k_num_requests << " requests, " << k_concurrency << " at a time, to " << host << ":" << http_port);
+
+    try
+    {
+      std::vector<std::unique_ptr<http2_client>> clients;
+      for (int i = 0; i < k_h2_connections; i++)
+      {
+        auto conn = tcp_client::connect(host, http_port);
+        if (conn.first != 0)
+          anon_throw(std::runtime_error, "connect to " << host << ":" << http_port << " failed: " << error_string(conn.first));
+        clients.emplace_back(new http2_client(std::move(conn.second)));
+      }
+
+      std::atomic<int> completed(0);
+      auto start_time = cur_time();
+      std::vector<std::function<void()>> fns;
+      for (int c = 0; c < k_concurrency; c++)
+        fns.push_back([c, host, &clients, &completed] {
+          auto &client = *clients[c % clients.size()];
+          for (int i = c; i < k_num_requests; i += k_concurrency)
+          {
+            auto resp = client.request("GET", host, "/");
+            if (resp.status != 200)
+              anon_throw(std::runtime_error, "http2 response status " << resp.status);
+            ++completed;
+          }
+        });
+      fiber::run_in_parallel(fns, fiber::k_small_stack_size, "http2_bench");
+      report("HTTP/2, " + std::to_string(k_h2_connections) + " connections", completed, to_seconds(cur_time() - start_time));
+    }
+    catch (const std::exception &e)
+    {
+      anon_log("HTTP/2 benchmark failed: " << e.what());
+    }
+
+    try
+    {
+      std::atomic<int> completed(0);
+      auto start_time = cur_time();
+      std::vector<std::function<void()>> fns;
+      for (int c = 0; c < k_concurrency; c++)
+        fns.push_back([c, host, http_port, &completed] {
+          completed += http1_client(host, http_port, (k_num_requests - c + k_concurrency - 1) / k_concurrency);
+        });
+      fiber::run_in_parallel(fns, fiber::k_default_stack_size, "http1_bench");
+      report("HTTP/1.1 keep-alive, " + std::to_string(k_concurrency) + " connections", completed, to_seconds(cur_time() - start_time));
+    }
+    catch (const std::exception &e)
+    {
+      anon_log("HTTP/1.1 benchmark failed: " << e.what());
+    }
+  }, fiber::k_default_stack_size, "http2_test");
 }
@@ -22,4 +22,5 @@
 
 #pragma once
 
+// compares HTTP/2 against HTTP/1.1 keep-alive, see http2_test.cpp
 void run_http2_test(int http_port);
@@ -0,0 +1,319 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "access_log.h"
+#include "http_server.h"
+#include "log.h"
+#include <arpa/inet.h>
+#include <condition_variable>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static_assert(sizeof(access_log::entry) == 256, "access_log::entry should be 256 bytes");
+
+std::atomic<bool> access_log::running_(false);
+
+namespace
+{
+
+// single producer (the thread that owns it), single consumer (the
+// writer thread).  head and tail only ever grow, and are kept on
+// cache lines of their own so the two threads don't fight over them.
+struct ring
+{
+  ring(size_t size)
+      : slots(size),
+        mask(size - 1)
+  {
+  }
+
+  std::vector<access_log::entry> slots;
+  size_t mask;
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  std::atomic<uint64_t> dropped{0};
+};
+
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<ring>> rings; // never freed, threads keep pointers to them
+thread_local ring *this_ring;
+size_t ring_size = access_log::k_default_ring_records;
+
+std::mutex writer_mutex;
+std::condition_variable writer_cond;
+std::thread writer;
+bool stopping;
+int out_fd = -1;
+int flush_interval_ms;
+std::atomic<uint64_t> written_bytes(0);
+
+ring *get_ring()
+{
+  if (!this_ring)
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    rings.emplace_back(new ring(ring_size));
+    this_ring = rings.back().get();
+  }
+  return this_ring;
+}
+
+void write_all(const std::string &out)
+{
+  size_t written = 0;
+  while (written < out.size())
+  {
+    auto n = ::write(out_fd, out.data() + written, out.size() - written);
+    if (n <= 0)
+    {
+      if (n == -1 && errno == EINTR)
+        continue;
+      // nothing we can usefully do about it, and it
+      // shouldn't stop the rest of the program
+      break;
+    }
+    written += n;
+  }
+  written_bytes += written;
+}
+
+// append the 'len' bytes at 'p' so they can't end the quoted field
+// they are written in, or the line - '"', '\\', control characters
+// and anything that isn't ascii are written as \xHH
+void append_escaped(std::string &out, const char *p, size_t len)
+{
+  static const char hex[] = "0123456789abcdef";
+  auto end = p + len;
+  auto run = p;
+  for (; p < end; p++)
+  {
+    auto c = (unsigned char)*p;
+    if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+      continue;
+    out.append(run, p - run);
+    char esc[4] = {'\\', 'x', hex[c >> 4], hex[c & 15]};
+    out.append(esc, 4);
+    run = p + 1;
+  }
+  out.append(run, end - run);
+}
+
+// "127.0.0.1 - - [18/Oct/2026:16:21:39 +0000] "GET /x HTTP/1.1" 200 1234 567us"
+void format(std::string &out, const access_log::entry &e)
+{
+  thread_local time_t date_sec = 0;
+  thread_local char date[40];
+
+  char peer[INET6_ADDRSTRLEN] = "-";
+  if (e.peer.sin6_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&e.peer.sin6_addr))
+    inet_ntop(AF_INET, &e.peer.sin6_addr.s6_addr[12], peer, sizeof(peer));
+  else if (e.peer.sin6_family == AF_INET6)
+    inet_ntop(AF_INET6, &e.peer.sin6_addr, peer, sizeof(peer));
+  else if (e.peer.sin6_family == AF_INET)
+    inet_ntop(AF_INET, &((const struct sockaddr_in *)&e.peer)->sin_addr, peer, sizeof(peer));
+
+  time_t sec = e.time_ns / 1000000000;
+  if (sec != date_sec)
+  {
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    strftime(date, sizeof(date), "[%d/%b/%Y:%H:%M:%S +0000]", &tm);
+    date_sec = sec;
+  }
+
+  char line[128];
+  out += peer;
+  out += " - - ";
+  out += date;
+  out += " \"";
+  out += http_method_str((enum http_method)e.method);
+  out += ' ';
+  append_escaped(out, e.url, e.url_len);
+  snprintf(line, sizeof(line), " HTTP/%d.%d\" ", e.version / 10, e.version % 10);
+  out += line;
+  if (e.status)
+    snprintf(line, sizeof(line), "%d %llu %uus\n", e.status, (unsigned long long)e.bytes, e.latency_us);
+  else
+    snprintf(line, sizeof(line), "- %llu %uus\n", (unsigned long long)e.bytes, e.latency_us);
+  out += line;
+}
+
+// format and write everything in the rings.  Returns
+// once there was nothing left to take out of them.
+void drain(std::string &out, uint64_t &dropped_reported)
+{
+  std::vector<ring *> all;
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (auto &r : rings)
+      all.push_back(r.get());
+  }
+
+  uint64_t dropped = 0;
+  for (auto r : all)
+  {
+    auto tail = r->tail.load(std::memory_order_relaxed);
+    auto head = r->head.load(std::memory_order_acquire);
+    while (tail != head)
+    {
+      format(out, r->slots[tail & r->mask]);
+      ++tail;
+      // let the producer have the slots back before
+      // doing anything as slow as a write
+      if (out.size() >= 64 * 1024)
+      {
+        r->tail.store(tail, std::memory_order_release);
+        write_all(out);
+        out.clear();
+      }
+    }
+    r->tail.store(tail, std::memory_order_release);
+    dropped += r->dropped.load(std::memory_order_relaxed);
+  }
+
+  if (dropped != dropped_reported)
+  {
+    out += "# access_log dropped " + std::to_string(dropped - dropped_reported) + " records\n";
+    dropped_reported = dropped;
+  }
+  if (!out.empty())
+  {
+    write_all(out);
+    out.clear();
+  }
+}
+
+void write_loop()
+{
+  std::string out;
+  uint64_t dropped_reported = 0;
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (auto &r : rings)
+      dropped_reported += r->dropped;
+  }
+  std::unique_lock<std::mutex> lock(writer_mutex);
+  while (true)
+  {
+    bool stop = stopping;
+    lock.unlock();
+    drain(out, dropped_reported);
+    lock.lock();
+    if (stop)
+      break;
+    writer_cond.wait_for(lock, std::chrono::milliseconds(flush_interval_ms));
+  }
+}
+
+} // namespace
+
+void access_log::start(const std::string &path, int flush_ms, size_t ring_records)
+{
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  if (running_)
+    anon_throw(std::runtime_error, "access_log::start called while already running");
+
+  if (path.empty() || path == "-")
+    out_fd = 1;
+  else
+  {
+    out_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (out_fd == -1)
+      do_error("open(\"" << path << "\", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)");
+  }
+
+  size_t size = 1;
+  while (size < ring_records)
+    size <<= 1;
+  {
+    std::lock_guard<std::mutex> rlock(rings_mutex);
+    ring_size = size;
+  }
+  flush_interval_ms = flush_ms;
+  stopping = false;
+  writer = std::thread(write_loop);
+  running_ = true;
+}
+
+void access_log::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex);
+    if (!running_)
+      return;
+    running_ = false;
+    stopping = true;
+  }
+  writer_cond.notify_one();
+  writer.join();
+  if (out_fd != 1)
+    close(out_fd);
+  out_fd = -1;
+}
+
+void access_log::record(const http_request &request, int status, uint64_t bytes, uint64_t latency_us)
+{
+  if (!running())
+    return;
+
+  auto r = get_ring();
+  auto head = r->head.load(std::memory_order_relaxed);
+  if (head - r->tail.load(std::memory_order_acquire) > r->mask)
+  {
+    r->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  auto &e = r->slots[head & r->mask];
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  e.time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  e.bytes = bytes;
+  e.latency_us = latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us;
+  e.status = status;
+  e.method = request.method;
+  e.version = request.http_major * 10 + request.http_minor;
+  if (request.src_addr && request.src_addr_len <= sizeof(e.peer))
+    memcpy(&e.peer, request.src_addr, request.src_addr_len);
+  else
+    e.peer.sin6_family = AF_UNSPEC;
+  auto url_len = std::min(request.url_str.size(), (size_t)k_max_url);
+  memcpy(&e.url[0], request.url_str.data(), url_len);
+  e.url_len = url_len;
+
+  r->head.store(head + 1, std::memory_order_release);
+}
+
+access_log::stats_t access_log::stats()
+{
+  stats_t st{0, 0, written_bytes};
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (auto &r : rings)
+  {
+    st.recorded += r->head;
+    st.dropped += r->dropped;
+  }
+  return st;
+}
@@ -0,0 +1,103 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+struct http_request;
+
+// an access log that costs the thread handling a request as little
+// as possible.  record copies what is worth logging about a request
+// into a fixed size binary record in a ring buffer belonging to the
+// calling thread - no formatting, no locks, no system calls.  A
+// background thread started by start takes the records out of all
+// of the rings, formats them in the common log format (with the
+// time in UTC and the request's latency added on the end), and
+// writes them in batches every flush_ms milliseconds.
+//
+// When a thread's ring is full its new records are dropped and
+// counted, and the writer notes how many were dropped in the log
+// itself.  Urls longer than k_max_url are cut short, and quotes,
+// backslashes and control characters in them are written as \xHH.
+//
+// http_server records each request when set_access_log(true) has
+// been called on it.
+class access_log
+{
+public:
+  enum
+  {
+    k_default_ring_records = 4096,
+    k_default_flush_ms = 100,
+    k_max_url = 200
+  };
+
+  // start the writer thread, appending to the file 'path', or to
+  // stdout if 'path' is "" or "-".  Rings created after this have
+  // room for 'ring_records' records (rounded up to a power of 2).
+  static void start(const std::string &path, int flush_ms = k_default_flush_ms,
+                    size_t ring_records = k_default_ring_records);
+
+  // write everything recorded so far and stop the writer thread.
+  // Records made after this are ignored.
+  static void stop();
+
+  static bool running()
+  {
+    return running_.load(std::memory_order_relaxed);
+  }
+
+  // 'bytes' is the size of the response body, 'latency_us'
+  // how long the request took to handle
+  static void record(const http_request &request, int status, uint64_t bytes, uint64_t latency_us);
+
+  struct stats_t
+  {
+    uint64_t recorded;
+    uint64_t dropped;
+    uint64_t written_bytes;
+  };
+
+  static stats_t stats();
+
+  // what record stores.  256 bytes in all.
+  struct entry
+  {
+    uint64_t time_ns; // CLOCK_REALTIME, when record was called
+    uint64_t bytes;
+    uint32_t latency_us;
+    uint16_t status;
+    uint8_t method;
+    uint8_t version; // 10 * http_major + http_minor
+    struct sockaddr_in6 peer; // or a sockaddr_in
+    uint16_t url_len;
+    char url[k_max_url];
+  };
+
+private:
+  static std::atomic<bool> running_;
+};
@@ -311,6 +311,19 @@ public:
   bool success;
 };
 
+// servers routinely close keep-alive connections that have been
+// idle for a while.  Catch that here, before the socket gets used,
+// so it doesn't turn into an io exception (and a retry with backoff)
+// in the middle of the next request.  Nothing should arrive on an
+// idle connection, so if anything is readable (eof, or a tls alert
+// that precedes the close) it isn't safe to reuse.
+bool closed_while_idle(const pipe_t *pipe)
+{
+  char c;
+  auto ret = recv(pipe->get_fd(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
 } // namespace
 
 void endpoint_cluster::do_with_connected_pipe(const std::function<bool(const pipe_t *pipe)> &f)
@@ -385,12 +398,20 @@ void endpoint_cluster::do_with_connected_pipe(const std::function<bool(const pip
     {
       auto s = ep->socks_.front();
       ep->socks_.pop();
-      if (cur_time() < s->idle_start_time + k_max_idle_time)
-        sock = s;
+      if (!(cur_time() < s->idle_start_time + k_max_idle_time))
+      {
 #ifdef ANON_LOG_DNS_LOOKUP
-      else
         anon_log("releasing socket (fd=" << s->pipe_->get_fd() << ", from " << ep->addr_ << ") because it has been idle for " << cur_time() - s->idle_start_time << " seconds");
 #endif
+      }
+      else if (closed_while_idle(s->pipe_.get()))
+      {
+#ifdef ANON_LOG_DNS_LOOKUP
+        anon_log("releasing socket (fd=" << s->pipe_->get_fd() << ", from " << ep->addr_ << ") because the server closed it");
+#endif
+      }
+      else
+        sock = s;
     }
 
     if (sock)
@@ -23,6 +23,9 @@
 #include "fiber.h"
 #include "time_utils.h"
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <thread>
 
 #ifdef ANON_USE_ASAN
 #include <pthread.h>
@@ -379,11 +382,57 @@ void fiber::msleep(int milliseconds)
   tls_io_params.msleep(milliseconds);
 }
 
+int fiber::wait_any(pipe_wait *waits, size_t count, int timeout_ms)
+{
+  anon::assert_no_locks();
+  struct timespec deadline;
+  if (timeout_ms >= 0)
+    deadline = cur_time() + timeout_ms / 1000.0;
+
+  struct pollfd stack_fds[8];
+  std::vector<struct pollfd> heap_fds;
+  auto fds = &stack_fds[0];
+  if (count > sizeof(stack_fds) / sizeof(stack_fds[0]))
+  {
+    heap_fds.resize(count);
+    fds = &heap_fds[0];
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    fds[i].fd = waits[i].pipe->get_fd();
+    fds[i].events = waits[i].events;
+    fds[i].revents = 0;
+  }
+
+  // edges only say that something changed, so the answer always
+  // comes from poll, and we only sleep when it says nothing is ready
+  while (true)
+  {
+    auto ret = ::poll(fds, count, 0);
+    if (ret < 0 && errno != EINTR)
+      anon_throw(fiber_io_error, "poll(<fds>, " << count << ", 0) failed with errno: " << errno_string());
+    if (ret > 0)
+    {
+      for (size_t i = 0; i < count; i++)
+        waits[i].revents = fds[i].revents;
+      return ret;
+    }
+    if (timeout_ms >= 0 && !(cur_time() < deadline))
+    {
+      for (size_t i = 0; i < count; i++)
+        waits[i].revents = 0;
+      return 0;
+    }
+    tls_io_params.sleep_until_any_io_possible(waits, count, timeout_ms >= 0 ? &deadline : 0);
+  }
+}
+
 /////////////////////////////////////////////////
 
 const struct timespec fiber_pipe::forever = {std::numeric_limits<time_t>::max(), 1000000000 - 1};
 fiber_pipe *fiber_pipe::first_ = 0;
 std::mutex fiber_pipe::list_mutex_;
+fiber_pipe::poll_desc *fiber_pipe::free_descs_ = 0;
 int fiber_pipe::num_net_pipes_;
 fiber_mutex fiber_pipe::zero_net_pipes_mutex_;
 fiber_cond fiber_pipe::zero_net_pipes_cond_;
@@ -391,11 +440,8 @@ fiber_cond fiber_pipe::zero_net_pipes_cond_;
 fiber_pipe::fiber_pipe(int socket_fd, pipe_sock_t socket_type)
     : fd_(socket_fd),
       socket_type_(socket_type),
-      io_fiber_(0),
       max_io_block_time_(0),
-      io_timeout_(forever),
-      attached_(false),
-      remote_hangup_(false),
+      io_timeout_{forever, forever},
       hibernating_(false)
 {
   if (socket_type == network)
@@ -413,6 +459,13 @@ fiber_pipe::fiber_pipe(int socket_fd, pipe_sock_t socket_type)
   }
 
   std::lock_guard<std::mutex> lock(list_mutex_);
+  if (free_descs_)
+  {
+    pd_ = free_descs_;
+    free_descs_ = pd_->next_free_;
+  }
+  else
+    pd_ = new poll_desc;
   next_ = first_;
   if (next_)
     next_->prev_ = this;
@@ -436,6 +489,17 @@ fiber_pipe::~fiber_pipe()
       prev_->next_ = next_;
     else
       first_ = next_;
+
+    // closing the fd removed it from epoll, but an event for it
+    // may already be on its way to io_avail.  Changing seq_ makes
+    // that event a no-op.
+    pd_->seq_++;
+    pd_->events_ = 0;
+    pd_->remote_hangup_ = false;
+    pd_->waiters_[k_read] = 0;
+    pd_->waiters_[k_write] = 0;
+    pd_->next_free_ = free_descs_;
+    free_descs_ = pd_;
   }
   if (socket_type_ == network) {
     fiber_lock lock(zero_net_pipes_mutex_);
@@ -444,61 +508,246 @@ fiber_pipe::~fiber_pipe()
   }
 }
 
-void fiber_pipe::io_avail(const struct epoll_event &event)
+fiber *fiber_pipe::poll_desc::signal(int dir)
 {
-  if (event.events & EPOLLRDHUP)
-    remote_hangup_ = true;
-  tls_io_params.wake_all(io_fiber_);
+  auto &w = waiters_[dir];
+  auto cur = w.load();
+  while (cur != ready())
+  {
+    if (cur == 0)
+    {
+      // no one is waiting, remember the edge for the next
+      // fiber that gets EAGAIN in this direction
+      if (w.compare_exchange_weak(cur, ready()))
+        return 0;
+    }
+    else if (w.compare_exchange_weak(cur, 0))
+      return cur;
+  }
+  return 0;
 }
 
-size_t fiber_pipe::read(void *buf, size_t count) const
+void fiber_pipe::poll_desc::watch(int fd, uint32_t event)
 {
-  anon::assert_no_locks();
-  ssize_t num_bytes_read;
-  while (true)
+  // a reader and a writer can both get here at the same time
+  std::lock_guard<std::mutex> lock(events_mutex_);
+  auto cur = events_.load();
+  if (cur & event)
+    return;
+  io_dispatch::epoll_ctl(cur ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd,
+                         cur | event | EPOLLET | EPOLLRDHUP, this, seq_);
+  events_ = cur | event;
+}
+
+void fiber_pipe::wake_waiter(fiber *w)
+{
+  if (is_parked(w))
+    resume_parked(w, false);
+  else if (multi_wait::is_tagged(w))
+    multi_wait::from_tagged(w)->wake();
+  else
+    tls_io_params.wake_all(w);
+}
+
+void fiber_pipe::resume_parked(fiber *f, bool closing)
+{
+  auto reader = from_parked_tag(f);
+  fiber::run_in_fiber(
+      [reader, closing] {
+        reader->parked_pipe_->io_timeout_[k_read] = forever;
+        reader->resume(closing);
+      },
+      reader->parked_stack_size_, "fiber_pipe::park_read");
+}
+
+bool fiber_pipe::park_read(parked_reader *reader, size_t stack_size)
+{
+  reader->parked_pipe_ = this;
+  reader->parked_stack_size_ = stack_size;
+  if (max_io_block_time_ > 0)
+    io_timeout_[k_read] = cur_time() + max_io_block_time_;
+  if (!(pd_->events_ & EPOLLIN))
+    pd_->watch(fd_, EPOLLIN);
+
+  while (!pd_->remote_hangup_)
   {
-    num_bytes_read = ::read(fd_, buf, count);
-    if (num_bytes_read == -1)
+    fiber *expected = 0;
+    if (pd_->waiters_[k_read].compare_exchange_strong(expected, parked_tag(reader)))
+      return true;
+
+    // an edge arrived since the last read.  It may have been for
+    // data that read already consumed, so look before giving up.
+    pd_->clear_ready(k_read);
+    char c;
+    if (::recv(fd_, &c, 1, MSG_PEEK | MSG_DONTWAIT) != -1 || errno != EAGAIN)
+      break;
+  }
+  io_timeout_[k_read] = forever;
+  return false;
+}
+
+// runs on the io thread, after the fiber has switched away
+fiber *fiber_pipe::multi_wait::commit(fiber *f)
+{
+  // our own reference, so finish() waits for us to be done
+  refs_ = 1;
+  fiber_ = f;
+  auto requeue = false;
+  for (size_t i = 0; i < count_ && !requeue; i++)
+  {
+    auto pd = waits_[i].pipe->pd_;
+    for (int dir = k_read; dir <= k_write && !requeue; dir++)
     {
-      if (remote_hangup_)
+      auto event = dir == k_read ? EPOLLIN : EPOLLOUT;
+      if (!(waits_[i].events & (dir == k_read ? POLLIN : POLLOUT)))
+        continue;
+      if (!(pd->events_ & event))
+        pd->watch(waits_[i].pipe->fd_, event);
+      ++refs_;
+      fiber *expected = 0;
+      if (!pd->waiters_[dir].compare_exchange_strong(expected, tagged()))
       {
-        // we get too many of these in some cases, and if ANON_LOG_ALL_THROWS is turned on
-        // the logs are mostly full of this one line.  So we don't log this - even if ANON_LOG_ALL_THROWS
-        // is enabled.
-        #if defined(ANON_LOG_ALL_THROWS)
-        throw fiber_io_error(Log::fmt([&](std::ostream &msg) { msg << "read(" << fd_ << ", <ptr>, " << count << ") detected remote hangup"; }));
-        #else
-        anon_throw(fiber_io_error, "read(" << fd_ << ", <ptr>, " << count << ") detected remote hangup");
-        #endif
-      }
-      else if (errno == EAGAIN)
-      {
-        tls_io_params.sleep_until_data_available(const_cast<fiber_pipe *>(this));
+        // an edge arrived since wait_any last polled.  Drop it,
+        // since wait_any will poll again anyway.
+        --refs_;
+        if (expected == poll_desc::ready())
+          pd->waiters_[dir].compare_exchange_strong(expected, 0);
+#if defined(ANON_RUNTIME_CHECKS)
+        else
+          anon_log_error("more than one fiber blocked in the same direction on fd " << waits_[i].pipe->fd_);
+#endif
+        requeue = true;
       }
-      else
+    }
+  }
+
+  if (!requeue && deadline_)
+  {
+    ++refs_;
+    timer_ = io_dispatch::schedule_task([this] { wake(); }, *deadline_);
+    timer_set_ = true;
+  }
+
+  fiber *ret = requeue ? fiber_.exchange(0) : 0;
+  --refs_;
+  return ret;
+}
+
+// called by whoever took one of our references
+void fiber_pipe::multi_wait::wake()
+{
+  auto f = fiber_.exchange(0);
+  --refs_;
+  if (f)
+    tls_io_params.wake_all(f);
+}
+
+// runs in the fiber once it has been woken
+void fiber_pipe::multi_wait::finish()
+{
+  auto t = tagged();
+  while (true)
+  {
+    for (size_t i = 0; i < count_; i++)
+    {
+      for (auto &w : waits_[i].pipe->pd_->waiters_)
       {
-        anon_throw(fiber_io_error, "read(" << fd_ << ", <ptr>, " << count << ") failed with errno: " << errno_string());
+        auto expected = t;
+        if (w.compare_exchange_strong(expected, 0))
+          --refs_;
       }
     }
-    else if (num_bytes_read == 0 && count != 0)
+    if (timer_set_.exchange(false) && io_dispatch::remove_task(timer_))
+      --refs_;
+    if (refs_ == 0)
+      break;
+
+    // commit, or someone waking us, is still running on another
+    // thread, and will be done in a moment.
+    std::this_thread::yield();
+  }
+}
+
+void fiber_pipe::poll_desc::io_avail(const struct epoll_event &event)
+{
+  if (io_dispatch::epoll_tag(event) != seq_)
+    return;
+
+  // a hangup or error has to wake whoever is blocked in either
+  // direction so they can see it and throw.
+  auto ev = event.events;
+  auto err = (ev & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+  if (ev & EPOLLRDHUP)
+    remote_hangup_ = true;
+  auto reader = (err || (ev & EPOLLIN)) ? signal(k_read) : 0;
+  auto writer = (err || (ev & EPOLLOUT)) ? signal(k_write) : 0;
+  if (reader)
+    wake_waiter(reader);
+  if (writer)
+    wake_waiter(writer);
+}
+
+io_result fiber_pipe::try_read(void *buf, size_t count) const
+{
+  anon::assert_no_locks();
+  while (true)
+  {
+    pd_->clear_ready(k_read);
+    auto num_bytes_read = ::read(fd_, buf, count);
+    if (num_bytes_read == -1)
     {
-      // don't use the anon_throw macro here.  It is sometimes useful to define
-      // ANON_LOG_ALL_THROWS to better understand where certain errors are being thrown
-      // (as opposed to where they are being caught).  But in a normal server deployment
-      // this one throw statement will flood the logs, making it harder to find whatever
-      // you are looking for.  So for this case, directly use the (non-logging) expansion
-      // of the macro.  The message body that is being generated will still end up
-      // in the error object itself, but it will not normally be written to the log
-      // file.
-      throw fiber_io_error(Log::fmt([&](std::ostream &msg) { msg << "read(" << fd_ << ", <ptr>, " << count << ") returned 0, other end probably closed"; }));
+      if (pd_->remote_hangup_)
+        return io_result{0, io_result::k_closed};
+      if (errno != EAGAIN)
+        return io_result{0, errno};
+      if (tls_io_params.sleep_until_io_possible(const_cast<fiber_pipe *>(this), io_params::oc_read))
+        return io_result{0, io_result::k_timed_out};
     }
+    else if (num_bytes_read == 0 && count != 0)
+      return io_result{0, io_result::k_closed};
     else
-      break;
+      return io_result{(size_t)num_bytes_read, 0};
   }
-  return (size_t)num_bytes_read;
 }
 
-void fiber_pipe::write(const void *buf, size_t count) const
+size_t fiber_pipe::read(void *buf, size_t count) const
+{
+  auto res = try_read(buf, count);
+  if (res)
+    return res.bytes;
+
+  if (res.timed_out())
+    throw fiber_io_timeout_error(Log::fmt([&](std::ostream &msg) { msg << "throwing read io timeout for fd: " << fd_; }));
+
+  if (res.closed())
+  {
+    if (pd_->remote_hangup_)
+    {
+      // we get too many of these in some cases, and if ANON_LOG_ALL_THROWS is turned on
+      // the logs are mostly full of this one line.  So we don't log this - even if ANON_LOG_ALL_THROWS
+      // is enabled.
+      #if defined(ANON_LOG_ALL_THROWS)
+      throw fiber_io_error(Log::fmt([&](std::ostream &msg) { msg << "read(" << fd_ << ", <ptr>, " << count << ") detected remote hangup"; }));
+      #else
+      anon_throw(fiber_io_error, "read(" << fd_ << ", <ptr>, " << count << ") detected remote hangup");
+      #endif
+    }
+
+    // don't use the anon_throw macro here.  It is sometimes useful to define
+    // ANON_LOG_ALL_THROWS to better understand where certain errors are being thrown
+    // (as opposed to where they are being caught).  But in a normal server deployment
+    // this one throw statement will flood the logs, making it harder to find whatever
+    // you are looking for.  So for this case, directly use the (non-logging) expansion
+    // of the macro.  The message body that is being generated will still end up
+    // in the error object itself, but it will not normally be written to the log
+    // file.
+    throw fiber_io_error(Log::fmt([&](std::ostream &msg) { msg << "read(" << fd_ << ", <ptr>, " << count << ") returned 0, other end probably closed"; }));
+  }
+
+  anon_throw(fiber_io_error, "read(" << fd_ << ", <ptr>, " << count << ") failed with errno: " << error_string(res.err));
+}
+
+io_result fiber_pipe::try_write(const void *buf, size_t count) const
 {
   anon::assert_no_locks();
   size_t total_bytes_written = 0;
@@ -506,27 +755,67 @@ void fiber_pipe::write(const void *buf, size_t count) const
 
   while (total_bytes_written < count)
   {
-    if (remote_hangup_)
-    {
-      anon_throw(fiber_io_error, "remote hangup detected on write, fd: " << fd_);
-    }
+    if (pd_->remote_hangup_)
+      return io_result{total_bytes_written, io_result::k_closed};
+    pd_->clear_ready(k_write);
     auto bytes_written = ::write(fd_, &p[total_bytes_written], count - total_bytes_written);
     if (bytes_written == -1)
     {
-      if (errno == EAGAIN)
-        tls_io_params.sleep_until_write_possible(const_cast<fiber_pipe *>(this));
-      else
-      {
-        anon_throw(fiber_io_error, "write(" << fd_ << ", <ptr>, " << count - total_bytes_written << ") failed with errno: " << errno_string());
-      }
+      if (errno != EAGAIN)
+        return io_result{total_bytes_written, errno};
+      if (tls_io_params.sleep_until_io_possible(const_cast<fiber_pipe *>(this), io_params::oc_write))
+        return io_result{total_bytes_written, io_result::k_timed_out};
     }
-    else if (bytes_written == 0 && count != 0)
+    else if (bytes_written == 0)
+      return io_result{total_bytes_written, io_result::k_closed};
+    else
+      total_bytes_written += bytes_written;
+  }
+  return io_result{total_bytes_written, 0};
+}
+
+io_result fiber_pipe::try_sendfile(int fd, off_t &offset, size_t count) const
+{
+  anon::assert_no_locks();
+  size_t total_bytes_written = 0;
+
+  while (total_bytes_written < count)
+  {
+    if (pd_->remote_hangup_)
+      return io_result{total_bytes_written, io_result::k_closed};
+    pd_->clear_ready(k_write);
+    auto bytes_written = ::sendfile(fd_, fd, &offset, count - total_bytes_written);
+    if (bytes_written == -1)
     {
-      anon_throw(fiber_io_error, "write(" << fd_ << ", <ptr>, " << count - total_bytes_written << ") returned 0, other end probably closed");
+      if (errno != EAGAIN)
+        return io_result{total_bytes_written, errno};
+      if (tls_io_params.sleep_until_io_possible(const_cast<fiber_pipe *>(this), io_params::oc_write))
+        return io_result{total_bytes_written, io_result::k_timed_out};
     }
+    else if (bytes_written == 0)
+      // the file is shorter than the caller thought
+      return io_result{total_bytes_written, EIO};
     else
       total_bytes_written += bytes_written;
   }
+  return io_result{total_bytes_written, 0};
+}
+
+void fiber_pipe::write(const void *buf, size_t count) const
+{
+  auto res = try_write(buf, count);
+  if (res)
+    return;
+
+  if (res.timed_out())
+    anon_throw(fiber_io_timeout_error, "throwing write io timeout for fd: " << fd_);
+  if (res.closed())
+  {
+    if (pd_->remote_hangup_)
+      anon_throw(fiber_io_error, "remote hangup detected on write, fd: " << fd_);
+    anon_throw(fiber_io_error, "write(" << fd_ << ", <ptr>, " << count - res.bytes << ") returned 0, other end probably closed");
+  }
+  anon_throw(fiber_io_error, "write(" << fd_ << ", <ptr>, " << count - res.bytes << ") failed with errno: " << error_string(res.err));
 }
 
 void fiber_pipe::for_each_sleeping_pipe(const std::function<void(const std::string& name)>&f)
@@ -534,8 +823,10 @@ void fiber_pipe::for_each_sleeping_pipe(const std::function<void(const std::stri
   io_dispatch::while_paused([f]{
     auto fib = first_;
     while (fib) {
-      if (fib->io_fiber_) {
-        f(fib->io_fiber_->fiber_name_);
+      for (auto &w : fib->pd_->waiters_) {
+        auto wf = w.load();
+        if (wf && wf != poll_desc::ready() && !multi_wait::is_tagged(wf) && !is_parked(wf))
+          f(wf->fiber_name_);
       }
       fib = fib->next_;
     }
@@ -566,19 +857,41 @@ void io_params::wake_all(fiber *first)
     case oc_write:
     {
 
-      auto pipe = io_pipe_;
-      int op;
-      if (!pipe->attached_)
+      // pipes stay registered with epoll, so in the common case
+      // blocking costs no system calls at all.  Registration has to
+      // happen before the fiber is published in waiters_ because as
+      // soon as it is, another thread can wake it and it can close
+      // the fd.
+      auto pd = io_pipe_->pd_;
+      auto event = opcode_ == oc_read ? EPOLLIN : EPOLLOUT;
+      if (!(pd->events_ & event))
+        pd->watch(io_pipe_->fd_, event);
+      auto &w = pd->waiters_[opcode_ == oc_read ? fiber_pipe::k_read : fiber_pipe::k_write];
+      fiber *expected = 0;
+      if (!w.compare_exchange_strong(expected, wake))
       {
-        op = EPOLL_CTL_ADD;
-        pipe->attached_ = true;
+        // an edge arrived between the fiber getting EAGAIN and
+        // now.  Consume it and let the fiber try again.
+#if defined(ANON_RUNTIME_CHECKS)
+        if (expected != fiber_pipe::poll_desc::ready())
+          anon_log_error("more than one fiber blocked in the same direction on fd " << io_pipe_->fd_);
+#endif
+        if (expected == fiber_pipe::poll_desc::ready())
+          w = 0;
+        wake->next_wake_ = wake_head_;
+        wake_head_ = wake;
       }
-      else
-        op = EPOLL_CTL_MOD;
+    }
+    break;
 
-      io_dispatch::epoll_ctl(op, pipe->fd_,
-                             (opcode_ == oc_read ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT | EPOLLET | EPOLLRDHUP,
-                             pipe);
+    case oc_wait_any:
+    {
+      auto requeue = multi_wait_->commit(wake);
+      if (requeue)
+      {
+        requeue->next_wake_ = wake_head_;
+        wake_head_ = requeue;
+      }
     }
     break;
 
@@ -635,10 +948,10 @@ void io_params::sweep_timed_out_pipes(bool orhibernating)
         auto pipe = fiber_pipe::first_;
         while (pipe)
         {
-          if ((pipe->io_timeout_ < ct) || (orhibernating && pipe->is_hibernating()))
+          if (pipe->pd_->events_ && (pipe->timed_out(ct) || (orhibernating && pipe->is_hibernating())))
           {
-            io_dispatch::epoll_ctl(EPOLL_CTL_DEL, pipe->fd_, 0, pipe);
-            pipe->attached_ = false;
+            io_dispatch::epoll_ctl(EPOLL_CTL_DEL, pipe->fd_, 0, pipe->pd_);
+            pipe->pd_->events_ = 0;
           }
           pipe = pipe->next_;
         }
@@ -655,8 +968,8 @@ void io_params::sweep_timed_out_pipes(bool orhibernating)
             while (pipe)
             {
               auto next = pipe->next_;
-              auto to_or_h = pipe->io_timeout_ < ct || (orhibernating && pipe->is_hibernating());
-              if (to_or_h && !pipe->attached_ && pipe->io_fiber_ && pipe->io_fiber_->timeout_pipe_ == pipe)
+              auto to_or_h = pipe->timed_out(ct) || (orhibernating && pipe->is_hibernating());
+              if (to_or_h && !pipe->pd_->events_ && pipe->claim_waiters())
               {
                 // remove from main list
                 if (pipe->next_)
@@ -683,8 +996,19 @@ void io_params::sweep_timed_out_pipes(bool orhibernating)
 #endif
             auto next = pipe->next_;
             pipe->next_ = pipe->prev_ = pipe; // so dtor's list removal is a no-op
-            params->timeout_expired_ = true;
-            params->wake_all(pipe->io_fiber_);
+
+            // once the first of these runs it may delete the pipe
+            fiber *wake[2] = {pipe->timed_out_fibers_[fiber_pipe::k_read], pipe->timed_out_fibers_[fiber_pipe::k_write]};
+            for (auto f : wake)
+            {
+              if (f && fiber_pipe::is_parked(f))
+                fiber_pipe::resume_parked(f, true);
+              else if (f)
+              {
+                params->timeout_expired_ = true;
+                params->wake_all(f);
+              }
+            }
             pipe = next;
           }
 
@@ -722,47 +1046,52 @@ void io_params::sweep_timed_out_pipes(bool orhibernating)
   }
 }
 
-void io_params::sleep_until_data_available(fiber_pipe *pipe)
+bool io_params::sleep_until_io_possible(fiber_pipe *pipe, op_code oc)
 {
-  opcode_ = oc_read;
+  auto dir = oc == oc_read ? fiber_pipe::k_read : fiber_pipe::k_write;
+  opcode_ = oc;
   auto cf = current_fiber_;
   cf->timeout_pipe_ = io_pipe_ = pipe;
-  pipe->io_fiber_ = current_fiber_;
   if (pipe->max_io_block_time_ > 0)
-    pipe->io_timeout_ = cur_time() + pipe->max_io_block_time_;
+    pipe->io_timeout_[dir] = cur_time() + pipe->max_io_block_time_;
   current_fiber_->switch_to_fiber(parent_fiber_);
-  pipe->io_fiber_ = 0;
-  pipe->io_timeout_ = fiber_pipe::forever;
+  pipe->io_timeout_[dir] = fiber_pipe::forever;
   cf->timeout_pipe_ = 0;
-  if (tls_io_params.timeout_expired_)
-  {
-    tls_io_params.timeout_expired_ = false;
+  auto expired = tls_io_params.timeout_expired_;
+  tls_io_params.timeout_expired_ = false;
+  return expired;
+}
+
+void io_params::sleep_until_data_available(fiber_pipe *pipe)
+{
+  if (sleep_until_io_possible(pipe, oc_read))
     throw fiber_io_timeout_error(Log::fmt([&](std::ostream &msg) { msg << "throwing read io timeout for fd: " << pipe->get_fd(); }));
-  }
 }
 
 void io_params::sleep_until_write_possible(fiber_pipe *pipe)
 {
-  opcode_ = oc_write;
-  auto cf = current_fiber_;
-  cf->timeout_pipe_ = io_pipe_ = pipe;
-  pipe->io_fiber_ = current_fiber_;
-  if (pipe->max_io_block_time_ > 0)
-    pipe->io_timeout_ = cur_time() + pipe->max_io_block_time_;
-  current_fiber_->switch_to_fiber(parent_fiber_);
-  pipe->io_fiber_ = 0;
-  pipe->io_timeout_ = fiber_pipe::forever;
-  cf->timeout_pipe_ = 0;
-  if (tls_io_params.timeout_expired_)
-  {
-    tls_io_params.timeout_expired_ = false;
+  if (sleep_until_io_possible(pipe, oc_write))
     anon_throw(fiber_io_timeout_error, "throwing write io timeout for fd: " << pipe->get_fd());
-  }
 }
 
 void io_params::sleep_cur_until_write_possible(fiber_pipe *pipe)
 {
-  tls_io_params.sleep_until_write_possible(pipe);
+  // this is used to wait for non-blocking connects to complete.
+  // Being woken only means the socket's state might have changed,
+  // so keep waiting until it is writable (connected) or in error.
+  struct pollfd pfd = {pipe->fd_, POLLOUT, 0};
+  do
+    tls_io_params.sleep_until_write_possible(pipe);
+  while (::poll(&pfd, 1, 0) == 0);
+}
+
+void io_params::sleep_until_any_io_possible(pipe_wait *waits, size_t count, const struct timespec *deadline)
+{
+  fiber_pipe::multi_wait mw(waits, count, deadline);
+  opcode_ = oc_wait_any;
+  multi_wait_ = &mw;
+  current_fiber_->switch_to_fiber(parent_fiber_);
+  mw.finish();
 }
 
 void io_params::msleep(int milliseconds)
@@ -60,6 +60,7 @@ class fiber;
 struct fiber_lock;
 class fiber_pipe;
 struct io_params;
+struct pipe_wait;
 
 struct fiber_cond
 {
@@ -331,6 +332,20 @@ public:
 
   static void msleep(int milliseconds);
 
+  // poll-style wait on several fiber_pipes at once.  Suspends the
+  // calling fiber until at least one of 'waits' is ready for the
+  // POLLIN/POLLOUT 'events' it names, or until 'timeout_ms' has
+  // passed (a negative value means wait forever).  Fills in each
+  // 'revents' and returns the number of ready entries, or 0 on
+  // timeout.  Lets a single fiber relay in both directions, or
+  // watch a command pipe and a socket, without a second fiber.
+  //
+  // Only one fiber at a time may block reading (or writing) a
+  // given pipe, whether in read/write or here.  Note that a
+  // tls_pipe can hold decrypted data that is not visible on the
+  // underlying fd, so this can't be used to wait on those.
+  static int wait_any(pipe_wait *waits, size_t count, int timeout_ms = -1);
+
   static void rename_fiber(const char *new_name)
   {
     fiber *f = (fiber *)get_current_fiber();
@@ -444,7 +459,7 @@ extern void *get_current_fiber();
 
 ////////////////////////////////////////////////////////////////////////
 
-class fiber_pipe : public io_dispatch::handler, public pipe_t
+class fiber_pipe : public pipe_t
 {
 public:
   enum pipe_sock_t
@@ -456,8 +471,6 @@ public:
   fiber_pipe(int socket_fd, pipe_sock_t socket_type);
   virtual ~fiber_pipe();
 
-  virtual void io_avail(const struct epoll_event &event) override;
-
   virtual void limit_io_block_time(int seconds) override
   {
     max_io_block_time_ = seconds;
@@ -479,10 +492,10 @@ public:
   int release()
   {
     int ret = fd_;
-    if (fd_ != -1 && attached_)
+    if (fd_ != -1 && pd_->events_)
     {
-      io_dispatch::epoll_ctl(EPOLL_CTL_DEL, fd_, 0, this);
-      attached_ = false;
+      io_dispatch::epoll_ctl(EPOLL_CTL_DEL, fd_, 0, pd_);
+      pd_->events_ = 0;
     }
     fd_ = -1;
     return ret;
@@ -490,6 +503,9 @@ public:
 
   virtual size_t read(void *buff, size_t len) const override;
   virtual void write(const void *buff, size_t len) const override;
+  virtual io_result try_read(void *buff, size_t len) const override;
+  virtual io_result try_write(const void *buff, size_t len) const override;
+  virtual io_result try_sendfile(int fd, off_t &offset, size_t len) const override;
 
   static void wait_for_zero_net_pipes()
   {
@@ -510,31 +526,213 @@ public:
 
   static void for_each_sleeping_pipe(const std::function<void(const std::string& name)>&f);
 
+  // what park_read hands the pipe off to.  Ownership of the reader
+  // passes back to resume, which can either park it again or delete it.
+  struct parked_reader
+  {
+    virtual ~parked_reader() {}
+
+    // called on a new fiber once the pipe has something to read, or
+    // has been closed by the other end.  'closing' is true instead if
+    // the pipe's io block time (see limit_io_block_time) ran out while
+    // it was parked, or the hibernation sweep picked it.  In that case
+    // the implementation should just release the pipe.
+    virtual void resume(bool closing) = 0;
+
+  private:
+    friend class fiber_pipe;
+    fiber_pipe *parked_pipe_;
+    size_t parked_stack_size_;
+  };
+
+  // wait for this pipe to become readable without keeping a fiber
+  // (and its stack) blocked in read while doing so.  When this returns
+  // true 'reader' now owns the wait, and will be resumed on a new fiber
+  // with the given stack size.  That can happen on another thread before
+  // park_read even returns, so the caller must not touch the pipe or
+  // 'reader' again, and should generally just return from its fiber.
+  // When it returns false there is already something to read (or the
+  // pipe is closed), nothing was handed off, and the caller should just
+  // go ahead and read.  The pipe's io block time applies to the parked
+  // wait the same way it would to a blocked read.
+  bool park_read(parked_reader *reader, size_t stack_size = fiber::k_default_stack_size);
+
 private:
   enum {
     k_net_io_sweep_time = 2
   };
 
   // fiber_pipe's are neither movable, nor copyable.
-  // the address of the pipe is regestered in epoll
   fiber_pipe(const fiber_pipe &);
   fiber_pipe(fiber_pipe &&);
 
   friend struct io_params;
 
+  enum
+  {
+    k_read = 0,
+    k_write = 1
+  };
+
+  // the part of a fiber_pipe that is registered with epoll.
+  // The fd is added, edge-triggered, the first time a fiber blocks
+  // on it and stays registered until it is closed.  EPOLLOUT is only
+  // added once a writer has actually blocked, since most pipes never
+  // fill their send buffer and would otherwise get an event every
+  // time the peer consumed data.  Since epoll may
+  // still hand out an event for it after the fiber_pipe itself
+  // has been deleted, poll_desc's are never freed.  They are
+  // recycled through free_descs_, and each reuse bumps seq_,
+  // which is also stored as the epoll tag so that io_avail can
+  // ignore events that were queued for a previous owner.
+  //
+  // waiters_[k_read/k_write] is 0 when nothing has happened,
+  // ready() when an edge arrived with no fiber waiting for it,
+  // the fiber that is blocked in that direction, a
+  // multi_wait::tagged() when a fiber is in fiber::wait_any, or
+  // (k_read only) a parked_tag() for a parked_reader.
+  struct poll_desc : public io_dispatch::handler
+  {
+    poll_desc()
+        : seq_(0),
+          events_(0),
+          remote_hangup_(false),
+          next_free_(0)
+    {
+      waiters_[k_read] = 0;
+      waiters_[k_write] = 0;
+    }
+
+    virtual void io_avail(const struct epoll_event &event) override;
+
+    static fiber *ready()
+    {
+      return (fiber *)1;
+    }
+
+    // read/write always try the system call before blocking, so an
+    // edge that arrived before that call is already accounted for.
+    void clear_ready(int dir)
+    {
+      auto r = ready();
+      if (waiters_[dir].load(std::memory_order_relaxed) == r)
+        waiters_[dir].compare_exchange_strong(r, 0);
+    }
+
+    fiber *signal(int dir);
+    void watch(int fd, uint32_t event);
+
+    std::atomic<fiber *> waiters_[2];
+    std::atomic<uint16_t> seq_;
+    std::atomic<uint32_t> events_;
+    std::mutex events_mutex_;
+    std::atomic<bool> remote_hangup_;
+    poll_desc *next_free_;
+  };
+
+  // the state of one call to fiber::wait_any.  It lives on the
+  // waiting fiber's stack, and is published (tagged) in waiters_
+  // of each pipe it waits on.  Whoever clears one of those slots,
+  // or runs the timeout task, owns a reference in refs_ and must
+  // release it before waking the fiber - and finish() doesn't
+  // return until all references are gone.  fiber_ is exchanged
+  // to 0 by whoever wakes the fiber, so it is woken only once.
+  struct multi_wait
+  {
+    multi_wait(pipe_wait *waits, size_t count, const struct timespec *deadline)
+        : waits_(waits),
+          count_(count),
+          deadline_(deadline),
+          fiber_(0),
+          refs_(0),
+          timer_set_(false)
+    {
+    }
+
+    fiber *tagged()
+    {
+      return (fiber *)((uintptr_t)this | 2);
+    }
+
+    static bool is_tagged(fiber *f)
+    {
+      return ((uintptr_t)f & 2) != 0;
+    }
+
+    static multi_wait *from_tagged(fiber *f)
+    {
+      return (multi_wait *)((uintptr_t)f & ~(uintptr_t)2);
+    }
+
+    fiber *commit(fiber *f);
+    void wake();
+    void finish();
+
+    pipe_wait *waits_;
+    size_t count_;
+    const struct timespec *deadline_;
+    std::atomic<fiber *> fiber_;
+    std::atomic<int> refs_;
+    std::atomic<bool> timer_set_;
+    io_dispatch::scheduled_task timer_;
+  };
+
+  static void wake_waiter(fiber *w);
+
+  static fiber *parked_tag(parked_reader *reader)
+  {
+    return (fiber *)((uintptr_t)reader | 4);
+  }
+
+  static bool is_parked(fiber *f)
+  {
+    return ((uintptr_t)f & 4) != 0;
+  }
+
+  static parked_reader *from_parked_tag(fiber *f)
+  {
+    return (parked_reader *)((uintptr_t)f & ~(uintptr_t)4);
+  }
+
+  static void resume_parked(fiber *f, bool closing);
+
+  bool timed_out(const struct timespec &ct) const
+  {
+    return io_timeout_[k_read] < ct || io_timeout_[k_write] < ct;
+  }
+
+  // called by the pipe sweeper while io is paused and this pipe is
+  // no longer in epoll.  Takes the blocked fibers, and any
+  // parked_reader, out of waiters_.
+  bool claim_waiters()
+  {
+    auto claimed = false;
+    for (int dir = k_read; dir <= k_write; dir++)
+    {
+      auto f = pd_->waiters_[dir].load();
+      timed_out_fibers_[dir] = 0;
+      if (f && f != poll_desc::ready() && !multi_wait::is_tagged(f) && (is_parked(f) || f->timeout_pipe_ == this) && pd_->waiters_[dir].compare_exchange_strong(f, 0))
+      {
+        timed_out_fibers_[dir] = f;
+        claimed = true;
+      }
+    }
+    return claimed;
+  }
+
   int fd_;
   pipe_sock_t socket_type_;
-  fiber *io_fiber_;
+  poll_desc *pd_;
   int max_io_block_time_;
-  struct timespec io_timeout_;
-  bool attached_;
-  bool remote_hangup_;
+  struct timespec io_timeout_[2];
+  fiber *timed_out_fibers_[2];
   bool hibernating_;
 
   fiber_pipe *next_;
   fiber_pipe *prev_;
   static fiber_pipe *first_;
   static std::mutex list_mutex_;
+  static poll_desc *free_descs_;
 
   static int num_net_pipes_;
   static fiber_mutex zero_net_pipes_mutex_;
@@ -543,6 +741,14 @@ private:
   static const struct timespec forever;
 };
 
+// one entry in a call to fiber::wait_any
+struct pipe_wait
+{
+  fiber_pipe *pipe;
+  short events;  // POLLIN and/or POLLOUT
+  short revents; // set by wait_any
+};
+
 /*
   fiber_io_error exceptions thrown in the context
   of endpoint_cluster::with_connected_pipe have some
@@ -606,7 +812,8 @@ struct io_params
     oc_mutex_suspend,
     oc_cond_wait,
     oc_sleep,
-    oc_exit_fiber
+    oc_exit_fiber,
+    oc_wait_any
   };
 
   io_params()
@@ -623,6 +830,8 @@ struct io_params
   void wake_all(fiber *first);
   void sleep_until_data_available(fiber_pipe *pipe);
   void sleep_until_write_possible(fiber_pipe *pipe);
+  bool sleep_until_io_possible(fiber_pipe *pipe, op_code oc);
+  void sleep_until_any_io_possible(pipe_wait *waits, size_t count, const struct timespec *deadline);
   void msleep(int milliseconds);
   void exit_fiber();
 
@@ -633,6 +842,7 @@ struct io_params
   fiber *wake_head_;
   op_code opcode_;
   fiber_pipe *io_pipe_;
+  fiber_pipe::multi_wait *multi_wait_;
   fiber iod_fiber_;
   std::atomic_int *mutex_state_;
   fiber_mutex *cond_mutex_;
@@ -0,0 +1,649 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "file_server.h"
+#include "lock_checker.h"
+#include "percent_codec.h"
+#include "time_utils.h"
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+
+// everything that can change what is cached for a directory
+const uint32_t k_watch_mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                              IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+struct content_type_t
+{
+  const char *ext;
+  const char *type;
+};
+
+const content_type_t k_content_types[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"ico", "image/x-icon"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"mp3", "audio/mpeg"},
+};
+
+const char *content_type(const std::string &key)
+{
+  auto dot = key.rfind('.');
+  auto slash = key.rfind('/');
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+  {
+    auto ext = key.c_str() + dot + 1;
+    for (auto &ct : k_content_types)
+      if (!strcasecmp(ext, ct.ext))
+        return ct.type;
+  }
+  return "application/octet-stream";
+}
+
+std::string http_date(time_t t)
+{
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char buf[64];
+  auto len = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return std::string(buf, len);
+}
+
+// 'path' (already percent decoded) as a path relative to the root,
+// without empty or "." segments.  False if it has a ".." segment.
+bool make_key(const std::string &path, std::string &key)
+{
+  auto p = path.c_str();
+  auto end = p + path.size();
+  while (p < end)
+  {
+    auto e = (const char *)memchr(p, '/', end - p);
+    if (!e)
+      e = end;
+    auto len = e - p;
+    if (len == 2 && p[0] == '.' && p[1] == '.')
+      return false;
+    if (len > 0 && !(len == 1 && p[0] == '.'))
+    {
+      if (!key.empty())
+        key += '/';
+      key.append(p, len);
+    }
+    p = e + 1;
+  }
+  return true;
+}
+
+std::string dir_of(const std::string &key)
+{
+  auto slash = key.rfind('/');
+  return slash == std::string::npos ? std::string() : key.substr(0, slash);
+}
+
+enum range_result
+{
+  k_no_range,
+  k_range,
+  k_unsatisfiable
+};
+
+// the one byte range asked for by 'range', clamped to a body of
+// 'size' bytes.  k_no_range when it isn't one we honor - malformed,
+// or several ranges, which get the whole body instead.
+range_result parse_range(const string_len &range, uint64_t size, uint64_t &first, uint64_t &last)
+{
+  auto p = range.ptr();
+  auto end = p + range.len();
+  if (range.len() < 6 || strncasecmp(p, "bytes=", 6))
+    return k_no_range;
+  p += 6;
+  while (p < end && *p == ' ')
+    ++p;
+  while (end > p && end[-1] == ' ')
+    --end;
+  if (memchr(p, ',', end - p))
+    return k_no_range;
+
+  auto number = [&p, end](uint64_t &v) {
+    auto start = p;
+    v = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+      if (v > (UINT64_MAX - 9) / 10)
+        return false;
+      v = v * 10 + (*p++ - '0');
+    }
+    return p != start;
+  };
+
+  uint64_t a, b;
+  if (p < end && *p == '-')
+  {
+    ++p;
+    if (!number(b) || p != end)
+      return k_no_range;
+    if (b == 0 || size == 0)
+      return k_unsatisfiable;
+    first = b >= size ? 0 : size - b;
+    last = size - 1;
+    return k_range;
+  }
+  if (!number(a) || p == end || *p++ != '-')
+    return k_no_range;
+  if (p == end)
+    b = UINT64_MAX;
+  else if (!number(b) || p != end || b < a)
+    return k_no_range;
+  if (a >= size)
+    return k_unsatisfiable;
+  first = a;
+  last = std::min(b, size - 1);
+  return k_range;
+}
+
+bool modified_since(const string_len &if_modified_since, time_t mtime)
+{
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  auto ims = if_modified_since.str();
+  if (!strptime(ims.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm))
+    return true;
+  return mtime > timegm(&tm);
+}
+
+} // namespace
+
+file_server::file::~file()
+{
+  if (fd != -1)
+    close(fd);
+}
+
+file_server::file_server(const std::string &root, const file_server_options &opts)
+    : root_(root),
+      opts_(opts),
+      root_fd_(::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+      watcher_(nullptr),
+      hits_(0),
+      misses_(0),
+      not_modified_(0),
+      partial_(0),
+      invalidations_(0)
+{
+  if (root_fd_ == -1)
+    do_error("open(\"" << root << "\", O_RDONLY | O_DIRECTORY | O_CLOEXEC)");
+
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1)
+  {
+    anon_log("inotify_init1 failed (errno " << errno << "), cached files will be re-checked every second");
+    return;
+  }
+  watcher_ = new watcher;
+  watcher_->owner = this;
+  watcher_->fd = fd;
+  io_dispatch::epoll_ctl(EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLET, watcher_);
+}
+
+file_server::~file_server()
+{
+  if (watcher_)
+  {
+    {
+      anon::lock_guard<std::mutex> lock(watcher_->mtx);
+      watcher_->owner = nullptr;
+      io_dispatch::epoll_ctl(EPOLL_CTL_DEL, watcher_->fd, 0, watcher_);
+      close(watcher_->fd);
+      watcher_->fd = -1;
+    }
+    // an io thread may have been handed an event for it just
+    // before it was removed, and not yet gotten to its lock
+    auto w = watcher_;
+    io_dispatch::schedule_task([w] { delete w; }, cur_time() + 1);
+  }
+  close(root_fd_);
+}
+
+bool file_server::serve(http_server::pipe_t &pipe, const http_request &request)
+{
+  auto path = request.get_url_field(UF_PATH);
+  auto &prefix = opts_.url_prefix;
+  if (path.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  auto rel = path.substr(prefix.size());
+  if (!rel.empty() && rel[0] != '/' && !prefix.empty() && prefix.back() != '/')
+    return false;
+  bool dir_path = rel.empty() ? prefix.empty() || prefix.back() == '/' : rel.back() == '/';
+
+  std::string key;
+  try
+  {
+    if (!make_key(percent_decode(rel), key))
+      return false;
+  }
+  catch (const std::exception &)
+  {
+    return false;
+  }
+
+  std::shared_ptr<const file> f;
+  if (dir_path)
+  {
+    if (opts_.index_file.empty())
+      return false;
+    key = key.empty() ? opts_.index_file : key + "/" + opts_.index_file;
+    f = lookup(key);
+    if (!f || f->is_dir)
+      return false;
+  }
+  else if (!key.empty())
+  {
+    f = lookup(key);
+    if (!f)
+      return false;
+  }
+
+  if (!f || f->is_dir)
+  {
+    http_response response("301 Moved Permanently");
+    auto location = path + "/";
+    auto query = request.get_url_field_s(UF_QUERY);
+    if (query.len() > 0)
+      location += "?" + query.str();
+    response.add_header("location", location);
+    pipe.respond(response);
+    return true;
+  }
+
+  bool head = request.method == HTTP_HEAD;
+  if (!head && request.method != HTTP_GET)
+  {
+    http_response response("405 Method Not Allowed");
+    response.add_header("allow", "GET, HEAD");
+    pipe.respond(response);
+    return true;
+  }
+
+  auto body = f;
+  const char *content_encoding = nullptr;
+  if (f->br || f->gz)
+  {
+    int available = (f->br ? http_compression::k_br : 0) | (f->gz ? http_compression::k_gzip : 0);
+    auto enc = http_compression::choose(request.headers.get_header(http_headers::k_accept_encoding), available);
+    if (enc == http_compression::k_br)
+      body = f->br;
+    else if (enc == http_compression::k_gzip)
+      body = f->gz;
+    if (body != f)
+      content_encoding = http_compression::name(enc);
+  }
+
+  auto add_validators = [&](http_response &response) {
+    response.add_header("etag", body->etag);
+    if (!opts_.cache_control.empty())
+      response.add_header("cache-control", opts_.cache_control);
+    if (f->br || f->gz)
+      response.add_header("vary", "accept-encoding");
+  };
+
+  // if-modified-since only counts when there is no if-none-match
+  bool not_modified = request.headers.contains_header("if-none-match")
+                          ? request.if_none_match(string_len(body->etag.c_str(), body->etag.size()))
+                          : request.headers.contains_header("if-modified-since") &&
+                                !modified_since(request.headers.get_header("if-modified-since"), body->st.st_mtime);
+  if (not_modified)
+  {
+    http_response response("304 Not Modified");
+    add_validators(response);
+    response.add_header("last-modified", body->last_modified);
+    ++not_modified_;
+    pipe.respond(response);
+    return true;
+  }
+
+  uint64_t size = body->st.st_size;
+  uint64_t first = 0, last = size - 1;
+  auto range = k_no_range;
+  if (request.headers.contains_header("range"))
+  {
+    // if-range is either the etag or the last-modified
+    // date of the version of the file the client has
+    bool same = true;
+    if (request.headers.contains_header("if-range"))
+    {
+      auto if_range = request.headers.get_header("if-range").str();
+      same = if_range == body->etag || if_range == body->last_modified;
+    }
+    if (same)
+      range = parse_range(request.headers.get_header("range"), size, first, last);
+  }
+
+  http_response response(range == k_range ? "206 Partial Content"
+                         : range == k_unsatisfiable ? "416 Range Not Satisfiable"
+                                                    : "200 OK");
+  add_validators(response);
+  response.add_header("last-modified", body->last_modified);
+  response.add_header("accept-ranges", "bytes");
+  if (range == k_unsatisfiable)
+  {
+    response.add_header("content-range", "bytes */" + std::to_string(size));
+    pipe.respond(response);
+    return true;
+  }
+  response.add_header("content-type", f->content_type);
+  if (content_encoding)
+    response.add_header("content-encoding", content_encoding);
+  if (range == k_range)
+  {
+    response.add_header("content-range", "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size));
+    ++partial_;
+  }
+  else
+    first = 0, last = size - 1;
+  pipe.respond_file(response, body->fd, first, size ? last - first + 1 : 0, head);
+  return true;
+}
+
+std::shared_ptr<const file_server::file> file_server::lookup(const std::string &key)
+{
+  uint64_t generation;
+  bool watched = false;
+  {
+    anon::lock_guard<std::mutex> lock(mtx_);
+    auto it = map_.find(key);
+    if (it != map_.end())
+    {
+      // without inotify entries are only trusted for a second
+      if (watcher_ || time(0) == it->second->opened)
+      {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        ++hits_;
+        return it->second->f;
+      }
+      lru_.erase(it->second);
+      map_.erase(it);
+    }
+
+    // the watch goes on before the file is opened, so
+    // that any change after that bumps generation_
+    watched = !watcher_ || watch(dir_of(key));
+    generation = generation_;
+  }
+
+  ++misses_;
+  auto f = open(key);
+  if (!f || !watched)
+    return f;
+
+  anon::lock_guard<std::mutex> lock(mtx_);
+
+  // if something changed while it was being opened this may
+  // already be out of date, so it's used for this request
+  // but not kept
+  if (generation != generation_ || map_.find(key) != map_.end())
+    return f;
+  lru_.push_front(entry{key, f, time(0)});
+  map_[key] = lru_.begin();
+  while (lru_.size() > opts_.max_cached_files)
+  {
+    map_.erase(lru_.back().key);
+    lru_.pop_back();
+  }
+  return f;
+}
+
+std::shared_ptr<const file_server::file> file_server::open(const std::string &key) const
+{
+  auto f = open_one(key, content_type(key));
+  if (!f || f->is_dir || !opts_.precompressed)
+    return f;
+
+  // a sibling older than the file itself is left over
+  // from a previous version of it, and isn't used
+  auto sibling = [&f, &key, this](const char *ext) -> std::shared_ptr<const file> {
+    auto s = open_one(key + ext, f->content_type);
+    if (!s || s->is_dir)
+      return nullptr;
+    if (s->st.st_mtim.tv_sec < f->st.st_mtim.tv_sec ||
+        (s->st.st_mtim.tv_sec == f->st.st_mtim.tv_sec && s->st.st_mtim.tv_nsec < f->st.st_mtim.tv_nsec))
+      return nullptr;
+    return s;
+  };
+  f->br = sibling(".br");
+  f->gz = sibling(".gz");
+  return f;
+}
+
+std::shared_ptr<file_server::file> file_server::open_one(const std::string &key, const char *content_type) const
+{
+  // O_NONBLOCK so that a fifo doesn't hang us here,
+  // it has no effect on regular files
+  int fd = ::openat(root_fd_, key.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd == -1)
+    return nullptr;
+  auto f = std::make_shared<file>();
+  f->fd = fd;
+  if (fstat(fd, &f->st) != 0)
+    return nullptr;
+  if (S_ISDIR(f->st.st_mode))
+  {
+    close(f->fd);
+    f->fd = -1;
+    f->is_dir = true;
+    return f;
+  }
+  if (!S_ISREG(f->st.st_mode))
+    return nullptr;
+
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"", (unsigned long long)f->st.st_ino,
+           (unsigned long long)f->st.st_mtim.tv_sec * 1000000000ULL + f->st.st_mtim.tv_nsec,
+           (unsigned long long)f->st.st_size);
+  f->etag = etag;
+  f->last_modified = http_date(f->st.st_mtime);
+  f->content_type = content_type;
+  return f;
+}
+
+// watch 'dir' and each directory above it.  A directory being moved
+// or deleted is only reported to the watch on its parent, so without
+// those, renaming "a" wouldn't be noticed by anything cached from
+// "a/b".  The ones above are watched first, so any directory in
+// watched_ has all of its ancestors in there too.
+bool file_server::watch(const std::string &dir)
+{
+  if (watched_.find(dir) != watched_.end())
+    return true;
+  if (!dir.empty() && !watch(dir_of(dir)))
+    return false;
+  auto path = dir.empty() ? root_ : root_ + "/" + dir;
+  auto wd = inotify_add_watch(watcher_->fd, path.c_str(), k_watch_mask);
+  if (wd == -1)
+    return false;
+  watched_[dir] = wd;
+  watches_[wd] = dir;
+  return true;
+}
+
+void file_server::watcher::io_avail(const struct epoll_event &event)
+{
+  anon::lock_guard<std::mutex> lock(mtx);
+  if (!owner)
+    return;
+  alignas(struct inotify_event) char buf[4096];
+  while (true)
+  {
+    auto len = ::read(fd, &buf[0], sizeof(buf));
+    if (len <= 0)
+      break;
+    for (auto p = &buf[0]; p < &buf[len];)
+    {
+      auto ev = (const struct inotify_event *)p;
+      owner->dir_changed(ev->wd, ev->mask, ev->len ? ev->name : "");
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
+
+void file_server::dir_changed(int wd, uint32_t mask, const char *name)
+{
+  anon::lock_guard<std::mutex> lock(mtx_);
+  ++generation_;
+  if (mask & IN_Q_OVERFLOW)
+  {
+    // events were lost, so anything might have changed
+    invalidations_ += lru_.size();
+    lru_.clear();
+    map_.clear();
+    return;
+  }
+
+  auto it = watches_.find(wd);
+  if (it == watches_.end())
+    return;
+  auto dir = it->second;
+
+  if (*name)
+  {
+    // something in the directory changed.  For "x.gz"
+    // and "x.br" that means "x"'s entry too.
+    auto key = dir.empty() ? std::string(name) : dir + "/" + name;
+    erase(key);
+    auto len = key.size();
+    if (len > 3 && (!key.compare(len - 3, 3, ".gz") || !key.compare(len - 3, 3, ".br")))
+      erase(key.substr(0, len - 3));
+
+    // a subdirectory moved or deleted takes everything under it
+    // along.  The watches below it hear nothing of that, and now
+    // name paths that are gone, so they are dropped as well.
+    if ((mask & IN_ISDIR) && (mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+    {
+      erase_under(key);
+      unwatch_under(key);
+    }
+    return;
+  }
+
+  // the directory itself was deleted or moved, so everything under
+  // it goes, and a directory found at the same path later gets
+  // watches of its own
+  erase_under(dir);
+  if (mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+    unwatch_under(dir);
+  if (mask & IN_IGNORED)
+  {
+    auto w = watched_.find(dir);
+    if (w != watched_.end() && w->second == wd)
+      watched_.erase(w);
+    watches_.erase(it);
+  }
+}
+
+void file_server::erase(const std::string &key)
+{
+  auto it = map_.find(key);
+  if (it == map_.end())
+    return;
+  lru_.erase(it->second);
+  map_.erase(it);
+  ++invalidations_;
+}
+
+// drop the entries for everything under the directory 'dir'
+void file_server::erase_under(const std::string &dir)
+{
+  for (auto e = lru_.begin(); e != lru_.end();)
+  {
+    if (dir.empty() || (!e->key.compare(0, dir.size(), dir) && e->key[dir.size()] == '/'))
+    {
+      map_.erase(e->key);
+      e = lru_.erase(e);
+      ++invalidations_;
+    }
+    else
+      ++e;
+  }
+}
+
+// remove the watches on 'dir' and every directory under it.  Their
+// watches_ entries go when the IN_IGNORED events for them arrive.
+void file_server::unwatch_under(const std::string &dir)
+{
+  for (auto w = watched_.begin(); w != watched_.end();)
+  {
+    if (dir.empty() || w->first == dir || (!w->first.compare(0, dir.size(), dir) && w->first[dir.size()] == '/'))
+    {
+      inotify_rm_watch(watcher_->fd, w->second);
+      w = watched_.erase(w);
+    }
+    else
+      ++w;
+  }
+}
+
+void file_server::clear()
+{
+  anon::lock_guard<std::mutex> lock(mtx_);
+  lru_.clear();
+  map_.clear();
+}
+
+file_server::stats_t file_server::stats() const
+{
+  stats_t st;
+  st.hits = hits_;
+  st.misses = misses_;
+  st.not_modified = not_modified_;
+  st.partial = partial_;
+  st.invalidations = invalidations_;
+  anon::lock_guard<std::mutex> lock(mtx_);
+  st.entries = lru_.size();
+  return st;
+}
@@ -0,0 +1,159 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "http_server.h"
+#include "io_dispatch.h"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+// the settings of a file_server, see below
+struct file_server_options
+{
+  // the part of the request's path that maps to the root
+  // directory.  Requests whose path doesn't start with this
+  // aren't served.
+  std::string url_prefix{"/"};
+
+  std::string index_file{"index.html"};
+
+  // sent as the cache-control header when not empty
+  std::string cache_control;
+
+  bool precompressed{true};
+  size_t max_cached_files{1024};
+};
+
+// serves the files under a directory.  Files are opened (and stat'ed)
+// the first time they are asked for, and the open fd is kept, along
+// with its etag and the rest of what its response headers need, until
+// inotify says the file or one of the directories above it has changed
+// or it falls off the end of the lru list.  Bodies are sent straight from the fd with
+// http_server::pipe_t::respond_file, which uses sendfile(2) on plain
+// tcp connections.
+//
+// Etags are strong, made from the file's inode, mtime and size.  Both
+// if-none-match and if-modified-since are honored with a 304, as is a
+// single range ("bytes=first-last", "bytes=first-" or "bytes=-suffix")
+// with a 206 - if-range permitting.  Requests for several ranges get
+// the whole file.  When 'precompressed' is on and "name.br" or
+// "name.gz" sits next to "name", is at least as new, and the request's
+// accept-encoding allows it, that is sent instead, with its own etag.
+//
+// A path naming a directory is redirected to the same path with a
+// trailing '/', and that is served with the directory's index_file.
+// Paths with ".." segments are refused.
+class file_server
+{
+public:
+  file_server(const std::string &root, const file_server_options &opts = file_server_options());
+  ~file_server();
+
+  // respond to 'request' with the file it names, returning false
+  // without sending anything when there isn't one.  Methods other
+  // than GET and HEAD get a 405 when the file exists.
+  bool serve(http_server::pipe_t &pipe, const http_request &request);
+
+  // close everything that's cached
+  void clear();
+
+  struct stats_t
+  {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t not_modified;  // 304's
+    uint64_t partial;       // 206's
+    uint64_t invalidations; // entries dropped because of inotify events
+    size_t entries;
+  };
+
+  stats_t stats() const;
+
+private:
+  struct file
+  {
+    ~file();
+
+    int fd{-1};
+    struct stat st;
+    bool is_dir{false};
+    std::string etag;
+    std::string last_modified;
+    const char *content_type{nullptr};
+
+    // precompressed siblings
+    std::shared_ptr<const file> br;
+    std::shared_ptr<const file> gz;
+  };
+
+  struct entry
+  {
+    std::string key; // path relative to the root
+    std::shared_ptr<const file> f;
+    time_t opened;
+  };
+
+  // reads the inotify events, see io_avail.  Kept apart from the
+  // file_server so it can outlive it while an io thread might still
+  // be calling io_avail.
+  struct watcher final : public io_dispatch::handler
+  {
+    virtual void io_avail(const struct epoll_event &event);
+
+    std::mutex mtx;
+    file_server *owner{nullptr};
+    int fd{-1};
+  };
+
+  std::shared_ptr<const file> lookup(const std::string &key);
+  std::shared_ptr<const file> open(const std::string &key) const;
+  std::shared_ptr<file> open_one(const std::string &key, const char *content_type) const;
+  bool watch(const std::string &dir);
+  void dir_changed(int wd, uint32_t mask, const char *name);
+  void erase(const std::string &key);
+  void erase_under(const std::string &dir);
+  void unwatch_under(const std::string &dir);
+
+  std::string root_;
+  file_server_options opts_;
+  int root_fd_;
+  watcher *watcher_;
+
+  mutable std::mutex mtx_;
+  std::list<entry> lru_; // most recently used at the front
+  std::unordered_map<std::string, std::list<entry>::iterator> map_;
+  std::unordered_map<std::string, int> watched_; // directory -> inotify wd
+  std::unordered_map<int, std::string> watches_; // and back
+  uint64_t generation_{0};
+
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> not_modified_;
+  std::atomic<uint64_t> partial_;
+  std::atomic<uint64_t> invalidations_;
+};
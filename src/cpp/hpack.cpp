@@ -0,0 +1,541 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "hpack.h"
+
+namespace hpack
+{
+
+namespace
+{
+
+const table::entry static_table[table::k_num_static] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}};
+
+// the code for each symbol (right aligned), and its length in bits.
+// Symbol 256 is EOS.
+const struct
+{
+  uint32_t code;
+  uint8_t bits;
+} huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+// the code is canonical - codes of the same length are consecutive
+// and in symbol order, and each length's codes follow on from the
+// last code of the length before - so a code can be decoded by
+// comparing its first 32 bits with the first code past the end of
+// each length, shortest first, instead of walking a tree a bit at
+// a time.
+struct huffman_decode_table
+{
+  enum
+  {
+    k_min_bits = 5,
+    k_max_bits = 30
+  };
+
+  huffman_decode_table()
+  {
+    int count[k_max_bits + 1] = {};
+    for (auto &c : huffman_codes)
+      ++count[c.bits];
+    size_t n = 0;
+    for (int bits = k_min_bits; bits <= k_max_bits; bits++)
+    {
+      offset[bits] = n;
+      for (int sym = 0; sym < 257; sym++)
+        if (huffman_codes[sym].bits == bits)
+        {
+          if (n == offset[bits])
+            first[bits] = huffman_codes[sym].code;
+          symbols[n++] = sym;
+        }
+      limit[bits] = (uint64_t)(first[bits] + count[bits]) << (32 - bits);
+    }
+  }
+
+  uint32_t first[k_max_bits + 1] = {};
+  uint64_t limit[k_max_bits + 1] = {};
+  size_t offset[k_max_bits + 1] = {};
+  uint16_t symbols[257];
+};
+
+const huffman_decode_table huffman_table;
+
+// write 'value' as an HPACK integer with an 'prefix_bits' bit prefix,
+// or'ing 'first' into the first byte
+void encode_int(std::vector<char> &out, uint8_t first, int prefix_bits, size_t value)
+{
+  size_t max_prefix = (1 << prefix_bits) - 1;
+  if (value < max_prefix)
+  {
+    out.push_back((char)(first | value));
+    return;
+  }
+  out.push_back((char)(first | max_prefix));
+  value -= max_prefix;
+  while (value >= 128)
+  {
+    out.push_back((char)(0x80 | (value & 0x7f)));
+    value >>= 7;
+  }
+  out.push_back((char)value);
+}
+
+bool decode_int(const uint8_t *&p, const uint8_t *end, int prefix_bits, size_t &value)
+{
+  if (p == end)
+    return false;
+  size_t max_prefix = (1 << prefix_bits) - 1;
+  value = *p++ & max_prefix;
+  if (value < max_prefix)
+    return true;
+  for (int shift = 0;; shift += 7)
+  {
+    // nothing we accept needs more than 4 continuation bytes
+    if (p == end || shift > 21)
+      return false;
+    auto b = *p++;
+    value += (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+}
+
+void encode_string(std::vector<char> &out, const char *str, size_t len)
+{
+  auto hlen = huffman_encoded_len(str, len);
+  if (hlen < len)
+  {
+    encode_int(out, 0x80, 7, hlen);
+    huffman_encode(out, str, len);
+  }
+  else
+  {
+    encode_int(out, 0, 7, len);
+    out.insert(out.end(), str, str + len);
+  }
+}
+
+bool eq(const std::string &s, const char *str, size_t len)
+{
+  return s.size() == len && !memcmp(s.data(), str, len);
+}
+
+// fields whose values seldom repeat, so adding them
+// to the table would just push out ones that do
+bool worth_indexing(const char *name, size_t len)
+{
+  switch (len)
+  {
+  case 4:
+    return memcmp(name, "etag", 4) != 0;
+  case 5:
+    return memcmp(name, ":path", 5) != 0;
+  case 13:
+    return memcmp(name, "last-modified", 13) != 0;
+  case 14:
+    return memcmp(name, "content-length", 14) != 0;
+  }
+  return true;
+}
+
+} // namespace
+
+const table::entry *table::static_entry(size_t index)
+{
+  return index >= 1 && index <= k_num_static ? &static_table[index - 1] : 0;
+}
+
+const table::entry *table::get(size_t index) const
+{
+  if (index <= k_num_static)
+    return static_entry(index);
+  index -= k_num_static + 1;
+  return index < entries_.size() ? &entries_[index] : 0;
+}
+
+void table::evict(size_t room)
+{
+  while (!entries_.empty() && size_ + room > max_size_)
+  {
+    auto &e = entries_.back();
+    size_ -= e.name.size() + e.value.size() + 32;
+    entries_.pop_back();
+  }
+}
+
+void table::add(const char *name, size_t name_len, const char *value, size_t value_len)
+{
+  auto sz = name_len + value_len + 32;
+  evict(sz);
+
+  // an entry bigger than the whole table empties
+  // it, and isn't added itself
+  if (sz > max_size_)
+    return;
+  entries_.push_front(entry{std::string(name, name_len), std::string(value, value_len)});
+  size_ += sz;
+}
+
+void table::set_max_size(size_t max_size)
+{
+  max_size_ = max_size;
+  evict(0);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+bool decoder::decode(const uint8_t *block, size_t len, header_list &out, size_t max_list_size)
+{
+  auto p = block;
+  auto end = block + len;
+  bool first = true;
+  while (p < end)
+  {
+    auto b = *p;
+    size_t index;
+    if (b & 0x80)
+    {
+      // indexed field
+      if (!decode_int(p, end, 7, index))
+        return false;
+      auto e = table_.get(index);
+      if (!e || index == 0)
+        return false;
+      header_list::field f;
+      f.name_off = out.data.size();
+      f.name_len = e->name.size();
+      out.data.insert(out.data.end(), e->name.begin(), e->name.end());
+      f.value_off = out.data.size();
+      f.value_len = e->value.size();
+      out.data.insert(out.data.end(), e->value.begin(), e->value.end());
+      out.fields.push_back(f);
+    }
+    else if ((b & 0xe0) == 0x20)
+    {
+      // dynamic table size update, only allowed at
+      // the start of a block
+      if (!first || !decode_int(p, end, 5, index) || index > max_table_size_)
+        return false;
+      table_.set_max_size(index);
+      continue;
+    }
+    else
+    {
+      // literal field, with incremental indexing (01xxxxxx),
+      // without indexing (0000xxxx) or never indexed (0001xxxx)
+      bool add = (b & 0xc0) == 0x40;
+      if (!decode_int(p, end, add ? 6 : 4, index))
+        return false;
+      header_list::field f;
+      if (index)
+      {
+        auto e = table_.get(index);
+        if (!e)
+          return false;
+        f.name_off = out.data.size();
+        f.name_len = e->name.size();
+        out.data.insert(out.data.end(), e->name.begin(), e->name.end());
+      }
+      else if (!read_string(p, end, out, f.name_off, f.name_len))
+        return false;
+      if (!read_string(p, end, out, f.value_off, f.value_len))
+        return false;
+      out.fields.push_back(f);
+      if (add)
+        table_.add(out.name(f), f.name_len, out.value(f), f.value_len);
+    }
+    first = false;
+    auto &f = out.fields.back();
+    out.size += f.name_len + f.value_len + 32;
+    if (out.size > max_list_size)
+      return false;
+  }
+  return true;
+}
+
+bool decoder::read_string(const uint8_t *&p, const uint8_t *end, header_list &out, uint32_t &off, uint32_t &len)
+{
+  if (p == end)
+    return false;
+  bool huffman = (*p & 0x80) != 0;
+  size_t n;
+  if (!decode_int(p, end, 7, n) || n > (size_t)(end - p))
+    return false;
+  off = out.data.size();
+  if (huffman)
+  {
+    if (!huffman_decode(p, n, out.data))
+      return false;
+  }
+  else
+    out.data.insert(out.data.end(), (const char *)p, (const char *)p + n);
+  len = out.data.size() - off;
+  p += n;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+void encoder::set_max_table_size(size_t max_size)
+{
+  // the decoder has to see the smallest size the table had
+  // since the last block, as well as the final one
+  if (pending_size_ == SIZE_MAX || max_size < pending_min_)
+    pending_min_ = max_size;
+  pending_size_ = max_size;
+}
+
+void encoder::begin_block(std::vector<char> &out)
+{
+  if (pending_size_ == SIZE_MAX)
+    return;
+  if (pending_min_ < pending_size_)
+  {
+    encode_int(out, 0x20, 5, pending_min_);
+    table_.set_max_size(pending_min_);
+  }
+  encode_int(out, 0x20, 5, pending_size_);
+  table_.set_max_size(pending_size_);
+  pending_size_ = SIZE_MAX;
+}
+
+void encoder::encode(std::vector<char> &out, const char *name, size_t name_len, const char *value, size_t value_len,
+                     int flags)
+{
+  // an exact match is sent as just its index, otherwise
+  // the first name match saves sending the name
+  size_t name_index = 0;
+  for (size_t i = 1; i <= table::k_num_static; i++)
+  {
+    auto e = table::static_entry(i);
+    if (eq(e->name, name, name_len))
+    {
+      if (eq(e->value, value, value_len))
+      {
+        encode_int(out, 0x80, 7, i);
+        return;
+      }
+      if (!name_index)
+        name_index = i;
+    }
+  }
+  for (size_t i = 0; i < table_.num_entries(); i++)
+  {
+    auto index = table::k_num_static + 1 + i;
+    auto e = table_.get(index);
+    if (eq(e->name, name, name_len))
+    {
+      if (!(flags & k_never_index) && eq(e->value, value, value_len))
+      {
+        encode_int(out, 0x80, 7, index);
+        return;
+      }
+      if (!name_index)
+        name_index = index;
+    }
+  }
+
+  bool add = !flags && worth_indexing(name, name_len) && name_len + value_len + 32 <= table_.max_size();
+  if (add)
+    encode_int(out, 0x40, 6, name_index);
+  else
+    encode_int(out, (flags & k_never_index) ? 0x10 : 0, 4, name_index);
+  if (!name_index)
+    encode_string(out, name, name_len);
+  encode_string(out, value, value_len);
+  if (add)
+    table_.add(name, name_len, value, value_len);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+size_t huffman_encoded_len(const char *str, size_t len)
+{
+  size_t bits = 0;
+  for (size_t i = 0; i < len; i++)
+    bits += huffman_codes[(uint8_t)str[i]].bits;
+  return (bits + 7) / 8;
+}
+
+void huffman_encode(std::vector<char> &out, const char *str, size_t len)
+{
+  uint64_t acc = 0;
+  int nbits = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    auto &c = huffman_codes[(uint8_t)str[i]];
+    acc = (acc << c.bits) | c.code;
+    nbits += c.bits;
+    while (nbits >= 8)
+    {
+      nbits -= 8;
+      out.push_back((char)(acc >> nbits));
+    }
+  }
+  // pad with the high bits of EOS, which are all ones
+  if (nbits > 0)
+    out.push_back((char)((acc << (8 - nbits)) | (0xff >> nbits)));
+}
+
+bool huffman_decode(const uint8_t *p, size_t len, std::vector<char> &out)
+{
+  auto &t = huffman_table;
+  auto end = p + len;
+  uint64_t acc = 0;
+  int nbits = 0;
+  while (true)
+  {
+    while (nbits <= 56 && p < end)
+    {
+      acc = (acc << 8) | *p++;
+      nbits += 8;
+    }
+    if (nbits == 0)
+      return true;
+
+    // the next 32 bits, zero filled past the end
+    uint64_t w = nbits >= 32 ? (acc >> (nbits - 32)) & 0xffffffff : (acc << (32 - nbits)) & 0xffffffff;
+    int bits = huffman_decode_table::k_min_bits;
+    while (w >= t.limit[bits])
+      if (++bits > huffman_decode_table::k_max_bits)
+        return false;
+    if (bits > nbits)
+    {
+      // what's left must be padding: fewer than 8 bits, all ones
+      return nbits < 8 && (acc & ((1u << nbits) - 1)) == (1u << nbits) - 1;
+    }
+    auto sym = t.symbols[t.offset[bits] + ((w >> (32 - bits)) - t.first[bits])];
+    if (sym == 256)
+      return false;
+    out.push_back((char)sym);
+    nbits -= bits;
+    acc &= nbits ? (((uint64_t)1 << nbits) - 1) : 0;
+  }
+}
+
+} // namespace hpack
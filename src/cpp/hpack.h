@@ -0,0 +1,191 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+// HPACK (RFC 7541), the header compression used by HTTP/2.
+//
+// Each direction of an HTTP/2 connection has its own compression
+// state - a table of recently sent headers that both ends keep in
+// step - so an http2 connection has one hpack::encoder for the header
+// blocks it sends and one hpack::decoder for the ones it receives.
+// Neither is thread safe, and blocks must be decoded in the order they
+// were encoded.
+namespace hpack
+{
+
+enum
+{
+  k_default_table_size = 4096
+};
+
+// the header fields of one decoded block.  Names and values are stored
+// one after another in 'data', and each field says where its name and
+// value are.  They aren't nul terminated.
+struct header_list
+{
+  struct field
+  {
+    uint32_t name_off;
+    uint32_t name_len;
+    uint32_t value_off;
+    uint32_t value_len;
+  };
+
+  const char *name(const field &f) const { return &data[f.name_off]; }
+  const char *value(const field &f) const { return &data[f.value_off]; }
+
+  void clear()
+  {
+    data.clear();
+    fields.clear();
+    size = 0;
+  }
+
+  std::vector<char> data;
+  std::vector<field> fields;
+
+  // the header list size as SETTINGS_MAX_HEADER_LIST_SIZE counts it:
+  // each field's name and value length plus 32
+  size_t size{0};
+};
+
+// the (dynamic) table the encoder and decoder both keep
+class table
+{
+public:
+  table(size_t max_size)
+      : max_size_(max_size)
+  {
+  }
+
+  struct entry
+  {
+    std::string name;
+    std::string value;
+  };
+
+  // 'index' counts from 1 across the static table followed by
+  // the dynamic one, as it does on the wire.  Returns null if
+  // there is no such entry.
+  const entry *get(size_t index) const;
+  void add(const char *name, size_t name_len, const char *value, size_t value_len);
+  void set_max_size(size_t max_size);
+
+  size_t max_size() const { return max_size_; }
+  size_t num_entries() const { return entries_.size(); }
+
+  // the static table's entries
+  static const entry *static_entry(size_t index);
+  enum
+  {
+    k_num_static = 61
+  };
+
+protected:
+  void evict(size_t room);
+
+  std::deque<entry> entries_; // newest first
+  size_t size_{0};
+  size_t max_size_;
+};
+
+class decoder
+{
+public:
+  // 'max_table_size' is the biggest dynamic table the encoder on the
+  // other end may use - our SETTINGS_HEADER_TABLE_SIZE
+  decoder(size_t max_table_size = k_default_table_size)
+      : table_(max_table_size),
+        max_table_size_(max_table_size)
+  {
+  }
+
+  // decode the complete header block in [block, block+len), appending
+  // its fields to 'out'.  Returns false if the block is malformed or
+  // makes 'out' bigger than 'max_list_size', after which the
+  // connection can't be used any more (it is a COMPRESSION_ERROR).
+  bool decode(const uint8_t *block, size_t len, header_list &out, size_t max_list_size = SIZE_MAX);
+
+private:
+  bool read_string(const uint8_t *&p, const uint8_t *end, header_list &out, uint32_t &off, uint32_t &len);
+
+  table table_;
+  size_t max_table_size_;
+};
+
+class encoder
+{
+public:
+  encoder(size_t table_size = k_default_table_size)
+      : table_(table_size)
+  {
+  }
+
+  enum field_flags
+  {
+    // never add this field to the table.  Used automatically for
+    // fields whose values are rarely repeated (see encode).
+    k_no_index = 1,
+
+    // as k_no_index, and also asks anything that re-encodes the field
+    // (a proxy) not to index it - for values like passwords that
+    // shouldn't be exposed to compression based attacks
+    k_never_index = 2
+  };
+
+  // append the encoding of one header field to 'out'.  Names must be
+  // lower case.  Call with the pseudo header fields first.
+  void encode(std::vector<char> &out, const char *name, size_t name_len, const char *value, size_t value_len,
+              int flags = 0);
+
+  void encode(std::vector<char> &out, const char *name, const char *value, int flags = 0)
+  {
+    encode(out, name, strlen(name), value, strlen(value), flags);
+  }
+
+  // call once the peer's SETTINGS_HEADER_TABLE_SIZE is known.  The
+  // table is shrunk (if needed) when the next block is started.
+  void set_max_table_size(size_t max_size);
+
+  // must be called before the first field of each header block
+  void begin_block(std::vector<char> &out);
+
+private:
+  table table_;
+  size_t pending_size_{SIZE_MAX};
+  size_t pending_min_{SIZE_MAX};
+};
+
+// Huffman coding of string literals (RFC 7541 appendix B)
+size_t huffman_encoded_len(const char *str, size_t len);
+void huffman_encode(std::vector<char> &out, const char *str, size_t len);
+bool huffman_decode(const uint8_t *p, size_t len, std::vector<char> &out);
+
+} // namespace hpack
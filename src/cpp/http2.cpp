@@ -21,176 +21,293 @@
 */
 
 #include "http2.h"
+#include "http_request_parser.h"
+#include "tls_pipe.h"
+#include "b64.h"
 #include <algorithm>
+#include <poll.h>
+#include <time.h>
 
-struct open_stream_handler
+namespace
 {
-  template <typename Fn>
-  open_stream_handler(Fn f, size_t stack_size, int fd)
-      : fiber_(f, stack_size),
-        pipe_(fd, fiber_pipe::unix_domain)
-  {
-  }
 
-  fiber fiber_;
-  fiber_pipe pipe_;
-};
+const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t client_preface_len = sizeof(client_preface) - 1;
 
-struct handlers_t
+uint32_t get32(const uint8_t *p)
 {
-  std::map<uint32_t, std::unique_ptr<open_stream_handler>> map;
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
 
-  ~handlers_t()
-  {
-    for (auto it = map.begin(); it != map.end(); it++)
-    {
-      close(it->second->pipe_.release());
-      it->second->fiber_.join();
-    }
-  }
-};
+void put32(char *p, uint32_t v)
+{
+  p[0] = (char)(v >> 24);
+  p[1] = (char)(v >> 16);
+  p[2] = (char)(v >> 8);
+  p[3] = (char)v;
+}
 
-const char *http2::http2_name = "h2c-15-anon";
+bool eq(const char *p, size_t len, const char *lit)
+{
+  return len == strlen(lit) && !memcmp(p, lit, len);
+}
 
-void http2::run(http_server::pipe_t &pipe)
+// fields that only mean something to a single HTTP/1.x
+// connection, and so are not allowed in HTTP/2 (8.1.2.2)
+bool connection_specific(const char *name, size_t len)
 {
-  handlers_t handlers;
+  return eq(name, len, "connection") || eq(name, len, "keep-alive") || eq(name, len, "upgrade")
+         || eq(name, len, "proxy-connection") || eq(name, len, "transfer-encoding");
+}
 
-  while (true)
+// the value of the date header for the current second
+const char *date_value()
+{
+  thread_local time_t formatted_at = 0;
+  thread_local char value[48];
+  auto now = time(0);
+  if (now != formatted_at)
   {
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(value, sizeof(value), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    formatted_at = now;
+  }
+  return value;
+}
 
-    // read (all of) the frame header for the next frame
-    unsigned char frame[k_frame_header_size];
-    size_t bytes_read = 0;
-    while (bytes_read < sizeof(frame))
-      bytes_read += pipe.read(&frame[bytes_read], sizeof(frame) - bytes_read);
-
-    // get the fields in a more managable state
-    uint32_t netv = 0;
-    memcpy(&((char *)&netv)[1], &frame[0], 3);
-    uint32_t frame_size = ntohl(netv);
-    memcpy(&netv, &frame[5], 4);
-    uint32_t stream_id = ntohl(netv);
-    uint8_t type = frame[3];
-    uint8_t flags = frame[4];
-    char buf[1024];
-
-    if (stream_id < 2)
-    {
-    }
-    else
-    {
-
-      if (type == k_HEADERS || type == k_PUSH_PROMISE)
-      {
+} // namespace
 
-        anon_log("received " << (type == k_HEADERS ? "HEADERS" : "PUSH_PROMISE") << " for stream_id " << stream_id);
+// one stream of the connection.  Its fields are guarded by the
+// connection's mtx_.
+struct http2::stream : public http_server::stream
+{
+  stream(http2 *conn, uint32_t id)
+      : conn(conn),
+        id(id),
+        recv_window(conn->opts_.initial_window_size),
+        send_window(conn->peer_initial_window_)
+  {
+  }
 
-        // a request to open a new stream_id. if legal, we create a new handler for it
+  virtual size_t read_body(void *buff, size_t len) override;
+  virtual void send_head(const http_response &response, int64_t content_length, bool vary,
+                         const char *content_encoding, bool end_stream) override;
+  virtual void send_body(const void *buff, size_t len, bool end_stream) override;
 
-        if (handlers.map.find(stream_id) != handlers.map.end())
-        {
-#if ANON_LOG_NET_TRAFFIC > 1
-          anon_log("invalid " << (type == k_HEADERS ? "HEADERS" : "PUSH_PROMISE") << " sent to already-open stream " << stream_id);
-#endif
-          return;
-        }
-
-        // the new handler will be reading from a different (unix-domain) socket
-        // that we will forward into.  So create that here
-        int sv[2];
-        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) != 0)
-          do_error("socketpair(AF_UNIX, SOCK_STREAM | NONBLOCK | SOCK_CLOEXEC, 0, sv)");
+  void throw_closed()
+  {
+    anon_throw(fiber_io_error, "http2 stream " << id << (reset ? " was reset" : " has ended"));
+  }
 
-        anon_log(" new " << (type == k_HEADERS ? "HEADERS" : "PUSH_PROMISE") << " for stream_id " << stream_id << " will use fds: " << sv[0] << " and " << sv[1]);
+  http2 *conn;
+  uint32_t id;
+  fiber_cond cond;
+
+  // DATA received and not yet read is in[in_pos..)
+  std::vector<char> in;
+  size_t in_pos{0};
+  int64_t recv_window;
+  uint32_t recv_unacked{0};
+  int64_t expected_len{-1};
+  uint64_t received{0};
+  bool remote_closed{false};
+
+  int64_t send_window;
+  bool local_closed{false};
+  bool reset{false};
+
+  // server side, the request.  Its headers point into header_data.
+  std::unique_ptr<http_request> request;
+  std::vector<char> header_data;
+  const http_request *upgrade_request{nullptr};
+
+  // client side, the response
+  response resp;
+  bool headers_done{false};
+};
 
-        auto svv = sv[0];
-        auto handv = stream_handler_factory_->new_handler();
+size_t http2::stream::read_body(void *buff, size_t len)
+{
+  fiber_lock lock(conn->mtx_);
+  while (in_pos == in.size() && !remote_closed && !reset && !conn->closed_)
+    cond.wait(lock);
+  if (in_pos == in.size())
+  {
+    if (remote_closed && !reset)
+      return 0;
+    throw_closed();
+  }
+  auto n = std::min(len, in.size() - in_pos);
+  memcpy(buff, &in[in_pos], n);
+  in_pos += n;
+  if (in_pos == in.size())
+  {
+    in.clear();
+    in_pos = 0;
+  }
+  else if (in_pos >= k_default_window_size && in_pos * 2 >= in.size())
+  {
+    in.erase(in.begin(), in.begin() + in_pos);
+    in_pos = 0;
+  }
 
-        // now start the handler running in a new fiber
-        handlers.map[stream_id] = std::unique_ptr<open_stream_handler>(new open_stream_handler([svv, &pipe, stream_id, handv] {
-          std::unique_ptr<stream_handler> hd(handv);
-          handv->exec(svv, pipe, stream_id);
-        },
-                                                                                               stack_size_, sv[1]));
-      }
+  // what has been read can be sent again
+  uint32_t update = 0;
+  recv_unacked += n;
+  if (!remote_closed && recv_unacked >= conn->opts_.initial_window_size / 2)
+  {
+    update = recv_unacked;
+    recv_window += update;
+    recv_unacked = 0;
+  }
+  lock.unlock();
+  if (update)
+    conn->send_window_update(id, update);
+  return n;
+}
 
-      auto sh = handlers.map.find(stream_id);
-      if (sh != handlers.map.end())
-      {
-        sh->second->pipe_.write(&frame[0], sizeof(frame));
-        size_t bytes_read = 0;
-        while (bytes_read < frame_size)
-        {
-          auto br = pipe.read(&buf[0], std::min(sizeof(buf), frame_size - bytes_read));
-          sh->second->pipe_.write(&buf[0], br);
-          bytes_read += br;
-        }
-      }
+void http2::stream::send_head(const http_response &response, int64_t content_length, bool vary,
+                              const char *content_encoding, bool end_stream)
+{
+  auto &status_line = response.get_status_code();
+  auto code = atoi(status_line.c_str());
+  if (code < 100 || code > 999)
+    anon_throw(std::runtime_error, "invalid http status: \"" << status_line << "\"");
+  char status[8];
+  snprintf(status, sizeof(status), "%d", code);
+
+  // the response's header lines, with their names in lower case
+  struct field
+  {
+    size_t name_off;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+  };
+  std::vector<field> fields;
+  std::string names;
+  bool has_date = false;
+  auto p = response.header_data();
+  auto end = p + response.header_size();
+  while (p < end)
+  {
+    auto eol = (const char *)memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+    auto colon = (const char *)memchr(p, ':', eol - p);
+    if (colon)
+    {
+      auto off = names.size();
+      for (auto c = p; c < colon; c++)
+        names.push_back((*c >= 'A' && *c <= 'Z') ? *c + ('a' - 'A') : *c);
+      auto v = colon + 1;
+      auto ve = eol;
+      while (v < ve && *v == ' ')
+        ++v;
+      while (ve > v && (ve[-1] == '\r' || ve[-1] == ' '))
+        --ve;
+      auto name_len = colon - p;
+      if (connection_specific(&names[off], name_len))
+        names.resize(off);
       else
       {
-#if ANON_LOG_NET_TRAFFIC > 1
-        anon_log("http2 frame intended for idle stream_id " << stream_id << ", of size " << frame_size);
-#endif
-        // TODO send GOAWAY? (see 5.4.1)
-        return;
+        has_date |= eq(&names[off], name_len, "date");
+        fields.push_back(field{off, (size_t)name_len, v, (size_t)(ve - v)});
       }
     }
+    p = eol + 1;
+  }
 
-#if 0
-    switch (frame[3]) {
-      case k_DATA:
-        break;
-      case k_HEADERS:
-        break;
-      case k_PRIORITY:
-        break;
-      case k_RST_STREAM:
-        break;
-      case k_SETTINGS:
-        parse_settings(stream_id, flags, frame_size);
-        break;
-      case k_PUSH_PROMISE:
-        break;
-      case k_PING:
-        break;
-      case k_GOAWAY:
-        break;
-      case k_WINDOW_UPDATE:
-        break;
-      case k_CONTINUATION:
-        break;
-      default:  {
-#if ANON_LOG_NET_TRAFFIC > 1
-        anon_log("ignoring unknown http2 frame type of " << (int)frame[3] << ", of size " << frame_size << " from " << *request.src_addr);
-#endif
-        char    buf[512];
-        size_t  bytes_skipped = 0;
-        while (bytes_skipped < frame_size)
-          bytes_skipped = pipe.read(&buf[0], std::min(sizeof(buf), frame_size-bytes_skipped));
-      } break;
+  {
+    fiber_lock lock(conn->mtx_);
+    if (reset || conn->closed_ || local_closed)
+      throw_closed();
+    local_closed = end_stream;
+  }
+
+  {
+    fiber_lock out_lock(conn->out_mtx_);
+    std::vector<char> block;
+    auto &enc = conn->encoder_;
+    enc.begin_block(block);
+    enc.encode(block, ":status", status);
+    for (auto &f : fields)
+      enc.encode(block, &names[f.name_off], f.name_len, f.value, f.value_len);
+    if (!has_date)
+      enc.encode(block, "date", date_value());
+    if (content_length >= 0 && (content_length > 0 || (code >= 200 && code != 204 && code != 304)))
+    {
+      char cl[24];
+      snprintf(cl, sizeof(cl), "%lld", (long long)content_length);
+      enc.encode(block, "content-length", cl);
     }
-#endif
+    if (vary)
+      enc.encode(block, "vary", "accept-encoding");
+    if (content_encoding)
+      enc.encode(block, "content-encoding", content_encoding);
+    conn->append_headers(id, end_stream, block);
   }
+  // a body of known length follows right away, and goes out
+  // in the same write as these headers (see send_body)
+  if (end_stream || content_length < 0)
+    conn->flush(true);
 }
 
-#if 0
+void http2::stream::send_body(const void *buff, size_t len, bool end_stream)
+{
+  if (len == 0 && !end_stream)
+    return;
+  auto p = (const char *)buff;
+  do
+  {
+    fiber_lock lock(conn->mtx_);
+    if (len > 0 && (send_window <= 0 || conn->send_window_ <= 0) && !reset && !conn->closed_)
+    {
+      // don't leave our headers sitting in out_ while we wait
+      lock.unlock();
+      conn->flush(true);
+      lock.lock();
+      while (len > 0 && (send_window <= 0 || conn->send_window_ <= 0) && !reset && !conn->closed_)
+        conn->window_cond_.wait(lock);
+    }
+    if (reset || conn->closed_ || local_closed)
+      throw_closed();
+    auto n = std::min({(int64_t)len, send_window, conn->send_window_, (int64_t)conn->peer_max_frame_});
+    send_window -= n;
+    conn->send_window_ -= n;
+    bool last = end_stream && (size_t)n == len;
+    local_closed = last;
+    lock.unlock();
 
-Frame Layout from section 4.1 of the spec:
+    {
+      fiber_lock out_lock(conn->out_mtx_);
+      conn->append_frame(k_DATA, last ? k_END_STREAM : 0, id, p, n);
+    }
+    conn->flush(true);
+    p += n;
+    len -= n;
+  } while (len > 0);
+}
 
-     0                   1                   2                   3
-     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-    |                 Length (24)                   |
-    +---------------+---------------+---------------+
-    |   Type (8)    |   Flags (8)   |
-    +-+-+-----------+---------------+-------------------------------+
-    |R|                 Stream Identifier (31)                      |
-    +=+=============================================================+
-    |                   Frame Payload (0...)                      ...
-    +---------------------------------------------------------------+
+/////////////////////////////////////////////////////////////////////////
 
-#endif
+http2::http2(::pipe_t *pipe, bool client, const options &opts)
+    : pipe_(pipe),
+      tls_(dynamic_cast<tls_pipe *>(pipe)),
+      client_(client),
+      opts_(opts),
+      next_stream_id_(client ? 1 : 2),
+      recv_window_(std::max(opts.connection_window_size, (uint32_t)k_default_window_size))
+{
+  fp_ = tls_ ? tls_->get_fiber_pipe() : dynamic_cast<fiber_pipe *>(pipe);
+  if (!fp_)
+    anon_throw(std::runtime_error, "http2 needs a fiber_pipe or a tls_pipe");
+}
+
+http2::~http2()
+{
+}
 
 void http2::format_frame(char *buf, uint32_t length, uint8_t type, uint8_t flags, uint32_t stream_id)
 {
@@ -213,193 +330,1031 @@ void http2::format_frame(char *buf, uint32_t length, uint8_t type, uint8_t flags
   memcpy(&buf[5], &netv, 4);
 }
 
-void http2::send_data()
+void http2::serve(http_server &server, const sockaddr *src_addr, socklen_t src_addr_len, std::vector<char> &&buffered,
+                  const http_request *upgrade_request, std::vector<char> &&upgrade_body,
+                  const string_len &upgrade_settings)
+{
+  server_ = &server;
+  src_addr_ = src_addr;
+  src_addr_len_ = src_addr_len;
+  in_ = std::move(buffered);
+  in_start_ = 0;
+  in_end_ = in_.size();
+
+  uint32_t error_code = k_NO_ERROR;
+  try
+  {
+    if (upgrade_request)
+    {
+      // the client's settings came in the HTTP2-Settings header (3.2.1)
+      auto settings = b64url_decode(upgrade_settings.ptr(), upgrade_settings.len());
+      if (settings.size() % 6)
+        throw connection_error{k_PROTOCOL_ERROR, "invalid HTTP2-Settings header"};
+      fiber_lock lock(mtx_);
+      fiber_lock out_lock(out_mtx_);
+      auto p = (const uint8_t *)settings.data();
+      for (size_t i = 0; i < settings.size(); i += 6)
+        apply_setting((p[i] << 8) | p[i + 1], get32(p + i + 2));
+    }
+    send_preface();
+
+    if (upgrade_request)
+    {
+      // the request that asked for the upgrade is stream 1,
+      // and has been sent in full
+      auto s = std::make_shared<stream>(this, 1);
+      s->upgrade_request = upgrade_request;
+      s->in = std::move(upgrade_body);
+      s->remote_closed = true;
+      {
+        fiber_lock lock(mtx_);
+        streams_[1] = s;
+        ++num_streams_;
+        last_peer_stream_ = 1;
+      }
+      fiber::run_in_fiber([this, s] { run_stream(s); }, opts_.stack_size, "http2 stream");
+    }
+
+    if (fill(client_preface_len))
+    {
+      if (memcmp(&in_[in_start_], client_preface, client_preface_len))
+        throw connection_error{k_PROTOCOL_ERROR, "invalid connection preface"};
+      in_start_ += client_preface_len;
+      read_frames();
+    }
+  }
+  catch (const connection_error &e)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("http2 connection from " << *src_addr_ << " failed, error " << e.code << ": " << e.what);
+#endif
+    error_code = e.code;
+  }
+  catch (const std::exception &e)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("http2 connection from " << *src_addr_ << " ended, what() = " << e.what());
+#endif
+    error_code = k_INTERNAL_ERROR;
+  }
+  finish(error_code);
+}
+
+void http2::start()
 {
+  {
+    fiber_lock out_lock(out_mtx_);
+    out_.insert(out_.end(), client_preface, client_preface + client_preface_len);
+  }
+  send_preface();
 }
 
-void http2::send_headers()
+void http2::run()
 {
+  uint32_t error_code = k_NO_ERROR;
+  try
+  {
+    read_frames();
+  }
+  catch (const connection_error &e)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("http2 connection failed, error " << e.code << ": " << e.what);
+#endif
+    error_code = e.code;
+  }
+  catch (const std::exception &e)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("http2 connection ended, what() = " << e.what());
+#endif
+    error_code = k_INTERNAL_ERROR;
+  }
+  finish(error_code);
 }
 
-void http2::send_priority()
+void http2::close(uint32_t error_code)
 {
+  uint32_t last;
+  {
+    fiber_lock lock(mtx_);
+    if (goaway_sent_)
+      return;
+    goaway_sent_ = true;
+    last = last_peer_stream_;
+  }
+  char payload[8];
+  put32(&payload[0], last);
+  put32(&payload[4], error_code);
+  send_frame(k_GOAWAY, 0, 0, payload, sizeof(payload));
 }
 
-void http2::send_reset_stream()
+// the end of the connection, seen by the reader.  Streams
+// still running find out when they next read or write.
+void http2::finish(uint32_t error_code)
 {
+  try
+  {
+    close(error_code);
+  }
+  catch (const std::exception &)
+  {
+  }
+
+  fiber_lock lock(mtx_);
+  closed_ = true;
+  for (auto &s : streams_)
+    s.second->cond.notify_all();
+  window_cond_.notify_all();
+  streams_cond_.notify_all();
+  if (!client_)
+  {
+    while (num_streams_ > 0)
+      streams_cond_.wait(lock);
+  }
 }
 
-#if 0
-Settings format from section 6.5.1.
+void http2::send_preface()
+{
+  char payload[6 * 4];
+  size_t len = 0;
+  auto add = [&payload, &len](uint16_t id, uint32_t value) {
+    payload[len] = (char)(id >> 8);
+    payload[len + 1] = (char)id;
+    put32(&payload[len + 2], value);
+    len += 6;
+  };
+  if (client_)
+    add(k_SETTINGS_ENABLE_PUSH, 0);
+  else
+    add(k_SETTINGS_MAX_CONCURRENT_STREAMS, opts_.max_concurrent_streams);
+  if (opts_.initial_window_size != k_default_window_size)
+    add(k_SETTINGS_INITIAL_WINDOW_SIZE, opts_.initial_window_size);
+  if (opts_.max_frame_size != k_min_max_frame_size)
+    add(k_SETTINGS_MAX_FRAME_SIZE, opts_.max_frame_size);
+  add(k_SETTINGS_MAX_HEADER_LIST_SIZE, opts_.max_header_list_size);
+
+  {
+    fiber_lock out_lock(out_mtx_);
+    append_frame(k_SETTINGS, 0, 0, payload, len);
+    if (opts_.connection_window_size > k_default_window_size)
+    {
+      char inc[4];
+      put32(inc, opts_.connection_window_size - k_default_window_size);
+      append_frame(k_WINDOW_UPDATE, 0, 0, inc, sizeof(inc));
+    }
+  }
+  flush();
+}
 
-Settings frame is an array of:
+/////////////////////////////////////////////////////////////////////////
 
-     0                   1                   2                   3
-     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-    |       Identifier (16)         |
-    +-------------------------------+-------------------------------+
-    |                        Value (32)                             |
-    +---------------------------------------------------------------+
+// make sure there are at least 'needed' bytes in in_[in_start_..in_end_),
+// returning false if the connection ends (or is idle too long) first
+bool http2::fill(size_t needed)
+{
+  // set once openssl has part of a record and needs more of it
+  auto need_socket = false;
+  while (in_end_ - in_start_ < needed)
+  {
+    if (in_start_ + needed > in_.size())
+    {
+      memmove(&in_[0], &in_[in_start_], in_end_ - in_start_);
+      in_end_ -= in_start_;
+      in_start_ = 0;
+      if (in_.size() < needed || in_.size() < 2 * k_min_max_frame_size)
+        in_.resize(std::max(needed, (size_t)(2 * k_min_max_frame_size)));
+    }
 
+    // over tls we can only read while holding io_mtx_, and must
+    // not hold it while waiting, so wait for the socket first and
+    // then read without letting the tls layer wait for the rest of
+    // a partly received record
+    if (!tls_ || need_socket || !tls_->has_buffered_data())
+    {
+      int timeout_ms = -1;
+      if (!client_)
+      {
+        fiber_lock lock(mtx_);
+        if (num_streams_ == 0)
+          timeout_ms = opts_.idle_timeout_seconds * 1000;
+      }
+      pipe_wait w{fp_, POLLIN, 0};
+      if (fiber::wait_any(&w, 1, timeout_ms) == 0)
+      {
+#if ANON_LOG_NET_TRAFFIC > 2
+        anon_log("http2 connection idle for " << opts_.idle_timeout_seconds << " seconds, closing it");
 #endif
+        return false;
+      }
+    }
+
+    io_result res;
+    if (tls_)
+    {
+      fiber_lock lock(io_mtx_);
+      res = tls_->try_read_nowait(&in_[in_end_], in_.size() - in_end_);
+    }
+    else
+      res = pipe_->try_read(&in_[in_end_], in_.size() - in_end_);
+    need_socket = res.err == EAGAIN;
+    if (need_socket)
+      continue;
+    if (!res)
+      return false;
+    in_end_ += res.bytes;
+  }
+  return true;
+}
 
-void http2::send_settings(http_server::pipe_t &pipe, uint32_t stream_id, const std::vector<std::pair<settings_t, uint32_t>> &settings)
+void http2::read_frames()
 {
-#if defined(ANON_RUNTIME_CHECKS)
-  if (settings.size() > k_num_settings_params)
-    do_error("too many parameters for http2::send_settings - tried to send " << settings.size() << ", maximum allowable is " << k_num_settings_params);
-#endif
+  while (fill(k_frame_header_size))
+  {
+    auto h = (const uint8_t *)&in_[in_start_];
+    uint32_t len = (h[0] << 16) | (h[1] << 8) | h[2];
+    auto type = h[3];
+    auto flags = h[4];
+    auto stream_id = get32(h + 5) & 0x7fffffff;
+    if (len > opts_.max_frame_size)
+      throw connection_error{k_FRAME_SIZE_ERROR, "frame bigger than SETTINGS_MAX_FRAME_SIZE"};
+    if (!fill(k_frame_header_size + len))
+      return;
+    auto payload = (const uint8_t *)&in_[in_start_ + k_frame_header_size];
+    in_start_ += k_frame_header_size + len;
+    on_frame(type, flags, stream_id, payload, len);
+  }
+}
 
-  char buf[k_frame_header_size + k_num_settings_params * 6];
+void http2::on_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len)
+{
+  if (continuation_stream_ && type != k_CONTINUATION)
+    throw connection_error{k_PROTOCOL_ERROR, "header block interrupted"};
+  if (!got_settings_ && type != k_SETTINGS)
+    throw connection_error{k_PROTOCOL_ERROR, "connection preface not followed by SETTINGS"};
 
-  format_frame(&buf[0], settings.size() * 6, k_SETTINGS, 0 /*flags*/, stream_id);
+  switch (type)
+  {
+  case k_DATA:
+    on_data(flags, stream_id, payload, len);
+    break;
 
-  for (int i = 0; i < settings.size(); i++)
+  case k_HEADERS:
   {
-    uint16_t netv16 = htons(settings[i].first);
-    memcpy(&buf[k_frame_header_size + i * 6 + 0], &netv16, 2);
-    uint32_t netv32 = htonl(settings[i].second);
-    memcpy(&buf[k_frame_header_size + i * 6 + 2], &netv16, 4);
+    if (!stream_id)
+      throw connection_error{k_PROTOCOL_ERROR, "HEADERS on stream 0"};
+    size_t pad = 0;
+    if (flags & k_PADDED)
+    {
+      if (len < 1)
+        throw connection_error{k_FRAME_SIZE_ERROR, "HEADERS too short"};
+      pad = *payload++;
+      --len;
+    }
+    if (flags & k_PRIORITY_FLAG)
+    {
+      if (len < 5)
+        throw connection_error{k_FRAME_SIZE_ERROR, "HEADERS too short"};
+      payload += 5;
+      len -= 5;
+    }
+    if (pad > len)
+      throw connection_error{k_PROTOCOL_ERROR, "HEADERS padding too long"};
+    header_block_.assign(payload, payload + len - pad);
+    header_flags_ = flags;
+    if (flags & k_END_HEADERS)
+      on_header_block(stream_id, (flags & k_END_STREAM) != 0);
+    else
+      continuation_stream_ = stream_id;
+    break;
   }
 
-  pipe.write(&buf[0], k_frame_header_size + settings.size() * 6);
+  case k_CONTINUATION:
+    if (!continuation_stream_ || stream_id != continuation_stream_)
+      throw connection_error{k_PROTOCOL_ERROR, "unexpected CONTINUATION"};
+    if (header_block_.size() + len > 2 * (size_t)opts_.max_header_list_size)
+      throw connection_error{k_ENHANCE_YOUR_CALM, "header block too large"};
+    header_block_.insert(header_block_.end(), payload, payload + len);
+    if (flags & k_END_HEADERS)
+    {
+      continuation_stream_ = 0;
+      on_header_block(stream_id, (header_flags_ & k_END_STREAM) != 0);
+    }
+    break;
+
+  case k_PRIORITY:
+    // streams are served in the order their frames arrive
+    if (!stream_id)
+      throw connection_error{k_PROTOCOL_ERROR, "PRIORITY on stream 0"};
+    if (len != 5)
+      send_rst(stream_id, k_FRAME_SIZE_ERROR);
+    break;
+
+  case k_RST_STREAM:
+  {
+    if (!stream_id)
+      throw connection_error{k_PROTOCOL_ERROR, "RST_STREAM on stream 0"};
+    if (len != 4)
+      throw connection_error{k_FRAME_SIZE_ERROR, "RST_STREAM not 4 bytes"};
+    fiber_lock lock(mtx_);
+    auto it = streams_.find(stream_id);
+    if (it != streams_.end())
+    {
+      it->second->reset = true;
+      it->second->cond.notify_all();
+      window_cond_.notify_all();
+    }
+    else if (client_ ? stream_id >= next_stream_id_ : stream_id > last_peer_stream_)
+      throw connection_error{k_PROTOCOL_ERROR, "RST_STREAM on idle stream"};
+    break;
+  }
+
+  case k_SETTINGS:
+    if (stream_id)
+      throw connection_error{k_PROTOCOL_ERROR, "SETTINGS not on stream 0"};
+    on_settings(flags, payload, len);
+    break;
+
+  case k_PUSH_PROMISE:
+    // we never enable push, and clients can't push
+    throw connection_error{k_PROTOCOL_ERROR, "PUSH_PROMISE not allowed"};
+
+  case k_PING:
+    if (stream_id)
+      throw connection_error{k_PROTOCOL_ERROR, "PING not on stream 0"};
+    if (len != 8)
+      throw connection_error{k_FRAME_SIZE_ERROR, "PING not 8 bytes"};
+    if (!(flags & k_ACK))
+      send_frame(k_PING, k_ACK, 0, payload, len);
+    break;
+
+  case k_GOAWAY:
+  {
+    if (stream_id)
+      throw connection_error{k_PROTOCOL_ERROR, "GOAWAY not on stream 0"};
+    if (len < 8)
+      throw connection_error{k_FRAME_SIZE_ERROR, "GOAWAY too short"};
+    auto last = get32(payload) & 0x7fffffff;
+#if ANON_LOG_NET_TRAFFIC > 2
+    anon_log("http2 GOAWAY received, last stream " << last << ", error " << get32(payload + 4));
+#endif
+    fiber_lock lock(mtx_);
+    goaway_received_ = true;
+    streams_cond_.notify_all();
+
+    // our streams after 'last' were never seen
+    if (client_)
+    {
+      for (auto &s : streams_)
+        if (s.first > last)
+        {
+          s.second->reset = true;
+          s.second->cond.notify_all();
+        }
+      window_cond_.notify_all();
+    }
+    break;
+  }
+
+  case k_WINDOW_UPDATE:
+  {
+    if (len != 4)
+      throw connection_error{k_FRAME_SIZE_ERROR, "WINDOW_UPDATE not 4 bytes"};
+    auto increment = get32(payload) & 0x7fffffff;
+    uint32_t rst = 0;
+    {
+      fiber_lock lock(mtx_);
+      if (!stream_id)
+      {
+        if (!increment)
+          throw connection_error{k_PROTOCOL_ERROR, "WINDOW_UPDATE of 0"};
+        send_window_ += increment;
+        if (send_window_ > k_max_window_size)
+          throw connection_error{k_FLOW_CONTROL_ERROR, "connection window too large"};
+      }
+      else
+      {
+        auto it = streams_.find(stream_id);
+        if (it == streams_.end())
+          break;
+        auto &s = *it->second;
+        s.send_window += increment;
+        if (!increment)
+          rst = k_PROTOCOL_ERROR;
+        else if (s.send_window > k_max_window_size)
+          rst = k_FLOW_CONTROL_ERROR;
+        if (rst)
+        {
+          s.reset = true;
+          s.cond.notify_all();
+        }
+      }
+      window_cond_.notify_all();
+    }
+    if (rst)
+      send_rst(stream_id, rst);
+    break;
+  }
+
+  default:
+    // unknown frame types are ignored
+    break;
+  }
 }
 
-void http2::send_push_promise()
+void http2::on_settings(uint8_t flags, const uint8_t *payload, uint32_t len)
 {
+  if (flags & k_ACK)
+  {
+    if (len)
+      throw connection_error{k_FRAME_SIZE_ERROR, "SETTINGS ack with a payload"};
+    return;
+  }
+  if (len % 6)
+    throw connection_error{k_FRAME_SIZE_ERROR, "SETTINGS not a multiple of 6 bytes"};
+  {
+    fiber_lock lock(mtx_);
+    fiber_lock out_lock(out_mtx_);
+    for (uint32_t i = 0; i < len; i += 6)
+      apply_setting((payload[i] << 8) | payload[i + 1], get32(payload + i + 2));
+  }
+  got_settings_ = true;
+  send_frame(k_SETTINGS, k_ACK, 0, 0, 0);
 }
 
-void http2::send_ping()
+// called with both mtx_ and out_mtx_ locked
+void http2::apply_setting(uint16_t id, uint32_t value)
 {
+  switch (id)
+  {
+  case k_SETTINGS_HEADER_TABLE_SIZE:
+    encoder_.set_max_table_size(std::min(value, (uint32_t)hpack::k_default_table_size));
+    break;
+
+  case k_SETTINGS_ENABLE_PUSH:
+    if (value > 1)
+      throw connection_error{k_PROTOCOL_ERROR, "invalid SETTINGS_ENABLE_PUSH"};
+    break;
+
+  case k_SETTINGS_MAX_CONCURRENT_STREAMS:
+    peer_max_streams_ = value;
+    streams_cond_.notify_all();
+    break;
+
+  case k_SETTINGS_INITIAL_WINDOW_SIZE:
+  {
+    if (value > k_max_window_size)
+      throw connection_error{k_FLOW_CONTROL_ERROR, "invalid SETTINGS_INITIAL_WINDOW_SIZE"};
+    // applies to the streams that are already open too
+    int64_t delta = (int64_t)value - peer_initial_window_;
+    for (auto &s : streams_)
+    {
+      s.second->send_window += delta;
+      if (s.second->send_window > k_max_window_size)
+        throw connection_error{k_FLOW_CONTROL_ERROR, "stream window too large"};
+    }
+    peer_initial_window_ = value;
+    window_cond_.notify_all();
+    break;
+  }
+
+  case k_SETTINGS_MAX_FRAME_SIZE:
+    if (value < k_min_max_frame_size || value > k_max_max_frame_size)
+      throw connection_error{k_PROTOCOL_ERROR, "invalid SETTINGS_MAX_FRAME_SIZE"};
+    peer_max_frame_ = value;
+    break;
+
+  default:
+    // SETTINGS_MAX_HEADER_LIST_SIZE is advisory, and
+    // unknown settings are ignored
+    break;
+  }
 }
 
-void http2::send_goaway()
+void http2::on_data(uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len)
 {
+  if (!stream_id)
+    throw connection_error{k_PROTOCOL_ERROR, "DATA on stream 0"};
+  auto data = payload;
+  uint32_t data_len = len;
+  uint32_t pad = 0;
+  if (flags & k_PADDED)
+  {
+    if (len < 1 || (uint32_t)payload[0] + 1 > len)
+      throw connection_error{k_PROTOCOL_ERROR, "DATA padding too long"};
+    pad = payload[0] + 1;
+    ++data;
+    data_len = len - pad;
+  }
+  bool end_stream = (flags & k_END_STREAM) != 0;
+
+  uint32_t conn_update = 0, stream_update = 0, rst = 0;
+  {
+    fiber_lock lock(mtx_);
+
+    // the whole frame counts against both windows.  The connection's
+    // is opened again as soon as data arrives, each stream's window
+    // being what limits what can be held for it.
+    recv_window_ -= len;
+    if (recv_window_ < 0)
+      throw connection_error{k_FLOW_CONTROL_ERROR, "connection flow control window exceeded"};
+    recv_unacked_ += len;
+    if (recv_unacked_ >= opts_.connection_window_size / 2)
+    {
+      conn_update = recv_unacked_;
+      recv_window_ += conn_update;
+      recv_unacked_ = 0;
+    }
+
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end() || it->second->remote_closed)
+    {
+      if (client_ ? stream_id >= next_stream_id_ : stream_id > last_peer_stream_)
+        throw connection_error{k_PROTOCOL_ERROR, "DATA on idle stream"};
+      rst = k_STREAM_CLOSED;
+    }
+    else
+    {
+      auto &s = *it->second;
+      s.recv_window -= len;
+      s.received += data_len;
+      if (s.recv_window < 0)
+        rst = k_FLOW_CONTROL_ERROR;
+      else if (s.expected_len >= 0 && (s.received > (uint64_t)s.expected_len || (end_stream && s.received != (uint64_t)s.expected_len)))
+        rst = k_PROTOCOL_ERROR;
+      else if (!s.reset)
+      {
+        s.in.insert(s.in.end(), data, data + data_len);
+
+        // padding is never read, so it can be sent again right away.
+        // The client's streams are read all at once at the end, so
+        // theirs is opened again as the data arrives.
+        s.recv_unacked += client_ ? len : pad;
+        if (end_stream)
+          s.remote_closed = true;
+        else if (s.recv_unacked >= opts_.initial_window_size / 2)
+        {
+          stream_update = s.recv_unacked;
+          s.recv_window += stream_update;
+          s.recv_unacked = 0;
+        }
+        s.cond.notify_all();
+      }
+      if (rst)
+      {
+        s.reset = true;
+        s.cond.notify_all();
+        window_cond_.notify_all();
+      }
+    }
+  }
+  if (conn_update)
+    send_window_update(0, conn_update);
+  if (stream_update)
+    send_window_update(stream_id, stream_update);
+  if (rst)
+    send_rst(stream_id, rst);
 }
 
-void http2::send_window_update()
+void http2::on_header_block(uint32_t stream_id, bool end_stream)
 {
+  // blocks are always decoded, even for streams that are then
+  // refused, to keep the decoder in step with the peer's encoder
+  headers_.clear();
+  if (!decoder_.decode(header_block_.data(), header_block_.size(), headers_, opts_.max_header_list_size))
+    throw connection_error{k_COMPRESSION_ERROR, "invalid header block"};
+
+  if (!client_)
+  {
+    open_stream(stream_id, end_stream, headers_);
+    return;
+  }
+
+  fiber_lock lock(mtx_);
+  auto it = streams_.find(stream_id);
+  if (it != streams_.end())
+    on_response_headers(*it->second, end_stream, headers_);
+  else if (stream_id >= next_stream_id_)
+    throw connection_error{k_PROTOCOL_ERROR, "HEADERS on idle stream"};
 }
 
-void http2::send_continuation()
+void http2::open_stream(uint32_t stream_id, bool end_stream, const hpack::header_list &headers)
 {
-}
+  if (!(stream_id & 1))
+    throw connection_error{k_PROTOCOL_ERROR, "client stream with an even id"};
 
-////////////////////////////////////////////
+  std::shared_ptr<stream> s;
+  uint32_t rst = 0;
+  {
+    fiber_lock lock(mtx_);
+    auto it = streams_.find(stream_id);
+    if (it != streams_.end())
+    {
+      // trailers, which end the request
+      auto &t = *it->second;
+      if (t.remote_closed)
+        throw connection_error{k_STREAM_CLOSED, "HEADERS on half closed stream"};
+      if (!end_stream)
+        throw connection_error{k_PROTOCOL_ERROR, "trailers without END_STREAM"};
+      t.remote_closed = true;
+      if (t.expected_len >= 0 && t.received != (uint64_t)t.expected_len)
+      {
+        t.reset = true;
+        rst = k_PROTOCOL_ERROR;
+      }
+      t.cond.notify_all();
+    }
+    else
+    {
+      if (stream_id <= last_peer_stream_)
+        throw connection_error{k_STREAM_CLOSED, "HEADERS on closed stream"};
+      last_peer_stream_ = stream_id;
+      if (goaway_sent_)
+        return;
+      if (num_streams_ >= opts_.max_concurrent_streams)
+        rst = k_REFUSED_STREAM;
+      else
+      {
+        s = std::make_shared<stream>(this, stream_id);
+        if (!build_request(*s, headers))
+        {
+          s.reset();
+          rst = k_PROTOCOL_ERROR;
+        }
+        else
+        {
+          s->remote_closed = end_stream;
+          streams_[stream_id] = s;
+          ++num_streams_;
+        }
+      }
+    }
+  }
+  if (rst)
+    send_rst(stream_id, rst);
+  else if (s)
+    fiber::run_in_fiber([this, s] { run_stream(s); }, opts_.stack_size, "http2 stream");
+}
 
-void http2::parse_settings(uint32_t stream_id, uint8_t flags, uint32_t frame_size)
+// fill in s.request from the request's header fields, returning
+// false if they are malformed (8.1.2)
+bool http2::build_request(stream &s, const hpack::header_list &headers)
 {
-  // is this an ack or an initiated settings?
-  if (flags & k_settings_ack)
+  const hpack::header_list::field *method = 0, *scheme = 0, *path = 0, *authority = 0;
+  bool regular = false, has_host = false;
+  size_t num_cookies = 0, cookies_len = 0;
+  for (auto &f : headers.fields)
   {
-    // peer is acknowleding a previous settings that we sent
-    // nothing to here yet...
+    auto name = headers.name(f);
+    if (f.name_len && name[0] == ':')
+    {
+      const hpack::header_list::field **pseudo;
+      if (eq(name, f.name_len, ":method"))
+        pseudo = &method;
+      else if (eq(name, f.name_len, ":scheme"))
+        pseudo = &scheme;
+      else if (eq(name, f.name_len, ":path"))
+        pseudo = &path;
+      else if (eq(name, f.name_len, ":authority"))
+        pseudo = &authority;
+      else
+        return false;
+      if (regular || *pseudo)
+        return false;
+      *pseudo = &f;
+      continue;
+    }
+    regular = true;
+    for (uint32_t i = 0; i < f.name_len; i++)
+      if (name[i] >= 'A' && name[i] <= 'Z')
+        return false;
+    if (connection_specific(name, f.name_len))
+      return false;
+    if (eq(name, f.name_len, "te") && !eq(headers.value(f), f.value_len, "trailers"))
+      return false;
+    if (eq(name, f.name_len, "host"))
+      has_host = true;
+    else if (eq(name, f.name_len, "cookie"))
+    {
+      ++num_cookies;
+      cookies_len += f.value_len + 2;
+    }
   }
-  else
+  if (!method)
+    return false;
+  bool connect = eq(headers.value(*method), method->value_len, "CONNECT");
+  if (connect ? (!authority || scheme || path) : (!scheme || !path || !path->value_len))
+    return false;
+
+  s.request.reset(new http_request(src_addr_, src_addr_len_));
+  auto &r = *s.request;
+  r.http_major = 2;
+  r.http_minor = 0;
+  r.method = http_request_parser::method(headers.value(*method), method->value_len);
+  if (r.method < 0)
+    return false;
+
+  // the request's headers point into header_data, which gets a copy
+  // of the decoded fields plus anything made here: a host field for
+  // :authority, and the cookie fields joined into one (8.1.2.5)
+  auto &hd = s.header_data;
+  hd.reserve(headers.data.size() + 4 + cookies_len);
+  hd.assign(headers.data.begin(), headers.data.end());
+  size_t host_off = 0, cookie_off = 0, cookie_name_off = 0;
+  if (authority && !has_host)
   {
-    // peer is sending us a new settings, we must acknowledge it
-    char buf[k_frame_header_size];
-    format_frame(&buf[0], 0 /*frame size*/, k_SETTINGS, k_settings_ack, stream_id);
+    host_off = hd.size();
+    hd.insert(hd.end(), "host", "host" + 4);
+  }
+  if (num_cookies > 1)
+  {
+    cookie_off = hd.size();
+    for (auto &f : headers.fields)
+      if (eq(headers.name(f), f.name_len, "cookie"))
+      {
+        if (hd.size() > cookie_off)
+          hd.insert(hd.end(), "; ", "; " + 2);
+        else
+          cookie_name_off = f.name_off;
+        hd.insert(hd.end(), headers.value(f), headers.value(f) + f.value_len);
+      }
   }
-}
 
-#if 0
-Headers format from section 6.2
+  for (auto &f : headers.fields)
+  {
+    auto name = &hd[f.name_off];
+    if (name[0] == ':' || (num_cookies > 1 && eq(name, f.name_len, "cookie")))
+      continue;
+    if (eq(name, f.name_len, "content-length"))
+    {
+      auto v = &hd[f.value_off];
+      if (!f.value_len || f.value_len > 15)
+        return false;
+      int64_t cl = 0;
+      for (uint32_t i = 0; i < f.value_len; i++)
+      {
+        if (v[i] < '0' || v[i] > '9')
+          return false;
+        cl = cl * 10 + (v[i] - '0');
+      }
+      if (s.expected_len >= 0 && s.expected_len != cl)
+        return false;
+      s.expected_len = cl;
+      r.has_content_length = true;
+      r.content_length = (int)std::min(cl, (int64_t)INT_MAX);
+    }
+    r.headers.add(name, f.name_len, &hd[f.value_off], f.value_len);
+  }
+  if (authority && !has_host)
+    r.headers.add(&hd[host_off], 4, &hd[authority->value_off], authority->value_len);
+  if (num_cookies > 1)
+    r.headers.add(&hd[cookie_name_off], 6, &hd[cookie_off], hd.size() - cookie_off);
 
-     0                   1                   2                   3
-     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-    |Pad Length? (8)|
-    +-+-------------+-----------------------------------------------+
-    |E|                 Stream Dependency? (31)                     |
-    +-+-------------+-----------------------------------------------+
-    |  Weight? (8)  |
-    +-+-------------+-----------------------------------------------+
-    |                   Header Block Fragment (*)                 ...
-    +---------------------------------------------------------------+
-    |                           Padding (*)                       ...
-    +---------------------------------------------------------------+
+  auto target = connect ? authority : path;
+  return http_request_parser::set_url(r, &hd[target->value_off], target->value_len);
+}
 
-                     Figure 7: HEADERS Frame Payload
+void http2::run_stream(std::shared_ptr<stream> s)
+{
+  try
+  {
+    server_->serve_stream(s.get(), pipe_, s->upgrade_request ? *s->upgrade_request : *s->request);
+  }
+  catch (const std::exception &e)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("http2 stream " << s->id << " from " << *src_addr_ << " failed, what() = " << e.what());
+#endif
+  }
 
-   The HEADERS frame payload has the following fields:
+  // a response that wasn't finished is reset, and so is the request
+  // if the handler didn't need the rest of it (8.1)
+  uint32_t rst = k_NO_ERROR;
+  bool send = false;
+  {
+    fiber_lock lock(mtx_);
+    if (!s->reset && !closed_)
+    {
+      if (!s->local_closed)
+      {
+        rst = k_INTERNAL_ERROR;
+        send = true;
+      }
+      else if (!s->remote_closed)
+        send = true;
+    }
+    s->reset = true;
+  }
+  if (send)
+  {
+    try
+    {
+      send_rst(s->id, rst);
+    }
+    catch (const std::exception &)
+    {
+    }
+  }
 
-   Pad Length:  An 8-bit field containing the length of the frame
-      padding in units of octets.  This field is only present if the
-      PADDED flag is set.
+  fiber_lock lock(mtx_);
+  streams_.erase(s->id);
+  --num_streams_;
+  streams_cond_.notify_all();
+}
 
-   E: A single bit flag indicates that the stream dependency is
-      exclusive, see Section 5.3.  This field is only present if the
-      PRIORITY flag is set.
+/////////////////////////////////////////////////////////////////////////
 
-   Stream Dependency:  A 31-bit stream identifier for the stream that
-      this stream depends on, see Section 5.3.  This field is only
-      present if the PRIORITY flag is set.
+http2::response http2::request(const char *method, const char *scheme, const char *authority, const char *path,
+                               const std::vector<std::pair<std::string, std::string>> &headers,
+                               const void *body, size_t body_len)
+{
+  std::shared_ptr<stream> s;
+  {
+    fiber_lock lock(mtx_);
+    while (num_streams_ >= peer_max_streams_ && !closed_ && !goaway_received_)
+      streams_cond_.wait(lock);
+    if (closed_ || goaway_received_ || goaway_sent_)
+      throw fiber_io_error("http2 connection closed");
+    s = std::make_shared<stream>(this, next_stream_id_);
+    next_stream_id_ += 2;
+    streams_[s->id] = s;
+    ++num_streams_;
+
+    // streams must be opened in the order of their ids,
+    // so this is queued before mtx_ is unlocked
+    fiber_lock out_lock(out_mtx_);
+    std::vector<char> block;
+    encoder_.begin_block(block);
+    encoder_.encode(block, ":method", method);
+    encoder_.encode(block, ":scheme", scheme);
+    encoder_.encode(block, ":authority", authority);
+    encoder_.encode(block, ":path", path);
+    for (auto &h : headers)
+      encoder_.encode(block, h.first.data(), h.first.size(), h.second.data(), h.second.size());
+    append_headers(s->id, body_len == 0, block);
+    s->local_closed = body_len == 0;
+  }
 
-   Weight:  An 8-bit weight for the stream, see Section 5.3.  Add one to
-      the value to obtain a weight between 1 and 256.  This field is
-      only present if the PRIORITY flag is set.
+  try
+  {
+    flush(true);
+    if (body_len)
+      s->send_body(body, body_len, true);
+
+    fiber_lock lock(mtx_);
+    while (!s->remote_closed && !s->reset && !closed_)
+      s->cond.wait(lock);
+    if (!s->remote_closed)
+      s->throw_closed();
+    s->resp.body.assign(s->in.begin() + s->in_pos, s->in.end());
+    streams_.erase(s->id);
+    --num_streams_;
+    streams_cond_.notify_all();
+    return std::move(s->resp);
+  }
+  catch (...)
+  {
+    fiber_lock lock(mtx_);
+    if (streams_.erase(s->id))
+    {
+      --num_streams_;
+      streams_cond_.notify_all();
+    }
+    throw;
+  }
+}
 
-   Header Block Fragment:  A header block fragment (Section 4.3).
+// called with mtx_ locked
+void http2::on_response_headers(stream &s, bool end_stream, const hpack::header_list &headers)
+{
+  if (!s.headers_done)
+  {
+    for (auto &f : headers.fields)
+    {
+      auto name = headers.name(f);
+      if (eq(name, f.name_len, ":status"))
+        s.resp.status = atoi(std::string(headers.value(f), f.value_len).c_str());
+      else if (f.name_len && name[0] != ':')
+        s.resp.headers.push_back(std::make_pair(std::string(name, f.name_len), std::string(headers.value(f), f.value_len)));
+    }
 
-   Padding:  Padding octets that contain no application semantic value.
-      Padding octets MUST be set to zero when sending and ignored when
-      receiving.
+    // an interim (1xx) response is followed by the real one
+    if (s.resp.status >= 100 && s.resp.status < 200)
+    {
+      s.resp.status = 0;
+      s.resp.headers.clear();
+    }
+    else
+      s.headers_done = true;
+  }
+  if (end_stream)
+  {
+    s.remote_closed = true;
+    s.cond.notify_all();
+  }
+}
 
-   The HEADERS frame defines the following flags:
+/////////////////////////////////////////////////////////////////////////
 
-   END_STREAM (0x1):  Bit 0 being set indicates that the header block
-      (Section 4.3) is the last that the endpoint will send for the
-      identified stream.  Setting this flag causes the stream to enter
-      one of "half closed" states (Section 5.1).
+// called with out_mtx_ locked
+void http2::append_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void *payload, size_t len)
+{
+  auto off = out_.size();
+  out_.resize(off + k_frame_header_size + len);
+  format_frame(&out_[off], len, type, flags, stream_id);
+  if (len)
+    memcpy(&out_[off + k_frame_header_size], payload, len);
+}
 
-      A HEADERS frame carries the END_STREAM flag that signals the end
-      of a stream.  However, a HEADERS frame with the END_STREAM flag
-      set can be followed by CONTINUATION frames on the same stream.
-      Logically, the CONTINUATION frames are part of the HEADERS frame.
+// called with out_mtx_ locked.  A block too big for one frame
+// continues in CONTINUATION frames, which must follow it directly.
+void http2::append_headers(uint32_t stream_id, bool end_stream, const std::vector<char> &block)
+{
+  size_t off = 0;
+  do
+  {
+    auto n = std::min(block.size() - off, (size_t)peer_max_frame_);
+    uint8_t flags = off + n == block.size() ? k_END_HEADERS : 0;
+    if (off == 0 && end_stream)
+      flags |= k_END_STREAM;
+    append_frame(off == 0 ? k_HEADERS : k_CONTINUATION, flags, stream_id, block.data() + off, n);
+    off += n;
+  } while (off < block.size());
+}
 
-   END_HEADERS (0x4):  Bit 2 being set indicates that this frame
-      contains an entire header block (Section 4.3) and is not followed
-      by any CONTINUATION frames.
+void http2::send_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void *payload, size_t len)
+{
+  {
+    fiber_lock out_lock(out_mtx_);
+    append_frame(type, flags, stream_id, payload, len);
+  }
+  flush();
+}
 
-      A HEADERS frame without the END_HEADERS flag set MUST be followed
-      by a CONTINUATION frame for the same stream.  A receiver MUST
-      treat the receipt of any other type of frame or a frame on a
-      different stream as a connection error (Section 5.4.1) of type
-      PROTOCOL_ERROR.
+void http2::send_rst(uint32_t stream_id, uint32_t error_code)
+{
+  char payload[4];
+  put32(payload, error_code);
+  send_frame(k_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
 
-   PADDED (0x8):  Bit 3 being set indicates that the Pad Length field
-      and any padding that it describes is present.
+void http2::send_window_update(uint32_t stream_id, uint32_t increment)
+{
+  char payload[4];
+  put32(payload, increment);
+  send_frame(k_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
 
-   PRIORITY (0x20):  Bit 5 being set indicates that the Exclusive Flag
-      (E), Stream Dependency, and Weight fields are present; see
-      Section 5.3.
+// write what has collected in out_, unless another fiber is already
+// doing that, in which case it writes ours too.  With 'wait', a fiber
+// that would otherwise add to out_ faster than it can be written waits
+// for it to drain first.
+void http2::flush(bool wait)
+{
+  fiber_lock lock(out_mtx_);
+  if (write_failed_)
+    throw fiber_io_error("http2 connection write failed");
+  if (writing_)
+  {
+    while (wait && writing_ && out_.size() > k_max_out && !write_failed_)
+      out_cond_.wait(lock);
+    return;
+  }
 
-#endif
+  writing_ = true;
+  std::vector<char> batch;
+  while (!out_.empty())
+  {
+    batch.swap(out_);
+    out_cond_.notify_all();
+    lock.unlock();
+    try
+    {
+      write_out(batch);
+    }
+    catch (...)
+    {
+      lock.lock();
+      writing_ = false;
+      write_failed_ = true;
+      out_.clear();
+      out_cond_.notify_all();
+      throw;
+    }
+    batch.clear();
+    lock.lock();
+  }
+  writing_ = false;
+  out_cond_.notify_all();
+}
 
-uint32_t http2::open_stream(http_server::pipe_t &pipe, std::vector<http2::hpack_header> &headers, bool is_headers)
-{
-  auto encoded = req_enc_.encode(headers);
-  auto encoded_len = encoded ? encoded->length() : 0;
-
-  // for now...
-  // padding will be 0 (turned off)
-  // stream dependency will be turned off
-  // weight will be turned off
-  // this means that the size of the header itself (the frame's 'payload')
-  // is just the size of the encoded headers
-
-  char buf[1024];
-  if (encoded_len > sizeof(buf) - k_frame_header_size)
-    do_error("encoded headers too big: must be smaller than " << sizeof(buf) - k_frame_header_size + 1 << ", it is " << encoded_len);
-
-  uint32_t stream_id = next_stream_id_;
-  next_stream_id_ += 2;
-  format_frame(&buf[0], encoded_len, k_HEADERS, k_HEADERS_END_HEADERS, stream_id);
-  if (encoded_len)
-    memcpy(&buf[k_frame_header_size], encoded->data(), encoded_len);
-  anon_log("sending " << k_frame_header_size + encoded_len << " byte HEADERS request for stream_id " << stream_id);
-  pipe.write(&buf[0], k_frame_header_size + encoded_len);
-  return stream_id;
+void http2::write_out(const std::vector<char> &data)
+{
+  if (tls_)
+  {
+    fiber_lock lock(io_mtx_);
+    pipe_->write(data.data(), data.size());
+  }
+  else
+    pipe_->write(data.data(), data.size());
 }
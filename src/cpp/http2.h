@@ -23,35 +23,101 @@
 #pragma once
 
 #include "http_server.h"
-#include "proxygen/lib/http/codec/compress/HPACKDecoder.h"
-#include "proxygen/lib/http/codec/compress/HPACKEncoder.h"
+#include "hpack.h"
+#include <map>
 
+class tls_pipe;
+
+// the settings of an http2 connection, see below
+struct http2_options
+{
+  // SETTINGS_MAX_CONCURRENT_STREAMS (server).  Streams opened
+  // beyond this are refused with REFUSED_STREAM.
+  uint32_t max_concurrent_streams{100};
+
+  // the flow control window of each stream, and of the connection
+  // as a whole, that we offer the peer.  These bound the request
+  // body data that can be buffered for each stream, and in total.
+  uint32_t initial_window_size{65535};
+  uint32_t connection_window_size{1024 * 1024};
+
+  // SETTINGS_MAX_FRAME_SIZE, the biggest frame the peer may send
+  uint32_t max_frame_size{16384};
+
+  // SETTINGS_MAX_HEADER_LIST_SIZE.  Bigger header blocks
+  // are a connection error.
+  uint32_t max_header_list_size{64 * 1024};
+
+  // a connection with no streams open that sends nothing
+  // for this long is closed (with a GOAWAY)
+  int idle_timeout_seconds{120};
+
+  size_t stack_size{fiber::k_default_stack_size};
+};
+
+// one HTTP/2 (RFC 7540) connection, from either end.
+//
+// The connection's frames are read by a single fiber - the one that
+// calls serve or run - which keeps the HPACK and flow control state and
+// hands each stream's data to the stream.  On a server every stream
+// runs in a fiber of its own, as an ordinary http_server request (see
+// http_server::serve_stream), so the same handlers answer HTTP/1.x and
+// HTTP/2 requests.  Their frames are collected in one buffer, and
+// whichever fiber finds nothing being written writes everything that
+// has collected, so responses on many streams go out in a few writes.
+// Nothing is ever buffered beyond what the peer's flow control windows
+// allow, and a stream that has used up its window blocks its fiber
+// until the peer opens it again.
+//
+// A tls_pipe can't be read and written from two fibers at once, so
+// over tls the reader waits for the socket to be readable before it
+// takes the lock that writers use.
 class http2
 {
 public:
-  // if/when HTTP/2 becomes a final standard and
-  // anon fully implements it, then this will become
-  // just "h2c".  For now, it is implementing draft 15
-  // of the IETF spec. and calls its protocol
-  // "h2c-15-anon"
-  static const char *http2_name /* = "h2c-15-anon"*/;
-
-  // 'f' argument is function to run when the other side
-  // of the HTTP/2 connection sends a HEADERS or PUSH_PROMISE
-  // to open a new stream
-  template <typename Fn>
-  http2(bool client /*vs. server*/, Fn f, size_t stack_size = fiber::k_default_stack_size)
-      : req_enc_(proxygen::HPACK::MessageType::REQ, true),
-        req_dec_(proxygen::HPACK::MessageType::REQ),
-        resp_enc_(proxygen::HPACK::MessageType::RESP, true),
-        resp_dec_(proxygen::HPACK::MessageType::RESP),
-        stream_handler_factory_(std::unique_ptr<stream_handler_factory>(new strm_hand_fact<Fn>(f))),
-        stack_size_(stack_size),
-        next_stream_id_(client ? 3 : 2)
+  typedef http2_options options;
+
+
+  // 'pipe' is the connection, which the caller still owns
+  http2(::pipe_t *pipe, bool client, const options &opts = options());
+  ~http2();
+
+  // the server side.  Runs the connection, serving each stream with
+  // 'server' (see http_server::serve_stream), until it ends, and only
+  // returns after every stream's fiber has finished.  'buffered' is
+  // whatever has already been read from the connection, starting with
+  // the client's connection preface.  For an "Upgrade: h2c" request the
+  // 101 response must already have been sent, and 'upgrade_request'
+  // and 'upgrade_body' are the request (and its complete body) that
+  // becomes stream 1.  'upgrade_settings' is its HTTP2-Settings header.
+  void serve(http_server &server, const sockaddr *src_addr, socklen_t src_addr_len, std::vector<char> &&buffered,
+             const http_request *upgrade_request = 0, std::vector<char> &&upgrade_body = std::vector<char>(),
+             const string_len &upgrade_settings = string_len());
+
+  // the client side.  start sends our connection preface, after which
+  // run reads the connection until it ends and must be running (in a
+  // fiber of its own) for request to get responses.
+  void start();
+  void run();
+
+  struct response
   {
-  }
+    int status{0};
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+  };
+
+  // send a request and wait for its response.  Any number of fibers
+  // can call this at once, each request being a stream of its own,
+  // up to the server's SETTINGS_MAX_CONCURRENT_STREAMS at a time.
+  // Throws fiber_io_error if the connection ends, or the server
+  // resets the stream, first.
+  response request(const char *method, const char *scheme, const char *authority, const char *path,
+                   const std::vector<std::pair<std::string, std::string>> &headers = {},
+                   const void *body = 0, size_t body_len = 0);
 
-  void run(http_server::pipe_t &pipe);
+  // send GOAWAY, after which no more streams are started
+  void close(uint32_t error_code = k_NO_ERROR);
 
   // frame types:
   // note, these are the constants defined in section 6 of the IETF
@@ -71,7 +137,11 @@ public:
   };
   enum
   {
-    k_frame_header_size = 9
+    k_frame_header_size = 9,
+    k_default_window_size = 65535,
+    k_min_max_frame_size = 16384,
+    k_max_max_frame_size = 16777215,
+    k_max_window_size = 0x7fffffff
   };
 
   // defined settings parameters
@@ -88,87 +158,124 @@ public:
 
     k_num_settings_params = k_SETTINGS_MAX_HEADER_LIST_SIZE
   } settings_t;
+
+  // frame flags
   enum
   {
-    k_settings_ack = 1
+    k_ACK = 0x1,
+    k_END_STREAM = 0x1,
+    k_END_HEADERS = 0x4,
+    k_PADDED = 0x8,
+    k_PRIORITY_FLAG = 0x20
   };
 
+  // error codes, section 7
   enum
   {
-    k_HEADERS_END_STREAM = 0x1,
-    k_HEADERS_END_HEADERS = 0x4,
-    k_HEADERS_PADDED = 0x8,
-    k_HEADERS_PRIORITY = 0x20
+    k_NO_ERROR,
+    k_PROTOCOL_ERROR,
+    k_INTERNAL_ERROR,
+    k_FLOW_CONTROL_ERROR,
+    k_SETTINGS_TIMEOUT,
+    k_STREAM_CLOSED,
+    k_FRAME_SIZE_ERROR,
+    k_REFUSED_STREAM,
+    k_CANCEL,
+    k_COMPRESSION_ERROR,
+    k_CONNECT_ERROR,
+    k_ENHANCE_YOUR_CALM,
+    k_INADEQUATE_SECURITY,
+    k_HTTP_1_1_REQUIRED
   };
 
-  typedef proxygen::HPACKHeader hpack_header;
-
   static void format_frame(char *buf, uint32_t length, uint8_t type, uint8_t flags, uint32_t stream_id);
 
-  static void send_data();
-  static void send_headers();
-  static void send_priority();
-  static void send_reset_stream();
-
-  static void send_settings(http_server::pipe_t &pipe, uint32_t stream_id, const std::vector<std::pair<settings_t, uint32_t>> &settings = std::vector<std::pair<settings_t, uint32_t>>());
-
-  static void send_push_promise();
-  static void send_ping();
-  static void send_goaway();
-  static void send_window_update();
-  static void send_continuation();
-
-  static void parse_settings(uint32_t stream_id, uint8_t flags, uint32_t frame_size);
-
-  // open a new stream (send the request to the peer)
-  // with the given headers.  Returns the stream_id for this new
-  // stream.  If is_headers is true then it will be opened with
-  // k_HEADERS, otherwise it is opened with k_PUSH_PROMISE
-  uint32_t open_stream(http_server::pipe_t &pipe, std::vector<http2::hpack_header> &headers, bool is_headers /*vs. is_push_promise*/);
-
 private:
-  proxygen::HPACKEncoder req_enc_;
-  proxygen::HPACKDecoder req_dec_;
-  proxygen::HPACKEncoder resp_enc_;
-  proxygen::HPACKDecoder resp_dec_;
-  uint32_t next_stream_id_;
+  struct stream;
+  friend struct stream;
 
-  struct stream_handler
+  // thrown (inside the reader) for errors that end the connection
+  struct connection_error
   {
-    virtual ~stream_handler() {}
-    virtual void exec(int read_fd, http_server::pipe_t &write_pipe, uint32_t stream_id) = 0;
+    uint32_t code;
+    const char *what;
   };
 
-  template <typename Fn>
-  struct strm_hand : public stream_handler
-  {
-    strm_hand(Fn f) : f_(f) {}
-    virtual void exec(int read_fd, http_server::pipe_t &write_pipe, uint32_t stream_id)
-    {
-      f_(std::unique_ptr<fiber_pipe>(new fiber_pipe(read_fd, fiber_pipe::unix_domain)), write_pipe, stream_id);
-    }
-    Fn f_;
-  };
+  void send_preface();
+  void read_frames();
+  bool fill(size_t needed);
+  void on_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len);
+  void on_settings(uint8_t flags, const uint8_t *payload, uint32_t len);
+  void apply_setting(uint16_t id, uint32_t value);
+  void on_data(uint8_t flags, uint32_t stream_id, const uint8_t *payload, uint32_t len);
+  void on_header_block(uint32_t stream_id, bool end_stream);
+  void open_stream(uint32_t stream_id, bool end_stream, const hpack::header_list &headers);
+  bool build_request(stream &s, const hpack::header_list &headers);
+  void on_response_headers(stream &s, bool end_stream, const hpack::header_list &headers);
+  void run_stream(std::shared_ptr<stream> s);
+  void finish(uint32_t error_code);
 
-  struct stream_handler_factory
-  {
-    virtual ~stream_handler_factory() {}
-    virtual stream_handler *new_handler() = 0;
-  };
+  // sending.  Frames are appended to out_ (with out_mtx_ locked) and
+  // then written by flush.  'wait' lets a stream wait for out_ to drain
+  // when the writer can't keep up.
+  void append_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void *payload, size_t len);
+  void append_headers(uint32_t stream_id, bool end_stream, const std::vector<char> &block);
+  void send_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const void *payload, size_t len);
+  void send_rst(uint32_t stream_id, uint32_t error_code);
+  void send_window_update(uint32_t stream_id, uint32_t increment);
+  void flush(bool wait = false);
+  void write_out(const std::vector<char> &data);
 
-  template <typename Fn>
-  struct strm_hand_fact : public stream_handler_factory
-  {
-    strm_hand_fact(Fn f) : f_(f) {}
+  ::pipe_t *pipe_;
+  tls_pipe *tls_;
+  fiber_pipe *fp_;
+  bool client_;
+  options opts_;
+  http_server *server_{nullptr};
+  const sockaddr *src_addr_{nullptr};
+  socklen_t src_addr_len_{0};
 
-    virtual stream_handler *new_handler()
-    {
-      return new strm_hand<Fn>(f_);
-    }
+  // input, read only by the reader fiber
+  std::vector<char> in_;
+  size_t in_start_{0};
+  size_t in_end_{0};
+  hpack::decoder decoder_;
+  std::vector<uint8_t> header_block_;
+  uint32_t continuation_stream_{0};
+  uint8_t header_flags_{0};
+  hpack::header_list headers_;
 
-    Fn f_;
-  };
+  // everything else is guarded by mtx_
+  fiber_mutex mtx_;
+  fiber_cond streams_cond_;
+  fiber_cond window_cond_;
+  std::map<uint32_t, std::shared_ptr<stream>> streams_;
+  uint32_t num_streams_{0};
+  uint32_t last_peer_stream_{0};
+  uint32_t next_stream_id_;
+  bool closed_{false};
+  bool goaway_sent_{false};
+  bool goaway_received_{false};
+  bool got_settings_{false};
+  int64_t send_window_{k_default_window_size};
+  int64_t recv_window_;
+  uint32_t recv_unacked_{0};
+  uint32_t peer_initial_window_{k_default_window_size};
+  uint32_t peer_max_frame_{k_min_max_frame_size};
+  uint32_t peer_max_streams_{UINT32_MAX};
 
-  std::unique_ptr<stream_handler_factory> stream_handler_factory_;
-  size_t stack_size_;
+  // output.  out_mtx_ is taken after mtx_ when both are needed,
+  // and io_mtx_ (only used over tls) with neither held.
+  fiber_mutex out_mtx_;
+  fiber_cond out_cond_;
+  std::vector<char> out_;
+  bool writing_{false};
+  bool write_failed_{false};
+  hpack::encoder encoder_;
+  fiber_mutex io_mtx_;
+
+  enum
+  {
+    k_max_out = 256 * 1024
+  };
 };
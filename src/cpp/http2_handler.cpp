@@ -22,7 +22,7 @@
 
 #include "http2_handler.h"
 
-void http2_handler::exec(http_server::pipe_t &pipe, const http_request &request)
+void http2_handler::upgrade(http_server::pipe_t &pipe, const http_request &request)
 {
   // upgrade to HTTP/2 is only legal if the client is at least HTTP/1.1
   // this is a conclusion from the fact that the spec requires us to
@@ -48,24 +48,42 @@ void http2_handler::exec(http_server::pipe_t &pipe, const http_request &request)
     return;
   }
 
-  // acknowledg the 1.x -> 2 upgrade
+  // the request becomes stream 1, but its body (if any) was sent
+  // the HTTP/1.1 way, before the switch, so read all of it now
+  std::vector<char> body;
+  try
+  {
+    char buf[8192];
+    while (auto n = pipe.read_body(buf, sizeof(buf)))
+      body.insert(body.end(), buf, buf + n);
+  }
+  catch (const http_body_error &e)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("ignoring http/2 upgrade sent from " << *request.src_addr << ", invalid body: " << e.what());
+#endif
+    return;
+  }
+
+  // acknowledge the 1.x -> 2 upgrade
   http_response resp;
   resp.set_status_code("101 Switching Protocols");
   resp.add_header("connection", "Upgrade");
-  resp.add_header("upgrade", http2::http2_name);
+  resp.add_header("upgrade", "h2c");
   pipe.respond(resp);
 
-  // send the server "preface" (section 3.5)
-  // unclear to me what stream_id these are supposed to be sent on.  I am
-  // assuming that they are sent on stream_id 1.  The last sentence of
-  // section 3.2 is:
-  //
-  //   After commencing the HTTP/2 connection, stream 1 is used for the response
-  //
-  http2_.send_settings(pipe, /*stream_id*/ 1);
-
-  // TODO - support initial body in request (that is the stuff "prior to commencing HTTP/2")
+  // we have now switched to HTTP/2
+  std::vector<char> buffered;
+  auto conn_pipe = pipe.detach(buffered);
+  http2 conn(conn_pipe, false /*client*/, opts_);
+  conn.serve(serv_, request.src_addr, request.src_addr_len, std::move(buffered), &request, std::move(body),
+             request.headers.get_header("http2-settings"));
+}
 
-  // we have now switched to HTTP/2, so just run the handler
-  http2_.run(pipe);
+void http2_handler::serve(http_server::pipe_t &pipe, const http_request &request)
+{
+  std::vector<char> buffered;
+  auto conn_pipe = pipe.detach(buffered);
+  http2 conn(conn_pipe, false /*client*/, opts_);
+  conn.serve(serv_, request.src_addr, request.src_addr_len, std::move(buffered));
 }
@@ -25,17 +25,28 @@
 #include "http_server.h"
 #include "http2.h"
 
+// serves HTTP/2 on an http_server, answering each stream with the
+// handler passed to the server's start, the same way it answers
+// HTTP/1.x requests.  Clients can get there three ways: cleartext with
+// "Upgrade: h2c" (RFC 7540 3.2), cleartext by sending the HTTP/2
+// connection preface straight away (3.4), or with tls by choosing "h2"
+// with ALPN (3.3).  Must be constructed before the server's start, and
+// last for as long as the server does.
 class http2_handler
 {
 public:
-  template <typename Fn>
-  http2_handler(http_server &serv, Fn f, size_t stack_size = fiber::k_default_stack_size)
-      : http2_(false, f, stack_size)
+  http2_handler(http_server &serv, const http2::options &opts = http2::options())
+      : serv_(serv),
+        opts_(opts)
   {
-    serv.add_upgrade_handler(http2::http2_name, [this](http_server::pipe_t &pipe, const http_request &request) { exec(pipe, request); });
+    serv.add_upgrade_handler("h2c", [this](http_server::pipe_t &pipe, const http_request &request) { upgrade(pipe, request); });
+    serv.add_protocol_handler("h2", [this](http_server::pipe_t &pipe, const http_request &request) { serve(pipe, request); });
   }
 
 private:
-  void exec(http_server::pipe_t &pipe, const http_request &request);
-  http2 http2_;
+  void upgrade(http_server::pipe_t &pipe, const http_request &request);
+  void serve(http_server::pipe_t &pipe, const http_request &request);
+
+  http_server &serv_;
+  http2::options opts_;
 };
@@ -91,12 +91,8 @@ http_client_response::parse(const pipe_t &pipe, bool read_body, bool throw_on_se
     if (c->header_state == pc::k_value)
     {
       // <field,value> complete, add new pair
-      std::transform(c->last_field_start, c->last_field_start + c->last_field_len,
-        (char*)c->last_field_start,
-        [](char c){ return std::tolower(c); });
-      string_len fld(c->last_field_start, c->last_field_len);
-      string_len val(c->last_value_start, c->last_value_len);
-      c->cr->headers.headers.insert(std::make_pair(fld, val));
+      c->cr->headers.add((char *)c->last_field_start, c->last_field_len,
+        c->last_value_start, c->last_value_len);
 
       c->last_field_start = at;
       c->last_field_len = 0;
@@ -127,12 +123,8 @@ http_client_response::parse(const pipe_t &pipe, bool read_body, bool throw_on_se
     c->headers_complete_ = true;
     if (c->header_state == pc::k_value)
     {
-      std::transform(c->last_field_start, c->last_field_start + c->last_field_len,
-        (char*)c->last_field_start,
-        [](char c){ return std::tolower(c); });
-      string_len fld(c->last_field_start, c->last_field_len);
-      string_len val(c->last_value_start, c->last_value_len);
-      c->cr->headers.headers.insert(std::make_pair(fld, val));
+      c->cr->headers.add((char *)c->last_field_start, c->last_field_len,
+        c->last_value_start, c->last_value_len);
     }
     c->cr->has_content_length = (p->flags & F_CONTENTLENGTH) != 0;
     c->cr->content_length = p->content_length;
@@ -248,11 +240,32 @@ http_client_response::parse(const pipe_t &pipe, bool read_body, bool throw_on_se
       // if there is no un-parsed data in our read buffer then read more
       if (bsp == bep)
       {
+        auto res = !pcallback.headers_complete_
+                       ? pipe.try_read(&header_buff_[bep], header_buff_.size() - bep)
+                       : pipe.try_read(&bdy_tmp[0], bdy_tmp.size());
+        if (!res)
+        {
+          if (res.timed_out())
+            throw fiber_io_timeout_error("timeout reading http response");
+          if (!res.closed())
+            anon_throw(fiber_io_error, "reading http response failed with errno: " << error_string(res.err));
+
+          // a server that doesn't send a content-length marks
+          // the end of the body by closing the connection.
+          // Tell the parser we hit eof and see if that completes it.
+          http_parser_execute(&parser, &settings, 0, 0);
+          if (pcallback.message_complete)
+          {
+            should_keep_alive = false;
+            break;
+          }
+          throw fiber_io_error("connection closed before the http response was complete");
+        }
         if (!pcallback.headers_complete_)
-          bep += pipe.read(&header_buff_[bep], header_buff_.size() - bep);
+          bep += res.bytes;
         else
         {
-          bep = pipe.read(&bdy_tmp[0], bdy_tmp.size());
+          bep = res.bytes;
           bsp = 0;
         }
       }
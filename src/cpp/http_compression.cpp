@@ -0,0 +1,329 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "http_compression.h"
+#include "lock_checker.h"
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <algorithm>
+#include <string_view>
+#include <zlib.h>
+#if defined(ANON_HTTP_BROTLI)
+#include <brotli/encode.h>
+#endif
+#if defined(ANON_HTTP_ZSTD)
+#include <zstd.h>
+#endif
+
+namespace
+{
+
+// compressor state for each io thread.  A fiber doesn't give up its
+// thread in the middle of compressing a body, so nothing else can be
+// using it at the same time.
+
+struct gzip_ctx
+{
+  ~gzip_ctx()
+  {
+    if (level >= 0)
+      deflateEnd(&zs);
+  }
+
+  z_stream zs;
+  int level{-1};
+};
+
+thread_local gzip_ctx gzip;
+
+#if defined(ANON_HTTP_ZSTD)
+struct zstd_ctx
+{
+  ~zstd_ctx()
+  {
+    ZSTD_freeCCtx(cctx);
+  }
+
+  ZSTD_CCtx *cctx{ZSTD_createCCtx()};
+};
+
+thread_local zstd_ctx zstd;
+#endif
+
+// a q value, "0", "0.5", "1.000", etc... in thousandths
+int parse_q(const char *p, const char *end)
+{
+  if (p == end || (*p != '0' && *p != '1'))
+    return 1000;
+  int q = (*p++ - '0') * 1000;
+  if (p < end && *p == '.')
+  {
+    ++p;
+    for (int scale = 100; scale > 0 && p < end && *p >= '0' && *p <= '9'; scale /= 10)
+      q += (*p++ - '0') * scale;
+  }
+  return std::min(q, 1000);
+}
+
+bool is(const char *s, size_t len, const char *lit)
+{
+  return len == strlen(lit) && !strncasecmp(s, lit, len);
+}
+
+} // namespace
+
+http_compression::http_compression(size_t min_size, size_t cache_size,
+                                   int gzip_level, int br_quality, int zstd_level)
+    : min_size_(min_size),
+      max_cache_size_(cache_size),
+      gzip_level_(gzip_level),
+      br_quality_(br_quality),
+      zstd_level_(zstd_level),
+      supported_(k_gzip),
+      cache_size_(0),
+      hits_(0),
+      misses_(0)
+{
+#if defined(ANON_HTTP_BROTLI)
+  supported_ |= k_br;
+#endif
+#if defined(ANON_HTTP_ZSTD)
+  supported_ |= k_zstd;
+#endif
+}
+
+int http_compression::choose(const string_len &accept_encoding, int available)
+{
+  // q value of each coding, -1 if it isn't listed
+  int q_gzip = -1, q_br = -1, q_zstd = -1, q_any = -1;
+
+  auto p = accept_encoding.ptr();
+  auto end = p + accept_encoding.len();
+  while (p < end)
+  {
+    auto comma = (const char *)memchr(p, ',', end - p);
+    auto e = comma ? comma : end;
+    while (p < e && (*p == ' ' || *p == '\t'))
+      ++p;
+    auto semi = (const char *)memchr(p, ';', e - p);
+    auto t = semi ? semi : e;
+    while (t > p && (t[-1] == ' ' || t[-1] == '\t'))
+      --t;
+    int q = 1000;
+    if (semi)
+    {
+      auto qp = semi + 1;
+      while (qp < e && (*qp == ' ' || *qp == '\t'))
+        ++qp;
+      if (e - qp >= 2 && (*qp == 'q' || *qp == 'Q') && qp[1] == '=')
+        q = parse_q(qp + 2, e);
+    }
+    if (is(p, t - p, "gzip") || is(p, t - p, "x-gzip"))
+      q_gzip = q;
+    else if (is(p, t - p, "br"))
+      q_br = q;
+    else if (is(p, t - p, "zstd"))
+      q_zstd = q;
+    else if (is(p, t - p, "*"))
+      q_any = q;
+    p = e + 1;
+  }
+
+  int best = k_identity, best_q = 0;
+  auto consider = [&](int enc, int q) {
+    if (q < 0)
+      q = q_any;
+    if ((available & enc) && q > best_q)
+    {
+      best = enc;
+      best_q = q;
+    }
+  };
+  consider(k_br, q_br);
+  consider(k_zstd, q_zstd);
+  consider(k_gzip, q_gzip);
+  return best;
+}
+
+bool http_compression::compressible_type(const string_len &content_type)
+{
+  auto p = content_type.ptr();
+  auto len = content_type.len();
+  auto semi = (const char *)memchr(p, ';', len);
+  if (semi)
+    len = semi - p;
+  while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+    --len;
+
+  auto starts = [p, len](const char *lit) {
+    auto l = strlen(lit);
+    return len >= l && !strncasecmp(p, lit, l);
+  };
+  auto ends = [p, len](const char *lit) {
+    auto l = strlen(lit);
+    return len >= l && !strncasecmp(p + len - l, lit, l);
+  };
+  return starts("text/") || ends("/json") || ends("+json") || ends("/xml") || ends("+xml") || ends("/javascript") || ends("/x-javascript") || ends("/wasm");
+}
+
+const char *http_compression::name(int enc)
+{
+  switch (enc)
+  {
+  case k_gzip:
+    return "gzip";
+  case k_br:
+    return "br";
+  case k_zstd:
+    return "zstd";
+  default:
+    return "identity";
+  }
+}
+
+std::shared_ptr<const std::string> http_compression::compress(int enc, const string_len &resource, const string_len &etag,
+                                                              const char *body, size_t len)
+{
+  // weak etags say two bodies mean the same thing, not that
+  // they are the same bytes, so those aren't cached
+  if (max_cache_size_ == 0 || etag.len() == 0 || (etag.len() >= 2 && !memcmp(etag.ptr(), "W/", 2)))
+    return compress(enc, body, len);
+
+  // an etag is only unique within a resource, and a handler that
+  // forgets to change it when the body changes shouldn't get the
+  // old body back, so the length and a hash of the body are part
+  // of the key too.  Hashing is cheap next to compressing.
+  uint64_t sum[2] = {(uint64_t)len, (uint64_t)std::hash<std::string_view>()(std::string_view(body, len))};
+  std::string key(1, (char)enc);
+  key.append((const char *)sum, sizeof(sum));
+  key.append(etag.ptr(), etag.len());
+  key.append(1, ' ');
+  key.append(resource.ptr(), resource.len());
+  {
+    anon::lock_guard<std::mutex> lock(mtx_);
+    auto it = cache_.find(key);
+    if (it != cache_.end())
+    {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      ++hits_;
+      return it->second->body;
+    }
+  }
+
+  // two fibers can get here for the same etag at the same
+  // time.  They both compress it, and the first one to
+  // finish is the one that is cached.
+  ++misses_;
+  auto compressed = compress(enc, body, len);
+  auto size = key.size() + (compressed ? compressed->size() : 0);
+  if (size <= max_cache_size_)
+  {
+    anon::lock_guard<std::mutex> lock(mtx_);
+    if (cache_.find(key) == cache_.end())
+    {
+      lru_.push_front(cache_ent{key, compressed});
+      cache_[key] = lru_.begin();
+      cache_size_ += size;
+      while (cache_size_ > max_cache_size_)
+      {
+        auto &oldest = lru_.back();
+        cache_size_ -= oldest.key.size() + (oldest.body ? oldest.body->size() : 0);
+        cache_.erase(oldest.key);
+        lru_.pop_back();
+      }
+    }
+  }
+  return compressed;
+}
+
+std::shared_ptr<const std::string> http_compression::compress(int enc, const char *body, size_t len)
+{
+  auto out = std::make_shared<std::string>();
+  switch (enc)
+  {
+  case k_gzip:
+  {
+    if (len > UINT_MAX)
+      return nullptr;
+    if (gzip.level != gzip_level_)
+    {
+      if (gzip.level >= 0)
+        deflateEnd(&gzip.zs);
+      gzip.level = -1;
+      memset(&gzip.zs, 0, sizeof(gzip.zs));
+      // 15 + 16 - largest window, with a gzip header and trailer
+      if (deflateInit2(&gzip.zs, gzip_level_, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nullptr;
+      gzip.level = gzip_level_;
+    }
+    else
+      deflateReset(&gzip.zs);
+    out->resize(deflateBound(&gzip.zs, len));
+    gzip.zs.next_in = (Bytef *)body;
+    gzip.zs.avail_in = (uInt)len;
+    gzip.zs.next_out = (Bytef *)&(*out)[0];
+    gzip.zs.avail_out = (uInt)out->size();
+    if (deflate(&gzip.zs, Z_FINISH) != Z_STREAM_END)
+      return nullptr;
+    out->resize(gzip.zs.total_out);
+    break;
+  }
+
+#if defined(ANON_HTTP_BROTLI)
+  case k_br:
+  {
+    // brotli's one shot encoder keeps no state between calls
+    auto size = BrotliEncoderMaxCompressedSize(len);
+    if (size == 0)
+      return nullptr;
+    out->resize(size);
+    if (!BrotliEncoderCompress(br_quality_, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, (const uint8_t *)body, &size, (uint8_t *)&(*out)[0]))
+      return nullptr;
+    out->resize(size);
+    break;
+  }
+#endif
+
+#if defined(ANON_HTTP_ZSTD)
+  case k_zstd:
+  {
+    if (!zstd.cctx)
+      return nullptr;
+    out->resize(ZSTD_compressBound(len));
+    auto size = ZSTD_compressCCtx(zstd.cctx, &(*out)[0], out->size(), body, len, zstd_level_);
+    if (ZSTD_isError(size))
+      return nullptr;
+    out->resize(size);
+    break;
+  }
+#endif
+
+  default:
+    return nullptr;
+  }
+
+  if (out->size() >= len)
+    return nullptr;
+  return out;
+}
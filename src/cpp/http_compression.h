@@ -0,0 +1,134 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "string_len.h"
+#include <mutex>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <atomic>
+
+// on the fly compression of http response bodies, used by http_server
+// when it has been given one of these (see http_server::set_compression).
+//
+// gzip is always available.  brotli and zstd are compiled in when
+// ANON_HTTP_BROTLI (link -lbrotlienc) and ANON_HTTP_ZSTD (link -lzstd)
+// are defined.  Each io thread keeps its own compressor state and
+// reuses it from one response to the next, rather than setting one up
+// (and allocating its tables) per response.
+//
+// Compressed bodies of responses that carry a strong etag are kept in
+// an lru cache, so a response that is sent over and over is only
+// compressed once.  The cache is keyed by the resource the response is
+// for, its etag, the encoding, and the length and a hash of the body,
+// so two resources that happen to use the same etag don't get each
+// other's bodies.
+class http_compression
+{
+public:
+  enum encoding
+  {
+    k_identity = 0,
+    k_gzip = 1,
+    k_br = 2,
+    k_zstd = 4
+  };
+
+  enum
+  {
+    k_default_min_size = 1024,
+    k_default_cache_size = 16 * 1024 * 1024
+  };
+
+  // bodies smaller than 'min_size' are sent as they are.  'cache_size'
+  // is the number of bytes of compressed bodies the cache can hold, 0
+  // turns it off.
+  http_compression(size_t min_size = k_default_min_size,
+                   size_t cache_size = k_default_cache_size,
+                   int gzip_level = 6, int br_quality = 5, int zstd_level = 3);
+
+  // the encoding to use for a client that sent 'accept_encoding'.  Of
+  // the encodings we support the one with the highest q value is picked,
+  // with ties going to br, then zstd, then gzip.  k_identity if there
+  // is none.
+  int choose(const string_len &accept_encoding) const
+  {
+    return choose(accept_encoding, supported_);
+  }
+
+  // same, but picking from the encodings in 'available'
+  static int choose(const string_len &accept_encoding, int available);
+
+  // whether a body with the given content-type is worth compressing -
+  // text, json, javascript, xml, svg and the like
+  static bool compressible_type(const string_len &content_type);
+
+  size_t min_size() const
+  {
+    return min_size_;
+  }
+
+  // 'body' compressed with 'enc'.  null if compressing it doesn't make
+  // it any smaller.  If 'etag' is a strong etag the result is cached
+  // for 'resource' (typically the request's host and url).
+  std::shared_ptr<const std::string> compress(int enc, const string_len &resource, const string_len &etag,
+                                              const char *body, size_t len);
+
+  // value for the content-encoding header
+  static const char *name(int enc);
+
+  uint64_t cache_hits() const
+  {
+    return hits_;
+  }
+
+  uint64_t cache_misses() const
+  {
+    return misses_;
+  }
+
+private:
+  std::shared_ptr<const std::string> compress(int enc, const char *body, size_t len);
+
+  struct cache_ent
+  {
+    std::string key;
+    std::shared_ptr<const std::string> body;
+  };
+
+  size_t min_size_;
+  size_t max_cache_size_;
+  int gzip_level_;
+  int br_quality_;
+  int zstd_level_;
+  int supported_;
+
+  std::mutex mtx_;
+  std::list<cache_ent> lru_; // most recently used at the front
+  std::unordered_map<std::string, std::list<cache_ent>::iterator> cache_;
+  size_t cache_size_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+};
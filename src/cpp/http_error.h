@@ -23,6 +23,7 @@
 #pragma once
 
 #include "http_server.h"
+#include "json_reader.h"
 #include <map>
 #include <string>
 #include "nlohmann/json.hpp"
@@ -109,8 +110,8 @@ inline void reply_back_error(const char* method_, int cors_enabled, const http_r
     else if (method == "DELETE")
       chk = cors_enabled & http_server::k_enable_cors_put;
     if (chk) {
-      if (request.headers.contains_header("origin"))
-        response.add_header("access-control-allow-origin", request.headers.get_header("origin").str());
+      if (request.headers.contains_header(http_headers::k_origin))
+        response.add_header("access-control-allow-origin", request.headers.get_header(http_headers::k_origin).str());
       response.add_header("access-control-allow-methods", method);
       response.add_header("access-control-allow-credentials", "true");
       response.add_header("access-control-max-age", "600");
@@ -161,6 +162,15 @@ void request_wrap(const char* method, int cors_enabled, const std::string& allow
   {
     reply_back_error(method, cors_enabled, request, e.what(), "400", "text/plain", allow_headers_error, pipe);
   }
+  catch (const json_error &e)
+  {
+    reply_back_error(method, cors_enabled, request, e.what(), "400", "text/plain", allow_headers_error, pipe);
+  }
+  catch (const http_body_error &e)
+  {
+    request_error err(e.status, e.what());
+    reply_back_error(method, cors_enabled, request, e.what(), err.code.c_str(), "text/plain", allow_headers_error, pipe);
+  }
   catch (const std::exception &e)
   {
     reply_back_error(method, cors_enabled, request, e.what(), "500", "text/plain", allow_headers_error, pipe);
@@ -0,0 +1,517 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "http_request_parser.h"
+#include <strings.h>
+#include <limits.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ANON_HTTP_PARSER_SIMD 1
+#endif
+
+namespace
+{
+
+// tchar, from RFC 7230 - the characters that can
+// appear in a method or header field name
+struct token_table
+{
+  token_table()
+  {
+    memset(is_token, 0, sizeof(is_token));
+    for (int c = '0'; c <= '9'; c++)
+      is_token[c] = true;
+    for (int c = 'a'; c <= 'z'; c++)
+      is_token[c] = is_token[c - 'a' + 'A'] = true;
+    for (const char *c = "!#$%&'*+-.^_`|~"; *c; c++)
+      is_token[(unsigned char)*c] = true;
+  }
+
+  bool is_token[256];
+};
+
+const token_table tokens;
+
+// each scanner returns the first byte in [p, end) that ends the
+// thing being scanned, or 'end' if there isn't one.
+
+// the end of a method or field name - anything but a tchar
+const char *scan_token_scalar(const char *p, const char *end)
+{
+  while (p < end && tokens.is_token[(unsigned char)*p])
+    ++p;
+  return p;
+}
+
+// the end of a header value - a control character
+// other than tab, or DEL
+const char *scan_value_scalar(const char *p, const char *end)
+{
+  while (p < end)
+  {
+    auto c = (unsigned char)*p;
+    if ((c < 0x20 && c != '\t') || c == 0x7f)
+      break;
+    ++p;
+  }
+  return p;
+}
+
+// the end of the request target - a space, or any
+// other control character, or DEL
+const char *scan_target_scalar(const char *p, const char *end)
+{
+  while (p < end)
+  {
+    auto c = (unsigned char)*p;
+    if (c <= 0x20 || c == 0x7f)
+      break;
+    ++p;
+  }
+  return p;
+}
+
+const char *scan_newline_scalar(const char *p, const char *end)
+{
+  auto nl = (const char *)memchr(p, '\n', end - p);
+  return nl ? nl : end;
+}
+
+#if defined(ANON_HTTP_PARSER_SIMD)
+
+// the bytes that aren't tchar, as the (inclusive) ranges that
+// pcmpestri takes.  The last range, '{' to 0xff, also covers '|'
+// and '~', which are tchar, so hits there get checked in the table.
+__attribute__((target("sse4.2")))
+const char *scan_token_sse42(const char *p, const char *end)
+{
+  alignas(16) static const char ranges[16] = {
+      '\x00', ' ', '"', '"', '(', ')', ',', ',', '/', '/', ':', '@', '[', ']', '{', '\xff'};
+  auto r = _mm_load_si128((const __m128i *)ranges);
+  while (end - p >= 16)
+  {
+    auto v = _mm_loadu_si128((const __m128i *)p);
+    auto i = _mm_cmpestri(r, 16, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (i == 16)
+      p += 16;
+    else
+    {
+      p += i;
+      if (!tokens.is_token[(unsigned char)*p])
+        return p;
+      ++p;
+    }
+  }
+  return scan_token_scalar(p, end);
+}
+
+__attribute__((target("sse4.2")))
+const char *scan_value_sse42(const char *p, const char *end)
+{
+  auto ctl = _mm_set1_epi8(0x1f);
+  auto tab = _mm_set1_epi8('\t');
+  auto del = _mm_set1_epi8(0x7f);
+  while (end - p >= 16)
+  {
+    auto v = _mm_loadu_si128((const __m128i *)p);
+    auto is_ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v);
+    auto stop = _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(v, tab), is_ctl), _mm_cmpeq_epi8(v, del));
+    auto mask = (unsigned)_mm_movemask_epi8(stop);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return scan_value_scalar(p, end);
+}
+
+__attribute__((target("sse4.2")))
+const char *scan_target_sse42(const char *p, const char *end)
+{
+  auto sp = _mm_set1_epi8(0x20);
+  auto del = _mm_set1_epi8(0x7f);
+  while (end - p >= 16)
+  {
+    auto v = _mm_loadu_si128((const __m128i *)p);
+    auto stop = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, sp), v), _mm_cmpeq_epi8(v, del));
+    auto mask = (unsigned)_mm_movemask_epi8(stop);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return scan_target_scalar(p, end);
+}
+
+__attribute__((target("sse4.2")))
+const char *scan_newline_sse42(const char *p, const char *end)
+{
+  auto nl = _mm_set1_epi8('\n');
+  while (end - p >= 16)
+  {
+    auto v = _mm_loadu_si128((const __m128i *)p);
+    auto mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return scan_newline_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+const char *scan_value_avx2(const char *p, const char *end)
+{
+  auto ctl = _mm256_set1_epi8(0x1f);
+  auto tab = _mm256_set1_epi8('\t');
+  auto del = _mm256_set1_epi8(0x7f);
+  while (end - p >= 32)
+  {
+    auto v = _mm256_loadu_si256((const __m256i *)p);
+    auto is_ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v);
+    auto stop = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), is_ctl), _mm256_cmpeq_epi8(v, del));
+    auto mask = (unsigned)_mm256_movemask_epi8(stop);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scan_value_sse42(p, end);
+}
+
+__attribute__((target("avx2")))
+const char *scan_target_avx2(const char *p, const char *end)
+{
+  auto sp = _mm256_set1_epi8(0x20);
+  auto del = _mm256_set1_epi8(0x7f);
+  while (end - p >= 32)
+  {
+    auto v = _mm256_loadu_si256((const __m256i *)p);
+    auto stop = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, sp), v), _mm256_cmpeq_epi8(v, del));
+    auto mask = (unsigned)_mm256_movemask_epi8(stop);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scan_target_sse42(p, end);
+}
+
+__attribute__((target("avx2")))
+const char *scan_newline_avx2(const char *p, const char *end)
+{
+  auto nl = _mm256_set1_epi8('\n');
+  while (end - p >= 32)
+  {
+    auto v = _mm256_loadu_si256((const __m256i *)p);
+    auto mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scan_newline_sse42(p, end);
+}
+
+#endif
+
+struct scanners
+{
+  const char *(*token)(const char *p, const char *end);
+  const char *(*value)(const char *p, const char *end);
+  const char *(*target)(const char *p, const char *end);
+  const char *(*newline)(const char *p, const char *end);
+  const char *name;
+};
+
+scanners pick_scanners()
+{
+#if defined(ANON_HTTP_PARSER_SIMD)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2"))
+    return {scan_token_sse42, scan_value_avx2, scan_target_avx2, scan_newline_avx2, "avx2"};
+  if (__builtin_cpu_supports("sse4.2"))
+    return {scan_token_sse42, scan_value_sse42, scan_target_sse42, scan_newline_sse42, "sse4.2"};
+#endif
+  return {scan_token_scalar, scan_value_scalar, scan_target_scalar, scan_newline_scalar, "scalar"};
+}
+
+const scanners scan = pick_scanners();
+
+int method_from(const char *m, size_t len)
+{
+  if (len == 3 && !memcmp(m, "GET", 3))
+    return HTTP_GET;
+  if (len == 4 && !memcmp(m, "POST", 4))
+    return HTTP_POST;
+#define XX(num, name, string)                                     \
+  if (len == sizeof(#string) - 1 && !memcmp(m, #string, len)) \
+    return num;
+  HTTP_METHOD_MAP(XX)
+#undef XX
+  return -1;
+}
+
+// fill in url_str and p_url.  The common case, a plain path with
+// maybe a query and fragment, is split here.  Anything else (absolute
+// urls, CONNECT's host:port, "*") goes to http_parser_parse_url.
+bool set_url(http_request &request, const char *target, size_t len)
+{
+  request.url_str.assign(target, len);
+  auto &u = request.p_url;
+  memset(&u, 0, sizeof(u));
+  auto url = request.url_str.c_str();
+  if (*url != '/' || len > 0xffff)
+    return http_parser_parse_url(url, len, request.method == HTTP_CONNECT, &u) == 0;
+
+  auto hash = (const char *)memchr(url, '#', len);
+  size_t frag = hash ? hash - url : len;
+  auto qm = (const char *)memchr(url, '?', frag);
+  size_t query = qm ? qm - url : frag;
+  u.field_set = 1 << UF_PATH;
+  u.field_data[UF_PATH].off = 0;
+  u.field_data[UF_PATH].len = query;
+  if (qm && frag > query + 1)
+  {
+    u.field_set |= 1 << UF_QUERY;
+    u.field_data[UF_QUERY].off = query + 1;
+    u.field_data[UF_QUERY].len = frag - query - 1;
+  }
+  if (hash && len > frag + 1)
+  {
+    u.field_set |= 1 << UF_FRAGMENT;
+    u.field_data[UF_FRAGMENT].off = frag + 1;
+    u.field_data[UF_FRAGMENT].len = len - frag - 1;
+  }
+  return true;
+}
+
+// calls f(element, len) for each comma separated element of a
+// header value, with the white space around it removed
+template <typename Fn>
+void for_each_element(const char *v, const char *end, Fn f)
+{
+  while (v < end)
+  {
+    auto comma = (const char *)memchr(v, ',', end - v);
+    auto e = comma ? comma : end;
+    auto s = v;
+    while (s < e && (*s == ' ' || *s == '\t'))
+      ++s;
+    auto t = e;
+    while (t > s && (t[-1] == ' ' || t[-1] == '\t'))
+      --t;
+    if (t > s)
+      f(s, t - s);
+    v = e + 1;
+  }
+}
+
+bool is(const char *s, size_t len, const char *lit)
+{
+  return len == strlen(lit) && !strncasecmp(s, lit, len);
+}
+
+} // namespace
+
+http_request_parser::result http_request_parser::parse(char *buf, size_t len, size_t &scanned, http_request &request, info &inf)
+{
+  const char *end = buf + len;
+
+  // empty lines in front of the request line are ignored (RFC 7230, 3.5)
+  const char *p = buf;
+  while (p < end && (*p == '\r' || *p == '\n'))
+    ++p;
+
+  // find the empty line that ends the headers.  Start a little
+  // before where the last call stopped looking so that a "\r\n\r\n"
+  // split across two reads is still found.
+  auto from = std::max(p, (const char *)buf + (scanned > 3 ? scanned - 3 : 0));
+  const char *hdr_end = 0;
+  while (true)
+  {
+    auto nl = scan.newline(from, end);
+    if (nl == end)
+      break;
+    if (nl + 1 < end && nl[1] == '\n')
+    {
+      hdr_end = nl + 2;
+      break;
+    }
+    if (nl + 2 < end && nl[1] == '\r' && nl[2] == '\n')
+    {
+      hdr_end = nl + 3;
+      break;
+    }
+    from = nl + 1;
+  }
+  if (!hdr_end)
+  {
+    scanned = len;
+    return k_partial;
+  }
+
+  // request line - method SP request-target SP HTTP/x.y
+  auto m = p;
+  p = scan.token(p, hdr_end);
+  if (p == m || *p != ' ')
+    return k_invalid;
+  request.method = method_from(m, p - m);
+  if (request.method < 0)
+    return k_invalid;
+  auto target = ++p;
+  p = scan.target(p, hdr_end);
+  if (p == target || *p != ' ')
+    return k_invalid;
+  if (!set_url(request, target, p - target))
+    return k_invalid;
+  ++p;
+  if (hdr_end - p < 9 || memcmp(p, "HTTP/", 5) || p[5] < '0' || p[5] > '9' || p[6] != '.' || p[7] < '0' || p[7] > '9')
+    return k_invalid;
+  request.http_major = p[5] - '0';
+  request.http_minor = p[7] - '0';
+  p += 8;
+  if (*p == '\r')
+    ++p;
+  if (*p != '\n')
+    return k_invalid;
+  ++p;
+
+  // headers
+  bool has_cl = false, has_te = false, chunked = false, has_upgrade = false;
+  bool conn_close = false, conn_keep_alive = false, conn_upgrade = false;
+  uint64_t cl = 0;
+  while (*p != '\r' && *p != '\n')
+  {
+    auto field = (char *)p;
+    p = scan.token(p, hdr_end);
+    // (this also rejects obsolete line folding, and
+    // white space between the field name and colon)
+    if (p == field || *p != ':')
+      return k_invalid;
+    size_t field_len = p - field;
+    ++p;
+    while (*p == ' ' || *p == '\t')
+      ++p;
+    auto value = p;
+    p = scan.value(p, hdr_end);
+    auto value_end = p;
+    if (*p == '\r')
+      ++p;
+    if (*p != '\n')
+      return k_invalid;
+    ++p;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+      --value_end;
+
+    request.headers.add(field, field_len, value, value_end - value);
+
+    // the field name is lower case now
+    switch (field_len)
+    {
+    case 14:
+      if (!memcmp(field, "content-length", 14))
+      {
+        if (value == value_end)
+          return k_invalid;
+        uint64_t v = 0;
+        for (auto d = value; d < value_end; d++)
+        {
+          if (*d < '0' || *d > '9' || v > (UINT64_MAX - 9) / 10)
+            return k_invalid;
+          v = v * 10 + (*d - '0');
+        }
+        if (has_cl && v != cl)
+          return k_invalid;
+        has_cl = true;
+        cl = v;
+      }
+      break;
+    case 17:
+      if (!memcmp(field, "transfer-encoding", 17))
+      {
+        // chunked only counts if it is the last coding applied
+        has_te = true;
+        for_each_element(value, value_end, [&chunked](const char *e, size_t len) {
+          chunked = is(e, len, "chunked");
+        });
+      }
+      break;
+    case 10:
+      if (!memcmp(field, "connection", 10))
+      {
+        for_each_element(value, value_end, [&](const char *e, size_t len) {
+          if (is(e, len, "close"))
+            conn_close = true;
+          else if (is(e, len, "keep-alive"))
+            conn_keep_alive = true;
+          else if (is(e, len, "upgrade"))
+            conn_upgrade = true;
+        });
+      }
+      break;
+    case 7:
+      if (!memcmp(field, "upgrade", 7))
+        has_upgrade = true;
+      break;
+    }
+  }
+
+  // the loop stops at the first line starting with '\r' or '\n'.
+  // Anything but the empty line that ends the headers (a line
+  // starting with a bare '\r', say) would leave the fields after
+  // it unread, where joyent's parser refuses the request.
+  if (*p == '\r')
+    ++p;
+  if (*p != '\n' || p + 1 != hdr_end)
+    return k_invalid;
+
+  // a request whose length we can't be sure of is refused
+  // rather than risk disagreeing with a proxy about where
+  // it ends (RFC 7230, 3.3.3)
+  if (has_te && (!chunked || has_cl))
+    return k_invalid;
+
+  request.has_content_length = has_cl;
+  // content_length is an int, body_length carries the real length
+  request.content_length = (int)std::min(cl, (uint64_t)INT_MAX);
+  request.is_chunked = chunked;
+
+  inf.header_len = hdr_end - buf;
+  inf.body_length = cl;
+  inf.upgrade = request.method == HTTP_CONNECT || (has_upgrade && conn_upgrade);
+  if (request.http_major > 0 && request.http_minor > 0)
+    inf.keep_alive = !conn_close;
+  else
+    inf.keep_alive = conn_keep_alive;
+  return k_complete;
+}
+
+const char *http_request_parser::engine_name()
+{
+  return scan.name;
+}
+
+int http_request_parser::method(const char *m, size_t len)
+{
+  return method_from(m, len);
+}
+
+bool http_request_parser::set_url(http_request &request, const char *target, size_t len)
+{
+  return ::set_url(request, target, len);
+}
@@ -0,0 +1,83 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "http_server.h"
+
+// a one pass parser for the request line and headers of an HTTP/1.x
+// request, used by http_server in place of joyent's http_parser when
+// the server's parser engine is k_fast_parser.
+//
+// Instead of walking the request a byte at a time and reporting what
+// it finds through callbacks, this first finds the end of the headers,
+// then fills in http_request directly - method, version, url (including
+// the offsets get_url_field uses) and headers - scanning for the
+// delimiters 16 or 32 bytes at a time with SSE4.2 or AVX2 when the cpu
+// has them.  It keeps no state between calls.  When the headers aren't
+// all there yet it says so and is called again, on the same bytes plus
+// whatever has arrived since, once more data has been read.  'scanned'
+// lets that call skip looking for the end of the headers in the part
+// it has already searched.
+class http_request_parser
+{
+public:
+  enum result
+  {
+    k_complete,
+    k_partial,
+    k_invalid
+  };
+
+  struct info
+  {
+    // number of bytes of request line and headers, including
+    // the empty line that ends them.  The body starts here.
+    size_t header_len;
+
+    // body length given by content-length, 0 if there wasn't one
+    uint64_t body_length;
+
+    // same meaning as http_should_keep_alive and http_parser::upgrade
+    bool keep_alive;
+    bool upgrade;
+  };
+
+  // parse the request at the start of buf[0..len).  Field names are
+  // converted to lower case in place, and 'request' keeps pointers
+  // into 'buf' for its headers, as with http_parser.  'scanned' must
+  // be 0 for the first call on a new request.
+  static result parse(char *buf, size_t len, size_t &scanned, http_request &request, info &inf);
+
+  // the http_method for the method name in m[0..len), or
+  // -1 if it isn't one http_parser knows
+  static int method(const char *m, size_t len);
+
+  // set request.url_str to target[0..len), and split it into the
+  // parts get_url_field returns.  'request.method' must already
+  // be set.  Returns false if it isn't a valid request target.
+  static bool set_url(http_request &request, const char *target, size_t len);
+
+  // which delimiter scanning code parse uses on this cpu:
+  // "avx2", "sse4.2" or "scalar"
+  static const char *engine_name();
+};
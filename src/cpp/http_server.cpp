@@ -22,260 +22,837 @@
 
 #include "http_server.h"
 #include "tls_pipe.h"
+#include "http_request_parser.h"
+#include "access_log.h"
 #include <algorithm>
+#include <atomic>
+#include <strings.h>
+#include <time.h>
 
-void http_server::start_(int tcp_port, body_handler *base_handler, int listen_backlog, tls_context *tls_ctx, bool port_is_fd, size_t stack_size)
+namespace
 {
+
+// parser callback struct used as "user data"
+// style communcation in the callbacks so we
+// know what we are doing
+struct pc
+{
+  pc(const sockaddr *src_addr, socklen_t src_addr_len)
+      : request(src_addr, src_addr_len)
+  {
+    init();
+  }
+
+  void init()
+  {
+    message_complete = false;
+    header_state = k_field;
+    last_field_len = 0;
+    last_value_len = 0;
+    last_field_start = 0;
+    last_value_start = 0;
+    request.init();
+  }
+
+  http_request request;
+  uint64_t body_length;
+  bool message_complete;
+
+  enum
+  {
+    k_value,
+    k_field
+  };
+  int header_state;
+  const char *last_field_start;
+  size_t last_field_len;
+  const char *last_value_start;
+  size_t last_value_len;
+};
+
+// joyent data structure, set its callback functions
+struct parser_settings : public http_parser_settings
+{
+  parser_settings()
+  {
+    on_message_begin = [](http_parser *p) -> int {
+      return 0;
+    };
+
+    on_url = [](http_parser *p, const char *at, size_t length) -> int {
+      pc *c = (pc *)p->data;
+      c->request.url_str += std::string(at, length);
+      auto &url = c->request.url_str;
+      http_parser_parse_url(url.c_str(), url.length(), true, &c->request.p_url);
+      return 0;
+    };
+
+    on_status = [](http_parser *p, const char *at, size_t length) -> int {
+#if ANON_LOG_NET_TRAFFIC > 1
+      anon_log("http status ignored since this should be a GET, status: \"" << std::string(at, length) << "\"");
+#endif
+      return 0;
+    };
+
+    on_header_field = [](http_parser *p, const char *at, size_t length) -> int {
+      pc *c = (pc *)p->data;
+      if (c->header_state == pc::k_value)
+      {
+        // <field,value> complete, add new pair
+        c->request.headers.add((char *)c->last_field_start, c->last_field_len,
+          c->last_value_start, c->last_value_len);
+
+        c->last_field_start = at;
+        c->last_field_len = 0;
+        c->header_state = pc::k_field;
+      }
+      else if (!c->last_field_start)
+        c->last_field_start = at;
+      c->last_field_len += length;
+      return 0;
+    };
+
+    on_header_value = [](http_parser *p, const char *at, size_t length) -> int {
+      pc *c = (pc *)p->data;
+      if (c->header_state == pc::k_field)
+      {
+        c->last_value_start = at;
+        c->last_value_len = 0;
+        c->header_state = pc::k_value;
+      }
+      c->last_value_len += length;
+      return 0;
+    };
+
+    on_headers_complete = [](http_parser *p) -> int {
+      pc *c = (pc *)p->data;
+      c->request.http_major = p->http_major;
+      c->request.http_minor = p->http_minor;
+      c->request.method = p->method;
+      if (c->header_state == pc::k_value)
+      {
+        c->request.headers.add((char *)c->last_field_start, c->last_field_len,
+          c->last_value_start, c->last_value_len);
+      }
+      c->request.has_content_length = (p->flags & F_CONTENTLENGTH) != 0;
+      c->request.content_length = p->content_length;
+      c->request.is_chunked = (p->flags & F_CHUNKED) != 0;
+      c->body_length = c->request.has_content_length ? p->content_length : 0;
+
+      // note, see code in http_parser.c, returning 1 causes the
+      // parser to skip attempting to read the body, which is
+      // what we want.
+      return 1;
+    };
+
+    on_body = [](http_parser *p, const char *at, size_t length) -> int {
+      return 1;
+    };
+
+    on_message_complete = [](http_parser *p) -> int {
+      pc *c = (pc *)p->data;
+      c->message_complete = true;
+      // stop here, leaving any pipelined requests that follow
+      // this one in the buffer until this one has been handled
+      http_parser_pause(p, 1);
+      return 0;
+    };
+  }
+};
+
+const parser_settings settings;
+
+// the "date: ...\r\n" header line for the current second,
+// formatted only when the second changes
+const char *date_header(size_t &len)
+{
+  thread_local time_t formatted_at = 0;
+  thread_local char line[64];
+  thread_local size_t line_len = 0;
+  auto now = time(0);
+  if (now != formatted_at)
+  {
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    line_len = strftime(line, sizeof(line), "date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    formatted_at = now;
+  }
+  len = line_len;
+  return line;
+}
+
+string_len strip_weak(const char *p, const char *end)
+{
+  if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+    p += 2;
+  return string_len(p, end - p);
+}
+
+// the etag a response gets when its body is sent compressed with
+// 'content_encoding'.  The compressed bytes are a different
+// representation than the handler's, so they can't share its
+// (possibly strong) etag.  "abc" becomes "abc-gzip".
+std::string encoded_etag(const string_len &etag, const char *content_encoding)
+{
+  auto e = etag.str();
+  auto pos = e.size() >= 2 && e.back() == '"' ? e.size() - 1 : e.size();
+  e.insert(pos, std::string("-") + content_encoding);
+  return e;
+}
+
+// whether 't', an etag from a conditional request, names 'tag' or
+// one of the compressed representations encoded_etag makes of it.
+// Both have already had any W/ removed.
+bool etag_matches(const string_len &t, const string_len &tag)
+{
+  if (t.len() == 0)
+    return false;
+  if (t.len() == tag.len())
+    return !memcmp(t.ptr(), tag.ptr(), t.len());
+  if (t.len() < tag.len() + 2 || tag.len() < 2 || tag.ptr()[tag.len() - 1] != '"' || t.ptr()[t.len() - 1] != '"')
+    return false;
+  auto inner = tag.len() - 1;
+  if (memcmp(t.ptr(), tag.ptr(), inner) || t.ptr()[inner] != '-')
+    return false;
+  auto suffix = t.ptr() + inner + 1;
+  auto suffix_len = t.len() - inner - 2;
+  for (auto enc : {http_compression::k_gzip, http_compression::k_br, http_compression::k_zstd})
+  {
+    auto name = http_compression::name(enc);
+    if (strlen(name) == suffix_len && !memcmp(name, suffix, suffix_len))
+      return true;
+  }
+  return false;
+}
+
+std::atomic<uint64_t> rb_borrowed(0);
+std::atomic<uint64_t> rb_reused(0);
+std::atomic<uint64_t> rb_grown(0);
+std::atomic<uint64_t> rb_too_big(0);
+std::atomic<int64_t> rb_in_use(0);
+std::atomic<int64_t> rb_pooled(0);
+std::atomic<int64_t> rb_pooled_bytes(0);
+
+// per-thread free lists of the buffers connections read requests
+// into, one list for each power of 2 size from k_read_buf_size up.
+// A connection's fiber can move between threads, so a buffer doesn't
+// necessarily go back to the pool it came from - it just joins the
+// pool of the thread it is given back on.
+struct read_buffer_pool
+{
+  enum
+  {
+    k_num_sizes = 8,
+    k_max_pooled_bytes = 1024 * 1024
+  };
+
+  ~read_buffer_pool()
+  {
+    for (auto &l : free)
+      rb_pooled -= l.size();
+    rb_pooled_bytes -= bytes;
+  }
+
+  static read_buffer_pool &local()
+  {
+    thread_local read_buffer_pool pool;
+    return pool;
+  }
+
+  // the size class that holds buffers of at least 'size' bytes
+  static int size_class(size_t size)
+  {
+    int c = 0;
+    while (c < k_num_sizes && ((size_t)http_server::k_read_buf_size << c) < size)
+      ++c;
+    return c;
+  }
+
+  std::vector<std::vector<char>> free[k_num_sizes];
+  size_t bytes{0};
+};
+
+// make 'buf' (which is empty) a buffer of at least 'size' bytes
+void borrow_read_buf(std::vector<char> &buf, size_t size)
+{
+  ++rb_borrowed;
+  ++rb_in_use;
+  auto c = read_buffer_pool::size_class(size);
+  if (c == read_buffer_pool::k_num_sizes)
+  {
+    buf.resize(size);
+    return;
+  }
+  auto &pool = read_buffer_pool::local();
+  auto &l = pool.free[c];
+  if (l.empty())
+  {
+    buf.resize((size_t)http_server::k_read_buf_size << c);
+    return;
+  }
+  buf.swap(l.back());
+  l.pop_back();
+  pool.bytes -= buf.size();
+  ++rb_reused;
+  --rb_pooled;
+  rb_pooled_bytes -= buf.size();
+}
+
+// give 'buf' back, leaving it empty
+void release_read_buf(std::vector<char> &buf)
+{
+  if (buf.empty())
+    return;
+  --rb_in_use;
+  auto c = read_buffer_pool::size_class(buf.size());
+  auto &pool = read_buffer_pool::local();
+  if (c < read_buffer_pool::k_num_sizes && buf.size() == ((size_t)http_server::k_read_buf_size << c) && pool.bytes + buf.size() <= read_buffer_pool::k_max_pooled_bytes)
+  {
+    pool.bytes += buf.size();
+    ++rb_pooled;
+    rb_pooled_bytes += buf.size();
+    pool.free[c].emplace_back();
+    pool.free[c].back().swap(buf);
+  }
+  else
+    std::vector<char>().swap(buf);
+}
+
+// swap 'buf' for one twice its size, keeping its first 'used' bytes
+void grow_read_buf(std::vector<char> &buf, size_t used)
+{
+  std::vector<char> bigger;
+  borrow_read_buf(bigger, buf.size() * 2);
+  memcpy(&bigger[0], &buf[0], used);
+  release_read_buf(buf);
+  buf.swap(bigger);
+  ++rb_grown;
+}
+
+// a connection's read buffer, which goes back to the pool
+// when serve returns
+struct read_buf
+{
+  ~read_buf()
+  {
+    release_read_buf(buf);
+  }
+
+  std::vector<char> buf;
+};
+
+} // namespace
+
+http_server::read_buffer_stats http_server::get_read_buffer_stats()
+{
+  return read_buffer_stats{rb_borrowed, rb_reused, rb_grown, rb_too_big, rb_in_use, rb_pooled, rb_pooled_bytes};
+}
+
+// the state of one connection that lasts across requests,
+// including while the connection is parked between them
+struct http_server::connection : public fiber_pipe::parked_reader
+{
+  connection(http_server *server, std::unique_ptr<fiber_pipe> &&pipe, const sockaddr *src_addr, socklen_t src_addr_len,
+             tls_context *tls_ctx)
+      : server_(server),
+        fp_(pipe.get()),
+        src_addr_len_(std::min(src_addr_len, (socklen_t)sizeof(src_addr_)))
+  {
+    memcpy(&src_addr_, src_addr, src_addr_len_);
+
+    // require prompt navigation through the
+    // initial tls handshake and http headers.
+    // No stalling a single read for longer
+    // than 4 seconds.
+    pipe->limit_io_block_time(2);
+
+    if (tls_ctx)
+    {
+      tlspipe_ = std::unique_ptr<tls_pipe>(new tls_pipe(std::move(pipe),
+                                                        false /*client - we are a server*/,
+                                                        false /*don't verify_peer*/,
+                                                        false /*don't do SNI*/,
+                                                        0 /*host_name*/,
+                                                        *tls_ctx));
+      http_pipe_ = tlspipe_.get();
+    }
+    else
+    {
+      pipe_ = std::move(pipe);
+      http_pipe_ = pipe_.get();
+    }
+  }
+
+  virtual void resume(bool closing) override
+  {
+    std::unique_ptr<connection> self(this);
+    if (closing)
+      return;
+    try
+    {
+      if (server_->serve(this))
+        self.release();
+    }
+    catch (const std::runtime_error &ex)
+    {
+#if ANON_LOG_NET_TRAFFIC > 1
+      anon_log("uncaught exception in http connection, what() = " << ex.what());
+#endif
+    }
+  }
+
+  // send the responses that have been held back in resp_buf_ so
+  // that those to pipelined requests go out in one write
+  void flush_responses()
+  {
+    if (!resp_buf_.empty())
+    {
+      http_pipe_->write(&resp_buf_[0], resp_buf_.size());
+      resp_buf_.clear();
+    }
+  }
+
+  // false if openssl is already holding (part of) the next request,
+  // in which case the socket may never become readable for it
+  bool can_park() const
+  {
+    return !tlspipe_ || !tlspipe_->has_buffered_data();
+  }
+
+  http_server *server_;
+  bool first_request_{true};
+  fiber_pipe *fp_;
+  std::unique_ptr<fiber_pipe> pipe_;
+  std::unique_ptr<tls_pipe> tlspipe_;
+  ::pipe_t *http_pipe_;
+  std::vector<char> resp_buf_;
+  struct sockaddr_storage src_addr_;
+  socklen_t src_addr_len_;
+};
+
+void http_server::start_(int tcp_port, body_handler *base_handler, int listen_backlog, tls_context *tls_ctx, bool port_is_fd, size_t stack_size,
+                         tcp_server::listen_mode mode)
+{
+  stack_size_ = stack_size;
+  body_holder_ = std::unique_ptr<body_handler>(base_handler);
+
+  if (tls_ctx && !m_protocol_map_.empty())
+  {
+    std::vector<std::string> protocols;
+    for (auto &p : m_protocol_map_)
+      protocols.push_back(p.first);
+    protocols.push_back("http/1.1");
+    tls_ctx->set_alpn_protocols(protocols);
+  }
+
   auto server = new tcp_server(
       tcp_port,
 
-      [base_handler, this, tls_ctx](std::unique_ptr<fiber_pipe> &&pipe, const sockaddr *src_addr, socklen_t src_addr_len) {
-        // parser callback struct used as "user data"
-        // style communcation in the callbacks so we
-        // know what we are doing
-        struct pc
-        {
-          pc(const sockaddr *src_addr, socklen_t src_addr_len)
-              : request(src_addr, src_addr_len)
-          {
-            init();
-          }
+      [this, tls_ctx](std::unique_ptr<fiber_pipe> &&pipe, const sockaddr *src_addr, socklen_t src_addr_len) {
+        std::unique_ptr<connection> conn(new connection(this, std::move(pipe), src_addr, src_addr_len, tls_ctx));
+        if (serve(conn.get()))
+          conn.release();
+      },
+      listen_backlog, port_is_fd, stack_size, mode);
 
-          void init()
-          {
-            message_complete = false;
-            header_state = k_field;
-            last_field_len = 0;
-            last_value_len = 0;
-            last_field_start = 0;
-            last_value_start = 0;
-            request.init();
-          }
+  if (limiter_)
+    server->set_rate_limiter(limiter_);
+  tcp_server_ = std::unique_ptr<tcp_server>(server);
+}
+
+// runs requests on 'conn' until the connection ends, returning false,
+// or until it is parked waiting for the next request, returning true.
+// In the parked case 'conn' is owned by the pipe it is parked on.
+bool http_server::serve(connection *conn)
+{
+  auto src_addr = (const sockaddr *)&conn->src_addr_;
+  auto http_pipe = conn->http_pipe_;
+  pc pcallback(src_addr, conn->src_addr_len_);
+
+  http_parser parser;
+  parser.data = &pcallback;
+  http_parser_init(&parser, HTTP_REQUEST);
+
+  bool fast_parser = parser_engine_ == k_fast_parser;
+  size_t scanned = 0;
+  bool need_more = false;
 
-          http_request request;
-          bool message_complete;
+  bool keep_alive = true;
+  read_buf rb;
+  auto &buf = rb.buf;
+  size_t bsp = 0, bep = 0;
+
+  // see add_protocol_handler
+  auto run_protocol = [&](const std::string &protocol) -> bool {
+    auto handler = m_protocol_map_.find(protocol);
+    if (handler == m_protocol_map_.end())
+      return false;
+    http_pipe->limit_io_block_time(15);
+    pcallback.request.http_major = protocol == "h2" ? 2 : 0;
+    pcallback.request.http_minor = 0;
+    pipe_t proto_pipe(http_pipe, buf, bsp, bep, &conn->resp_buf_);
+    handler->second->exec(proto_pipe, pcallback.request);
+    return true;
+  };
+  static const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+  const size_t h2_preface_len = sizeof(h2_preface) - 1;
+  bool check_preface = false;
+  if (conn->first_request_ && !m_protocol_map_.empty())
+  {
+    if (conn->tlspipe_)
+    {
+      if (run_protocol(conn->tlspipe_->alpn_protocol()))
+        return false;
+    }
+    else
+      check_preface = m_protocol_map_.count("h2") != 0;
+  }
+
+  while (keep_alive)
+  {
+    // if there is no un-parsed data in buf, or the fast
+    // parser needs more of it, then read more
+    if (bsp == bep || need_more)
+    {
+      conn->flush_responses();
+      need_more = false;
 
-          enum
+      // the client closing a keep-alive connection (or the
+      // hibernation sweep closing it for us) is the normal
+      // way for this loop to end, so don't throw for it.
+      io_result res;
+      if (bep == 0 && !buf.empty() && !park_idle_)
+      {
+        // waiting for the next request on a keep-alive connection,
+        // which can take a while.  Don't hold a buffer for it.
+        char idle_buf[k_idle_read_size];
+        release_read_buf(buf);
+        res = http_pipe->try_read(idle_buf, sizeof(idle_buf));
+        if (res)
+        {
+          borrow_read_buf(buf, k_read_buf_size);
+          memcpy(&buf[0], idle_buf, res.bytes);
+        }
+      }
+      else
+      {
+        if (buf.empty())
+          borrow_read_buf(buf, k_read_buf_size);
+        else if (bep == buf.size())
+        {
+          if (buf.size() >= max_header_size_)
           {
-            k_value,
-            k_field
-          };
-          int header_state;
-          const char *last_field_start;
-          size_t last_field_len;
-          const char *last_value_start;
-          size_t last_value_len;
-        };
-        pc pcallback(src_addr, src_addr_len);
-
-        // joyent data structure, set its callback functions
-        http_parser_settings settings;
-        settings.on_message_begin = [](http_parser *p) -> int {
-          return 0;
-        };
-
-        settings.on_url = [](http_parser *p, const char *at, size_t length) -> int {
-          pc *c = (pc *)p->data;
-          c->request.url_str += std::string(at, length);
-          auto &url = c->request.url_str;
-          http_parser_parse_url(url.c_str(), url.length(), true, &c->request.p_url);
-          return 0;
-        };
-
-        settings.on_status = [](http_parser *p, const char *at, size_t length) -> int {
 #if ANON_LOG_NET_TRAFFIC > 1
-          anon_log("http status ignored since this should be a GET, status: \"" << std::string(at, length) << "\"");
+            anon_log("http request from: " << *src_addr << " refused, headers bigger than " << buf.size() << " bytes");
 #endif
-          return 0;
-        };
-
-        settings.on_header_field = [](http_parser *p, const char *at, size_t length) -> int {
-          pc *c = (pc *)p->data;
-          if (c->header_state == pc::k_value)
-          {
-            // <field,value> complete, convert field to lower case and add new pair
-            std::transform(c->last_field_start, c->last_field_start + c->last_field_len,
-              (char*)c->last_field_start,
-              [](char c){ return std::tolower(c); });
-            string_len fld(c->last_field_start, c->last_field_len);
-            string_len val(c->last_value_start, c->last_value_len);
-            c->request.headers.headers.insert(std::make_pair(fld, val));
-
-            c->last_field_start = at;
-            c->last_field_len = 0;
-            c->header_state = pc::k_field;
+            ++rb_too_big;
+            http_response response;
+            response.set_status_code("431 Request Header Fields Too Large");
+            response.add_header("content-type", "text/plain");
+            response.add_header("connection", "close");
+            response << "request headers too large\n";
+            pipe_t err_pipe(http_pipe, buf, bsp, bep, &conn->resp_buf_);
+            err_pipe.respond(response);
+            conn->flush_responses();
+            return false;
           }
-          else if (!c->last_field_start)
-            c->last_field_start = at;
-          c->last_field_len += length;
-          return 0;
-        };
-
-        settings.on_header_value = [](http_parser *p, const char *at, size_t length) -> int {
-          pc *c = (pc *)p->data;
-          if (c->header_state == pc::k_field)
-          {
-            c->last_value_start = at;
-            c->last_value_len = 0;
-            c->header_state = pc::k_value;
-          }
-          c->last_value_len += length;
-          return 0;
-        };
-
-        settings.on_headers_complete = [](http_parser *p) -> int {
-          pc *c = (pc *)p->data;
-          c->request.http_major = p->http_major;
-          c->request.http_minor = p->http_minor;
-          c->request.method = p->method;
-          if (c->header_state == pc::k_value)
+
+          // the request starts at buf[0] (see the memmove below).
+          // joyent's parser has been handed pointers into the old
+          // buffer, so it starts over on the new one.
+          grow_read_buf(buf, bep);
+          if (!fast_parser)
           {
-            std::transform(c->last_field_start, c->last_field_start + c->last_field_len,
-              (char*)c->last_field_start,
-              [](char c){ return std::tolower(c); });
-            string_len fld(c->last_field_start, c->last_field_len);
-            string_len val(c->last_value_start, c->last_value_len);
-            c->request.headers.headers.insert(std::make_pair(fld, val));
+            http_parser_init(&parser, HTTP_REQUEST);
+            pcallback.init();
+            bsp = 0;
           }
-          c->request.has_content_length = (p->flags & F_CONTENTLENGTH) != 0;
-          c->request.content_length = p->content_length;
-
-          // note, see code in http_parser.c, returning 1 causes the
-          // parser to skip attempting to read the body, which is
-          // what we want.
-          return 1;
-        };
-
-        settings.on_body = [](http_parser *p, const char *at, size_t length) -> int {
-          return 1;
-        };
-
-        settings.on_message_complete = [](http_parser *p) -> int {
-          pc *c = (pc *)p->data;
-          c->message_complete = true;
-          return 0;
-        };
-
-        // require prompt navigation through the
-        // initial tls handshake and http headers.
-        // No stalling a single read for longer
-        // than 4 seconds.
-        pipe->limit_io_block_time(2);
-
-        std::unique_ptr<tls_pipe> tlspipe;
-        ::pipe_t *http_pipe;
-        if (tls_ctx)
-        {
-          tlspipe = std::unique_ptr<tls_pipe>(new tls_pipe(std::move(pipe),
-                                                           false /*client - we are a server*/,
-                                                           false /*don't verify_peer*/,
-                                                           false /*don't do SNI*/,
-                                                           0 /*host_name*/,
-                                                           *tls_ctx));
-          http_pipe = tlspipe.get();
         }
-        else
-          http_pipe = pipe.get();
+        res = http_pipe->try_read(&buf[bep], buf.size() - bep);
+      }
+      if (!res)
+      {
+#if ANON_LOG_NET_TRAFFIC > 2
+        anon_log("http connection from: " << *src_addr << " ended, err: " << res.err);
+#endif
+        return false;
+      }
+      //anon_log("client sent: " << std::string(&buf[bep], res.bytes));
+      bep += res.bytes;
+    }
 
-        http_parser parser;
-        parser.data = &pcallback;
-        http_parser_init(&parser, HTTP_REQUEST);
+    http_pipe->set_hibernating(false);
 
-        bool keep_alive = true;
-        std::vector<char>buf(8192);
-        size_t bsp = 0, bep = 0;
-        while (keep_alive)
-        {
-          // if there is no un-parsed data in buf then read more
-          if (bsp == bep)
-          {
-            auto bytes_read = http_pipe->read(&buf[bep], buf.size() - bep);
-            //anon_log("client sent: " << std::string(&buf[bep], bytes_read));
-            bep += bytes_read;
-          }
+    // an HTTP/2 client that knows it can skip the upgrade
+    if (check_preface)
+    {
+      auto n = std::min(bep, h2_preface_len);
+      if (memcmp(&buf[0], h2_preface, n))
+        check_preface = false;
+      else if (n < h2_preface_len)
+      {
+        need_more = true;
+        continue;
+      }
+      else
+      {
+        run_protocol("h2");
+        return false;
+      }
+    }
+
+    bool upgrade = false, should_keep_alive = false;
+    if (fast_parser)
+    {
+      http_request_parser::info inf;
+      auto res = http_request_parser::parse(&buf[bsp], bep - bsp, scanned, pcallback.request, inf);
+      if (res == http_request_parser::k_partial)
+      {
+        need_more = true;
+        continue;
+      }
+      if (res == http_request_parser::k_invalid)
+      {
+#if ANON_LOG_NET_TRAFFIC > 1
+        anon_log("invalid http received from: " << *src_addr);
+#endif
+        conn->flush_responses();
+        return false;
+      }
+      bsp += inf.header_len;
+      scanned = 0;
+      pcallback.message_complete = true;
+      pcallback.body_length = inf.body_length;
+      upgrade = inf.upgrade;
+      should_keep_alive = inf.keep_alive;
+    }
+    else
+    {
+      // call the joyent parser
+      bsp += http_parser_execute(&parser, &settings, &buf[bsp], bep - bsp);
+      if (pcallback.message_complete)
+      {
+        upgrade = parser.upgrade;
+        should_keep_alive = http_should_keep_alive(&parser);
+      }
+    }
 
-          http_pipe->set_hibernating(false);
+    if (pcallback.message_complete)
+    {
+      conn->first_request_ = false;
+      check_preface = false;
 
-          // call the joyent parser
-          bsp += http_parser_execute(&parser, &settings, &buf[bsp], bep - bsp);
+      // requirement of prompt send's is a one-time
+      // policy.  If we make it this far, then reset
+      // the io blocking time to something more generous
+      http_pipe->limit_io_block_time(15);
 
-          if (pcallback.message_complete)
-          {
-            // requirement of prompt send's is a one-time
-            // policy.  If we make it this far, then reset
-            // the io blocking time to something more generous
-            http_pipe->limit_io_block_time(15);
-
-            pipe_t body_pipe(http_pipe, buf, bsp, bep);
-
-            // did the headers indicate an upgrade?
-            // if so, handle that differently
-            if (parser.upgrade)
-            {
-              auto handler = m_upgrade_map_.find(pcallback.request.headers.get_header("upgrade").str());
-              if (handler != m_upgrade_map_.end())
-                handler->second->exec(body_pipe, pcallback.request);
-              else
-              {
+      pipe_t body_pipe(http_pipe, buf, bsp, bep, &conn->resp_buf_);
+      body_pipe.http_1_0 = pcallback.request.http_major == 1 && pcallback.request.http_minor == 0;
+      if (compression_)
+      {
+        body_pipe.compression = compression_.get();
+        body_pipe.request = &pcallback.request;
+        body_pipe.encoding = compression_->choose(pcallback.request.headers.get_header(http_headers::k_accept_encoding));
+      }
+      if (pcallback.request.is_chunked)
+        body_pipe.body = pipe_t::k_body_chunk_size;
+      else if (pcallback.body_length > 0)
+      {
+        body_pipe.body = pipe_t::k_body_length;
+        body_pipe.body_left = pcallback.body_length;
+      }
+
+      if (limiter_ && !limiter_->allow_request(src_addr))
+      {
+#if ANON_LOG_NET_TRAFFIC > 1
+        anon_log("http request from: " << *src_addr << " refused, over its rate limit");
+#endif
+        http_response response;
+        response.set_status_code("429 Too Many Requests");
+        response.add_header("content-type", "text/plain");
+        response.add_header("retry-after", "1");
+        response.add_header("connection", "close");
+        response << "too many requests\n";
+        body_pipe.respond(response);
+        conn->flush_responses();
+        return false;
+      }
+
+      // did the headers indicate an upgrade?
+      // if so, handle that differently
+      if (upgrade)
+      {
+        conn->flush_responses();
+        auto handler = m_upgrade_map_.find(pcallback.request.headers.get_header(http_headers::k_upgrade).str());
+        if (handler != m_upgrade_map_.end())
+          handler->second->exec(body_pipe, pcallback.request);
+        else
+        {
 #if ANON_LOG_NET_TRAFFIC > 1
-                anon_log("unknown http upgrade type: \"" << pcallback.request.headers.get_header("upgrade").str() << "\"");
+          anon_log("unknown http upgrade type: \"" << pcallback.request.headers.get_header(http_headers::k_upgrade).str() << "\"");
 #endif
-              }
+        }
 
-              // an upgrade always results in final transfer
-              // of the socket to the handler.  We never go
-              // back and look at things like keep_alive again
-              // here.  Once the handler returns (or if there
-              // is no handler) we close the socket.
-              return;
-            }
+        // an upgrade always results in final transfer
+        // of the socket to the handler.  We never go
+        // back and look at things like keep_alive again
+        // here.  Once the handler returns (or if there
+        // is no handler) we close the socket.
+        return false;
+      }
 
-            base_handler->exec(body_pipe, pcallback.request);
+      struct timespec start{};
+      if (access_log_)
+        start = cur_time();
+      try
+      {
+        body_holder_->exec(body_pipe, pcallback.request);
+        body_pipe.end_chunked();
+      }
+      catch (...)
+      {
+        if (access_log_)
+          log_access(body_pipe, pcallback.request, start);
 
-            keep_alive = http_should_keep_alive(&parser);
+        // the connection is about to end, but earlier
+        // pipelined requests still get their responses.
+        // A chunked response that was cut short is not
+        // finished, so the client can tell it is incomplete.
+        if (body_pipe.chunked)
+          conn->resp_buf_.resize(body_pipe.chunk_start);
+        conn->flush_responses();
+        throw;
+      }
+      if (access_log_)
+        log_access(body_pipe, pcallback.request, start);
+
+      keep_alive = should_keep_alive && !body_pipe.close_after;
+
+      // the next request starts after whatever the handler left
+      // unread of this one's body.  Without reading past that we
+      // would parse the body as if it were the next request.
+      if (keep_alive && !body_pipe.discard_body())
+        keep_alive = false;
 #if defined(ANON_FORCE_NO_KEEP_ALIVE)
-            keep_alive = false;
+      keep_alive = false;
 #endif
 #if defined(ANON_TOO_MANY_FIBERS)
-            keep_alive &= fiber::get_approximate_num_fibers() < ANON_TOO_MANY_FIBERS;
+      keep_alive &= fiber::get_approximate_num_fibers() < ANON_TOO_MANY_FIBERS;
 #endif
-            if (keep_alive)
-            {
-              http_parser_init(&parser, HTTP_REQUEST);
-              memmove(&buf[0], &buf[bsp], bep - bsp);
-              bep -= bsp;
-              bsp = 0;
-              pcallback.init();
-              http_pipe->set_hibernating(true);
-            }
-          }
-          else
-          {
+      if (keep_alive)
+      {
+        if (!fast_parser)
+          http_parser_init(&parser, HTTP_REQUEST);
+        memmove(&buf[0], &buf[bsp], bep - bsp);
+        bep -= bsp;
+        bsp = 0;
+        pcallback.init();
+        http_pipe->set_hibernating(true);
+
+        // nothing of the next request has arrived yet, so
+        // let go of this fiber while we wait for it.  Don't
+        // hold on to an unusually large response buffer while
+        // parked either.
+        if (park_idle_ && bep == 0 && conn->can_park())
+        {
+          conn->flush_responses();
+          if (conn->resp_buf_.capacity() > k_max_parked_resp_buf)
+            std::vector<char>().swap(conn->resp_buf_);
+          if (conn->fp_->park_read(conn, stack_size_))
+            return true;
+        }
+      }
+    }
+    else
+    {
 
-            if (bsp != bep)
-            {
+      if (bsp != bep)
+      {
 #if ANON_LOG_NET_TRAFFIC > 1
-              anon_log("invalid http received from: " << *src_addr << ", error: " << http_errno_description((enum http_errno)parser.http_errno));
+        anon_log("invalid http received from: " << *src_addr << ", error: " << http_errno_description((enum http_errno)parser.http_errno));
 #endif
-              return;
-            }
-            if (bsp == buf.size())
-            {
+        conn->flush_responses();
+        return false;
+      }
+    }
+  }
+  conn->flush_responses();
+  return false;
+}
+
+void http_server::serve_stream(stream *strm, ::pipe_t *conn_pipe, const http_request &request)
+{
+  pipe_t pipe(conn_pipe, strm);
+  if (compression_)
+  {
+    pipe.compression = compression_.get();
+    pipe.request = &request;
+    pipe.encoding = compression_->choose(request.headers.get_header(http_headers::k_accept_encoding));
+  }
+
+  if (limiter_ && !limiter_->allow_request(request.src_addr))
+  {
 #if ANON_LOG_NET_TRAFFIC > 1
-              anon_log("http GET from: " << *src_addr << " invalid headers - bigger than " << buf.size() << " bytes");
+    anon_log("http request from: " << *request.src_addr << " refused, over its rate limit");
 #endif
-              return;
-            }
-          }
-        }
-      },
-      listen_backlog, port_is_fd, stack_size);
+    http_response response;
+    response.set_status_code("429 Too Many Requests");
+    response.add_header("content-type", "text/plain");
+    response.add_header("retry-after", "1");
+    response << "too many requests\n";
+    pipe.respond(response);
+    return;
+  }
 
-  tcp_server_ = std::unique_ptr<tcp_server>(server);
-  body_holder_ = std::unique_ptr<body_handler>(base_handler);
+  struct timespec start{};
+  if (access_log_)
+    start = cur_time();
+  try
+  {
+    body_holder_->exec(pipe, request);
+    pipe.end_chunked();
+  }
+  catch (...)
+  {
+    if (access_log_)
+      log_access(pipe, request, start);
+    throw;
+  }
+  if (access_log_)
+    log_access(pipe, request, start);
+}
+
+void http_server::log_access(const pipe_t &pipe, const http_request &request, const struct timespec &start)
+{
+  auto elapsed = cur_time() - start;
+  access_log::record(request, pipe.resp_status, pipe.body_sent, elapsed.tv_sec * 1000000 + elapsed.tv_nsec / 1000);
 }
 
 size_t http_server::pipe_t::read(void *buff, size_t len)
+{
+  if (strm)
+    return strm->read_body(buff, len);
+
+  // a content-length body read this way is still counted, so
+  // that serve knows where the next request starts.  Reading
+  // past the body, or reading a chunked one undecoded, leaves
+  // that unknown, so then the connection is closed once the
+  // handler returns.
+  if (body == k_body_length)
+  {
+    auto n = read_raw(buff, std::min((uint64_t)len, body_left));
+    body_left -= n;
+    body_read += n;
+    if (body_left == 0)
+      body = k_body_done;
+    return n;
+  }
+  close_after = true;
+  return read_raw(buff, len);
+}
+
+size_t http_server::pipe_t::read_raw(void *buff, size_t len)
 {
   if (bsp != bep)
   {
@@ -285,45 +862,635 @@ size_t http_server::pipe_t::read(void *buff, size_t len)
     bsp += len;
     return len;
   }
+  // don't leave responses to earlier requests (or the
+  // chunk being built for this one) unsent while we
+  // wait for more of this one
+  if (resp_buf || chunked)
+  {
+    fiber_lock lock(mutex);
+    flush_out();
+  }
   return pipe->read(buff, len);
 }
 
+::pipe_t *http_server::pipe_t::detach(std::vector<char> &buffered)
+{
+  fiber_lock lock(mutex);
+  flush_out();
+  buffered.insert(buffered.end(), buf.begin() + bsp, buf.begin() + bep);
+  bsp = bep;
+  return pipe;
+}
+
+size_t http_server::pipe_t::read_body(void *buff, size_t len)
+{
+  if (strm)
+  {
+    if (body == k_body_done)
+      return 0;
+    auto n = strm->read_body(buff, len);
+    body_read += n;
+    if (body_read > max_body)
+      body_error(HTTP_STATUS_PAYLOAD_TOO_LARGE, "request body too large");
+    if (n == 0)
+      body = k_body_done;
+    return n;
+  }
+
+  auto out = (char *)buff;
+  while (len > 0)
+  {
+    switch (body)
+    {
+    case k_body_none:
+      // no content-length and not chunked means no body
+      body = k_body_done;
+      return 0;
+
+    case k_body_length:
+    {
+      if (body_read == 0 && body_left > max_body)
+        body_error(HTTP_STATUS_PAYLOAD_TOO_LARGE, "request body too large");
+      auto n = read_raw(out, std::min((uint64_t)len, body_left));
+      body_left -= n;
+      body_read += n;
+      if (body_left == 0)
+        body = k_body_done;
+      return n;
+    }
+
+    case k_body_chunk_size:
+    {
+      auto line_len = read_line("chunk size line too long in request body");
+      auto line = &buf[bsp];
+      auto end = line + line_len;
+      uint64_t size = 0;
+      auto p = line;
+      for (; p < end; p++)
+      {
+        int digit;
+        if (*p >= '0' && *p <= '9')
+          digit = *p - '0';
+        else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+          digit = (*p | 0x20) - 'a' + 10;
+        else
+          break;
+        if (size > (max_body >> 4))
+          body_error(HTTP_STATUS_PAYLOAD_TOO_LARGE, "request body too large");
+        size = (size << 4) | digit;
+      }
+      // anything after the size must be chunk extensions (ignored)
+      if (p == line || (p < end && *p != ';' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'))
+        body_error(HTTP_STATUS_BAD_REQUEST, "invalid chunk size in request body");
+      bsp += line_len;
+      if (body_read + size > max_body)
+        body_error(HTTP_STATUS_PAYLOAD_TOO_LARGE, "request body too large");
+      body = size == 0 ? k_body_trailer : k_body_chunk_data;
+      body_left = size == 0 ? (uint64_t)k_max_trailer : size;
+      break;
+    }
+
+    case k_body_chunk_data:
+    {
+      auto n = read_raw(out, std::min((uint64_t)len, body_left));
+      body_left -= n;
+      body_read += n;
+      if (body_left == 0)
+        body = k_body_chunk_end;
+      return n;
+    }
+
+    case k_body_chunk_end:
+    {
+      auto line_len = read_line("chunk data longer than its size in request body");
+      if (line_len > 2 || (line_len == 2 && buf[bsp] != '\r'))
+        body_error(HTTP_STATUS_BAD_REQUEST, "chunk data longer than its size in request body");
+      bsp += line_len;
+      body = k_body_chunk_size;
+      break;
+    }
+
+    case k_body_trailer:
+    {
+      // trailer fields are read and dropped, the body
+      // ends with the first empty line.  body_left is
+      // what remains of the trailer size limit.
+      auto line_len = read_line("request body trailer too large");
+      if (line_len > body_left)
+        body_error(HTTP_STATUS_BAD_REQUEST, "request body trailer too large");
+      body_left -= line_len;
+      auto empty = line_len == 1 || (line_len == 2 && buf[bsp] == '\r');
+      bsp += line_len;
+      if (empty)
+      {
+        body = k_body_done;
+        return 0;
+      }
+      break;
+    }
+
+    case k_body_done:
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// make sure buf[bsp] starts a complete, '\n' terminated line,
+// reading more from the pipe if needed, and return its length
+// (including the '\n').  Lines longer than k_max_chunk_line
+// fail with 'too_long'.
+size_t http_server::pipe_t::read_line(const char *too_long)
+{
+  size_t scanned = 0;
+  while (true)
+  {
+    auto nl = (const char *)memchr(buf.data() + bsp + scanned, '\n', bep - bsp - scanned);
+    if (nl)
+      return nl - (buf.data() + bsp) + 1;
+    scanned = bep - bsp;
+    if (scanned >= k_max_chunk_line)
+      body_error(HTTP_STATUS_BAD_REQUEST, too_long);
+
+    if (bsp == bep)
+      bsp = bep = 0;
+    else if (bep == buf.size())
+    {
+      memmove(&buf[0], &buf[bsp], bep - bsp);
+      bep -= bsp;
+      bsp = 0;
+    }
+    if (resp_buf || chunked)
+    {
+      fiber_lock lock(mutex);
+      flush_out();
+    }
+    bep += pipe->read(&buf[bep], buf.size() - bep);
+  }
+}
+
+// read and drop whatever the handler left unread of the request
+// body.  false if that is more than k_max_discarded_body bytes, or
+// the body is malformed, in which case the connection can't be used
+// for another request.
+bool http_server::pipe_t::discard_body()
+{
+  if (body == k_body_length && body_left > k_max_discarded_body)
+    return false;
+  char scratch[4096];
+  size_t discarded = 0;
+  try
+  {
+    while (body != k_body_done)
+    {
+      auto n = read_body(scratch, sizeof(scratch));
+      discarded += n;
+      if (discarded > k_max_discarded_body || (n == 0 && body != k_body_done))
+        return false;
+    }
+  }
+  catch (const http_body_error &)
+  {
+    return false;
+  }
+  catch (const fiber_io_error &)
+  {
+    // the client stopped sending, or went away
+    return false;
+  }
+  return true;
+}
+
+void http_server::pipe_t::body_error(int status, const char *msg)
+{
+  // where the body ends is now unknown, so this
+  // connection can't be used for another request
+  close_after = true;
+  body = k_body_done;
+  throw http_body_error(status, msg);
+}
+
+bool http_request::if_none_match(const string_len &etag) const
+{
+  if (!headers.contains_header("if-none-match"))
+    return false;
+  auto if_none_match = headers.get_header("if-none-match");
+  auto tag = strip_weak(etag.ptr(), etag.ptr() + etag.len());
+  auto p = if_none_match.ptr();
+  auto end = p + if_none_match.len();
+  while (p < end)
+  {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      ++p;
+    auto e = p;
+    while (e < end && *e != ',' && *e != ' ' && *e != '\t')
+      ++e;
+    if (e - p == 1 && *p == '*')
+      return true;
+    if (etag_matches(strip_weak(p, e), tag))
+      return true;
+    p = e;
+  }
+  return false;
+}
+
+void http_server::pipe_t::write_pending(std::vector<char> &out)
+{
+  if (!out.empty())
+  {
+    pipe->write(&out[0], out.size());
+    out.clear();
+  }
+}
+
+void http_server::pipe_t::append_head(std::vector<char> &out, const http_response &response, size_t body_len,
+                                      bool vary, const char *content_encoding)
+{
+  auto append = [&out](const char *str, size_t len) { out.insert(out.end(), str, str + len); };
+
+  auto &status = response.get_status_code();
+  append("HTTP/1.1 ", 9);
+  append(status.c_str(), status.size());
+  append("\r\n", 2);
+  append(response.header_data(), response.header_size());
+  if (!response.has_header("date"))
+  {
+    size_t len;
+    auto date = date_header(len);
+    append(date, len);
+  }
+
+  if (chunked)
+  {
+    if (http_1_0)
+      append("connection: close\r\n", 19);
+    else
+      append("transfer-encoding: chunked\r\n", 28);
+  }
+  else
+  {
+    // 1xx, 204 and 304 responses can't have a body, and so
+    // must not claim one.  Everything else says how long its
+    // body is so the connection can be reused.
+    auto code = atoi(status.c_str());
+    if (body_len > 0 || (code >= 200 && code != 204 && code != 304))
+    {
+      char cl[48];
+      append(cl, snprintf(cl, sizeof(cl), "content-length: %zu\r\n", body_len));
+    }
+  }
+  if (vary)
+    append("vary: accept-encoding\r\n", 23);
+  if (content_encoding)
+  {
+    append("content-encoding: ", 18);
+    append(content_encoding, strlen(content_encoding));
+    append("\r\n", 2);
+  }
+  append("\r\n", 2);
+}
+
+namespace
+{
+
+// see http_server::set_compression
+bool may_compress(const http_response &response)
+{
+  auto &status = response.get_status_code();
+  if (status.compare(0, 3, "200") && status.compare(0, 3, "203"))
+    return false;
+  if (response.has_header("content-encoding"))
+    return false;
+  auto cc = response.get_header("cache-control");
+  if (cc.len() && memmem(cc.ptr(), cc.len(), "no-transform", 12))
+    return false;
+  return http_compression::compressible_type(response.get_header("content-type"));
+}
+
+} // namespace
+
 void http_server::pipe_t::respond(const http_response &response)
 {
-  std::ostringstream rp;
-  rp << "HTTP/1.1 " << response.get_status_code() << "\r\n";
-  for (auto it = response.get_headers().begin(); it != response.get_headers().end(); it++)
-    rp << it->first << ": " << it->second << "\r\n";
-  for (auto it = response.get_cookies().begin(); it != response.get_cookies().end(); it++)
-  {
-    rp << "Set-Cookie: " << it->name_ << "=";
-    if (!it->delete_it_)
-      rp << it->value_;
-    if (it->path_.size())
-      rp << "; Path=" << it->path_;
-    if (it->domain_.size())
-      rp << "; Domain=" << it->domain_;
-    if (it->delete_it_)
-      rp << "; Max-Age=0";
-    else if (it->max_age_ > 0)
-      rp << "; Max-Age=" << it->max_age_;
-    else if (it->max_age_ < 0)
-      rp << "; expires=Thu, 01 Jan 1970 00:00:00 GMT";
-    if (it->same_site_.size())
-      rp << "; SameSite=" << it->same_site_;
-    if (it->secure_ || it->same_site_ == "None")
-      rp << "; Secure";
-    if (it->http_only_)
-      rp << "; HttpOnly";
-    rp << "\r\n";
-  }
-  if (response.get_body().length() > 0)
-    rp << "content-length: " << response.get_body().length() << "\r\n";
-  rp << "\r\n";
-  if (response.get_body().length())
-    rp << response.get_body();
+  if (chunked)
+    anon_throw(std::runtime_error, "http_server::pipe_t::respond called after start_chunked");
+
+  auto body = response.body_data();
+  auto body_len = response.body_size();
+  std::shared_ptr<const std::string> compressed;
+  const char *content_encoding = 0;
+  const http_response *head = &response;
+  std::unique_ptr<http_response> encoded_head;
+  bool vary = compression && may_compress(response);
+  if (vary && encoding != http_compression::k_identity && body_len >= compression->min_size())
+  {
+    auto etag = response.get_header("etag");
+    std::string resource;
+    if (etag.len() > 0 && request)
+    {
+      auto host = request->headers.get_header(http_headers::k_host);
+      resource.assign(host.ptr(), host.len());
+      resource.append(request->url_str);
+    }
+    compressed = compression->compress(encoding, string_len(resource.c_str(), resource.size()), etag, body, body_len);
+    if (compressed)
+    {
+      body = compressed->data();
+      body_len = compressed->size();
+      content_encoding = http_compression::name(encoding);
+      if (etag.len() > 0)
+      {
+        encoded_head.reset(new http_response);
+        encoded_head->copy_head(response);
+        encoded_head->add_header("etag", encoded_etag(etag, content_encoding));
+        head = encoded_head.get();
+      }
+    }
+  }
+
+  resp_status = atoi(response.get_status_code().c_str());
+  body_sent += body_len;
+  if (strm)
+  {
+    strm->send_head(*head, body_len, vary, content_encoding, body_len == 0);
+    if (body_len > 0)
+      strm->send_body(body, body_len, true);
+    return;
+  }
+
+  // resp_buf may already hold the responses to
+  // earlier requests that were pipelined with this one
+  std::vector<char> local_buf;
+  auto &out = resp_buf ? *resp_buf : local_buf;
+  append_head(out, *head, body_len, vary, content_encoding);
+
+  // big bodies are written straight from the response rather
+  // than copied in after the headers
+  if (body_len <= k_max_coalesced_body)
+  {
+    out.insert(out.end(), body, body + body_len);
+
+    // if more of the client's data is already buffered it is most
+    // likely the next pipelined request, so hold this response and
+    // send it along with the next one(s)
+    if (resp_buf && bsp != bep && out.size() < k_max_coalesced_body)
+      return;
+    write_pending(out);
+  }
+  else
+  {
+    write_pending(out);
+    pipe->write(body, body_len);
+  }
+}
+
+void http_server::pipe_t::respond_file(const http_response &response, int fd, off_t offset, size_t len,
+                                       bool head_only)
+{
+  if (chunked)
+    anon_throw(std::runtime_error, "http_server::pipe_t::respond_file called after start_chunked");
+
+  resp_status = atoi(response.get_status_code().c_str());
+  if (!head_only)
+    body_sent += len;
+
+  if (strm)
+  {
+    strm->send_head(response, len, false, 0, head_only || len == 0);
+    if (head_only || len == 0)
+      return;
+    std::vector<char> chunk(std::min(len, (size_t)k_max_coalesced_body));
+    while (len > 0)
+    {
+      auto bytes_read = ::pread(fd, &chunk[0], std::min(len, chunk.size()), offset);
+      if (bytes_read <= 0)
+        anon_throw(fiber_io_error, "pread of file body failed, err: " << (bytes_read == 0 ? EIO : errno));
+      offset += bytes_read;
+      len -= bytes_read;
+      strm->send_body(&chunk[0], bytes_read, len == 0);
+    }
+    return;
+  }
+
+  std::vector<char> local_buf;
+  auto &out = resp_buf ? *resp_buf : local_buf;
+  auto head_start = out.size();
+  append_head(out, response, len);
+  if (head_only)
+  {
+    if (resp_buf && bsp != bep && out.size() < k_max_coalesced_body)
+      return;
+    write_pending(out);
+    return;
+  }
+
+  if (len <= k_max_copied_file)
+  {
+    auto body_start = out.size();
+    out.resize(body_start + len);
+    size_t copied = 0;
+    while (copied < len)
+    {
+      auto bytes_read = ::pread(fd, &out[body_start + copied], len - copied, offset + copied);
+      if (bytes_read <= 0)
+      {
+        // nothing of this response has been sent yet, so drop it
+        // all, leaving whatever was queued for earlier requests
+        auto err = bytes_read == 0 ? EIO : errno;
+        out.resize(head_start);
+        anon_throw(fiber_io_error, "pread of file body failed, err: " << err);
+      }
+      copied += bytes_read;
+    }
+    if (resp_buf && bsp != bep && out.size() < k_max_coalesced_body)
+      return;
+    write_pending(out);
+    return;
+  }
+
+  write_pending(out);
+  auto res = pipe->try_sendfile(fd, offset, len);
+  if (!res)
+    anon_throw(fiber_io_error, "sending file body failed after " << res.bytes << " of " << len << " bytes, err: " << res.err);
+}
+
+// chunks are staged in out_buf(), with the chunk's data starting
+// k_chunk_header_room bytes after chunk_start.  Anything in front of
+// chunk_start (the headers, and any responses held for pipelining)
+// goes out in the same write as the first chunk.
+
+void http_server::pipe_t::start_chunked(const http_response &response)
+{
+  if (chunked)
+    anon_throw(std::runtime_error, "http_server::pipe_t::start_chunked called twice");
+  resp_status = atoi(response.get_status_code().c_str());
+  if (strm)
+  {
+    chunked = true;
+    strm->send_head(response, -1, false, 0, false);
+    if (response.body_size() > 0)
+      strm->send_body(response.body_data(), response.body_size(), false);
+    return;
+  }
+  fiber_lock lock(mutex);
+  chunked = true;
+  close_after = http_1_0;
+  auto &out = out_buf();
+  append_head(out, response, response.body_size());
+  chunk_start = out.size();
+  out.resize(chunk_start + k_chunk_header_room);
+  lock.unlock();
+  write_chunk(response.body_data(), response.body_size());
+}
 
-  auto buff = rp.str();
-  auto len = buff.size();
-  pipe->write(buff.c_str(), len);
+void http_server::pipe_t::write_chunk(const void *buff, size_t len)
+{
+  fiber_lock lock(mutex);
+  if (!chunked)
+    anon_throw(std::runtime_error, "http_server::pipe_t::write_chunk called without start_chunked");
+  body_sent += len;
+  if (strm)
+  {
+    lock.unlock();
+    strm->send_body(buff, len, false);
+    return;
+  }
+  auto &out = out_buf();
+  auto p = (const char *)buff;
+  while (len > 0)
+  {
+    auto staged = out.size() - chunk_start - k_chunk_header_room;
+    auto n = std::min(len, (size_t)k_chunk_size - staged);
+    out.insert(out.end(), p, p + n);
+    p += n;
+    len -= n;
+    if (staged + n == k_chunk_size)
+      send_chunk(out, true);
+  }
+}
+
+void http_server::pipe_t::end_chunked()
+{
+  fiber_lock lock(mutex);
+  if (!chunked)
+    return;
+  if (strm)
+  {
+    chunked = false;
+    lock.unlock();
+    strm->send_body(0, 0, true);
+    return;
+  }
+  auto &out = out_buf();
+  send_chunk(out, false);
+  chunked = false;
+  if (!http_1_0)
+  {
+    const char last_chunk[] = "0\r\n\r\n";
+    out.insert(out.end(), last_chunk, last_chunk + 5);
+  }
+
+  // same as respond, the end of this response can wait
+  // for the response to a pipelined request that follows it
+  if (resp_buf && bsp != bep && out.size() < k_max_coalesced_body)
+    return;
+  write_pending(out);
+}
+
+// fill in the staged chunk's length and frame it.  If 'more' it is
+// then written and a new chunk is staged, otherwise it is left in 'out'
+void http_server::pipe_t::send_chunk(std::vector<char> &out, bool more)
+{
+  auto data_len = out.size() - chunk_start - k_chunk_header_room;
+  if (http_1_0)
+    out.erase(out.begin() + chunk_start, out.begin() + chunk_start + k_chunk_header_room);
+  else if (data_len == 0)
+    out.resize(chunk_start);
+  else
+  {
+    char hdr[k_chunk_header_room + 1];
+    snprintf(hdr, sizeof(hdr), "%08zx\r\n", data_len);
+    memcpy(&out[chunk_start], hdr, k_chunk_header_room);
+    out.insert(out.end(), "\r\n", "\r\n" + 2);
+  }
+  if (more)
+  {
+    write_pending(out);
+    chunk_start = 0;
+    out.resize(k_chunk_header_room);
+  }
+}
+
+void http_server::pipe_t::flush_out()
+{
+  if (chunked)
+    send_chunk(out_buf(), true);
+  else if (resp_buf)
+    write_pending(*resp_buf);
+}
+
+size_t http_response::find_header(const char *field, size_t len) const
+{
+  auto hdrs = headers_.data();
+  auto end = hdrs + headers_.size();
+  auto line = hdrs;
+  while (line < end)
+  {
+    if (line + len < end && line[len] == ':' && !strncasecmp(line, field, len))
+      return line - hdrs;
+    line = (const char *)memchr(line, '\n', end - line) + 1;
+  }
+  return std::string::npos;
+}
+
+string_len http_response::get_header(const char *field) const
+{
+  auto len = strlen(field);
+  auto off = find_header(field, len);
+  if (off == std::string::npos)
+    return string_len();
+  auto p = headers_.data() + off + len + 1;
+  auto eol = (const char *)memchr(p, '\r', headers_.data() + headers_.size() - p);
+  while (p < eol && *p == ' ')
+    ++p;
+  return string_len(p, eol - p);
+}
+
+void http_response::add_header(const std::string &field, const std::string &value)
+{
+  auto off = find_header(field.c_str(), field.size());
+  if (off != std::string::npos)
+  {
+    auto line = headers_.data() + off;
+    auto eol = (const char *)memchr(line, '\n', headers_.size() - off) + 1;
+    headers_.erase(off, eol - line);
+  }
+  headers_.append(field);
+  headers_.append(": ", 2);
+  headers_.append(value);
+  headers_.append("\r\n", 2);
+}
+
+void http_response::add_cookie(const browser_cookie &cookie)
+{
+  std::ostream rp(&headers_);
+  rp << "Set-Cookie: " << cookie.name_ << "=";
+  if (!cookie.delete_it_)
+    rp << cookie.value_;
+  if (cookie.path_.size())
+    rp << "; Path=" << cookie.path_;
+  if (cookie.domain_.size())
+    rp << "; Domain=" << cookie.domain_;
+  if (cookie.delete_it_)
+    rp << "; Max-Age=0";
+  else if (cookie.max_age_ > 0)
+    rp << "; Max-Age=" << cookie.max_age_;
+  else if (cookie.max_age_ < 0)
+    rp << "; expires=Thu, 01 Jan 1970 00:00:00 GMT";
+  if (cookie.same_site_.size())
+    rp << "; SameSite=" << cookie.same_site_;
+  if (cookie.secure_ || cookie.same_site_ == "None")
+    rp << "; Secure";
+  if (cookie.http_only_)
+    rp << "; HttpOnly";
+  rp << "\r\n";
 }
@@ -27,29 +27,171 @@
 #include "tcp_utils.h"
 #include "tls_context.h"
 #include "string_len.h"
+#include "http_compression.h"
 #include <list>
+#include <vector>
+#include <streambuf>
+#include <ostream>
 
 struct http_headers
 {
+  // headers that are recognized while they are parsed, and
+  // so can be found without searching.  get_header/contains_header
+  // given the (lower case) name of one of these uses the fast path
+  // automatically, or you can pass the enum value directly.
+  enum known_header
+  {
+    k_host,
+    k_content_length,
+    k_cookie,
+    k_upgrade,
+    k_accept_encoding,
+    k_origin,
+    k_authorization,
+    k_num_known_headers,
+    k_other = k_num_known_headers
+  };
+
+  typedef std::pair<string_len, string_len> field_value;
+
+  // the <field, value> pairs in the order they were received.  The
+  // first k_inline_capacity of them are stored in the object itself,
+  // so the headers of a typical request cost no allocations.
+  class table
+  {
+  public:
+    enum
+    {
+      k_inline_capacity = 16
+    };
+
+    const field_value *begin() const { return size_ > k_inline_capacity ? spill_.data() : inline_; }
+    const field_value *end() const { return begin() + size_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    void push_back(const field_value &fv)
+    {
+      if (size_ < k_inline_capacity)
+        inline_[size_] = fv;
+      else
+      {
+        if (size_ == k_inline_capacity)
+          spill_.assign(inline_, inline_ + k_inline_capacity);
+        spill_.push_back(fv);
+      }
+      ++size_;
+    }
+
+    void clear()
+    {
+      size_ = 0;
+      spill_.clear();
+    }
+
+  private:
+    size_t size_{0};
+    field_value inline_[k_inline_capacity];
+    std::vector<field_value> spill_;
+  };
+
+  static known_header classify(const char *field, size_t len)
+  {
+    switch (len)
+    {
+    case 4:
+      if (!memcmp(field, "host", 4))
+        return k_host;
+      break;
+    case 6:
+      if (!memcmp(field, "cookie", 6))
+        return k_cookie;
+      if (!memcmp(field, "origin", 6))
+        return k_origin;
+      break;
+    case 7:
+      if (!memcmp(field, "upgrade", 7))
+        return k_upgrade;
+      break;
+    case 13:
+      if (!memcmp(field, "authorization", 13))
+        return k_authorization;
+      break;
+    case 14:
+      if (!memcmp(field, "content-length", 14))
+        return k_content_length;
+      break;
+    case 15:
+      if (!memcmp(field, "accept-encoding", 15))
+        return k_accept_encoding;
+      break;
+    }
+    return k_other;
+  }
+
+  // add a header as it comes off the wire.  'field' is converted
+  // to lower case in place, so it must point into a writable buffer
+  // (the one the parser is reading from).
+  void add(char *field, size_t field_len, const char *value, size_t value_len)
+  {
+    for (size_t i = 0; i < field_len; i++)
+      if (field[i] >= 'A' && field[i] <= 'Z')
+        field[i] += 'a' - 'A';
+    auto k = classify(field, field_len);
+    // like the multimap this replaced, lookups find the first
+    // of any duplicated headers
+    if (k != k_other && known_[k] == 0)
+      known_[k] = headers.size() + 1;
+    headers.push_back(std::make_pair(string_len(field, field_len), string_len(value, value_len)));
+  }
+
+  string_len get_header(known_header k) const
+  {
+    if (known_[k] != 0)
+      return headers.begin()[known_[k] - 1].second;
+    return string_len("");
+  }
+
+  bool contains_header(known_header k) const
+  {
+    return known_[k] != 0;
+  }
+
   string_len get_header(const char *field) const
   {
-    auto it = headers.find(string_len(field));
-    if (it != headers.end())
-      return it->second;
+    auto fv = find(field);
+    if (fv)
+      return fv->second;
     return string_len("");
   }
 
   bool contains_header(const char *field) const
   {
-    return headers.find(string_len(field)) != headers.end();
+    return find(field) != 0;
   }
 
   void init()
   {
     headers.clear();
+    memset(&known_, 0, sizeof(known_));
   }
 
-  std::multimap<string_len, string_len> headers;
+  table headers;
+
+private:
+  const field_value *find(const char *field) const
+  {
+    auto len = strlen(field);
+    auto k = classify(field, len);
+    if (k != k_other)
+      return known_[k] != 0 ? &headers.begin()[known_[k] - 1] : 0;
+    for (auto &fv : headers)
+      if (fv.first.len() == len && !memcmp(fv.first.ptr(), field, len))
+        return &fv;
+    return 0;
+  }
+
+  uint32_t known_[k_num_known_headers] = {};
 };
 
 // method, headers, url, etc... (not body)
@@ -59,7 +201,8 @@ struct http_request
       : src_addr(src_addr),
         src_addr_len(src_addr_len),
         has_content_length(false),
-        content_length(0)
+        content_length(0),
+        is_chunked(false)
   {
     memset(&p_url, 0, sizeof(p_url)); // joyent data structure
   }
@@ -71,6 +214,10 @@ struct http_request
   bool has_content_length;
   int content_length;
 
+  // body sent with "transfer-encoding: chunked".  Use
+  // http_server::pipe_t::read_body to read it decoded.
+  bool is_chunked;
+
   std::string get_url_field(enum http_parser_url_fields f) const
   {
     if (p_url.field_set & (1 << f))
@@ -144,10 +291,16 @@ struct http_request
     }
   }
 
+  // true if the request has an if-none-match header listing 'etag'
+  // (or "*").  This is the weak comparison, where W/"x" and "x" are
+  // the same etag.  The etags respond gives compressed bodies ("x-gzip",
+  // etc.) also match.
+  bool if_none_match(const string_len &etag) const;
+
   std::string get_cookie_val(const char *name) const
   {
     auto slen = strlen(name);
-    auto cs = headers.get_header("cookie");
+    auto cs = headers.get_header(http_headers::k_cookie);
     auto ptr = cs.ptr();
     auto end = ptr + cs.len();
     while (ptr < end)
@@ -246,64 +399,190 @@ struct browser_cookie
   bool delete_it_;
 };
 
+// a std::streambuf that writes into inline_size bytes held in the
+// object itself, and only moves to the heap once those fill up.
+// http_response uses these so that small responses don't allocate.
+template <size_t inline_size>
+class inline_streambuf : public std::streambuf
+{
+public:
+  inline_streambuf()
+  {
+    setp(inline_, inline_ + inline_size);
+  }
+
+  inline_streambuf(const inline_streambuf &) = delete;
+  inline_streambuf &operator=(const inline_streambuf &) = delete;
+
+  const char *data() const { return pbase(); }
+  size_t size() const { return pptr() - pbase(); }
+
+  void append(const char *str, size_t len) { xsputn(str, len); }
+  void append(const std::string &str) { xsputn(str.data(), str.size()); }
+
+  // room for at least 'len' more bytes at the end, to be written
+  // directly.  commit(n) then adds the first n of them.
+  char *reserve(size_t len)
+  {
+    if ((size_t)(epptr() - pptr()) < len)
+      grow(len);
+    return pptr();
+  }
+  void commit(size_t len) { pbump((int)len); }
+
+  // remove 'len' bytes starting at 'off'
+  void erase(size_t off, size_t len)
+  {
+    auto p = pbase() + off;
+    memmove(p, p + len, size() - off - len);
+    pbump(-(int)len);
+  }
+
+protected:
+  int_type overflow(int_type ch) override
+  {
+    if (traits_type::eq_int_type(ch, traits_type::eof()))
+      return traits_type::not_eof(ch);
+    grow(1);
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+    return ch;
+  }
+
+  std::streamsize xsputn(const char *str, std::streamsize len) override
+  {
+    if (epptr() - pptr() < len)
+      grow(len);
+    memcpy(pptr(), str, len);
+    pbump((int)len);
+    return len;
+  }
+
+private:
+  void grow(size_t len)
+  {
+    auto sz = size();
+    auto cap = std::max((size_t)(epptr() - pbase()) * 2, sz + len);
+    if (pbase() == inline_)
+    {
+      heap_.resize(cap);
+      memcpy(&heap_[0], inline_, sz);
+    }
+    else
+      heap_.resize(cap);
+    setp(&heap_[0], &heap_[0] + cap);
+    pbump((int)sz);
+  }
+
+  char inline_[inline_size];
+  std::vector<char> heap_;
+};
+
 class http_response
 {
 public:
   http_response(const std::string &status_code = "200 OK")
-      : status_code_(status_code)
+      : status_code_(status_code),
+        body_(&body_buf_)
   {
   }
 
   void set_status_code(const std::string &code) { status_code_ = code; }
   const std::string &get_status_code() const { return status_code_; }
 
-  void add_header(const std::string &field, const std::string &value) { headers_[field] = value; }
-  const std::map<std::string, std::string> &get_headers() const { return headers_; }
+  // replaces any header previously added with the same
+  // (case insensitive) field name
+  void add_header(const std::string &field, const std::string &value);
+  bool has_header(const char *field) const { return find_header(field, strlen(field)) != std::string::npos; }
 
-  const std::string get_body() const { return ostr_.str(); }
+  // value of the header added with (case insensitive) name
+  // 'field', empty if there isn't one
+  string_len get_header(const char *field) const;
 
-  void add_cookie(const browser_cookie &cookie) { cookies_.push_back(cookie); }
+  void add_cookie(const browser_cookie &cookie);
 
-  const std::list<browser_cookie> &get_cookies() const { return cookies_; }
+  // replace the status code and headers (but not the body)
+  // with those of 'other'
+  void copy_head(const http_response &other)
+  {
+    status_code_ = other.status_code_;
+    headers_.erase(0, headers_.size());
+    headers_.append(other.header_data(), other.header_size());
+  }
+
+  // the headers and Set-Cookie's, already formatted as
+  // "field: value\r\n" lines, in the order they were added
+  const char *header_data() const { return headers_.data(); }
+  size_t header_size() const { return headers_.size(); }
+
+  const char *body_data() const { return body_buf_.data(); }
+  size_t body_size() const { return body_buf_.size(); }
+
+  // for writing the body directly, see inline_streambuf::reserve
+  char *body_reserve(size_t len) { return body_buf_.reserve(len); }
+  void body_commit(size_t len) { body_buf_.commit(len); }
+  std::string get_body() const { return std::string(body_data(), body_size()); }
 
   template <typename T>
   http_response &operator<<(const T &t)
   {
-    ostr_ << t;
+    body_ << t;
     return *this;
   }
 
   http_response &operator<<(const sockaddr &sa)
   {
-    ostr_ << sa;
+    body_ << sa;
     return *this;
   }
 
   http_response &operator<<(const string_len &s)
   {
-    ostr_ << s;
+    body_buf_.append(s.ptr(), s.len());
     return *this;
   }
 
   http_response &operator<<(const std::vector<char> &v)
   {
-    ostr_.write(&v[0], v.size());
+    body_buf_.append(v.data(), v.size());
     return *this;
   }
 
   #if defined(ANON_LOG_KEEP_RECENT)
   http_response &operator<<(const recent_logs &r)
   {
-    ostr_ << r;
+    body_ << r;
     return *this;
   }
   #endif
 
 private:
+  size_t find_header(const char *field, size_t len) const;
+
+  enum
+  {
+    k_inline_header_size = 512,
+    k_inline_body_size = 1024
+  };
+
   std::string status_code_;
-  std::map<std::string, std::string> headers_;
-  std::list<browser_cookie> cookies_;
-  std::ostringstream ostr_;
+  inline_streambuf<k_inline_header_size> headers_;
+  inline_streambuf<k_inline_body_size> body_buf_;
+  std::ostream body_;
+};
+
+// thrown by http_server::pipe_t::read_body when the request body
+// is malformed or bigger than allowed.  'status' is the http status
+// code that describes the problem.
+struct http_body_error : public std::runtime_error
+{
+  http_body_error(int status, const std::string &what)
+      : std::runtime_error(what),
+        status(status)
+  {
+  }
+
+  int status;
 };
 
 class http_server
@@ -319,7 +598,7 @@ class http_server
     When this is called, 'request' will contain all of headers, the HTTP
     method, the client address, etc...  'pipe' will be positioned to the
     first byte of the body of the message if there is one.  So calling
-    pipe.read() will begin reading the body.  A common behavior of an Fn
+    pipe.read_body() will begin reading the body.  A common behavior of an Fn
     function is to construct an http response of some kind and write it
     back to the client.  The simplest way to do this is to declare an
     http_response object, set it the way you want, and then call
@@ -348,9 +627,10 @@ class http_server
   // of this http_server
   template <typename Fn>
   http_server(int tcp_port, Fn f, int listen_backlog = tcp_server::k_default_backlog,
-              tls_context *tls_ctx = 0, bool port_is_fd = false, size_t stack_size = fiber::k_default_stack_size)
+              tls_context *tls_ctx = 0, bool port_is_fd = false, size_t stack_size = fiber::k_default_stack_size,
+              tcp_server::listen_mode mode = tcp_server::k_single_listener)
   {
-    start(tcp_port, f, listen_backlog, tls_ctx, port_is_fd, stack_size);
+    start(tcp_port, f, listen_backlog, tls_ctx, port_is_fd, stack_size, mode);
   }
 
   // add the given 'f' as an upgrade handler, identified by 'name'.
@@ -369,6 +649,117 @@ class http_server
     m_upgrade_map_[name] = std::unique_ptr<body_handler>(new bod_hand<Fn>(f));
   }
 
+  // add the given 'f' as the handler for connections that use
+  // 'protocol' from the start instead of HTTP/1.x.  For tls connections
+  // that is when it is the protocol chosen by ALPN (start adds the
+  // names of these handlers, followed by "http/1.1", to tls_ctx's
+  // alpn protocols).  An "h2" handler is also used for cleartext
+  // connections that start with the HTTP/2 connection preface - that
+  // is, whose clients know in advance that the server speaks HTTP/2.
+  // 'f' is called the same way as any other handler, with a request
+  // that has only its src_addr set (and http_major set to 2 for "h2").
+  // pipe.read returns the connection's data from its first byte, and
+  // pipe.detach takes over the connection.  Must be called before start.
+  template <typename Fn>
+  void add_protocol_handler(const char *protocol, Fn f)
+  {
+#if defined(ANON_RUNTIME_CHECKS)
+    if (tcp_server_)
+      do_error("add_protocol_handler called after start");
+#endif
+    m_protocol_map_[protocol] = std::unique_ptr<body_handler>(new bod_hand<Fn>(f));
+  }
+
+  // when 'park' is true a keep-alive connection that is waiting for
+  // its next request does not keep a fiber blocked in read.  Instead it
+  // is parked (see fiber_pipe::park_read), costing only its socket, its
+  // tls state if any, and a small heap object, and a new fiber picks it
+  // back up when the next request arrives.  Like add_upgrade_handler,
+  // this must be called before start.
+  void park_idle_connections(bool park)
+  {
+    park_idle_ = park;
+  }
+
+  // when 'log' is true each request is recorded with access_log::record
+  // once its handler returns, giving the status and body size of the
+  // response it sent and how long the handler took.  Nothing is
+  // written unless access_log::start has been called too.
+  void set_access_log(bool log)
+  {
+    access_log_ = log;
+  }
+
+  enum
+  {
+    k_read_buf_size = 8 * 1024,
+    k_default_max_header_size = 64 * 1024
+  };
+
+  // connections read requests into buffers borrowed from a per-thread
+  // pool, and only hold one while a request is in progress - a
+  // connection waiting for its next request gives its buffer back.
+  // Buffers start at k_read_buf_size bytes and are doubled for requests
+  // whose headers don't fit, up to 'max_header_size' (rounded up to the
+  // next doubling).  Requests with bigger headers get a "431 Request Header Fields Too Large" reply,
+  // after which the connection is closed.  Must be called before start.
+  void set_max_header_size(size_t max_header_size)
+  {
+    max_header_size_ = max_header_size;
+  }
+
+  struct read_buffer_stats
+  {
+    uint64_t borrowed;     // times a connection took a buffer
+    uint64_t reused;       // ...that came from a pool rather than the heap
+    uint64_t grown;        // times one was swapped for a bigger one
+    uint64_t too_big;      // requests refused for the size of their headers
+    int64_t in_use;        // buffers held by connections right now
+    int64_t pooled;        // buffers in the pools, across all threads
+    int64_t pooled_bytes;
+  };
+
+  // the read buffer pool's numbers, for all http_servers in the process
+  static read_buffer_stats get_read_buffer_stats();
+
+  // check each new connection, and each request, against 'limiter'.
+  // Connections that are over the limit are closed before a fiber is
+  // created for them (see tcp_server::set_rate_limiter), and requests
+  // get a "429 Too Many Requests" reply, after which the connection
+  // is closed.  Must be called before start.
+  void set_rate_limiter(const std::shared_ptr<ip_rate_limiter> &limiter)
+  {
+    limiter_ = limiter;
+  }
+
+  enum parser_engine
+  {
+    // joyent's http_parser, driven through its callbacks
+    k_joyent_parser,
+
+    // http_request_parser, which parses the request line and
+    // headers in one pass once they have all arrived
+    k_fast_parser
+  };
+
+  // choose the code that parses requests.  Both produce the same
+  // http_request.  Must be called before start.
+  void set_parser_engine(parser_engine engine)
+  {
+    parser_engine_ = engine;
+  }
+
+  // compress response bodies for clients that accept it, see
+  // http_compression.h.  Only whole responses sent with respond are
+  // compressed, and only when they don't already have a content-encoding,
+  // have a status of 200 or 203, a content-type that compresses well,
+  // no "cache-control: no-transform", and a body of at least
+  // compression->min_size() bytes.  Must be called before start.
+  void set_compression(const std::shared_ptr<http_compression> &compression)
+  {
+    compression_ = compression;
+  }
+
   // used when you have constructed the http_server with the default ctor
   // and now want to start it running (presumably because you wanted to call
   // add_upgrade_handler prior to it starting)
@@ -376,50 +767,270 @@ class http_server
   // of this http_server
   template <typename Fn>
   void start(int tcp_port, Fn f, int listen_backlog = tcp_server::k_default_backlog,
-             tls_context *tls_ctx = 0, bool port_is_fd = false, size_t stack_size = fiber::k_default_stack_size)
+             tls_context *tls_ctx = 0, bool port_is_fd = false, size_t stack_size = fiber::k_default_stack_size,
+             tcp_server::listen_mode mode = tcp_server::k_single_listener)
   {
-    start_(tcp_port, new bod_hand<Fn>(f), listen_backlog, std::move(tls_ctx), port_is_fd, stack_size);
+    start_(tcp_port, new bod_hand<Fn>(f), listen_backlog, std::move(tls_ctx), port_is_fd, stack_size, mode);
   }
 
+  // how a pipe_t reads the body of a request, and sends its response,
+  // when the request didn't arrive as HTTP/1.x on a connection of its
+  // own - for example when it is one of the streams of an HTTP/2
+  // connection (see http2.h).  See serve_stream.
+  struct stream
+  {
+    virtual ~stream() {}
+
+    // same as pipe_t::read_body, without the size limit
+    virtual size_t read_body(void *buff, size_t len) = 0;
+
+    // send the status and headers of 'response', but not its body.
+    // 'content_length' is the length of the body that will follow,
+    // or -1 if that isn't known.  'vary' and 'content_encoding' are
+    // as for pipe_t::append_head.  When 'end_stream' is true there
+    // is no body.
+    virtual void send_head(const http_response &response, int64_t content_length, bool vary,
+                           const char *content_encoding, bool end_stream) = 0;
+
+    // send (more of) the body.  The last call has 'end_stream'
+    // true, and may have len 0.
+    virtual void send_body(const void *buff, size_t len, bool end_stream) = 0;
+  };
+
   struct pipe_t
   {
-    pipe_t(::pipe_t *pipe, const std::vector<char>& buf, size_t &bsp, size_t bep)
+    // 'resp_buf', if given, is where respond formats the response
+    // before writing it.  Passing the same one for each request on
+    // a connection lets its capacity be reused, and lets responses
+    // to pipelined requests collect there so they can be sent with
+    // a single write.  Whoever owns it must send anything left in
+    // it once the request is done (http_server does this).
+    pipe_t(::pipe_t *pipe, std::vector<char>& buf, size_t &bsp, size_t &bep,
+           std::vector<char> *resp_buf = 0)
         : pipe(pipe),
           buf(buf),
           bep(bep),
-          bsp(bsp)
+          bsp(bsp),
+          resp_buf(resp_buf)
     {
     }
 
+    // a pipe_t for a request carried by 'strm'.  'pipe' is the
+    // connection it arrived on.
+    pipe_t(::pipe_t *pipe, stream *strm)
+        : pipe(pipe),
+          buf(no_buf),
+          bep(no_pos),
+          bsp(no_pos),
+          resp_buf(0),
+          strm(strm)
+    {
+    }
+
+    // a pipe_t for the same request as 'other', whose body is read
+    // and response sent through 'strm' instead - to capture the
+    // response, for example (see response_cache.h)
+    pipe_t(pipe_t &other, stream *strm)
+        : pipe_t(other.pipe, strm)
+    {
+      max_body = other.max_body;
+    }
+
+    // raw read of whatever the client sent after the request's headers.
+    // A body with a content-length is still only read up to its end
+    // this way.  Anything else read with this (a chunked body, say)
+    // means the connection is closed once the handler returns.  Use
+    // read_body to read bodies.
     size_t read(void *buff, size_t len);
 
+    // for upgrade and protocol handlers that speak some other protocol
+    // on the connection from here on.  Sends anything still held for
+    // pipelining, appends whatever the client has sent that hasn't been
+    // read yet to 'buffered', and returns the connection's pipe, which
+    // is still closed when the handler returns.
+    ::pipe_t *detach(std::vector<char> &buffered);
+
+    // read the request's body, decoding it if it was sent chunked.
+    // Returns the number of body bytes written to 'buff', which is
+    // 0 only once the whole body has been read.  Chunked data is
+    // read straight into 'buff', a chunk's worth at most per call.
+    // A body bigger than the max body size, or malformed chunk
+    // framing, throws http_body_error and the connection is closed
+    // once the handler returns.  Whatever the handler leaves unread
+    // is read and dropped before the next request on the connection,
+    // or the connection is closed if there is too much of it.
+    size_t read_body(void *buff, size_t len);
+
+    void set_max_body_size(size_t max_body_size)
+    {
+      max_body = max_body_size;
+    }
+
+    // raw write to the connection.  Between start_chunked and
+    // end_chunked this is the same as write_chunk, so it can't put
+    // unframed bytes in the middle of the body.  On a stream (see the
+    // ctor above) it can only add to a body started with start_chunked.
     void write(const void *buff, size_t len)
     {
+      if (strm || chunked)
+      {
+        write_chunk(buff, len);
+        return;
+      }
       fiber_lock lock(mutex);
+      if (resp_buf)
+        flush_out();
       pipe->write(buff, len);
     }
 
     void respond(const http_response &response);
 
+    // respond with the status and headers of 'response' (whose own
+    // body is ignored) and 'len' bytes of the file 'fd', starting at
+    // 'offset', as the body.  Small files are copied in after the
+    // headers, bigger ones are sent with pipe_t::try_sendfile.  The
+    // body is never compressed, and when 'head_only' is true it isn't
+    // sent at all.  See file_server.h.
+    void respond_file(const http_response &response, int fd, off_t offset, size_t len,
+                      bool head_only = false);
+
+    /*
+      streaming responses.  start_chunked sends the status line and
+      headers of 'response' (along with "transfer-encoding: chunked")
+      and any body it already has as the first chunk.  Each call to
+      write_chunk then adds to the body, and end_chunked finishes it.
+      Data is sent in chunks of at most k_chunk_size bytes, and each
+      one is written with the same fiber-blocking write as everything
+      else, so a slow client holds up the code producing the body
+      rather than letting it pile up in memory.  If the request was
+      HTTP/1.0 the body is sent unframed and the connection is closed
+      afterwards.  end_chunked is called for you when your handler
+      returns, if you haven't called it yourself.
+    */
+    void start_chunked(const http_response &response);
+    void write_chunk(const void *buff, size_t len);
+    void end_chunked();
+
     int get_fd() const
     {
       return pipe->get_fd();
     }
 
+    enum
+    {
+      k_chunk_size = 16 * 1024,
+      k_default_max_body_size = 8 * 1024 * 1024
+    };
+
   private:
+    friend class http_server;
+
+    std::vector<char> &out_buf() { return resp_buf ? *resp_buf : own_buf; }
+    void write_pending(std::vector<char> &out);
+    void flush_out();
+    void append_head(std::vector<char> &out, const http_response &response, size_t body_len,
+                     bool vary = false, const char *content_encoding = 0);
+    void send_chunk(std::vector<char> &out, bool more);
+    size_t read_raw(void *buff, size_t len);
+    size_t read_line(const char *too_long);
+    void body_error(int status, const char *msg);
+    bool discard_body();
+
+    enum body_state
+    {
+      k_body_none,
+      k_body_length,
+      k_body_chunk_size,
+      k_body_chunk_data,
+      k_body_chunk_end,
+      k_body_trailer,
+      k_body_done
+    };
+
     fiber_mutex mutex;
     ::pipe_t *pipe;
-    const std::vector<char>& buf;
+    std::vector<char>& buf;
     size_t &bsp;
-    size_t bep;
+    size_t &bep;
+    std::vector<char> *resp_buf;
+    std::vector<char> own_buf;
+    bool http_1_0{false};
+    bool chunked{false};
+    bool close_after{false};
+    size_t chunk_start{0};
+    body_state body{k_body_none};
+    uint64_t body_left{0};
+    uint64_t body_read{0};
+    size_t max_body{k_default_max_body_size};
+    http_compression *compression{nullptr};
+    int encoding{http_compression::k_identity};
+    const http_request *request{nullptr}; // set along with compression
+    stream *strm{nullptr};
+
+    // what was sent, for the access log
+    int resp_status{0};
+    uint64_t body_sent{0};
+
+    std::vector<char> no_buf;
+    size_t no_pos{0};
+
+    enum
+    {
+      k_max_coalesced_body = 64 * 1024,
+
+      // files up to this size are read in after the headers rather
+      // than sent with a separate try_sendfile
+      k_max_copied_file = 16 * 1024,
+
+      // room in front of each chunk's data for its length, written
+      // as 8 (zero padded) hex digits, and crlf
+      k_chunk_header_room = 10,
+
+      // longest chunk-size line (with extensions) and total
+      // trailer size accepted in a chunked request body
+      k_max_chunk_line = 1024,
+      k_max_trailer = 8 * 1024,
+
+      // most of a request body the handler didn't read that
+      // will be read and dropped to keep the connection alive
+      k_max_discarded_body = 64 * 1024
+    };
   };
 
+  // run the handler given to start for 'request', which arrived on
+  // one of this server's connections (as one of the streams of an
+  // HTTP/2 connection, for example) rather than as HTTP/1.x.  'strm'
+  // reads its body and sends its response.  Compression and the rate
+  // limiter apply the same as for other requests, and end_chunked is
+  // called after the handler returns.
+  void serve_stream(stream *strm, ::pipe_t *conn_pipe, const http_request &request);
+
   void stop()
   {
     if (tcp_server_)
       tcp_server_->stop();
   }
 
+  // see tcp_server::set_accept_batch, set_defer_accept and set_fast_open.
+  // these only have an effect after 'start' has been called.
+  void set_accept_batch(int max_accepts)
+  {
+    if (tcp_server_)
+      tcp_server_->set_accept_batch(max_accepts);
+  }
+
+  void set_defer_accept(int seconds)
+  {
+    if (tcp_server_)
+      tcp_server_->set_defer_accept(seconds);
+  }
+
+  void set_fast_open(int queue_len)
+  {
+    if (tcp_server_)
+      tcp_server_->set_fast_open(queue_len);
+  }
+
   /*
     although not directly used by the http_server class, these
     are used be multiple http-related pieces of code, so the
@@ -454,9 +1065,32 @@ private:
     Fn f_;
   };
 
-  void start_(int tcp_port, body_handler *base_handler, int listen_backlog, tls_context *tls_ctx, bool port_is_fd, size_t stack_size);
+  void start_(int tcp_port, body_handler *base_handler, int listen_backlog, tls_context *tls_ctx, bool port_is_fd, size_t stack_size,
+              tcp_server::listen_mode mode);
+
+  struct connection;
+  bool serve(connection *conn);
+
+  enum
+  {
+    k_max_parked_resp_buf = 16 * 1024,
+
+    // what a connection waiting for its next request reads into,
+    // on its stack, so that it isn't holding a pooled buffer
+    k_idle_read_size = 2 * 1024
+  };
+
+  void log_access(const pipe_t &pipe, const http_request &request, const struct timespec &start);
 
+  bool park_idle_{false};
+  bool access_log_{false};
+  size_t max_header_size_{k_default_max_header_size};
+  parser_engine parser_engine_{k_joyent_parser};
+  size_t stack_size_{fiber::k_default_stack_size};
+  std::shared_ptr<ip_rate_limiter> limiter_;
+  std::shared_ptr<http_compression> compression_;
   std::unique_ptr<tcp_server> tcp_server_;
   std::unique_ptr<body_handler> body_holder_;
   std::map<std::string, std::unique_ptr<body_handler>> m_upgrade_map_;
+  std::map<std::string, std::unique_ptr<body_handler>> m_protocol_map_;
 };
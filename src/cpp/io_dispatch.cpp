@@ -421,7 +421,7 @@ void io_dispatch::epoll_loop()
     {
 
       for (int i = 0; i < ret; i++)
-        ((handler *)event[i].data.ptr)->io_avail(event[i]);
+        epoll_handler(event[i])->io_avail(event[i]);
     }
     else if ((ret != 0) && (errno != EINTR))
     {
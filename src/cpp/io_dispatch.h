@@ -79,6 +79,11 @@ public:
   // start_this_thread if that was called).
   static void join();
 
+  static int num_threads()
+  {
+    return io_d.num_threads_;
+  }
+
   // base class associated with the action taken when there
   // is io available on a watched file descriptor
   class handler
@@ -102,6 +107,31 @@ public:
       do_error("epoll_ctl(ep_fd_, " << op_string(op) << ", " << fd << ", &evt)");
   }
 
+  // same as above, but also stores 'tag' in the (otherwise unused)
+  // high bits of the handler's address.  Handlers that stay
+  // registered while the object they represent comes and goes
+  // can use this to recognize events that were queued for a
+  // previous user of the same handler.  The tag is returned to
+  // io_avail through epoll_tag(event).
+  static void epoll_ctl(int op, int fd, uint32_t events, handler *hnd, uint16_t tag)
+  {
+    struct epoll_event evt;
+    evt.events = events;
+    evt.data.u64 = (uint64_t)hnd | ((uint64_t)tag << k_tag_shift);
+    if (::epoll_ctl(io_d.ep_fd_, op, fd, &evt) < 0)
+      do_error("epoll_ctl(ep_fd_, " << op_string(op) << ", " << fd << ", &evt)");
+  }
+
+  static uint16_t epoll_tag(const struct epoll_event &event)
+  {
+    return (uint16_t)(event.data.u64 >> k_tag_shift);
+  }
+
+  static handler *epoll_handler(const struct epoll_event &event)
+  {
+    return (handler *)(event.data.u64 & ((1ULL << k_tag_shift) - 1));
+  }
+
   // pause all io threads (other than the one calling this function
   // if it happens to be called from an io thread) and execute 'f'
   // while they are paused. Once 'f' returns resume all io threads.
@@ -414,6 +444,12 @@ private:
     k_on_one = 3
   };
 
+  // user-space addresses on x86_64/aarch64 fit in the low 48 bits
+  enum
+  {
+    k_tag_shift = 48
+  };
+
   io_dispatch(const io_dispatch &);
   io_dispatch(io_dispatch &&);
 
@@ -0,0 +1,225 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "ip_rate_limiter.h"
+#include "time_utils.h"
+#include <netinet/in.h>
+
+namespace
+{
+
+uint32_t now_ms()
+{
+  auto now = cur_time();
+  return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+} // namespace
+
+ip_rate_limiter::ip_rate_limiter(double tokens_per_second, int burst, int max_conns_per_ip, int num_sets)
+    : refill_per_ms_(tokens_per_second),
+      max_tokens_((uint32_t)(burst > 0 ? burst : 1) * 1000),
+      max_conns_(max_conns_per_ip > 0 ? max_conns_per_ip : 0),
+      conns_refused_(0),
+      requests_refused_(0)
+{
+  uint32_t sets = 1;
+  while (sets < (uint32_t)num_sets)
+    sets <<= 1;
+  set_mask_ = sets - 1;
+  sets_ = std::unique_ptr<set[]>(new set[sets]);
+  for (uint32_t i = 0; i < sets; i++)
+  {
+    for (auto &s : sets_[i].slots_)
+    {
+      s.owner_ = 0;
+      s.bucket_ = 0;
+    }
+  }
+
+  // so that which addresses share a set isn't predictable from outside
+  auto now = cur_epoc_time();
+  seed_ = (uint32_t)(now.tv_nsec ^ (now.tv_sec << 7) ^ (uintptr_t)this);
+}
+
+// murmur3's 32 bit finalizer over the address bytes.  ipv4 addresses
+// hash the same whether they arrive as AF_INET or as ipv4-mapped ipv6,
+// and the port is ignored.  Never returns 0, except for address
+// families we don't track.
+uint32_t ip_rate_limiter::hash(const struct sockaddr *addr) const
+{
+  const uint8_t *p;
+  size_t len;
+  if (addr->sa_family == AF_INET6)
+  {
+    auto a6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(a6))
+    {
+      p = &a6->s6_addr[12];
+      len = 4;
+    }
+    else
+    {
+      p = &a6->s6_addr[0];
+      len = 16;
+    }
+  }
+  else if (addr->sa_family == AF_INET)
+  {
+    p = (const uint8_t *)&((const struct sockaddr_in *)addr)->sin_addr;
+    len = 4;
+  }
+  else
+    return 0;
+
+  uint32_t h = seed_;
+  for (size_t i = 0; i < len; i += 4)
+  {
+    uint32_t k = (uint32_t)p[i] | ((uint32_t)p[i + 1] << 8) | ((uint32_t)p[i + 2] << 16) | ((uint32_t)p[i + 3] << 24);
+    k *= 0xcc9e2d51;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1b873593;
+    h ^= k;
+    h = (h << 13) | (h >> 19);
+    h = h * 5 + 0xe6546b64;
+  }
+  h ^= len;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h ? h : 1;
+}
+
+ip_rate_limiter::slot *ip_rate_limiter::lookup(uint32_t hash, uint32_t now)
+{
+  auto &st = sets_[hash & set_mask_];
+  while (true)
+  {
+    slot *victim = 0;
+    uint64_t victim_owner = 0;
+    uint32_t victim_age = 0;
+    for (auto &s : st.slots_)
+    {
+      auto owner = s.owner_.load();
+      if ((owner >> 32) == hash)
+        return &s;
+      if ((uint32_t)owner != 0)
+        continue; // has open connections, can't be evicted
+      uint32_t age = (owner == 0) ? UINT32_MAX : now - (uint32_t)s.bucket_.load();
+      if (!victim || age > victim_age)
+      {
+        victim = &s;
+        victim_owner = owner;
+        victim_age = age;
+      }
+    }
+    if (!victim)
+      return 0;
+
+    // if this fails, someone else changed the slot first, so look again
+    if (victim->owner_.compare_exchange_strong(victim_owner, (uint64_t)hash << 32))
+    {
+      victim->bucket_ = ((uint64_t)max_tokens_ << 32) | now;
+      return victim;
+    }
+  }
+}
+
+bool ip_rate_limiter::take_token(slot *s, uint32_t now)
+{
+  auto bucket = s->bucket_.load();
+  while (true)
+  {
+    uint64_t tokens = bucket >> 32;
+    int32_t elapsed = (int32_t)(now - (uint32_t)bucket);
+    if (elapsed > 0)
+    {
+      tokens += (uint64_t)(elapsed * refill_per_ms_);
+      if (tokens > max_tokens_)
+        tokens = max_tokens_;
+    }
+    if (tokens < 1000)
+      return false;
+    if (s->bucket_.compare_exchange_weak(bucket, ((tokens - 1000) << 32) | now))
+      return true;
+  }
+}
+
+int ip_rate_limiter::admit_connection(const struct sockaddr *addr)
+{
+  auto h = hash(addr);
+  if (h == 0)
+    return k_untracked;
+  auto now = now_ms();
+  auto s = lookup(h, now);
+  if (!s)
+    return k_untracked;
+
+  // the connection is counted before a token is taken for it, so
+  // that one refused for being over max_conns doesn't also use up
+  // the address's rate
+  auto owner = s->owner_.load();
+  while (true)
+  {
+    // the slot can only have been given to another address if
+    // its count went to 0 after lookup found it
+    if ((owner >> 32) != h)
+      return k_untracked;
+    if (max_conns_ && (uint32_t)owner >= max_conns_)
+    {
+      ++conns_refused_;
+      return k_refused;
+    }
+    if (s->owner_.compare_exchange_weak(owner, owner + 1))
+      break;
+  }
+
+  if (!take_token(s, now))
+  {
+    s->owner_--;
+    ++conns_refused_;
+    return k_refused;
+  }
+  auto set_index = h & set_mask_;
+  return (int)(set_index * k_ways + (s - sets_[set_index].slots_));
+}
+
+void ip_rate_limiter::release_connection(int slot)
+{
+  if (slot >= 0)
+    sets_[slot / k_ways].slots_[slot % k_ways].owner_--;
+}
+
+bool ip_rate_limiter::allow_request(const struct sockaddr *addr)
+{
+  auto h = hash(addr);
+  if (h == 0)
+    return true;
+  auto now = now_ms();
+  auto s = lookup(h, now);
+  if (!s || take_token(s, now))
+    return true;
+  ++requests_refused_;
+  return false;
+}
@@ -0,0 +1,115 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <sys/socket.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+// per source address rate limiting, used by tcp_server and
+// http_server to keep any single client from taking more than
+// its share of fibers and file descriptors.
+//
+// Each address gets a token bucket, plus a count of its currently
+// open connections.  These live in a fixed size, set-associative
+// table so memory use doesn't grow with the number of addresses we
+// see.  An address hashes to one set (k_ways slots, one cache line).
+// If it isn't already in that set it takes over the least recently
+// used slot that has no open connections, and if every slot in the
+// set has open connections it just isn't tracked.  Nothing here
+// takes a lock - all updates are compare-and-swaps on a slot's two
+// words.  Addresses are identified by a 32 bit hash, so two of them
+// can occasionally end up sharing a bucket.
+class ip_rate_limiter : public std::enable_shared_from_this<ip_rate_limiter>
+{
+public:
+  enum
+  {
+    k_refused = -1,
+    k_untracked = -2,
+
+    k_ways = 4,
+    k_default_num_sets = 16384 // 1MB
+  };
+
+  // each address's bucket holds up to 'burst' tokens and refills at
+  // 'tokens_per_second'.  A new connection costs one token, and so
+  // does each http request made on it.  'max_conns_per_ip' <= 0 means
+  // no limit on the number of concurrent connections.  'num_sets' is
+  // rounded up to a power of 2.
+  ip_rate_limiter(double tokens_per_second, int burst, int max_conns_per_ip = 0, int num_sets = k_default_num_sets);
+
+  // called when a connection from 'addr' is accepted.  Returns
+  // k_refused if the connection should be closed.  Otherwise the
+  // return value must be passed to release_connection once the
+  // connection has closed.
+  int admit_connection(const struct sockaddr *addr);
+  void release_connection(int slot);
+
+  // called for each request made on a connection.  Returns false if
+  // 'addr' has run out of tokens.
+  bool allow_request(const struct sockaddr *addr);
+
+  uint64_t connections_refused() const
+  {
+    return conns_refused_;
+  }
+
+  uint64_t requests_refused() const
+  {
+    return requests_refused_;
+  }
+
+private:
+  struct slot
+  {
+    // high 32 bits are the address hash (0 when the slot has never
+    // been used), low 32 bits are the number of open connections.
+    // The hash can only be replaced while the count is 0.
+    std::atomic<uint64_t> owner_;
+
+    // high 32 bits are the number of tokens, in thousandths of a
+    // token, low 32 bits are the time, in milliseconds, when they
+    // were last updated.  That time is also what lru eviction uses.
+    std::atomic<uint64_t> bucket_;
+  };
+
+  struct alignas(64) set
+  {
+    slot slots_[k_ways];
+  };
+
+  uint32_t hash(const struct sockaddr *addr) const;
+  slot *lookup(uint32_t hash, uint32_t now);
+  bool take_token(slot *s, uint32_t now);
+
+  std::unique_ptr<set[]> sets_;
+  uint32_t set_mask_;
+  uint32_t seed_;
+  double refill_per_ms_;
+  uint32_t max_tokens_;
+  uint32_t max_conns_;
+  std::atomic<uint64_t> conns_refused_;
+  std::atomic<uint64_t> requests_refused_;
+};
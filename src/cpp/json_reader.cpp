@@ -0,0 +1,576 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "json_reader.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ANON_JSON_READER_SIMD 1
+#endif
+
+namespace
+{
+
+// each scanner returns the first byte in [p, end) that ends the plain
+// part of a string - a '"', a '\\' or a control character - or 'end'
+// if there isn't one.
+
+const char *scan_string_scalar(const char *p, const char *end)
+{
+  while (p < end)
+  {
+    auto c = (unsigned char)*p;
+    if (c == '"' || c == '\\' || c < 0x20)
+      break;
+    ++p;
+  }
+  return p;
+}
+
+#if defined(ANON_JSON_READER_SIMD)
+
+__attribute__((target("sse2")))
+const char *scan_string_sse2(const char *p, const char *end)
+{
+  auto quote = _mm_set1_epi8('"');
+  auto bslash = _mm_set1_epi8('\\');
+  auto ctl = _mm_set1_epi8(0x1f);
+  while (end - p >= 16)
+  {
+    auto v = _mm_loadu_si128((const __m128i *)p);
+    // max(v, 0x1f) == 0x1f only for bytes <= 0x1f
+    auto hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+                            _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl));
+    auto mask = (unsigned)_mm_movemask_epi8(hit);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return scan_string_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+const char *scan_string_avx2(const char *p, const char *end)
+{
+  auto quote = _mm256_set1_epi8('"');
+  auto bslash = _mm256_set1_epi8('\\');
+  auto ctl = _mm256_set1_epi8(0x1f);
+  while (end - p >= 32)
+  {
+    auto v = _mm256_loadu_si256((const __m256i *)p);
+    auto hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+                               _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl));
+    auto mask = (unsigned)_mm256_movemask_epi8(hit);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return scan_string_sse2(p, end);
+}
+
+#endif
+
+struct scanner
+{
+  const char *(*string)(const char *p, const char *end);
+  const char *name;
+};
+
+scanner pick_scanner()
+{
+#if defined(ANON_JSON_READER_SIMD)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return {scan_string_avx2, "avx2"};
+  if (__builtin_cpu_supports("sse2"))
+    return {scan_string_sse2, "sse2"};
+#endif
+  return {scan_string_scalar, "scalar"};
+}
+
+const scanner scan = pick_scanner();
+
+bool is_digit(int c)
+{
+  return c >= '0' && c <= '9';
+}
+
+int hex_val(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+void append_utf8(std::string &s, uint32_t cp)
+{
+  if (cp < 0x80)
+    s += (char)cp;
+  else if (cp < 0x800)
+  {
+    s += (char)(0xc0 | (cp >> 6));
+    s += (char)(0x80 | (cp & 0x3f));
+  }
+  else if (cp < 0x10000)
+  {
+    s += (char)(0xe0 | (cp >> 12));
+    s += (char)(0x80 | ((cp >> 6) & 0x3f));
+    s += (char)(0x80 | (cp & 0x3f));
+  }
+  else
+  {
+    s += (char)(0xf0 | (cp >> 18));
+    s += (char)(0x80 | ((cp >> 12) & 0x3f));
+    s += (char)(0x80 | ((cp >> 6) & 0x3f));
+    s += (char)(0x80 | (cp & 0x3f));
+  }
+}
+
+} // namespace
+
+void json_arena::new_block(size_t len)
+{
+  // blocks double in size, up to 64K, so a big document doesn't
+  // need many of them and a small one doesn't waste much
+  size_t size = blocks_.empty() ? 1024 : std::min<size_t>(capacity_, 64 * 1024);
+  if (size < len)
+    size = len;
+  blocks_.emplace_back(new char[size]);
+  next_ = blocks_.back().get();
+  left_ = size;
+  capacity_ += size;
+}
+
+json_reader::json_reader(const char *json, size_t len)
+    : start_(json),
+      p_(json),
+      end_(json + len)
+{
+}
+
+json_reader::json_reader(const std::function<size_t(char *buf, size_t len)> &source)
+    : source_(source),
+      buf_(new char[k_buffer_size]),
+      start_(buf_.get()),
+      p_(start_),
+      end_(start_)
+{
+}
+
+const char *json_reader::engine_name()
+{
+  return scan.name;
+}
+
+const char *json_reader::scan_string(const char *p, const char *end)
+{
+  return scan.string(p, end);
+}
+
+void json_reader::fail(const char *what) const
+{
+  anon_throw(json_error, "invalid json, " << what << " at offset " << offset());
+}
+
+bool json_reader::fill()
+{
+  if (!source_)
+    return false;
+  consumed_ += end_ - start_;
+  auto n = source_(buf_.get(), k_buffer_size);
+  p_ = start_ = buf_.get();
+  end_ = start_ + n;
+  return n != 0;
+}
+
+// the next byte that isn't white space, left unread, or -1 at the end
+int json_reader::skip_space()
+{
+  while (true)
+  {
+    while (p_ < end_)
+    {
+      auto c = *p_;
+      if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+        return (unsigned char)c;
+      ++p_;
+    }
+    if (!fill())
+      return -1;
+  }
+}
+
+int json_reader::get()
+{
+  if (p_ == end_ && !fill())
+    fail("unexpected end");
+  return (unsigned char)*p_++;
+}
+
+string_len json_reader::keep(const char *p, size_t len)
+{
+  if (skipping_)
+    return string_len();
+  if (!keep_)
+    return string_len(p, len);
+  auto s = arena_.alloc(len + 1);
+  memcpy(s, p, len);
+  s[len] = 0;
+  return string_len(s, len);
+}
+
+json_reader::token json_reader::next()
+{
+  int c;
+  switch (state_)
+  {
+  case k_want_value:
+    return value(skip_space());
+
+  case k_want_first_key:
+  case k_want_key:
+    c = skip_space();
+    if (c == '}' && state_ == k_want_first_key)
+    {
+      ++p_;
+      return end_container('{');
+    }
+    if (c != '"')
+      fail("expected a key");
+    ++p_;
+    read_string();
+    if (!keep_ && !(p_ < end_ && *p_ == ':') && text_.ptr() >= start_ && text_.ptr() < end_)
+    {
+      // finding the ':' might read more into the buffer the key is in
+      scratch_.assign(text_.ptr(), text_.len());
+      text_ = string_len(scratch_.data(), scratch_.size());
+    }
+    if (skip_space() != ':')
+      fail("expected ':'");
+    ++p_;
+    state_ = k_want_value;
+    return tok_ = k_key;
+
+  case k_want_first_value:
+    c = skip_space();
+    if (c == ']')
+    {
+      ++p_;
+      return end_container('[');
+    }
+    return value(c);
+
+  case k_want_more:
+    c = skip_space();
+    if (depth_ == 0)
+    {
+      if (c != -1)
+        fail("unexpected text after the value");
+      state_ = k_done;
+      return tok_ = k_end;
+    }
+    if (c == ',')
+    {
+      ++p_;
+      state_ = stack_[depth_ - 1] == '{' ? k_want_key : k_want_value;
+      return next();
+    }
+    if (c == (stack_[depth_ - 1] == '{' ? '}' : ']'))
+    {
+      ++p_;
+      return end_container(stack_[depth_ - 1]);
+    }
+    fail(stack_[depth_ - 1] == '{' ? "expected ',' or '}'" : "expected ',' or ']'");
+
+  case k_done:
+  default:
+    return tok_ = k_end;
+  }
+}
+
+json_reader::token json_reader::value(int c)
+{
+  state_ = k_want_more;
+  switch (c)
+  {
+  case '{':
+  case '[':
+    if (depth_ == k_max_depth)
+      fail("nested too deeply");
+    ++p_;
+    stack_[depth_++] = (char)c;
+    state_ = c == '{' ? k_want_first_key : k_want_first_value;
+    return tok_ = c == '{' ? k_begin_object : k_begin_array;
+  case '"':
+    ++p_;
+    read_string();
+    return tok_ = k_string;
+  case 't':
+    read_literal("true");
+    return tok_ = k_true;
+  case 'f':
+    read_literal("false");
+    return tok_ = k_false;
+  case 'n':
+    read_literal("null");
+    return tok_ = k_null;
+  case -1:
+    fail("unexpected end");
+  default:
+    if (c == '-' || is_digit(c))
+    {
+      read_number();
+      return tok_ = k_number;
+    }
+    fail("unexpected character");
+  }
+}
+
+json_reader::token json_reader::end_container(char c)
+{
+  --depth_;
+  state_ = k_want_more;
+  return tok_ = c == '{' ? k_end_object : k_end_array;
+}
+
+// called with p_ just past the opening '"'
+void json_reader::read_string()
+{
+  // usually the whole string is in the buffer with nothing escaped
+  auto e = scan.string(p_, end_);
+  if (e < end_ && *e == '"')
+  {
+    text_ = keep(p_, e - p_);
+    p_ = e + 1;
+    return;
+  }
+
+  scratch_.clear();
+  while (true)
+  {
+    e = scan.string(p_, end_);
+    scratch_.append(p_, e - p_);
+    p_ = e;
+    if (p_ == end_)
+    {
+      if (!fill())
+        fail("unterminated string");
+      continue;
+    }
+    auto c = (unsigned char)*p_++;
+    if (c == '"')
+      break;
+    if (c < 0x20)
+      fail("control character in string");
+    switch (c = get())
+    {
+    case '"':
+    case '\\':
+    case '/':
+      scratch_ += (char)c;
+      break;
+    case 'b':
+      scratch_ += '\b';
+      break;
+    case 'f':
+      scratch_ += '\f';
+      break;
+    case 'n':
+      scratch_ += '\n';
+      break;
+    case 'r':
+      scratch_ += '\r';
+      break;
+    case 't':
+      scratch_ += '\t';
+      break;
+    case 'u':
+    {
+      auto hex4 = [this] {
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++)
+        {
+          auto h = hex_val(get());
+          if (h < 0)
+            fail("invalid \\u escape");
+          v = (v << 4) | h;
+        }
+        return v;
+      };
+      auto cp = hex4();
+      if (cp >= 0xd800 && cp < 0xdc00)
+      {
+        if (get() != '\\' || get() != 'u')
+          fail("unpaired surrogate");
+        auto lo = hex4();
+        if (lo < 0xdc00 || lo >= 0xe000)
+          fail("unpaired surrogate");
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+      }
+      else if (cp >= 0xdc00 && cp < 0xe000)
+        fail("unpaired surrogate");
+      append_utf8(scratch_, cp);
+      break;
+    }
+    default:
+      fail("invalid escape");
+    }
+  }
+  text_ = keep(scratch_.data(), scratch_.size());
+}
+
+void json_reader::read_number()
+{
+  auto is_num_char = [](char c) { return is_digit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E'; };
+  auto e = p_;
+  while (e < end_ && is_num_char(*e))
+    ++e;
+  const char *num;
+  size_t len;
+  if (e < end_ || !source_)
+  {
+    num = p_;
+    len = e - p_;
+    p_ = e;
+  }
+  else
+  {
+    // the number might go on into the next buffer
+    scratch_.assign(p_, e - p_);
+    p_ = e;
+    while (fill())
+    {
+      e = p_;
+      while (e < end_ && is_num_char(*e))
+        ++e;
+      scratch_.append(p_, e - p_);
+      p_ = e;
+      if (e < end_)
+        break;
+    }
+    num = scratch_.data();
+    len = scratch_.size();
+  }
+
+  // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+  auto p = num;
+  auto end = num + len;
+  if (p < end && *p == '-')
+    ++p;
+  if (p == end || !is_digit(*p))
+    fail("invalid number");
+  if (*p++ == '0' && p < end && is_digit(*p))
+    fail("invalid number");
+  while (p < end && is_digit(*p))
+    ++p;
+  is_integer_ = true;
+  if (p < end && *p == '.')
+  {
+    is_integer_ = false;
+    if (++p == end || !is_digit(*p))
+      fail("invalid number");
+    while (p < end && is_digit(*p))
+      ++p;
+  }
+  if (p < end && (*p == 'e' || *p == 'E'))
+  {
+    is_integer_ = false;
+    if (++p < end && (*p == '+' || *p == '-'))
+      ++p;
+    if (p == end || !is_digit(*p))
+      fail("invalid number");
+    while (p < end && is_digit(*p))
+      ++p;
+  }
+  if (p != end)
+    fail("invalid number");
+  text_ = keep(num, len);
+}
+
+void json_reader::read_literal(const char *lit)
+{
+  for (auto l = lit; *l; l++)
+    if (get() != *l)
+      fail("invalid literal");
+}
+
+int64_t json_reader::int_value() const
+{
+  if (!is_integer())
+    anon_throw(json_error, "json value is not an integer");
+  auto p = text_.ptr();
+  auto end = p + text_.len();
+  bool neg = *p == '-';
+  if (neg)
+    ++p;
+  uint64_t v = 0;
+  for (; p < end; p++)
+  {
+    if (v > (UINT64_MAX - 9) / 10)
+      anon_throw(json_error, "json integer " << text_ << " is too big");
+    v = v * 10 + (*p - '0');
+  }
+  if (v > (uint64_t)INT64_MAX + neg)
+    anon_throw(json_error, "json integer " << text_ << " is too big");
+  return neg ? (int64_t)(0 - v) : (int64_t)v;
+}
+
+double json_reader::double_value() const
+{
+  if (tok_ != k_number)
+    anon_throw(json_error, "json value is not a number");
+  if (keep_)
+    return strtod(text_.ptr(), 0);
+  char buf[64];
+  if (text_.len() < sizeof(buf))
+  {
+    memcpy(buf, text_.ptr(), text_.len());
+    buf[text_.len()] = 0;
+    return strtod(buf, 0);
+  }
+  return strtod(text_.str().c_str(), 0);
+}
+
+void json_reader::skip()
+{
+  if (tok_ != k_begin_object && tok_ != k_begin_array)
+    return;
+  auto depth = depth_ - 1;
+  skipping_ = true;
+  try
+  {
+    while (depth_ > depth)
+      next();
+  }
+  catch (...)
+  {
+    skipping_ = false;
+    throw;
+  }
+  skipping_ = false;
+}
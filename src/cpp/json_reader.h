@@ -0,0 +1,233 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "string_len.h"
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// thrown by json_reader when what it is reading isn't valid json
+struct json_error : public std::runtime_error
+{
+  json_error(const std::string &what)
+      : std::runtime_error(what)
+  {
+  }
+};
+
+// a bump allocator for memory that is all freed at once, when the
+// json_arena is destroyed.  json_reader keeps the text of the strings
+// and numbers it reads in one.
+class json_arena
+{
+public:
+  json_arena() {}
+  json_arena(const json_arena &) = delete;
+  json_arena &operator=(const json_arena &) = delete;
+
+  char *alloc(size_t len)
+  {
+    if (len > left_)
+      new_block(len);
+    auto p = next_;
+    next_ += len;
+    left_ -= len;
+    return p;
+  }
+
+  // total bytes in the blocks allocated so far
+  size_t capacity() const
+  {
+    return capacity_;
+  }
+
+private:
+  void new_block(size_t len);
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char *next_{0};
+  size_t left_{0};
+  size_t capacity_{0};
+};
+
+// a pull parser for json.  Each call to next reads just enough to
+// return the next token - the start or end of an object or array, a
+// key, or a value - so a document can be handled as it is read,
+// without building a tree of it first.  It can read a document that
+// is all in memory, or one that arrives in pieces through a 'source'
+// function - for example a request body read with
+// http_server::pipe_t::read_body.
+//
+// The text of keys, strings and numbers is kept in an arena owned by
+// the json_reader, nul terminated, so the string_len's that text
+// returns stay valid until the json_reader is destroyed.  Readers of
+// big documents that don't need that can turn it off with keep_text,
+// and then nothing is copied unless it has escapes or is split across
+// reads.  Strings are found 16 or 32 bytes at a time with SSE2 or AVX2
+// when the cpu has them (see engine_name).
+//
+// Invalid json throws json_error.
+class json_reader
+{
+public:
+  enum token
+  {
+    // the end of the document, returned by next once the whole
+    // top-level value has been read
+    k_end,
+    k_begin_object,
+    k_end_object,
+    k_begin_array,
+    k_end_array,
+    k_key,
+    k_string,
+    k_number,
+    k_true,
+    k_false,
+    k_null
+  };
+
+  enum
+  {
+    k_max_depth = 128,
+    k_buffer_size = 16 * 1024
+  };
+
+  // read the 'len' bytes at 'json'
+  json_reader(const char *json, size_t len);
+
+  // read bytes with 'source', which fills up to 'len' bytes at 'buf'
+  // and returns the number it filled, or 0 at the end of the document
+  json_reader(const std::function<size_t(char *buf, size_t len)> &source);
+
+  json_reader(const json_reader &) = delete;
+  json_reader &operator=(const json_reader &) = delete;
+
+  token next();
+
+  // the token next last returned
+  token current() const
+  {
+    return tok_;
+  }
+
+  // whether text is kept in the arena (the default), or is only
+  // valid until the next call to next - and isn't nul terminated
+  void keep_text(bool keep)
+  {
+    keep_ = keep;
+  }
+
+  // the decoded text of a k_key or k_string, or the text of a k_number
+  const string_len &text() const
+  {
+    return text_;
+  }
+
+  std::string str() const
+  {
+    return text_.str();
+  }
+
+  // whether the k_number just read has no fraction or exponent
+  bool is_integer() const
+  {
+    return tok_ == k_number && is_integer_;
+  }
+
+  // the value of a k_number.  int_value throws json_error if the
+  // number isn't an integer or doesn't fit in an int64_t.
+  int64_t int_value() const;
+  double double_value() const;
+
+  // after k_begin_object or k_begin_array, skip the rest of that
+  // object or array, so that the next call to next returns whatever
+  // follows it.  After any other token this does nothing.
+  void skip();
+
+  // the number of objects and arrays the reader is inside of
+  int depth() const
+  {
+    return depth_;
+  }
+
+  // bytes of json read so far
+  size_t offset() const
+  {
+    return consumed_ + (p_ - start_);
+  }
+
+  json_arena &arena()
+  {
+    return arena_;
+  }
+
+  // which string scanning code this cpu uses: "avx2", "sse2" or "scalar"
+  static const char *engine_name();
+
+  // the first '"', '\\' or control character in [p, end), or 'end' if
+  // there isn't one - where the plain part of a json string ends
+  static const char *scan_string(const char *p, const char *end);
+
+private:
+  enum state
+  {
+    k_want_value,
+    k_want_first_key,
+    k_want_key,
+    k_want_first_value,
+    k_want_more,
+    k_done
+  };
+
+  bool fill();
+  int skip_space();
+  int get();
+  token value(int c);
+  token end_container(char c);
+  void read_string();
+  void read_number();
+  void read_literal(const char *lit);
+  string_len keep(const char *p, size_t len);
+  [[noreturn]] void fail(const char *what) const;
+
+  std::function<size_t(char *buf, size_t len)> source_;
+  std::unique_ptr<char[]> buf_;
+  const char *start_;
+  const char *p_;
+  const char *end_;
+  size_t consumed_{0};
+
+  json_arena arena_;
+  std::string scratch_;
+  string_len text_;
+  token tok_{k_end};
+  state state_{k_want_value};
+  bool is_integer_{false};
+  bool skipping_{false};
+  bool keep_{true};
+  int depth_{0};
+  char stack_[k_max_depth];
+};
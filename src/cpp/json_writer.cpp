@@ -0,0 +1,175 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "json_writer.h"
+#include "json_reader.h"
+#include "log.h"
+#include <charconv>
+#include <cmath>
+
+namespace
+{
+
+const char hex_digits[] = "0123456789abcdef";
+
+} // namespace
+
+json_writer &json_writer::open(char c)
+{
+  if (depth_ == k_max_depth)
+    anon_throw(std::runtime_error, "json_writer nested too deeply");
+  *start(1) = c;
+  response_.body_commit(1);
+  first_[depth_++] = true;
+  return *this;
+}
+
+json_writer &json_writer::close(char c)
+{
+  if (depth_ > 0)
+    --depth_;
+  *response_.body_reserve(1) = c;
+  response_.body_commit(1);
+  return *this;
+}
+
+void json_writer::write_string(const char *str, size_t len)
+{
+  auto end = str + len;
+  *response_.body_reserve(1) = '"';
+  response_.body_commit(1);
+  while (true)
+  {
+    auto e = json_reader::scan_string(str, end);
+    if (e > str)
+    {
+      memcpy(response_.body_reserve(e - str), str, e - str);
+      response_.body_commit(e - str);
+    }
+    if (e == end)
+      break;
+    auto c = (unsigned char)*e;
+    auto p = response_.body_reserve(6);
+    p[0] = '\\';
+    size_t n = 2;
+    switch (c)
+    {
+    case '"':
+    case '\\':
+      p[1] = c;
+      break;
+    case '\b':
+      p[1] = 'b';
+      break;
+    case '\f':
+      p[1] = 'f';
+      break;
+    case '\n':
+      p[1] = 'n';
+      break;
+    case '\r':
+      p[1] = 'r';
+      break;
+    case '\t':
+      p[1] = 't';
+      break;
+    default:
+      p[1] = 'u';
+      p[2] = '0';
+      p[3] = '0';
+      p[4] = hex_digits[c >> 4];
+      p[5] = hex_digits[c & 15];
+      n = 6;
+      break;
+    }
+    response_.body_commit(n);
+    str = e + 1;
+  }
+  *response_.body_reserve(1) = '"';
+  response_.body_commit(1);
+}
+
+json_writer &json_writer::key(const char *k, size_t len)
+{
+  start(0);
+  write_string(k, len);
+  *response_.body_reserve(1) = ':';
+  response_.body_commit(1);
+  after_key_ = true;
+  return *this;
+}
+
+json_writer &json_writer::value(const char *str, size_t len)
+{
+  start(0);
+  write_string(str, len);
+  return *this;
+}
+
+json_writer &json_writer::value(bool b)
+{
+  auto p = start(5);
+  auto len = b ? 4 : 5;
+  memcpy(p, b ? "true" : "false", len);
+  response_.body_commit(len);
+  return *this;
+}
+
+json_writer &json_writer::value(long long v)
+{
+  auto p = start(24);
+  response_.body_commit(std::to_chars(p, p + 24, v).ptr - p);
+  return *this;
+}
+
+json_writer &json_writer::value(unsigned long long v)
+{
+  auto p = start(24);
+  response_.body_commit(std::to_chars(p, p + 24, v).ptr - p);
+  return *this;
+}
+
+json_writer &json_writer::value(double v)
+{
+  if (!std::isfinite(v))
+    return null();
+  // to_chars gives the shortest text that reads back as 'v'
+  auto p = start(32);
+  response_.body_commit(std::to_chars(p, p + 32, v).ptr - p);
+  return *this;
+}
+
+json_writer &json_writer::null()
+{
+  auto p = start(4);
+  memcpy(p, "null", 4);
+  response_.body_commit(4);
+  return *this;
+}
+
+json_writer &json_writer::raw(const char *json, size_t len)
+{
+  auto p = start(len);
+  memcpy(p, json, len);
+  response_.body_commit(len);
+  return *this;
+}
@@ -0,0 +1,177 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "http_server.h"
+#include "string_len.h"
+#include <string>
+
+// writes json straight into the body of an http_response, without
+// building a tree of it first:
+//
+//    json_writer w(response);
+//    w.begin_object();
+//    w.member("id", 12);
+//    w.key("tags").begin_array().value("a").value("b").end_array();
+//    w.end_object();
+//
+// writes {"id":12,"tags":["a","b"]}.  The commas and colons are
+// added for you.  Strings are escaped as they are copied in, finding
+// the characters that need it 16 or 32 bytes at a time the way
+// json_reader does.  Doubles are written in the shortest form that
+// reads back as the same value, and inf and nan (which json can't
+// represent) as null.
+//
+// json_writer doesn't check that what it is told to write makes
+// sense - a key outside of an object, say - it just writes it.
+class json_writer
+{
+public:
+  enum
+  {
+    k_max_depth = 128
+  };
+
+  explicit json_writer(http_response &response)
+      : response_(response)
+  {
+  }
+
+  json_writer(const json_writer &) = delete;
+  json_writer &operator=(const json_writer &) = delete;
+
+  json_writer &begin_object()
+  {
+    return open('{');
+  }
+
+  json_writer &end_object()
+  {
+    return close('}');
+  }
+
+  json_writer &begin_array()
+  {
+    return open('[');
+  }
+
+  json_writer &end_array()
+  {
+    return close(']');
+  }
+
+  json_writer &key(const char *k, size_t len);
+  json_writer &key(const char *k)
+  {
+    return key(k, strlen(k));
+  }
+  json_writer &key(const std::string &k)
+  {
+    return key(k.data(), k.size());
+  }
+  json_writer &key(const string_len &k)
+  {
+    return key(k.ptr(), k.len());
+  }
+
+  json_writer &value(const char *str, size_t len);
+  json_writer &value(const char *str)
+  {
+    return value(str, strlen(str));
+  }
+  json_writer &value(const std::string &str)
+  {
+    return value(str.data(), str.size());
+  }
+  json_writer &value(const string_len &str)
+  {
+    return value(str.ptr(), str.len());
+  }
+  json_writer &value(bool b);
+  json_writer &value(int v)
+  {
+    return value((long long)v);
+  }
+  json_writer &value(long v)
+  {
+    return value((long long)v);
+  }
+  json_writer &value(long long v);
+  json_writer &value(unsigned v)
+  {
+    return value((unsigned long long)v);
+  }
+  json_writer &value(unsigned long v)
+  {
+    return value((unsigned long long)v);
+  }
+  json_writer &value(unsigned long long v);
+  json_writer &value(double v);
+  json_writer &null();
+
+  // 'json', which must already be valid json, as a value
+  json_writer &raw(const char *json, size_t len);
+
+  template <typename K, typename V>
+  json_writer &member(const K &k, const V &v)
+  {
+    return key(k).value(v);
+  }
+
+  // the number of objects and arrays begun and not yet ended
+  int depth() const
+  {
+    return depth_;
+  }
+
+private:
+  // called before each value and key, to add the ',' that goes
+  // between them.  Returns where to write the next 'len' bytes.
+  char *start(size_t len)
+  {
+    if (after_key_)
+    {
+      after_key_ = false;
+      return response_.body_reserve(len);
+    }
+    auto p = response_.body_reserve(len + 1);
+    if (depth_ > 0 && !first_[depth_ - 1])
+    {
+      *p = ',';
+      response_.body_commit(1);
+      ++p;
+    }
+    if (depth_ > 0)
+      first_[depth_ - 1] = false;
+    return p;
+  }
+
+  json_writer &open(char c);
+  json_writer &close(char c);
+  void write_string(const char *str, size_t len);
+
+  http_response &response_;
+  int depth_{0};
+  bool after_key_{false};
+  bool first_[k_max_depth];
+};
@@ -0,0 +1,187 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "path_router.h"
+#include "log.h"
+
+namespace
+{
+
+bool is_hex(char c)
+{
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+int capture_type_of(const std::string &name_and_type, const std::string &spec)
+{
+  auto colon = name_and_type.find(':');
+  if (colon == std::string::npos)
+    return path_router::k_any;
+  auto type = name_and_type.substr(colon + 1);
+  if (type == "int")
+    return path_router::k_int;
+  if (type == "uuid")
+    return path_router::k_uuid;
+  if (type == "big_id")
+    return path_router::k_big_id;
+  anon_throw(std::runtime_error, "unknown path variable type: \"" << type << "\" in: " << spec);
+}
+
+} // namespace
+
+path_router::path_router()
+    : root_(new node)
+{
+}
+
+path_router::~path_router()
+{
+}
+
+int path_router::add(const std::string &spec)
+{
+  auto n = root_.get();
+  auto p = spec.c_str();
+  auto end = p + spec.size();
+  int num_captures = 0;
+  while (p < end)
+  {
+    auto brace = (const char *)memchr(p, '{', end - p);
+    if (!brace)
+      brace = end;
+    if (brace > p)
+      n = add_literal(n, p, brace);
+    if (brace == end)
+      break;
+    auto close = (const char *)memchr(brace, '}', end - brace);
+    if (!close)
+      anon_throw(std::runtime_error, "missing '}' in path: " << spec);
+    if (++num_captures > k_max_captures)
+      anon_throw(std::runtime_error, "more than " << (int)k_max_captures << " variables in path: " << spec);
+    n = add_capture(n, capture_type_of(std::string(brace + 1, close), spec));
+    p = close + 1;
+  }
+  if (n->route == -1)
+    n->route = num_routes_++;
+  return n->route;
+}
+
+path_router::node *path_router::add_literal(node *n, const char *p, const char *end)
+{
+  while (p < end)
+  {
+    if (*p != '/')
+      n->whole_segment = false;
+
+    node *next = nullptr;
+    for (auto &c : n->literals)
+    {
+      if (c->label[0] != *p)
+        continue;
+
+      size_t common = 1;
+      while (common < c->label.size() && p + common < end && c->label[common] == p[common])
+        ++common;
+
+      // split c where the new text differs from it
+      if (common < c->label.size())
+      {
+        std::unique_ptr<node> mid(new node);
+        mid->label = c->label.substr(0, common);
+        c->label.erase(0, common);
+        mid->whole_segment = c->label[0] == '/';
+        mid->literals.push_back(std::move(c));
+        c = std::move(mid);
+      }
+      next = c.get();
+      p += common;
+      break;
+    }
+
+    if (!next)
+    {
+      n->literals.emplace_back(new node);
+      next = n->literals.back().get();
+      next->label.assign(p, end);
+      p = end;
+    }
+    n = next;
+  }
+  return n;
+}
+
+path_router::node *path_router::add_capture(node *n, int type)
+{
+  n->whole_segment = false;
+  auto it = n->captures.begin();
+  while (it != n->captures.end() && (*it)->type < type)
+    ++it;
+  if (it != n->captures.end() && (*it)->type == type)
+    return it->get();
+  std::unique_ptr<node> c(new node);
+  c->type = type;
+  return n->captures.insert(it, std::move(c))->get();
+}
+
+bool path_router::valid(int type, const char *p, const char *end)
+{
+  auto len = end - p;
+  switch (type)
+  {
+  case k_int:
+    if (len > 0 && *p == '-')
+      ++p, --len;
+    // at most 18 digits, so it always fits in an int64_t
+    if (len < 1 || len > 18)
+      return false;
+    for (; p < end; p++)
+      if (*p < '0' || *p > '9')
+        return false;
+    return true;
+
+  case k_uuid:
+    if (len != 36)
+      return false;
+    for (int i = 0; i < 36; i++)
+    {
+      if (i == 8 || i == 13 || i == 18 || i == 23)
+      {
+        if (p[i] != '-')
+          return false;
+      }
+      else if (!is_hex(p[i]))
+        return false;
+    }
+    return true;
+
+  case k_big_id:
+    if (len != 64)
+      return false;
+    for (; p < end; p++)
+      if (!is_hex(*p))
+        return false;
+    return true;
+
+  default:
+    return true;
+  }
+}
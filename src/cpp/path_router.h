@@ -0,0 +1,162 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "string_len.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// a radix tree of url paths written in request_dispatcher's path_spec
+// syntax - literal text, with "{name}" standing for a variable part
+// that runs up to the next '/'.  "{name:int}", "{name:uuid}" and
+// "{name:big_id}" (64 hex digits) only match text of that shape.
+//
+// match walks the tree once along the path, trying literal text before
+// variables, and typed variables before untyped ones.  A variable that
+// can be followed by more text in its segment leaves room for that
+// before taking the whole segment, so "/a/{x}.json" is matched ahead
+// of "/a/{x}", whichever was added first.  It only backs up when what
+// it tried first leads nowhere, so the cost of matching depends on the
+// length of the path, not the number of routes.  The variable parts
+// are returned as string_len's pointing into the path.
+class path_router
+{
+public:
+  enum capture_type
+  {
+    // in the order they are tried
+    k_int,
+    k_uuid,
+    k_big_id,
+    k_any
+  };
+
+  enum
+  {
+    k_max_captures = 16
+  };
+
+  path_router();
+  ~path_router();
+
+  // add 'spec', returning its route id.  Ids count up from 0 in the
+  // order specs are added.  Adding the same spec again returns the id
+  // it got the first time.  Throws for specs with an unterminated '{',
+  // an unknown capture type, or more than k_max_captures variables.
+  int add(const std::string &spec);
+
+  // call f(route_id, num_captures) for the routes that match 'path',
+  // with captures[0] through captures[num_captures - 1] set to its
+  // variable parts, until f returns true.  Returns false if it never
+  // does.  'captures' must have room for k_max_captures.
+  template <typename Fn>
+  bool match(const string_len &path, string_len *captures, Fn f) const
+  {
+    return match(root_.get(), path.ptr(), path.ptr() + path.len(), captures, 0, f);
+  }
+
+  int num_routes() const
+  {
+    return num_routes_;
+  }
+
+  // whether [p, end) has the shape 'type' asks for
+  static bool valid(int type, const char *p, const char *end);
+
+private:
+  struct node
+  {
+    // literal text this node matches, empty for captures
+    std::string label;
+    int type{k_any};
+    int route{-1};
+
+    // true when everything that can follow this node starts with
+    // a '/' (or is the end of the path), so that when it is a
+    // capture it always takes the whole rest of the segment
+    bool whole_segment{true};
+
+    std::vector<std::unique_ptr<node>> literals; // each with a different first char
+    std::vector<std::unique_ptr<node>> captures; // sorted by type
+  };
+
+  node *add_literal(node *n, const char *p, const char *end);
+  node *add_capture(node *n, int type);
+
+  template <typename Fn>
+  bool match(const node *n, const char *p, const char *end, string_len *captures, int num, Fn &f) const
+  {
+    if (p == end)
+      return n->route != -1 && f(n->route, num);
+
+    for (auto &c : n->literals)
+    {
+      if (c->label[0] != *p)
+        continue;
+      auto len = c->label.size();
+      if ((size_t)(end - p) >= len && !memcmp(p + 1, c->label.data() + 1, len - 1) &&
+          match(c.get(), p + len, end, captures, num, f))
+        return true;
+      break;
+    }
+
+    if (n->captures.empty())
+      return false;
+    auto seg_end = (const char *)memchr(p, '/', end - p);
+    if (!seg_end)
+      seg_end = end;
+    if (seg_end == p)
+      return false;
+    for (auto &c : n->captures)
+    {
+      // like the ([^/]*) regex it replaces, a capture takes as much of
+      // the segment as it can, and only gives some of it back when
+      // what follows needs that.  But when more of the segment can
+      // follow it, the splits that leave some for that are tried
+      // first, so that "{x}.json" is matched ahead of "{x}" (and
+      // "{x}.json/y" ahead of "{x}/y") for "foo.json".
+      if (!c->whole_segment)
+      {
+        for (auto e = seg_end - 1; e > p; --e)
+        {
+          if (!valid(c->type, p, e))
+            continue;
+          captures[num] = string_len(p, e - p);
+          if (match(c.get(), e, end, captures, num + 1, f))
+            return true;
+        }
+      }
+      if (valid(c->type, p, seg_end))
+      {
+        captures[num] = string_len(p, seg_end - p);
+        if (match(c.get(), seg_end, end, captures, num + 1, f))
+          return true;
+      }
+    }
+    return false;
+  }
+
+  std::unique_ptr<node> root_;
+  int num_routes_{0};
+};
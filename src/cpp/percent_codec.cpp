@@ -62,6 +62,25 @@ std::string percent_decode(const std::string &encoded)
   return dec;
 }
 
+size_t percent_decode(const char *encoded, size_t len, char *decoded)
+{
+  auto end = encoded + len;
+  auto dec = decoded;
+  while (encoded < end)
+  {
+    if (*encoded != '%')
+    {
+      *dec++ = *encoded++;
+      continue;
+    }
+    if (end - encoded < 3 || !valid_hex(encoded[1]) || !valid_hex(encoded[2]))
+      anon_throw(std::runtime_error, "invalid encoded uri character");
+    *dec++ = nib(encoded[1]) * 16 + nib(encoded[2]);
+    encoded += 3;
+  }
+  return dec - decoded;
+}
+
 static char toa(int nib)
 {
   if (nib < 10)
@@ -26,3 +26,8 @@
 
 std::string percent_encode(const std::string &plain);
 std::string percent_decode(const std::string &encoded);
+
+// decode the 'len' bytes at 'encoded' into 'decoded', which needs room
+// for 'len' bytes (and can be the same as 'encoded'), returning the
+// length of the decoded text.
+size_t percent_decode(const char *encoded, size_t len, char *decoded);
@@ -25,17 +25,73 @@
 #include <string>
 #include <streambuf>
 #include <vector>
+#include <algorithm>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
 
 #if defined(ANON_AWS)
 #include <aws/core/utils/StringUtils.h>
 #endif
 
+// what try_read and try_write return.  'err' is 0 on success,
+// k_closed when the other end has closed or hung up, k_timed_out
+// when the pipe's io block time expired, and otherwise the errno
+// (or EPROTO for tls failures) of whatever went wrong.  'bytes'
+// is the number of bytes read, or written before the error.
+struct io_result
+{
+  enum
+  {
+    k_closed = -1,
+    k_timed_out = -2
+  };
+
+  size_t bytes;
+  int err;
+
+  explicit operator bool() const { return err == 0; }
+  bool closed() const { return err == k_closed; }
+  bool timed_out() const { return err == k_timed_out; }
+};
+
 class pipe_t
 {
 public:
   virtual ~pipe_t() {}
   virtual size_t read(void *buff, size_t len) const = 0;
   virtual void write(const void *buff, size_t len) const = 0;
+
+  // same as read and write, but report errors - including the
+  // other end closing - through the return value instead of
+  // throwing.  Use these where a closed connection is a normal
+  // event and not worth the cost of an exception.
+  virtual io_result try_read(void *buff, size_t len) const = 0;
+  virtual io_result try_write(const void *buff, size_t len) const = 0;
+
+  // writes 'len' bytes of the file 'fd', starting at 'offset' - which
+  // is advanced past whatever got written - reporting errors the same
+  // way try_write does.  This version copies the file through a buffer
+  // with pread, fiber_pipe overrides it to use sendfile(2) so the data
+  // never has to come up into user space.
+  virtual io_result try_sendfile(int fd, off_t &offset, size_t len) const
+  {
+    char buf[16 * 1024];
+    size_t total_bytes_written = 0;
+    while (total_bytes_written < len)
+    {
+      auto bytes_read = ::pread(fd, &buf[0], std::min(len - total_bytes_written, sizeof(buf)), offset);
+      if (bytes_read <= 0)
+        return io_result{total_bytes_written, bytes_read == 0 ? EIO : errno};
+      auto res = try_write(&buf[0], bytes_read);
+      offset += res.bytes;
+      total_bytes_written += res.bytes;
+      if (!res)
+        return io_result{total_bytes_written, res.err};
+    }
+    return io_result{total_bytes_written, 0};
+  }
+
   virtual void limit_io_block_time(int seconds) = 0;
   virtual int get_fd() const = 0;
   virtual void set_hibernating(bool hibernating) = 0;
@@ -22,159 +22,179 @@
 
 #include "request_dispatcher.h"
 #include "percent_codec.h"
+#include "big_id_serial.h"
+#include <algorithm>
 
 // path "specs" look like this:
 //
-//  some_host.com/some_partial_path/{thing_one}/some_more_partial_path/{thing_two}/maybe_even_more?queryName1&queryName2
+//  some_host.com/some_partial_path/{thing_one}/some_more_partial_path/{thing_two}/maybe_even_more?queryName1&queryName2?header1
 
-request_helper request_mapping_helper(const std::string &path_spec)
+namespace
 {
-  std::string path, query, headers;
-  pcrecpp::RE split_at_q("([^?]*)(.*)");
-  if (!split_at_q.FullMatch(path_spec, &path, &query))
-    anon_throw(std::runtime_error, "request_mapping failed, invalid path: " << path_spec);
-  if (query.size() > 0)
-  {
-    if (!split_at_q.FullMatch(query.substr(1), &query, &headers))
-      anon_throw(std::runtime_error, "request_mapping failed, invalid path: " << path);
-    if (headers.size() > 0)
-      headers = headers.substr(1);
-  }
-
-  // firgure out how many {foo} statments are in the path
-  pcrecpp::StringPiece input(path);
-  int count = 0;
-  pcrecpp::RE re1("({[^}]*})");
-  while (re1.FindAndConsume(&input))
-    ++count;
 
-  // construct a regular expression for what we will be parsing
-  // out of incomming uri's
-  std::string newre_str = path;
-  pcrecpp::RE("{[^}]*}").GlobalReplace("([^/]*)", &newre_str);
-
-  request_helper h(newre_str, count);
-
-  pcrecpp::RE split_at_and("([^&]+)");
-  if (query.size() > 0)
+void split_at_and(const std::string &items, std::vector<std::string> &into)
+{
+  size_t pos = 0;
+  while (pos < items.size())
   {
-    pcrecpp::StringPiece input(query);
-    std::string val;
-    while (split_at_and.FindAndConsume(&input, &val))
-      h.query_string_items.push_back(val);
+    auto e = items.find('&', pos);
+    if (e == std::string::npos)
+      e = items.size();
+    if (e > pos)
+      into.push_back(items.substr(pos, e - pos));
+    pos = e + 1;
   }
+}
+
+} // namespace
 
-  if (headers.size() > 0)
+request_helper request_mapping_helper(const std::string &path_spec)
+{
+  request_helper h;
+  auto q = path_spec.find('?');
+  h.path = path_spec.substr(0, q);
+  if (q != std::string::npos)
   {
-    pcrecpp::StringPiece input(headers);
-    std::string val;
-    while (split_at_and.FindAndConsume(&input, &val))
+    auto hd = path_spec.find('?', q + 1);
+    split_at_and(path_spec.substr(q + 1, hd == std::string::npos ? std::string::npos : hd - q - 1), h.query_string_items);
+    for (auto &it : h.query_string_items)
+    {
+      h.query_string_required.push_back(it[0] == '+');
+      if (it[0] == '+')
+        it.erase(0, 1);
+    }
+    if (hd != std::string::npos)
     {
-      h.header_items.push_back(val);
+      // the parser gives us header names in lower case
+      split_at_and(path_spec.substr(hd + 1), h.header_items);
+      // headers are always required, so a '+' doesn't change anything
+      for (auto &it : h.header_items)
+      {
+        if (it[0] == '+')
+          it.erase(0, 1);
+        std::transform(it.begin(), it.end(), it.begin(), ::tolower);
+      }
     }
   }
-
-  pcrecpp::RE split_at_var("([^?{]*)(.*)");
-  if (!split_at_var.FullMatch(path_spec, &h.non_var))
-    anon_throw(std::runtime_error, "request_mapping failed, invalid path");
-
   return h;
 }
 
-std::pair<bool, std::vector<std::string>> extract_params(const request_helper &h, const http_request &request, const std::string &path, const std::string &query, bool is_options)
+void query_index::parse()
 {
-  auto ret = std::make_pair(false, std::vector<std::string>());
+  parsed_ = true;
+  auto p = raw_.ptr();
+  auto end = p + raw_.len();
 
-  std::vector<std::string> p(8);
-  bool match = false;
-  switch (h.num_path_substitutions)
+  // fields are split before they are decoded, so an escaped '&' or
+  // '=' is part of a name or value.  Decoded text is never longer
+  // than the encoded, so decoded_ has room for all of it and doesn't
+  // move while the fields point into it.
+  char *d = 0;
+  if (memchr(p, '%', raw_.len()))
   {
-  case 0:
-    match = h.path_re.FullMatch(path);
-    break;
-  case 1:
-    match = h.path_re.FullMatch(path, &p[0]);
-    break;
-  case 2:
-    match = h.path_re.FullMatch(path, &p[0], &p[1]);
-    break;
-  case 3:
-    match = h.path_re.FullMatch(path, &p[0], &p[1], &p[2]);
-    break;
-  case 4:
-    match = h.path_re.FullMatch(path, &p[0], &p[1], &p[2], &p[3]);
-    break;
-  case 5:
-    match = h.path_re.FullMatch(path, &p[0], &p[1], &p[2], &p[3], &p[4]);
-    break;
-  case 6:
-    match = h.path_re.FullMatch(path, &p[0], &p[1], &p[2], &p[3], &p[4], &p[5]);
-    break;
-  case 7:
-    match = h.path_re.FullMatch(path, &p[0], &p[1], &p[2], &p[3], &p[4], &p[5], &p[6]);
-    break;
-  case 8:
-    match = h.path_re.FullMatch(path, &p[0], &p[1], &p[2], &p[3], &p[4], &p[5], &p[6], &p[7]);
-    break;
-  default:
-    break;
+    decoded_.resize(raw_.len());
+    d = &decoded_[0];
   }
-  if (!match)
-    return ret;
-  for (auto &v : p)
-  {
-    if (v.size() == 0)
-      break;
-    ret.second.push_back(v);
-  }
-  if (ret.second.size() != h.num_path_substitutions)
+  auto field = [&d](const char *b, const char *e) {
+    if (!d)
+      return string_len(b, e - b);
+    auto len = percent_decode(b, e - b, d);
+    string_len ret(d, len);
+    d += len;
     return ret;
+  };
 
-  if (h.query_string_items.size() > 0)
+  while (p < end && num_fields_ < k_max_fields)
   {
-    auto quer = percent_decode(query);
-    for (auto &it : h.query_string_items)
+    auto e = (const char *)memchr(p, '&', end - p);
+    if (!e)
+      e = end;
+    if (e > p)
     {
-      size_t pos = 0;
-      auto skip_len = it.size() + 1; // for the "="
-      while (true)
-      {
-        pos = quer.find(it + "=", pos);
-        if (pos == std::string::npos)
-          break;
-        if (pos == 0 || (quer[pos - 1] == '&'))
-          break;
-        pos = quer.find("&", pos + skip_len);
-      }
-      if (pos == std::string::npos)
-        ret.second.push_back("");
-      else
-      {
-        auto v = quer.substr(pos + skip_len);
-        ret.second.push_back(v.substr(0, v.find("&", 0)));
-      }
+      auto eq = (const char *)memchr(p, '=', e - p);
+      names_[num_fields_] = field(p, eq ? eq : e);
+      values_[num_fields_++] = eq ? field(eq + 1, e) : string_len();
     }
+    p = e + 1;
+  }
+}
+
+void extract_params(const request_helper &h, const http_request &request, route_match &m, bool is_options)
+{
+  for (size_t i = 0; i < h.query_string_items.size(); i++)
+  {
+    auto &it = h.query_string_items[i];
+    auto val = m.query_fields.find(it);
+    if (!val && !is_options && h.query_string_required[i])
+      throw_request_error(HTTP_STATUS_BAD_REQUEST, "missing, required query string value: " << it);
+    m.add(val ? *val : string_len());
   }
 
   if (!is_options && h.header_items.size() > 0)
   {
     for (auto &it : h.header_items)
     {
-      auto headers = request.headers;
+      auto &headers = request.headers;
       if (!headers.contains_header(it.c_str()))
         throw_request_error(HTTP_STATUS_BAD_REQUEST, "missing, required header: " << it);
-      ret.second.push_back(headers.get_header(it.c_str()).str());
+      m.add(headers.get_header(it.c_str()));
+    }
+  }
+}
+
+route_param::operator int64_t() const
+{
+  auto p = value.ptr();
+  auto e = p + value.len();
+  if (!path_router::valid(path_router::k_int, p, e))
+    throw_request_error(HTTP_STATUS_BAD_REQUEST, "invalid integer: \"" << value.str() << "\"");
+  bool neg = *p == '-';
+  if (neg)
+    ++p;
+  int64_t v = 0;
+  while (p < e)
+    v = v * 10 + (*p++ - '0');
+  return neg ? -v : v;
+}
+
+route_param::operator big_id() const
+{
+  auto p = value.ptr();
+  if (!path_router::valid(path_router::k_big_id, p, p + value.len()))
+    throw_request_error(HTTP_STATUS_BAD_REQUEST, "invalid id: \"" << value.str() << "\"");
+  big_id id;
+  for (int i = 0; i < big_id::id_size; i++, p += 2)
+    id.m_buf[i] = (priv::hex_to_i(p[0]) << 4) + priv::hex_to_i(p[1]);
+  return id;
+}
+
+void check_json_body(http_server::pipe_t &pipe, const http_request &request, size_t max_len)
+{
+  if (request.has_content_length)
+  {
+    auto clen = request.content_length;
+    if (clen < 2)
+      throw_request_error(HTTP_STATUS_NOT_ACCEPTABLE, "Content-Length cannot be less than 2 (" << clen << ")");
+    if ((size_t)clen > max_len)
+    {
+      struct sockaddr_in6 addr6;
+      socklen_t addr_len = sizeof(addr6);
+      getpeername(pipe.get_fd(), (struct sockaddr *)&addr6, &addr_len);
+      throw_request_error(HTTP_STATUS_PAYLOAD_TOO_LARGE, "Content-Length cannot exceed " << max_len << " (" << clen << " - " << addr6 << ")");
     }
   }
+  else if (!request.is_chunked)
+    throw_request_error(HTTP_STATUS_LENGTH_REQUIRED, "required Content-Length header is missing");
 
-  ret.first = true;
-  return ret;
+  // a chunked body can't be bigger than max_len either,
+  // read_body throws (413) if it is
+  pipe.set_max_body_size(max_len);
 }
 
 void respond_options(http_server::pipe_t &pipe, const http_request &request, const std::vector<std::string>& allowed_headers)
 {
   http_response response;
-  auto orig = request.headers.get_header("origin");
+  auto orig = request.headers.get_header(http_headers::k_origin);
   auto orig2 = orig.len() > 0 ? orig.str() : std::string("*");
   response.add_header("access-control-allow-origin", orig2);
   response.add_header("access-control-allow-methods", request.headers.get_header("access-control-request-method").str());
@@ -203,11 +223,12 @@ void respond_options(http_server::pipe_t &pipe, const http_request &request, con
 void request_dispatcher::dispatch(http_server::pipe_t &pipe, const http_request &request, bool is_tls)
 {
   request_wrap(request.method_str(), _cors_enabled, _allow_error_headers, pipe, request, [this, &pipe, &request, is_tls] {
-    std::string method = request.method_str();
+    const char *method = request.method_str();
     bool is_options = (_cors_enabled != 0) && (_options == method);
-    auto path = request.get_url_field(UF_PATH);
+    auto path = request.get_url_field_s(UF_PATH);
+    std::string cors_method;
     if (is_options) {
-      if (path == "*" || path == "") {
+      if (path.len() == 0 || (path.len() == 1 && *path.ptr() == '*')) {
         std::ostringstream oss;
         oss << "OPTIONS";
         if (_cors_enabled & http_server::k_enable_cors_get)
@@ -230,37 +251,40 @@ void request_dispatcher::dispatch(http_server::pipe_t &pipe, const http_request
       }
       if (!request.headers.contains_header("access-control-request-method"))
         throw_request_error(HTTP_STATUS_BAD_REQUEST, "OPTIONS request missing required access-control-request-method header");
-      method = request.headers.get_header("access-control-request-method").str();
+      cors_method = request.headers.get_header("access-control-request-method").str();
+      method = cors_method.c_str();
       bool chk = false;
-      if (method == "GET")
+      if (cors_method == "GET")
         chk = _cors_enabled & http_server::k_enable_cors_get;
-      else if (method == "HEAD")
+      else if (cors_method == "HEAD")
         chk = _cors_enabled & http_server::k_enable_cors_head;
-      else if (method == "POST")
+      else if (cors_method == "POST")
         chk = _cors_enabled & http_server::k_enable_cors_post;
-      else if (method == "PUT")
+      else if (cors_method == "PUT")
         chk = _cors_enabled & http_server::k_enable_cors_put;
-      else if (method == "DELETE")
+      else if (cors_method == "DELETE")
         chk = _cors_enabled & http_server::k_enable_cors_put;
       if (!chk)
         throw_request_error(HTTP_STATUS_METHOD_NOT_ALLOWED, "method not allowed: " << method);
     }
-    auto m = _map.find(method);
-    if (m == _map.end())
+    auto rt = _map.find(method);
+    if (rt == _map.end())
       throw_request_error(HTTP_STATUS_METHOD_NOT_ALLOWED, "method not allowed: " << method);
-    auto query = request.get_url_field(UF_QUERY);
-    auto e = m->second.upper_bound(path);
-    if (e == m->second.begin())
-    {
-      //anon_log("resource not found: " << method << " " << path);
-      throw_request_error(HTTP_STATUS_NOT_FOUND, "resource: \"" << path << "\" not found");
-    }
-    --e;
-    for (auto &f : e->second)
-    {
-      if (f(pipe, request, is_tls, path, query, is_options))
-        return;
-    }
+    route_match m(path, request.get_url_field_s(UF_QUERY));
+    string_len captures[path_router::k_max_captures];
+    auto found = rt->second.router.match(path, captures, [&](int route, int num_captures) {
+      for (auto &f : rt->second.responders[route])
+      {
+        m.num_params = 0;
+        for (int i = 0; i < num_captures; i++)
+          m.add(captures[i]);
+        if (f(pipe, request, is_tls, m, is_options))
+          return true;
+      }
+      return false;
+    });
+    if (found)
+      return;
     //anon_log("resource not found: " << method << " " << path);
     throw_request_error(HTTP_STATUS_NOT_FOUND, "resource: \"" << path << "\" not found");
   });
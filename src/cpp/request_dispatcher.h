@@ -23,8 +23,12 @@
 #pragma once
 
 #include "http_error.h"
+#include "response_cache.h"
+#include "path_router.h"
+#include "big_id.h"
+#include "json_reader.h"
+#include "json_writer.h"
 #include "nlohmann/json.hpp"
-#include <pcrecpp.h>
 #include "request_dispatcher_priv.h"
 
 /*
@@ -103,26 +107,38 @@
  * 
  *    "foo/{}/bar/{}/bonk/{}"
  * 
- * One rule about the way you specify path variables is that
- * they have to be the entire contents between the "/"'s.
- * That is, you can't give a path spec that looks like:
+ * A path variable takes everything up to the next "/", or
+ * as much of it as it can when the path_spec has more literal
+ * text after the variable in the same segment.  So:
  * 
  *    "foo/hello-{name}/bar"
  * 
- * and then provide a function whose arguments are:
- * 
- *    (pipe, request, string)
- * 
- * and use a GET request to "/myapi/foo/hello-bob/bar"
- * and try to capture just the "bob" of the url as your
- * string argument.  If you need to support urls like
- * this one, you need to specify the path spec as:
- * 
- *    "foo/{name}/bar"
- * 
- * and then remove the "hello-" part of the string yourself
- * when your function is called - it will be called with the
- * string "hello-bob".
+ * called with "/myapi/foo/hello-bob/bar" passes "bob".  All
+ * of the non-variable text in a path_spec is matched literally
+ * (it is not a regular expression).
+ * 
+ * Path variables can also be given a type, in which case
+ * they only match text of that shape:
+ * 
+ *    "{id:int}"      an optional '-' followed by up to 18 digits
+ *    "{id:uuid}"     8-4-4-4-12 hex digits
+ *    "{id:big_id}"   64 hex digits, as big_id's are printed
+ * 
+ * Paths are tried against literal text first, then typed
+ * variables, then untyped ones, so "items/{id:int}" and
+ * "items/{name}" can both be mapped, with "/myapi/items/12"
+ * going to the first and "/myapi/items/abc" to the second.
+ * The path_specs are compiled into a single tree (see
+ * path_router.h), so matching does not get slower as more
+ * of them are added.
+ * 
+ * The arguments for path variables, query string values and
+ * headers can be declared as std::string, or as string_len if
+ * you don't want the copy - in which case they point into the
+ * request and are only valid during the call.  They can also
+ * be declared int64_t or big_id, in which case a value that
+ * does not parse as one returns a 400 response to the caller
+ * without calling your function.
  * 
  * Query strings
  * 
@@ -210,6 +226,65 @@
  * as a json object request_dispatcher will return 400 responses
  * to the caller without calling your function.
  * 
+ * Bodies are limited to 16384 bytes by default - requests with
+ * bigger ones get a 413 response.  request_mapping_body takes a
+ * different limit as an optional last argument.
+ * 
+ * For bodies that are big, or that you would rather not turn
+ * into an nlohmann::json first, request_mapping_body_reader is
+ * the same as request_mapping_body except that the last argument
+ * to your function is a json_reader& (see json_reader.h).  It
+ * reads the body as you ask it for more tokens, so you can build
+ * whatever you want from it directly:
+ * 
+ *    rd.request_mapping_body_reader(
+ *        "POST",
+ *        "items",
+ *        [](http_server::pipe_t &pipe, const http_request &request, bool is_tls, json_reader &body) {
+ *          if (body.next() != json_reader::k_begin_array)
+ *            throw_request_error(HTTP_STATUS_BAD_REQUEST, "expected an array");
+ *          while (body.next() == json_reader::k_begin_object)
+ *            add_item(body);
+ *          ...
+ *        },
+ *        {}, 16 * 1024 * 1024);
+ * 
+ * With request_mapping_body_reader invalid json is only found
+ * when your function gets to it.  json_reader then throws, and
+ * if your function lets that exception go the caller gets a 400
+ * response.
+ * 
+ * Writing json responses
+ * 
+ * request_dispatcher::respond_json writes a json response with a
+ * json_writer (see json_writer.h), which puts the json straight
+ * into the response body instead of building an nlohmann::json
+ * and then copying what its dump() returns:
+ * 
+ *    request_dispatcher::respond_json(pipe, [&](json_writer &w) {
+ *      w.begin_object();
+ *      w.member("id", id);
+ *      w.member("name", name);
+ *      w.end_object();
+ *    });
+ * 
+ * Caching responses
+ * 
+ * For GET endpoints whose response stays the same for a while,
+ * request_mapping_cached takes the same arguments as
+ * request_mapping, plus a response_cache and the policy to use
+ * with it (see response_cache.h):
+ * 
+ *    auto cache = std::make_shared<response_cache>();
+ *    response_cache::policy pol;
+ *    pol.ttl_seconds = 5;
+ *    pol.stale_seconds = 30;
+ *    rd.request_mapping_cached("GET", "items/{id}?lang", cache, pol, ...);
+ * 
+ * The path, and the query string values and headers named in the
+ * path_spec are always part of the cache key, the policy can add
+ * more.
+ * 
  * Some final notes.
  * 
  * request_dispatcher is intended to to be used in a teflon-like
@@ -238,17 +313,36 @@
  */
 class request_dispatcher
 {
-  std::map<std::string, std::map<std::string, std::vector<std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>>>> _map;
-  pcrecpp::RE _split_at_var;
+  struct routes
+  {
+    path_router router;
+    std::vector<std::vector<route_responder>> responders; // by route id
+  };
+
+  std::map<std::string, routes, std::less<>> _map;
   std::string _root_path;
   std::string _options;
   std::string _allow_error_headers;
   int _cors_enabled;
 
+  void add_responder(const std::string &method, const request_helper &h, const route_responder &r)
+  {
+    auto &rt = _map[method];
+    auto id = rt.router.add(h.path);
+    if (id >= (int)rt.responders.size())
+      rt.responders.resize(id + 1);
+    rt.responders[id].push_back(r);
+  }
+
 public:
+  enum
+  {
+    // the largest body request_mapping_body reads, unless told otherwise
+    k_default_max_body = 16384
+  };
+
   request_dispatcher(const std::string &root_path, int cors_enabled = 0, const std::string& allow_error_headers = "")
-      : _split_at_var("([^?{]*)(.*)"),
-        _root_path(root_path),
+      : _root_path(root_path),
         _options("OPTIONS"),
         _cors_enabled(cors_enabled),
         _allow_error_headers(allow_error_headers)
@@ -258,24 +352,74 @@ public:
   template <typename Fn>
   void request_mapping(const std::string &method, const std::string &path_spec, Fn f,
      const std::vector<std::string>& allowed_headers = std::vector<std::string>())
+  {
+    auto h = request_mapping_helper(_root_path + path_spec);
+    add_responder(method, h, get_map_responder(f, allowed_headers, h));
+  }
+
+  // same as request_mapping, but with the responses kept in 'cache' and
+  // reused as described by 'pol'.  The query string values and headers
+  // named in 'path_spec' are added to the ones pol says are part of
+  // the key.
+  template <typename Fn>
+  void request_mapping_cached(const std::string &method, const std::string &path_spec,
+                              const std::shared_ptr<response_cache> &cache, const response_cache::policy &pol, Fn f,
+                              const std::vector<std::string> &allowed_headers = std::vector<std::string>())
   {
     auto full_path_spec = _root_path + path_spec;
-    std::string non_var, var;
-    if (!_split_at_var.FullMatch(full_path_spec, &non_var, &var))
-      anon_throw(std::runtime_error, "path split failed, invalid path: " << full_path_spec);
-    _map[method][non_var].push_back(get_map_responder(f, allowed_headers, request_mapping_helper(full_path_spec)));
+    auto h = request_mapping_helper(full_path_spec);
+    auto key_pol = pol;
+    key_pol.query_fields.insert(key_pol.query_fields.end(), h.query_string_items.begin(), h.query_string_items.end());
+    key_pol.vary.insert(key_pol.vary.end(), h.header_items.begin(), h.header_items.end());
+    auto key_prefix = method + " " + full_path_spec;
+    auto responder = get_map_responder(f, allowed_headers, h);
+    add_responder(method, h, [responder, cache, key_pol, key_prefix](http_server::pipe_t &pipe, const http_request &request, bool is_tls,
+                                                                      route_match &m, bool is_options) -> bool {
+      if (is_options)
+        return responder(pipe, request, is_tls, m, is_options);
+      return cache->serve(key_pol, key_prefix, pipe, request, m.path.str(), m.query.str(), [&](http_server::pipe_t &cap_pipe) {
+        return responder(cap_pipe, request, is_tls, m, false);
+      });
+    });
   }
 
   template <typename Fn>
   void request_mapping_body(const std::string &method, const std::string &path_spec, Fn f,
-    const std::vector<std::string>& allowed_headers = std::vector<std::string>())
+    const std::vector<std::string>& allowed_headers = std::vector<std::string>(), size_t max_body = k_default_max_body)
   {
-    auto full_path_spec = _root_path + path_spec;
-    std::string non_var, var;
-    if (!_split_at_var.FullMatch(full_path_spec, &non_var, &var))
-      anon_throw(std::runtime_error, "path split failed, invalid path: " << full_path_spec);
-    _map[method][non_var].push_back(get_map_responder_body(f, allowed_headers, request_mapping_helper(full_path_spec)));
+    auto h = request_mapping_helper(_root_path + path_spec);
+    add_responder(method, h, get_map_responder_body<nlohmann::json>(f, allowed_headers, h, max_body));
+  }
+
+  // same as request_mapping_body, except that the function's last
+  // argument is a json_reader&, that reads the body as the function
+  // asks for it
+  template <typename Fn>
+  void request_mapping_body_reader(const std::string &method, const std::string &path_spec, Fn f,
+    const std::vector<std::string>& allowed_headers = std::vector<std::string>(), size_t max_body = k_default_max_body)
+  {
+    auto h = request_mapping_helper(_root_path + path_spec);
+    add_responder(method, h, get_map_responder_body<json_reader>(f, allowed_headers, h, max_body));
   }
 
   void dispatch(http_server::pipe_t &pipe, const http_request &request, bool is_tls);
+
+  // respond with the json that 'f' writes with the json_writer it is
+  // called with.  The second form uses the status and headers that
+  // 'response' already has.
+  template <typename Fn>
+  static void respond_json(http_server::pipe_t &pipe, Fn f)
+  {
+    http_response response;
+    respond_json(pipe, response, f);
+  }
+
+  template <typename Fn>
+  static void respond_json(http_server::pipe_t &pipe, http_response &response, Fn f)
+  {
+    response.add_header("content-type", "application/json");
+    json_writer writer(response);
+    f(writer);
+    pipe.respond(response);
+  }
 };
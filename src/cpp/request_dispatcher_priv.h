@@ -22,60 +22,156 @@
 
 struct request_helper
 {
-  pcrecpp::RE path_re;
-  int num_path_substitutions;
-  std::string non_var;
+  // the part of the path_spec before any '?'
+  std::string path;
   std::vector<std::string> query_string_items;
+  std::vector<bool> query_string_required; // the ones written "+name"
   std::vector<std::string> header_items;
+};
+
+// a path variable, query string value or header value, as passed to a
+// request_mapping function.  It converts to whatever type the function
+// takes it as - std::string, string_len (which points into the request,
+// so is only good until the function returns), int64_t (or any other
+// number type), or big_id.  Converting something that isn't a number
+// or a big_id to one of those gets a 400 response.
+struct route_param
+{
+  string_len value;
+
+  operator std::string() const { return value.str(); }
+  operator string_len() const { return value; }
+  operator int64_t() const;
+  operator big_id() const;
+};
+
+// the name=value fields of a request's query string.  They are split
+// and percent decoded the first time one is looked up, and from then
+// on shared by all of the mappings dispatch tries for the request.
+// Unless the query string has %-escapes the names and values point
+// straight into it, without allocating anything.  Fields after the
+// first k_max_fields are ignored.
+class query_index
+{
+public:
+  enum
+  {
+    k_max_fields = 32
+  };
+
+  explicit query_index(const string_len &query)
+      : raw_(query)
+  {
+  }
+
+  // the value of the first field called 'name', or null if there isn't one
+  const string_len *find(const std::string &name)
+  {
+    if (!parsed_)
+      parse();
+    for (int i = 0; i < num_fields_; i++)
+      if (names_[i].len() == name.size() && !memcmp(names_[i].ptr(), name.c_str(), name.size()))
+        return &values_[i];
+    return 0;
+  }
+
+private:
+  void parse();
+
+  string_len raw_;
+  bool parsed_{false};
+  int num_fields_{0};
+  string_len names_[k_max_fields];
+  string_len values_[k_max_fields];
+  std::string decoded_;
+};
+
+// what dispatch found for a request, passed to the function that runs
+// the request_mapping's function.  params starts with the path's
+// variables, and extract_params adds the query string and header
+// values.
+struct route_match
+{
+  route_match(const string_len &path, const string_len &query)
+      : path(path),
+        query(query),
+        query_fields(query)
+  {
+  }
+
+  string_len path;
+  string_len query;
+  query_index query_fields;
+  int num_params{0};
+  route_param params[path_router::k_max_captures * 2];
 
-  request_helper(const pcrecpp::RE &path_re, int num_path_substitutions)
-      : path_re(path_re),
-        num_path_substitutions(num_path_substitutions)
+  void add(const string_len &value)
   {
+    if (num_params == sizeof(params) / sizeof(params[0]))
+      throw_request_error(HTTP_STATUS_BAD_REQUEST, "too many parameters");
+    params[num_params++].value = value;
   }
 };
 
+typedef std::function<bool(http_server::pipe_t &, const http_request &, bool, route_match &, bool)> route_responder;
+
 request_helper request_mapping_helper(const std::string &path_spec);
 
+// checks the body of a request that is going to be read as json:
+// that it is either chunked or has a content-length, and isn't bigger
+// than 'max_len'.  Throws request_error (411, 413 etc...) when it
+// isn't.  Sets the pipe's max body size to 'max_len'.
+void check_json_body(http_server::pipe_t &pipe, const http_request &request, size_t max_len);
+
 template <typename Fn, typename... Args>
-void body_as_json(http_server::pipe_t &pipe, const http_request &request, bool is_tls, Fn f, Args &&... args)
-{
-  // auto &h = request.headers;
-  if (!request.has_content_length)
-    throw_request_error(HTTP_STATUS_LENGTH_REQUIRED, "required Content-Length header is missing");
-  auto clen = request.content_length;
-  if (clen < 2)
-    throw_request_error(HTTP_STATUS_NOT_ACCEPTABLE, "Content-Length cannot be less than 2 (" << clen << ")");
-  if (clen > 16384) {
-    struct sockaddr_in6 addr6;
-    socklen_t addr_len = sizeof(addr6);
-    getpeername(pipe.get_fd(), (struct sockaddr *)&addr6, &addr_len);
-    throw_request_error(HTTP_STATUS_PAYLOAD_TOO_LARGE, "Content-Length cannot exceed 16384 (" << clen << " - " << addr6 << ")");
-  }
-  std::vector<char> buff(clen);
-  auto bytes_read = 0;
-  while (bytes_read < clen)
-    bytes_read += pipe.read(&buff[bytes_read], clen - bytes_read);
+void body_as_json(http_server::pipe_t &pipe, const http_request &request, bool is_tls, size_t max_len, Fn f, Args &&... args)
+{
+  check_json_body(pipe, request, max_len);
+  std::vector<char> buff(request.has_content_length ? request.content_length + 1 : max_len + 1);
+  size_t bytes_read = 0;
+  while (auto n = pipe.read_body(&buff[bytes_read], buff.size() - bytes_read))
+    bytes_read += n;
+  buff.resize(bytes_read);
   nlohmann::json body = nlohmann::json::parse(buff.begin(), buff.end());
   f(pipe, request, is_tls, std::forward<Args>(args)..., body);
 }
 
+// the json_reader reads the body as the function asks for more of it
+template <typename Fn, typename... Args>
+void body_as_json_reader(http_server::pipe_t &pipe, const http_request &request, bool is_tls, size_t max_len, Fn f, Args &&... args)
+{
+  check_json_body(pipe, request, max_len);
+  json_reader body([&pipe](char *buf, size_t len) { return pipe.read_body(buf, len); });
+  f(pipe, request, is_tls, std::forward<Args>(args)..., body);
+}
+
+template <typename Fn, typename... Args>
+void body_as(nlohmann::json *, http_server::pipe_t &pipe, const http_request &request, bool is_tls, size_t max_len, Fn f, Args &&... args)
+{
+  body_as_json(pipe, request, is_tls, max_len, f, std::forward<Args>(args)...);
+}
+
+template <typename Fn, typename... Args>
+void body_as(json_reader *, http_server::pipe_t &pipe, const http_request &request, bool is_tls, size_t max_len, Fn f, Args &&... args)
+{
+  body_as_json_reader(pipe, request, is_tls, max_len, f, std::forward<Args>(args)...);
+}
+
 void respond_options(http_server::pipe_t &pipe, const http_request &request, const std::vector<std::string>& allowed_headers);
 
 #define n_pipe *(http_server::pipe_t *)0
 #define n_request *(http_request *)0
-#define n_json *(nlohmann::json *)0
+#define n_body *(Body *)0
+#define n_param *(route_param *)0
 
 
-std::pair<bool, std::vector<std::string>> extract_params(const request_helper &h, const http_request &request, const std::string &path, const std::string &query, bool is_options);
+void extract_params(const request_helper &h, const http_request &request, route_match &m, bool is_options);
 
 template <typename Fn>
-auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false)), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &s, bool)>())
+auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
@@ -85,166 +181,144 @@ auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, co
 }
 
 template <typename Fn>
-auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string())), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, n_param)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      f(pipe, request, is_tls, params.second[0]);
+      f(pipe, request, is_tls, m.params[0]);
     return true;
   };
 }
 
 template <typename Fn>
-auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), std::string())), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_param)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query,bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      f(pipe, request, is_tls, params.second[0], params.second[1]);
+      f(pipe, request, is_tls, m.params[0], m.params[1]);
     return true;
   };
 }
 
 template <typename Fn>
-auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), std::string(), std::string())), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_param, n_param)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      f(pipe, request, is_tls, params.second[0], params.second[1], params.second[2]);
+      f(pipe, request, is_tls, m.params[0], m.params[1], m.params[2]);
     return true;
   };
 }
 
 template <typename Fn>
-auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), std::string(), std::string(), std::string())), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_param, n_param, n_param)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      f(pipe, request, is_tls, params.second[0], params.second[1], params.second[2], params.second[3]);
+      f(pipe, request, is_tls, m.params[0], m.params[1], m.params[2], m.params[3]);
     return true;
   };
 }
 
 template <typename Fn>
-auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), std::string(), std::string(), std::string(), std::string())), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+auto get_map_responder(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_param, n_param, n_param, n_param)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      f(pipe, request, is_tls, params.second[0], params.second[1], params.second[2], params.second[3], params.second[4]);
+      f(pipe, request, is_tls, m.params[0], m.params[1], m.params[2], m.params[3], m.params[4]);
     return true;
   };
 }
 
-template <typename Fn>
-auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, n_json)), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+template <typename Body, typename Fn>
+auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h, size_t max_body) -> decltype((void)(f(n_pipe, n_request, false, n_body)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h, max_body](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      body_as_json(pipe, request, is_tls, f);
+      body_as((Body *)0, pipe, request, is_tls, max_body, f);
     return true;
   };
 }
 
-template <typename Fn>
-auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), n_json)), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+template <typename Body, typename Fn>
+auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h, size_t max_body) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_body)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h, max_body](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      body_as_json(pipe, request, is_tls, f, params.second[0]);
+      body_as((Body *)0, pipe, request, is_tls, max_body, f, m.params[0]);
     return true;
   };
 }
 
-template <typename Fn>
-auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), std::string(), n_json)), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+template <typename Body, typename Fn>
+auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h, size_t max_body) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_param, n_body)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h, max_body](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      body_as_json(pipe, request, is_tls, f, params.second[0], params.second[1]);
+      body_as((Body *)0, pipe, request, is_tls, max_body, f, m.params[0], m.params[1]);
     return true;
   };
 }
 
-template <typename Fn>
-auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), std::string(), std::string(), n_json)), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+template <typename Body, typename Fn>
+auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h, size_t max_body) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_param, n_param, n_body)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h, max_body](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      body_as_json(pipe, request, is_tls, f, params.second[0], params.second[1], params.second[2]);
+      body_as((Body *)0, pipe, request, is_tls, max_body, f, m.params[0], m.params[1], m.params[2]);
     return true;
   };
 }
 
-template <typename Fn>
-auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), std::string(), std::string(), std::string(), n_json)), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+template <typename Body, typename Fn>
+auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h, size_t max_body) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_param, n_param, n_param, n_body)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h, max_body](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      body_as_json(pipe, request, is_tls, f, params.second[0], params.second[1], params.second[2], params.second[3]);
+      body_as((Body *)0, pipe, request, is_tls, max_body, f, m.params[0], m.params[1], m.params[2], m.params[3]);
     return true;
   };
 }
 
-template <typename Fn>
-auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h) -> decltype((void)(f(n_pipe, n_request, false, std::string(), std::string(), std::string(), std::string(), std::string(), n_json)), std::function<bool(http_server::pipe_t &, const http_request &, bool, const std::string &, const std::string &, bool)>())
+template <typename Body, typename Fn>
+auto get_map_responder_body(Fn f, const std::vector<std::string>& allowed_headers, const request_helper &h, size_t max_body) -> decltype((void)(f(n_pipe, n_request, false, n_param, n_param, n_param, n_param, n_param, n_body)), route_responder())
 {
-  return [f, allowed_headers, h](http_server::pipe_t &pipe, const http_request &request, bool is_tls, const std::string &path, const std::string &query, bool is_options) -> bool {
-    auto params = extract_params(h, request, path, query, is_options);
-    if (!params.first)
-      return false;
+  return [f, allowed_headers, h, max_body](http_server::pipe_t &pipe, const http_request &request, bool is_tls, route_match &m, bool is_options) -> bool {
+    extract_params(h, request, m, is_options);
     if (is_options)
       respond_options(pipe, request, allowed_headers);
     else
-      body_as_json(pipe, request, is_tls, f, params.second[0], params.second[1], params.second[2], params.second[3], params.second[4]);
+      body_as((Body *)0, pipe, request, is_tls, max_body, f, m.params[0], m.params[1], m.params[2], m.params[3], m.params[4]);
     return true;
   };
 }
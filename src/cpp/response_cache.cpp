@@ -0,0 +1,355 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "response_cache.h"
+#include "time_utils.h"
+#include <algorithm>
+
+namespace
+{
+
+enum
+{
+  // rough cost of an entry beyond its key, headers and body
+  k_entry_overhead = 128
+};
+
+// a stream that collects the response a handler sends through the
+// pipe_t it's given, and reads the request's body from the real one
+struct capture : public http_server::stream
+{
+  capture(http_server::pipe_t &pipe)
+      : pipe(pipe)
+  {
+  }
+
+  size_t read_body(void *buff, size_t len) override
+  {
+    return pipe.read_body(buff, len);
+  }
+
+  void send_head(const http_response &head, int64_t content_length, bool vary,
+                 const char *content_encoding, bool end_stream) override
+  {
+    response = std::make_shared<http_response>();
+    response->copy_head(head);
+  }
+
+  void send_body(const void *buff, size_t len, bool end_stream) override
+  {
+    if (len > 0)
+      *response << string_len((const char *)buff, len);
+  }
+
+  http_server::pipe_t &pipe;
+  std::shared_ptr<http_response> response;
+};
+
+bool has_token(const string_len &list, const char *token)
+{
+  std::string l = list.str();
+  std::transform(l.begin(), l.end(), l.begin(), ::tolower);
+  return l.find(token) != std::string::npos;
+}
+
+bool cacheable(const http_response &response)
+{
+  auto code = atoi(response.get_status_code().c_str());
+  if (code != 200 && code != 203 && code != 204 && code != 301 && code != 404 && code != 410)
+    return false;
+  if (response.has_header("set-cookie"))
+    return false;
+  auto cc = response.get_header("cache-control");
+  return !has_token(cc, "no-store") && !has_token(cc, "no-cache") && !has_token(cc, "private");
+}
+
+std::string body_etag(const http_response &response)
+{
+  // fnv-1a
+  uint64_t h = 14695981039346656037ULL;
+  auto p = (const unsigned char *)response.body_data();
+  auto end = p + response.body_size();
+  while (p < end)
+    h = (h ^ *p++) * 1099511628211ULL;
+  char etag[24];
+  snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)h);
+  return etag;
+}
+
+} // namespace
+
+response_cache::response_cache(size_t max_bytes, int num_shards)
+    : max_shard_bytes_(max_bytes / std::max(num_shards, 1)),
+      hits_(0),
+      stale_hits_(0),
+      misses_(0),
+      collapsed_(0),
+      not_modified_(0),
+      evictions_(0)
+{
+  for (int i = 0; i < std::max(num_shards, 1); i++)
+    shards_.emplace_back(new shard);
+}
+
+std::string response_cache::make_key(const policy &pol, const std::string &key_prefix, const http_request &request,
+                                     const std::string &path, const std::string &query) const
+{
+  std::string key(key_prefix);
+  key += '\n';
+  key += request.method_str();
+  key += ' ';
+  key += path;
+  if (pol.whole_query)
+  {
+    key += '?';
+    key += query;
+  }
+  else
+  {
+    string_len q(query.c_str(), query.size());
+    for (auto &f : pol.query_fields)
+    {
+      key += '\n';
+      key += f;
+      key += '=';
+      key += http_request::get_query_val_s(q, f.c_str());
+    }
+  }
+  for (auto &h : pol.vary)
+  {
+    auto v = request.headers.get_header(h.c_str());
+    key += '\n';
+    key += h;
+    key += ':';
+    key.append(v.ptr(), v.len());
+  }
+  return key;
+}
+
+bool response_cache::serve(const policy &pol, const std::string &key_prefix, http_server::pipe_t &pipe,
+                           const http_request &request, const std::string &path, const std::string &query,
+                           const std::function<bool(http_server::pipe_t &)> &fill)
+{
+  if (request.method != HTTP_GET && request.method != HTTP_HEAD)
+    return fill(pipe);
+
+  auto key = make_key(pol, key_prefix, request, path, query);
+  auto &s = *shards_[std::hash<std::string>()(key) % shards_.size()];
+  std::shared_ptr<const http_response> response;
+
+  // whether what this request's handler responds with can be kept.
+  // false when it is running because the handler it waited for
+  // didn't leave anything that could be.
+  bool fills = true;
+  {
+    fiber_lock lock(s.mtx);
+    uint64_t waited_for = 0;
+    while (true)
+    {
+      auto now = cur_time();
+      auto it = s.map.find(key);
+      if (it == s.map.end())
+      {
+        s.lru.emplace_front();
+        auto &e = s.lru.front();
+        e.key = key;
+        e.filling = true;
+        e.fill = ++s.fills;
+        s.map[key] = s.lru.begin();
+        break;
+      }
+
+      auto &e = *it->second;
+      if (e.response && now < e.stale_until && (now < e.fresh_until || e.filling))
+      {
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        response = e.response;
+        ++(now < e.fresh_until ? hits_ : stale_hits_);
+        break;
+      }
+
+      if (!e.filling)
+      {
+        e.filling = true;
+        e.fill = ++s.fills;
+        break;
+      }
+
+      // rather than queue up behind each other one at a time when the
+      // response can't be kept, everyone who waited runs the handler
+      if (waited_for != 0 && waited_for != e.fill)
+      {
+        fills = false;
+        break;
+      }
+      if (waited_for == 0)
+        ++collapsed_;
+      waited_for = e.fill;
+      s.filled.wait(lock);
+    }
+  }
+
+  if (!response)
+  {
+    ++misses_;
+    capture cap(pipe);
+    http_server::pipe_t cap_pipe(pipe, &cap);
+    bool handled;
+    try
+    {
+      handled = fill(cap_pipe);
+      cap_pipe.end_chunked();
+    }
+    catch (...)
+    {
+      if (fills)
+        finish(s, key, pol, nullptr);
+      throw;
+    }
+
+    auto r = handled ? cap.response : nullptr;
+    bool keep = r && cacheable(*r);
+    if (keep)
+    {
+      if (!r->has_header("etag"))
+        r->add_header("etag", body_etag(*r));
+      if (pol.vary.size() > 0 && !r->has_header("vary"))
+      {
+        std::string vary;
+        for (auto &h : pol.vary)
+          vary += (vary.size() ? ", " : "") + h;
+        r->add_header("vary", vary);
+      }
+    }
+    if (fills)
+      finish(s, key, pol, keep ? r : nullptr);
+    if (!handled)
+      return false;
+    if (!r)
+      return true;
+    response = r;
+  }
+
+  respond(pipe, request, *response);
+  return true;
+}
+
+void response_cache::finish(shard &s, const std::string &key, const policy &pol,
+                            const std::shared_ptr<const http_response> &response)
+{
+  fiber_lock lock(s.mtx);
+  auto it = s.map.find(key);
+  if (it != s.map.end())
+  {
+    auto &e = *it->second;
+    e.filling = false;
+    auto size = response ? key.size() + response->header_size() + response->body_size() + k_entry_overhead : 0;
+    if (response && size <= max_shard_bytes_)
+    {
+      s.bytes += size - e.size;
+      e.response = response;
+      e.size = size;
+      e.fresh_until = cur_time() + pol.ttl_seconds;
+      e.stale_until = e.fresh_until + pol.stale_seconds;
+      s.lru.splice(s.lru.begin(), s.lru, it->second);
+    }
+    else if (response || !e.response)
+    {
+      // too big to keep, or the handler failed without there being
+      // an older response to go on serving until it goes stale
+      s.bytes -= e.size;
+      s.lru.erase(it->second);
+      s.map.erase(it);
+    }
+
+    // entries being filled stay put, their key is being waited on
+    auto l = s.lru.end();
+    while (s.bytes > max_shard_bytes_ && l != s.lru.begin())
+    {
+      --l;
+      if (l->filling)
+        continue;
+      s.bytes -= l->size;
+      s.map.erase(l->key);
+      l = s.lru.erase(l);
+      ++evictions_;
+    }
+  }
+  s.filled.notify_all();
+}
+
+void response_cache::respond(http_server::pipe_t &pipe, const http_request &request, const http_response &response)
+{
+  auto code = atoi(response.get_status_code().c_str());
+  if (code >= 200 && code < 300)
+  {
+    auto etag = response.get_header("etag");
+    if (request.if_none_match(etag))
+    {
+      http_response not_modified("304 Not Modified");
+      not_modified.add_header("etag", etag.str());
+      for (auto h : {"cache-control", "expires", "vary"})
+        if (response.has_header(h))
+          not_modified.add_header(h, response.get_header(h).str());
+      ++not_modified_;
+      pipe.respond(not_modified);
+      return;
+    }
+  }
+  pipe.respond(response);
+}
+
+void response_cache::clear()
+{
+  for (auto &sp : shards_)
+  {
+    auto &s = *sp;
+    fiber_lock lock(s.mtx);
+    for (auto it = s.lru.begin(); it != s.lru.end();)
+    {
+      s.bytes -= it->size;
+      if (it->filling)
+      {
+        it->response.reset();
+        it->size = 0;
+        ++it;
+      }
+      else
+      {
+        s.map.erase(it->key);
+        it = s.lru.erase(it);
+      }
+    }
+  }
+}
+
+response_cache::stats_t response_cache::stats() const
+{
+  stats_t st{hits_, stale_hits_, misses_, collapsed_, not_modified_, evictions_, 0, 0};
+  for (auto &sp : shards_)
+  {
+    fiber_lock lock(sp->mtx);
+    st.bytes += sp->bytes;
+    st.entries += sp->map.size();
+  }
+  return st;
+}
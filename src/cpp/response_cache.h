@@ -0,0 +1,151 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "http_server.h"
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// a short lived cache of whole responses, for handlers whose response
+// stays the same for seconds at a time.  Most easily used through
+// request_dispatcher::request_mapping_cached.
+//
+// Responses are keyed by method, path and whichever query fields and
+// request headers the policy names - nothing else about the request
+// is looked at, so a handler whose response depends on anything more
+// (a cookie, the body) must name it or not be cached.  A response is
+// fresh for ttl_seconds, and then for stale_seconds more it is still
+// served to everyone except one request, which runs the handler again
+// to replace it.  When a key isn't in the cache, or has gone past
+// stale, concurrent requests for it wait for the first one's handler
+// rather than all running it.
+//
+// Only 200, 203, 204, 301, 404 and 410 responses without set-cookie
+// or a cache-control of no-store, no-cache or private are kept.  The
+// handler's response is collected whole before anything is sent, so
+// a chunked response is sent as one body, with a content-length.
+// Kept responses are given a strong etag (a hash of the body) if the
+// handler didn't set one, and requests with a matching if-none-match
+// get a 304.  Memory is bounded by max_bytes, split over a number of
+// shards that each have their own lock and lru list.
+class response_cache
+{
+public:
+  struct policy
+  {
+    int ttl_seconds{1};
+    int stale_seconds{0};
+
+    // query string fields that are part of the key.  The rest of the
+    // query string is ignored unless whole_query is true, in which case
+    // all of it is part of the key.
+    std::vector<std::string> query_fields;
+    bool whole_query{false};
+
+    // names of request headers that are part of the key.
+    // Also sent back in a vary header.
+    std::vector<std::string> vary;
+  };
+
+  enum
+  {
+    k_default_max_bytes = 64 * 1024 * 1024,
+    k_default_shards = 16
+  };
+
+  response_cache(size_t max_bytes = k_default_max_bytes, int num_shards = k_default_shards);
+
+  // respond to 'request' from the cache, or with what 'fill' responds
+  // with when it's not there.  'fill' is called with a pipe_t whose
+  // response is collected rather than sent, and returns false if it
+  // doesn't handle 'request' after all (so the request_dispatcher can
+  // try the next mapping), in which case serve returns false without
+  // having sent anything.  'key_prefix' keeps keys for different
+  // handlers sharing one response_cache apart.  Exceptions thrown by
+  // 'fill' are passed on, and its response isn't kept.
+  bool serve(const policy &pol, const std::string &key_prefix, http_server::pipe_t &pipe,
+             const http_request &request, const std::string &path, const std::string &query,
+             const std::function<bool(http_server::pipe_t &)> &fill);
+
+  // drop everything that isn't being filled right now
+  void clear();
+
+  struct stats_t
+  {
+    uint64_t hits;         // fresh responses sent from the cache
+    uint64_t stale_hits;   // stale ones, sent while being refreshed
+    uint64_t misses;       // requests that ran the handler
+    uint64_t collapsed;    // requests that waited on another's handler
+    uint64_t not_modified; // 304's
+    uint64_t evictions;
+    size_t bytes;
+    size_t entries;
+  };
+
+  stats_t stats() const;
+
+private:
+  struct entry
+  {
+    std::string key;
+    std::shared_ptr<const http_response> response;
+    struct timespec fresh_until;
+    struct timespec stale_until;
+    size_t size{0};
+
+    // a request is running the handler for this key, the
+    // fill'th one to run on this shard
+    bool filling{false};
+    uint64_t fill{0};
+  };
+
+  struct shard
+  {
+    fiber_mutex mtx;
+    fiber_cond filled;
+    std::list<entry> lru; // most recently used at the front
+    std::unordered_map<std::string, std::list<entry>::iterator> map;
+    size_t bytes{0};
+    uint64_t fills{0};
+  };
+
+  std::string make_key(const policy &pol, const std::string &key_prefix, const http_request &request,
+                       const std::string &path, const std::string &query) const;
+  void finish(shard &s, const std::string &key, const policy &pol,
+              const std::shared_ptr<const http_response> &response);
+  void respond(http_server::pipe_t &pipe, const http_request &request, const http_response &response);
+
+  size_t max_shard_bytes_;
+  std::vector<std::unique_ptr<shard>> shards_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> stale_hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> collapsed_;
+  std::atomic<uint64_t> not_modified_;
+  std::atomic<uint64_t> evictions_;
+};
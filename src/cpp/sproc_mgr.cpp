@@ -335,7 +335,7 @@ void watch_for_child_death_and_restart(int child_pid)
 
 } // namespace
 
-void sproc_mgr_init(int port, int private_port, const std::vector<int> udp_ports, bool udp_is_ipv6)
+void sproc_mgr_init(int port, int private_port, const std::vector<int> udp_ports, bool udp_is_ipv6, bool reuseport)
 {
   // no SOCK_CLOEXEC since we inherit this socket down to the child
   listen_sock = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
@@ -344,6 +344,10 @@ void sproc_mgr_init(int port, int private_port, const std::vector<int> udp_ports
 
   anon_log("using fd " << listen_sock << " for main listening socket");
 
+  int reuse = 1;
+  if (reuseport && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0)
+    do_error("setsockopt(" << listen_sock << ", SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))");
+
   // bind to any address that will route to this machine
   struct sockaddr_in6 addr = {0};
 
@@ -370,6 +374,9 @@ void sproc_mgr_init(int port, int private_port, const std::vector<int> udp_ports
 
     anon_log("using fd " << private_listen_sock << " for private listening socket");
 
+    if (reuseport && setsockopt(private_listen_sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0)
+      do_error("setsockopt(" << private_listen_sock << ", SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))");
+
     // bind to any address that will route to this machine
     struct sockaddr_in6 addr = {0};
 
@@ -26,7 +26,11 @@
 #include <string>
 #include <functional>
 
-void sproc_mgr_init(int port, int pivate_port = 0, const std::vector<int> udp_ports = std::vector<int>(), bool udp_is_ipv6 = false);
+// 'reuseport' sets SO_REUSEPORT on the tcp listening sockets that get
+// passed to the child processes, which lets a child's tcp_server use one
+// of the tcp_server::k_reuseport listen modes.
+void sproc_mgr_init(int port, int pivate_port = 0, const std::vector<int> udp_ports = std::vector<int>(), bool udp_is_ipv6 = false,
+                    bool reuseport = false);
 void sproc_mgr_term();
 void start_server(const char *exe_name, bool do_tls, const std::vector<std::string> &args,
                 const std::vector<std::string>& envs = std::vector<std::string>(),
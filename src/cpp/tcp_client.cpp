@@ -29,7 +29,84 @@
 namespace tcp_client
 {
 
+namespace
+{
+
+std::atomic<uint64_t> fast_open_successes_(0);
+std::atomic<uint64_t> fast_open_fallbacks_(0);
+
+// send the connection's first bytes the normal way, returning
+// 0 or an errno value
+int send_first_data(fiber_pipe *pipe, const void *data, size_t len)
+{
+  auto res = pipe->try_write(data, len);
+  if (res)
+    return 0;
+  if (res.timed_out())
+    return ETIMEDOUT;
+  if (res.closed())
+    return EPIPE;
+  return res.err;
+}
+
+// non-blocking connect of pipe's socket to 'addr', sending 'data' in
+// the SYN if the kernel has a fast open cookie for that server.  If it
+// doesn't, sendto sends a plain SYN (asking the server for a cookie for
+// next time) and fails with EINPROGRESS, and we send the data after the
+// handshake completes.  Returns 0 or an errno value.
+int fast_open_connect(fiber_pipe *pipe, const struct sockaddr *addr, socklen_t addrlen, const void *data, size_t len)
+{
+  int fd = pipe->get_fd();
+  size_t sent = 0;
+  auto sr = sendto(fd, data, len, MSG_FASTOPEN | MSG_NOSIGNAL, addr, addrlen);
+  if (sr >= 0)
+    sent = sr;
+  else if (errno == EOPNOTSUPP)
+  {
+    // fast open is turned off on this machine
+    if (::connect(fd, addr, addrlen) != 0 && errno != EINPROGRESS)
+      return errno;
+  }
+  else if (errno != EINPROGRESS)
+    return errno;
+
+  // fiber-sleep until connect completes
+  io_params::sleep_cur_until_write_possible(pipe);
+
+  int result;
+  socklen_t optlen = sizeof(result);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &result, &optlen) != 0)
+    return errno;
+  if (result != 0)
+    return result;
+
+  struct tcp_info info;
+  optlen = sizeof(info);
+  if (sent > 0 && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &optlen) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA))
+    ++fast_open_successes_;
+  else
+    ++fast_open_fallbacks_;
+
+  // if the data went in the SYN but the server didn't take it, the
+  // kernel retransmits it for us, so we only send what sendto didn't
+  if (sent < len)
+    return send_first_data(pipe, (const char *)data + sent, len - sent);
+  return 0;
+}
+
+} // namespace
+
+fast_open_counters get_fast_open_counters()
+{
+  return fast_open_counters{fast_open_successes_, fast_open_fallbacks_};
+}
+
 std::pair<int, std::unique_ptr<fiber_pipe>> connect(const struct sockaddr *addr, socklen_t addrlen, bool non_blocking)
+{
+  return connect(addr, addrlen, 0, 0, non_blocking);
+}
+
+std::pair<int, std::unique_ptr<fiber_pipe>> connect(const struct sockaddr *addr, socklen_t addrlen, const void *data, size_t len, bool non_blocking)
 {
   int type = SOCK_STREAM | SOCK_CLOEXEC;
   if (non_blocking)
@@ -49,6 +126,20 @@ std::pair<int, std::unique_ptr<fiber_pipe>> connect(const struct sockaddr *addr,
   }
 
   std::unique_ptr<fiber_pipe> pipe(new fiber_pipe(fd, fiber_pipe::network));
+
+  if (len > 0 && non_blocking)
+  {
+    auto err = fast_open_connect(pipe.get(), addr, addrlen, data, len);
+    if (err != 0)
+    {
+#if ANON_LOG_NET_TRAFFIC > 0
+      anon_log("fast open connect(" << *addr << ") failed, err: " << error_string(err));
+#endif
+      return std::make_pair(err, std::unique_ptr<fiber_pipe>());
+    }
+    return std::make_pair(0, std::move(pipe));
+  }
+
   // anon_log("connecting new socket, fd: " << fd);
   auto cr = ::connect(fd, addr, addrlen);
 
@@ -99,6 +190,13 @@ std::pair<int, std::unique_ptr<fiber_pipe>> connect(const struct sockaddr *addr,
     }
   }
 
+  if (len > 0)
+  {
+    auto err = send_first_data(pipe.get(), data, len);
+    if (err != 0)
+      return std::make_pair(err, std::unique_ptr<fiber_pipe>());
+  }
+
   return std::make_pair(0, std::move(pipe));
 }
 
@@ -107,9 +205,10 @@ static void inform(tcp_caller *tcpc, int err_code)
   tcpc->exec(err_code, std::unique_ptr<fiber_pipe>());
 }
 
-void do_connect_and_run(const char *host, int port, tcp_caller *tcpc, size_t stack_size, bool non_blocking)
+void do_connect_and_run(const char *host, int port, tcp_caller *tcpc, size_t stack_size, bool non_blocking,
+                        const std::string &first_data)
 {
-  dns_cache::lookup_and_run(host, port, [tcpc, non_blocking](int err_code, const struct sockaddr *addr, socklen_t addrlen) {
+  dns_cache::lookup_and_run(host, port, [tcpc, non_blocking, first_data](int err_code, const struct sockaddr *addr, socklen_t addrlen) {
     std::unique_ptr<tcp_caller> td(tcpc);
 
     if (err_code != 0) {
@@ -134,6 +233,17 @@ void do_connect_and_run(const char *host, int port, tcp_caller *tcpc, size_t sta
       anon_log("initiating async connect() to " << *addr);
 #endif
 
+      if (non_blocking && !first_data.empty())
+      {
+        std::unique_ptr<fiber_pipe> pipe(new fiber_pipe(fd, fiber_pipe::network));
+        auto err = fast_open_connect(pipe.get(), addr, addrlen, first_data.c_str(), first_data.size());
+        if (err != 0)
+          inform(tcpc, err);
+        else
+          tcpc->exec(0, std::move(pipe));
+        return;
+      }
+
       auto cr = connect(fd, addr, addrlen);
       std::unique_ptr<fiber_pipe> pipe(new fiber_pipe(fd, fiber_pipe::network));
 
@@ -171,6 +281,16 @@ void do_connect_and_run(const char *host, int port, tcp_caller *tcpc, size_t sta
         }
       }
 
+      if (!first_data.empty())
+      {
+        auto err = send_first_data(pipe.get(), first_data.c_str(), first_data.size());
+        if (err != 0)
+        {
+          inform(tcpc, err);
+          return;
+        }
+      }
+
       // connect succeeded, call the functor
       tcpc->exec(0, std::move(pipe));
     }
@@ -179,6 +299,11 @@ void do_connect_and_run(const char *host, int port, tcp_caller *tcpc, size_t sta
 }
 
 std::pair<int, std::unique_ptr<fiber_pipe>> connect(const char *host, int port, bool non_blocking)
+{
+  return connect(host, port, 0, 0, non_blocking);
+}
+
+std::pair<int, std::unique_ptr<fiber_pipe>> connect(const char *host, int port, const void *data, size_t len, bool non_blocking)
 {
   int err = 0;
   fiber_cond cond;
@@ -194,7 +319,8 @@ std::pair<int, std::unique_ptr<fiber_pipe>> connect(const char *host, int port,
   };
 
   tcp_caller *tcpc = new tcp_call<decltype(f)>(f);
-  do_connect_and_run(host, port, tcpc, fiber::k_default_stack_size, non_blocking);
+  do_connect_and_run(host, port, tcpc, fiber::k_default_stack_size, non_blocking,
+                     len > 0 ? std::string((const char *)data, len) : std::string());
 
   {
     fiber_lock lock(mtx);
@@ -25,6 +25,7 @@
 #include "io_dispatch.h"
 #include "fiber.h"
 #include "tcp_utils.h"
+#include <string>
 
 namespace tcp_client
 {
@@ -62,7 +63,8 @@ struct tcp_call : public tcp_caller
   Fn f_;
 };
 
-void do_connect_and_run(const char *host, int port, tcp_caller *tcpc, size_t stack_size, bool non_blocking);
+void do_connect_and_run(const char *host, int port, tcp_caller *tcpc, size_t stack_size, bool non_blocking,
+                        const std::string &first_data = std::string());
 
 // attempt to tcp-connect to 'host' / 'port'
 // and when this succeeds or fails call the given
@@ -84,10 +86,15 @@ void do_connect_and_run(const char *host, int port, tcp_caller *tcpc, size_t sta
 // If err_code < 0 then it is a "GetAddrInfo" code
 // which can be displayed in human-readable form by
 // calling the system call gai_strerror.
+//
+// If 'first_data' is not empty it is sent as the first bytes on
+// the connection before 'f' is called, using TCP Fast Open when it
+// is possible (see connect, below).
 template <typename Fn>
-void connect_and_run(const char *host, int port, Fn f, size_t stack_size = fiber::k_default_stack_size, bool non_blocking = true)
+void connect_and_run(const char *host, int port, Fn f, size_t stack_size = fiber::k_default_stack_size, bool non_blocking = true,
+                     const std::string &first_data = std::string())
 {
-  do_connect_and_run(host, port, new tcp_call<Fn>(f), stack_size, non_blocking);
+  do_connect_and_run(host, port, new tcp_call<Fn>(f), stack_size, non_blocking, first_data);
 }
 
 // can only be called from a fiber.  The calling fiber will
@@ -102,4 +109,30 @@ std::pair<int, std::unique_ptr<fiber_pipe>> connect(const char *host, int port,
 // similar to the version of connect above, except that no dns
 // logic is involved
 std::pair<int, std::unique_ptr<fiber_pipe>> connect(const struct sockaddr *addr, socklen_t addrlen, bool non_blocking = true);
+
+// same as the two versions of connect above, except that the 'len'
+// bytes at 'data' are sent as the first bytes on the connection before
+// it is returned.  For non-blocking connects this uses TCP Fast Open
+// (sendto with MSG_FASTOPEN), so if we have a fast open cookie from an
+// earlier connection to the same server the data goes out in the SYN
+// and reaches the server one round trip sooner.  Otherwise it quietly
+// falls back to sending it once the connection is established.  The
+// client side of this requires bit 0x1 of net.ipv4.tcp_fastopen (the
+// default), and the server must have it enabled too.
+std::pair<int, std::unique_ptr<fiber_pipe>> connect(const char *host, int port, const void *data, size_t len, bool non_blocking = true);
+std::pair<int, std::unique_ptr<fiber_pipe>> connect(const struct sockaddr *addr, socklen_t addrlen, const void *data, size_t len,
+                                                    bool non_blocking = true);
+
+// counts of the connections where we tried to use TCP Fast Open.
+// 'successes' are the ones where the server accepted the data we
+// sent in the SYN.  'fallbacks' are the ones where it had to be sent
+// after the handshake - because we didn't have a cookie for the server
+// yet, or it rejected the data, or fast open is turned off here.
+struct fast_open_counters
+{
+  uint64_t successes;
+  uint64_t fallbacks;
+};
+
+fast_open_counters get_fast_open_counters();
 } // namespace tcp_client
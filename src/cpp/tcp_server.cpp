@@ -23,12 +23,24 @@
 #include "tcp_server.h"
 #include <mutex>
 #include <netinet/tcp.h>
+#include <linux/filter.h>
 
-void tcp_server::init_socket(int tcp_port, int listen_backlog, bool port_is_fd)
+void tcp_server::init_socket(int tcp_port, int listen_backlog, bool port_is_fd, listen_mode mode)
 {
   if (port_is_fd)
   {
     listen_sock_ = tcp_port;
+
+    if (mode != k_single_listener)
+    {
+      int reuse = 0;
+      socklen_t len = sizeof(reuse);
+      if (getsockopt(listen_sock_, SOL_SOCKET, SO_REUSEPORT, &reuse, &len) != 0 || !reuse)
+      {
+        anon_log("listening socket " << listen_sock_ << " does not have SO_REUSEPORT set, using a single listener");
+        mode = k_single_listener;
+      }
+    }
   }
   else
   {
@@ -36,6 +48,16 @@ void tcp_server::init_socket(int tcp_port, int listen_backlog, bool port_is_fd)
     if (listen_sock_ == -1)
       do_error("socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP)");
 
+    if (mode != k_single_listener)
+    {
+      int reuse = 1;
+      if (setsockopt(listen_sock_, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0)
+      {
+        close(listen_sock_);
+        do_error("setsockopt(listen_sock_, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))");
+      }
+    }
+
     // bind to any address that will route to this machine
     struct sockaddr_in6 addr = {0};
     addr.sin6_family = AF_INET6;
@@ -56,25 +78,93 @@ void tcp_server::init_socket(int tcp_port, int listen_backlog, bool port_is_fd)
 
   anon_log("listening for tcp connections on port " << get_port() << ", socket " << listen_sock_);
 
+  if (mode != k_single_listener)
+    add_siblings(listen_backlog, mode);
+
   // To get synchronization correct at stop time we use EPOLLONESHOT
   // which causes a slight performance penalty, since it requires that
   // we rearm the listening socket after each accept notification
   io_dispatch::epoll_ctl(EPOLL_CTL_ADD, listen_sock_, EPOLLIN | EPOLLONESHOT, this);
+  for (auto &sib : siblings_)
+    io_dispatch::epoll_ctl(EPOLL_CTL_ADD, sib->sock_, EPOLLIN | EPOLLONESHOT, sib.get());
+}
+
+void tcp_server::add_siblings(int listen_backlog, listen_mode mode)
+{
+  struct sockaddr_in6 addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getsockname(listen_sock_, (struct sockaddr *)&addr, &addr_len) != 0)
+    do_error("getsockname(" << listen_sock_ << ", addr, sizeof(addr))");
+
+  for (int i = 1; i < io_dispatch::num_threads(); i++)
+  {
+    int sock = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (sock == -1)
+      do_error("socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP)");
+
+    int reuse = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0
+        || bind(sock, (struct sockaddr *)&addr, addr_len) != 0
+        || listen(sock, listen_backlog) != 0)
+    {
+      auto err = errno;
+      close(sock);
+      anon_log_error("unable to add SO_REUSEPORT listener for port " << ntohs(addr.sin6_port) << ": " << error_string(err));
+      break;
+    }
+    siblings_.push_back(std::unique_ptr<sibling>(new sibling(this, sock)));
+  }
+
+  if (mode == k_reuseport_cpu && siblings_.size() > 0)
+  {
+    // A = cpu the connection arrived on, A = A % num_listeners, return A.
+    // The kernel uses the returned value as the index into the group
+    // of sockets, in the order they joined it.
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)(siblings_.size() + 1)},
+        {BPF_RET | BPF_A, 0, 0, 0}};
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(listen_sock_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0)
+      anon_log_error("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed, connections will be distributed by hash: " << errno_string());
+  }
+
+  anon_log("using " << siblings_.size() + 1 << " SO_REUSEPORT listeners for port " << ntohs(addr.sin6_port)
+                    << (mode == k_reuseport_cpu ? ", steered by cpu" : ""));
 }
 
 void tcp_server::io_avail(const struct epoll_event &event)
 {
   if (event.events & EPOLLIN)
-  {
+    accept_on(listen_sock_, this, arm_mutex_);
+  else
+    anon_log_error("tcp_server::io_avail called with no EPOLLIN. event.events = " << event_bits_to_string(event.events));
+}
 
+// Called when one of our listening sockets has fired.  Because the
+// sockets are armed with EPOLLONESHOT, at most one thread at a time is
+// in here for any one socket, so arm_mutex is uncontended except when
+// stop_listening is shutting all of them down.  We accept up to
+// accept_batch_ connections before re-arming so that a burst of new
+// connections doesn't cost an epoll round trip for each one.
+void tcp_server::accept_on(int sock, io_dispatch::handler *hnd, std::mutex &arm_mutex)
+{
+  std::unique_lock<std::mutex> lock(arm_mutex);
+  if (stopped_)
+    return;
+
+  auto limiter = std::atomic_load(&limiter_);
+  for (int i = accept_batch_; i > 0; i--)
+  {
     struct sockaddr_in6 addr;
     socklen_t addr_len = sizeof(addr);
-    int conn = accept4(listen_sock_, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    int conn = accept4(sock, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (conn == -1)
     {
       // we can get EAGAIN because multiple io_d threads
-      // can wake up from a single EPOLLIN event.
-      // don't bother reporting those.
+      // can wake up from a single EPOLLIN event, and also
+      // whenever we have drained the queue before hitting
+      // the batch limit.  don't bother reporting those.
       if (errno != EAGAIN) {
         anon_log_error("accept4(listen_sock_, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC): " << error_string(errno));
         if (errno == EMFILE && !forced_close_) {
@@ -83,37 +173,121 @@ void tcp_server::io_avail(const struct epoll_event &event)
           fiber::k_default_stack_size, "tcp_server::io_avail - accept4");
         }
       }
-
-      io_dispatch::epoll_ctl(EPOLL_CTL_MOD, listen_sock_, EPOLLIN | EPOLLONESHOT, this);
+      break;
     }
-    else
+
+    forced_close_ = false;
+    if (stop_ && (addr == stop_addr_))
     {
-      forced_close_ = false;
-      if (stop_ && (addr == stop_addr_))
+      lock.unlock();
+      stop_listening();
       {
-        io_dispatch::epoll_ctl(EPOLL_CTL_DEL, listen_sock_, 0, this);
         fiber_lock lock(stop_mutex_);
         stop_ = false;
         stop_cond_.notify_all();
       }
-      else
-        io_dispatch::epoll_ctl(EPOLL_CTL_MOD, listen_sock_, EPOLLIN | EPOLLONESHOT, this);
+      start_connection(conn, addr, addr_len, "tcp_server::io_avail");
+      return;
+    }
+
+    int slot = ip_rate_limiter::k_untracked;
+    if (limiter)
+    {
+      slot = limiter->admit_connection((struct sockaddr *)&addr);
+      if (slot == ip_rate_limiter::k_refused)
+      {
+#if ANON_LOG_NET_TRAFFIC > 1
+        anon_log("refusing tcp connection from addr: " << addr << ", over its rate limit");
+#endif
+        struct linger lg = {1, 0};
+        setsockopt(conn, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        close(conn);
+        continue;
+      }
+    }
 
 #if ANON_LOG_NET_TRAFFIC > 2
-      anon_log("new tcp connection on socket: " << conn << ", from addr: " << addr);
+    anon_log("new tcp connection on socket: " << conn << ", from addr: " << addr);
 #endif
-      fiber::run_in_fiber(
-        [conn, addr, addr_len, this]
-        {
-          int flag = 1;
-          if (setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) != 0)
-            anon_log("setsockopt(conn, SOL_SOCKET, TCP_NODELAY,...) failed");
-          new_conn_->exec(conn, (struct sockaddr *)&addr, addr_len);
-        }, stack_size_, "tcp_server::io_avail");
+    start_connection(conn, addr, addr_len, "tcp_server::io_avail", limiter, slot);
+  }
+
+  io_dispatch::epoll_ctl(EPOLL_CTL_MOD, sock, EPOLLIN | EPOLLONESHOT, hnd);
+}
+
+void tcp_server::start_connection(int conn, const struct sockaddr_in6 &addr, socklen_t addr_len, const char *fiber_name,
+                                  const std::shared_ptr<ip_rate_limiter> &limiter, int limiter_slot)
+{
+  fiber::run_in_fiber(
+    [conn, addr, addr_len, this, limiter, limiter_slot]
+    {
+      int flag = 1;
+      if (setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) != 0)
+        anon_log("setsockopt(conn, SOL_SOCKET, TCP_NODELAY,...) failed");
+      std::unique_ptr<fiber_pipe> pipe;
+      if (limiter_slot >= 0)
+        pipe.reset(new limited_pipe(conn, limiter, limiter_slot));
+      else
+        pipe.reset(new fiber_pipe(conn, fiber_pipe::network));
+      new_conn_->exec(std::move(pipe), (struct sockaddr *)&addr, addr_len);
+    }, stack_size_, fiber_name);
+}
+
+// Turn off all of our listening sockets.  listen_sock_ stays open
+// (until the destructor) so that, in the port_is_fd case, whatever
+// is queued on it is picked up by the next process sharing it.  The
+// SO_REUSEPORT siblings are private to this process, so anything
+// already queued on them is accepted and run here, and then they are
+// closed so the kernel stops sending them new connections.  A
+// connection that arrives between the last accept and the close is
+// reset, unless net.ipv4.tcp_migrate_req is enabled.
+void tcp_server::stop_listening()
+{
+  {
+    std::lock_guard<std::mutex> lock(arm_mutex_);
+    stopped_ = true;
+    io_dispatch::epoll_ctl(EPOLL_CTL_DEL, listen_sock_, 0, this);
+  }
+  for (auto &sib : siblings_)
+  {
+    std::lock_guard<std::mutex> lock(sib->arm_mutex_);
+    io_dispatch::epoll_ctl(EPOLL_CTL_DEL, sib->sock_, 0, sib.get());
+    while (true)
+    {
+      struct sockaddr_in6 addr;
+      socklen_t addr_len = sizeof(addr);
+      int conn = accept4(sib->sock_, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (conn == -1)
+        break;
+      start_connection(conn, addr, addr_len, "tcp_server::stop_listening");
     }
+    close(sib->sock_);
+    sib->sock_ = -1;
+  }
+}
+
+void tcp_server::set_defer_accept(int seconds)
+{
+  if (setsockopt(listen_sock_, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) != 0)
+    do_error("setsockopt(" << listen_sock_ << ", IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds))");
+  for (auto &sib : siblings_)
+  {
+    std::lock_guard<std::mutex> lock(sib->arm_mutex_);
+    if (sib->sock_ != -1 && setsockopt(sib->sock_, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) != 0)
+      do_error("setsockopt(" << sib->sock_ << ", IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds))");
+  }
+}
+
+void tcp_server::set_fast_open(int queue_len)
+{
+  if (setsockopt(listen_sock_, IPPROTO_TCP, TCP_FASTOPEN, &queue_len, sizeof(queue_len)) != 0)
+    do_error("setsockopt(" << listen_sock_ << ", IPPROTO_TCP, TCP_FASTOPEN, &queue_len, sizeof(queue_len))");
+  for (auto &sib : siblings_)
+  {
+    std::lock_guard<std::mutex> lock(sib->arm_mutex_);
+    if (sib->sock_ != -1 && setsockopt(sib->sock_, IPPROTO_TCP, TCP_FASTOPEN, &queue_len, sizeof(queue_len)) != 0)
+      do_error("setsockopt(" << sib->sock_ << ", IPPROTO_TCP, TCP_FASTOPEN, &queue_len, sizeof(queue_len))");
   }
-  else
-    anon_log_error("tcp_server::io_avail called with no EPOLLIN. event.events = " << event_bits_to_string(event.events));
 }
 
 void tcp_server::stop()
@@ -25,6 +25,9 @@
 #include "tcp_utils.h"
 #include "io_dispatch.h"
 #include "fiber.h"
+#include "ip_rate_limiter.h"
+#include <mutex>
+#include <vector>
 
 class tcp_server : public io_dispatch::handler
 {
@@ -34,7 +37,32 @@ public:
   // (which is usually 128).
   enum
   {
-    k_default_backlog = 32
+    k_default_backlog = 32,
+    k_default_accept_batch = 16
+  };
+
+  // how the server listens for new connections.
+  //
+  //  k_single_listener - one listening socket, armed with EPOLLONESHOT,
+  //    so at most one io thread at a time can be accepting.
+  //
+  //  k_reuseport - one SO_REUSEPORT listening socket per io thread.
+  //    The kernel spreads new connections across their accept queues,
+  //    and each socket is armed separately, so as many threads as there
+  //    are sockets can be accepting at the same time.
+  //
+  //  k_reuseport_cpu - same as k_reuseport, but with a small classic
+  //    bpf program attached that picks the socket by the cpu that
+  //    received the connection, instead of by hashing its address.
+  //
+  // With port_is_fd the passed-in socket must already have SO_REUSEPORT
+  // set for the reuseport modes to work (see sproc_mgr_init).  If it
+  // doesn't, the server falls back to k_single_listener.
+  enum listen_mode
+  {
+    k_single_listener = 0,
+    k_reuseport = 1,
+    k_reuseport_cpu = 2
   };
 
   // whenever a new tcp connection is established
@@ -52,18 +80,26 @@ public:
   // in an ipv6 format, so if the client was, in fact, using an ipv4
   // address it will lock like a 'tunneled' address
   template <typename Fn>
-  tcp_server(int tcp_port, Fn f, int listen_backlog = k_default_backlog, bool port_is_fd = false, size_t stack_size = fiber::k_default_stack_size)
+  tcp_server(int tcp_port, Fn f, int listen_backlog = k_default_backlog, bool port_is_fd = false,
+             size_t stack_size = fiber::k_default_stack_size, listen_mode mode = k_single_listener)
       : new_conn_(new new_con<Fn>(f)),
         stop_(false),
+        stopped_(false),
         forced_close_(false),
-        stack_size_(stack_size)
+        stack_size_(stack_size),
+        accept_batch_(k_default_accept_batch)
   {
-    init_socket(tcp_port, listen_backlog, port_is_fd);
+    init_socket(tcp_port, listen_backlog, port_is_fd, mode);
   }
 
   ~tcp_server()
   {
     close(listen_sock_);
+    for (auto &sib : siblings_)
+    {
+      if (sib->sock_ != -1)
+        close(sib->sock_);
+    }
   }
 
   virtual void io_avail(const struct epoll_event &event);
@@ -71,13 +107,96 @@ public:
   void stop();
   int get_port();
 
+  // the maximum number of connections accepted each time a listening
+  // socket reports EPOLLIN, before it is re-armed.  Larger values save
+  // an epoll round trip per connection during connection storms, at the
+  // cost of one thread doing all of the accepting for that batch.
+  void set_accept_batch(int max_accepts)
+  {
+    accept_batch_ = max_accepts > 0 ? max_accepts : 1;
+  }
+
+  // when 'seconds' > 0, set TCP_DEFER_ACCEPT on the listening sockets
+  // so that a connection is only accepted (and a fiber only created
+  // for it) once the client has sent some data, or after roughly
+  // 'seconds' have passed.  Pass 0 to turn it back off.  This is only
+  // appropriate for protocols where the client speaks first, like http.
+  void set_defer_accept(int seconds);
+
+  // when 'queue_len' > 0, set TCP_FASTOPEN on the listening sockets so
+  // that clients holding a fast open cookie from us can send their
+  // first bytes in the SYN, and the connection is accepted (and its
+  // fiber can read them) without waiting for the rest of the handshake.
+  // 'queue_len' bounds the number of such connections that have not yet
+  // completed the handshake.  Requires bit 0x2 of the
+  // net.ipv4.tcp_fastopen sysctl, which is off by default.
+  void set_fast_open(int queue_len);
+
+  // when 'limiter' is set, each new connection is checked against it
+  // before a fiber is created for it.  Connections from addresses that
+  // are over their rate, or that already have the limiter's maximum
+  // number of open connections, are closed immediately with a reset.
+  // Pass an empty pointer to turn limiting back off.
+  void set_rate_limiter(const std::shared_ptr<ip_rate_limiter> &limiter)
+  {
+    std::atomic_store(&limiter_, limiter);
+  }
+
 private:
-  void init_socket(int tcp_port, int backlog, bool port_is_fd);
+  void init_socket(int tcp_port, int backlog, bool port_is_fd, listen_mode mode);
+  void add_siblings(int backlog, listen_mode mode);
+  void accept_on(int sock, io_dispatch::handler *hnd, std::mutex &arm_mutex);
+  void stop_listening();
+  void start_connection(int conn, const struct sockaddr_in6 &addr, socklen_t addr_len, const char *fiber_name,
+                        const std::shared_ptr<ip_rate_limiter> &limiter = std::shared_ptr<ip_rate_limiter>(),
+                        int limiter_slot = ip_rate_limiter::k_untracked);
+
+  // a connection that was admitted by an ip_rate_limiter, and
+  // gives its slot back when it closes
+  struct limited_pipe : public fiber_pipe
+  {
+    limited_pipe(int sock, const std::shared_ptr<ip_rate_limiter> &limiter, int slot)
+        : fiber_pipe(sock, fiber_pipe::network),
+          limiter_(limiter),
+          slot_(slot)
+    {
+    }
+
+    ~limited_pipe()
+    {
+      limiter_->release_connection(slot_);
+    }
+
+    std::shared_ptr<ip_rate_limiter> limiter_;
+    int slot_;
+  };
+
+  // the additional SO_REUSEPORT listeners used in the k_reuseport
+  // modes.  listen_sock_ is always the first one in the group and is
+  // handled by tcp_server::io_avail directly.
+  struct sibling : public io_dispatch::handler
+  {
+    sibling(tcp_server *server, int sock)
+        : server_(server),
+          sock_(sock)
+    {
+    }
+
+    virtual void io_avail(const struct epoll_event &event) override
+    {
+      if (event.events & EPOLLIN)
+        server_->accept_on(sock_, this, arm_mutex_);
+    }
+
+    tcp_server *server_;
+    int sock_;
+    std::mutex arm_mutex_;
+  };
 
   struct new_connection
   {
     virtual ~new_connection() {}
-    virtual void exec(int sock, const sockaddr *src_addr, socklen_t src_addr_len) = 0;
+    virtual void exec(std::unique_ptr<fiber_pipe> &&pipe, const sockaddr *src_addr, socklen_t src_addr_len) = 0;
   };
 
   template <typename Fn>
@@ -88,11 +207,11 @@ private:
     {
     }
 
-    virtual void exec(int sock, const sockaddr *src_addr, socklen_t src_addr_len)
+    virtual void exec(std::unique_ptr<fiber_pipe> &&pipe, const sockaddr *src_addr, socklen_t src_addr_len)
     {
       try
       {
-        f_(std::unique_ptr<fiber_pipe>(new fiber_pipe(sock, fiber_pipe::network)), src_addr, src_addr_len);
+        f_(std::move(pipe), src_addr, src_addr_len);
       }
       catch (const std::runtime_error &ex)
       {
@@ -110,8 +229,13 @@ private:
 
   std::unique_ptr<new_connection> new_conn_;
   int listen_sock_;
+  std::mutex arm_mutex_;
+  std::vector<std::unique_ptr<sibling>> siblings_;
   size_t stack_size_;
   bool stop_;
+  std::atomic<bool> stopped_;
+  std::atomic<int> accept_batch_;
+  std::shared_ptr<ip_rate_limiter> limiter_;
   bool forced_close_;
   struct sockaddr_in6 stop_addr_;
   fiber_mutex stop_mutex_;
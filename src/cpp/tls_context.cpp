@@ -749,4 +749,52 @@ tls_context::~tls_context()
   SSL_CTX_free(ctx_);
 }
 
+namespace
+{
+
+// the protocol list, in its wire format, is kept with the SSL_CTX
+// so that it lasts as long as the SSL_CTX does
+int alpn_index()
+{
+  static int index = SSL_CTX_get_ex_new_index(0, 0, 0, 0,
+                                              [](void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp) {
+                                                delete (std::string *)ptr;
+                                              });
+  return index;
+}
+
+int alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                const unsigned char *in, unsigned int inlen, void *arg)
+{
+  auto ours = (const std::string *)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), alpn_index());
+  if (!ours || SSL_select_next_proto((unsigned char **)out, outlen, (const unsigned char *)ours->data(), ours->size(),
+                                     in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+} // namespace
+
+void tls_context::set_alpn_protocols(const std::vector<std::string> &protocols)
+{
+  std::unique_ptr<std::string> wire(new std::string);
+  for (auto &p : protocols)
+  {
+    if (p.empty() || p.size() > 255)
+      anon_throw(std::runtime_error, "invalid alpn protocol name: \"" << p << "\"");
+    wire->push_back((char)p.size());
+    wire->append(p);
+  }
+
+  // (SSL_CTX_set_alpn_protos is the one function
+  // here that returns 0 for success)
+  if (SSL_CTX_set_alpn_protos(ctx_, (const unsigned char *)wire->data(), wire->size()) != 0)
+    throw_ssl_error();
+  delete (std::string *)SSL_CTX_get_ex_data(ctx_, alpn_index());
+  if (!SSL_CTX_set_ex_data(ctx_, alpn_index(), wire.get()))
+    throw_ssl_error();
+  wire.release();
+  SSL_CTX_set_alpn_select_cb(ctx_, alpn_select, 0);
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -25,6 +25,7 @@
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 #include <string>
+#include <vector>
 
 // a tls "context" object that holds a number of characteristics
 // about one or more tls connections that will be attempted with
@@ -57,6 +58,14 @@ public:
 
   operator SSL_CTX *() const { return ctx_; }
 
+  // the application protocols (ALPN, RFC 7301) offered, or accepted,
+  // during the handshake, most preferred first - for example "h2"
+  // and "http/1.1".  A server picks the first of its own that the
+  // client also offers, and continues without one if there are none.
+  // tls_pipe::alpn_protocol says which was chosen.  Must be called
+  // before this context is used for any connection.
+  void set_alpn_protocols(const std::vector<std::string> &protocols);
+
   // currently, this only returns non-empty for DTLS contexts
   const std::string& sha256_digest() const { return sha256_digest_; }
 
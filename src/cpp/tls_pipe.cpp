@@ -22,6 +22,9 @@
 
 #include "tls_pipe.h"
 #include <openssl/opensslv.h>
+#include <openssl/err.h>
+#include <unistd.h>
+#include <errno.h>
 
 ///////////////////////////////////////////////////////////////
 
@@ -112,13 +115,28 @@ public:
   fp_pipe(std::unique_ptr<fiber_pipe> &&pipe)
       : pipe_(std::move(pipe)),
         hit_fiber_io_error_(false),
-        hit_fiber_io_timeout_error_(false)
+        hit_fiber_io_timeout_error_(false),
+        io_err_(0),
+        nowait_(false)
   {
   }
 
+  void set_error(const io_result &res)
+  {
+    if (res.timed_out())
+      hit_fiber_io_timeout_error_ = true;
+    else
+      hit_fiber_io_error_ = true;
+    io_err_ = res.err;
+  }
+
   std::unique_ptr<fiber_pipe> pipe_;
   bool hit_fiber_io_error_;
   bool hit_fiber_io_timeout_error_;
+  int io_err_;
+
+  // set while tls_pipe::try_read_nowait is running
+  bool nowait_;
 };
 
 } // namespace
@@ -155,22 +173,26 @@ static int fp_read(BIO *b, char *out, int outl)
   auto p = reinterpret_cast<fp_pipe *>(BIO_get_data(b));
   if (p)
   {
-    try
-    {
-      int ret = p->pipe_->read(out, outl);
-      return ret;
-    }
-    catch (const fiber_io_error &)
-    {
-      p->hit_fiber_io_error_ = true;
-    }
-    catch(const fiber_io_timeout_error &)
-    {
-      p->hit_fiber_io_timeout_error_ = true;
-    }
-    catch (...)
+    BIO_clear_retry_flags(b);
+    if (p->nowait_)
     {
+      // the socket is non-blocking, so read it directly and let
+      // openssl see EAGAIN as an ordinary "want read"
+      auto ret = ::read(p->pipe_->get_fd(), out, outl);
+      if (ret > 0)
+        return ret;
+      if (ret == -1 && errno == EAGAIN)
+      {
+        BIO_set_retry_read(b);
+        return -1;
+      }
+      p->set_error(io_result{0, ret == 0 ? io_result::k_closed : errno});
+      return -1;
     }
+    auto res = p->pipe_->try_read(out, outl);
+    if (res)
+      return res.bytes;
+    p->set_error(res);
   }
   return -1;
 }
@@ -180,22 +202,10 @@ static int fp_write(BIO *b, const char *in, int inl)
   auto p = reinterpret_cast<fp_pipe *>(BIO_get_data(b));
   if (p)
   {
-    try
-    {
-      p->pipe_->write(in, inl);
+    auto res = p->pipe_->try_write(in, inl);
+    if (res)
       return inl;
-    }
-    catch (const fiber_io_error &)
-    {
-      p->hit_fiber_io_error_ = true;
-    }
-    catch (const fiber_io_timeout_error &)
-    {
-      p->hit_fiber_io_timeout_error_ = true;
-    }
-    catch (...)
-    {
-    }
+    p->set_error(res);
   }
   return -1;
 }
@@ -371,6 +381,19 @@ static void throw_ssl_error_(BIO *fpb, unsigned long err)
     throw_ssl_error(err);
 }
 
+// the io_result for an SSL_read/SSL_write that returned 'ret'
+io_result ssl_io_result_(SSL *ssl, BIO *fpb, int ret)
+{
+  auto p = reinterpret_cast<fp_pipe *>(BIO_get_data(fpb));
+  if (p->hit_fiber_io_error_ || p->hit_fiber_io_timeout_error_)
+    return io_result{0, p->io_err_};
+  auto err = SSL_get_error(ssl, ret);
+  if (err == SSL_ERROR_ZERO_RETURN)
+    return io_result{0, io_result::k_closed};
+  ERR_clear_error();
+  return io_result{0, EPROTO};
+}
+
 void throw_ssl_io_error_(BIO *fpb, unsigned long err)
 {
   auto p = reinterpret_cast<fp_pipe *>(BIO_get_data(fpb));
@@ -447,6 +470,28 @@ size_t tls_pipe::read(void *buff, size_t len) const
   return ret;
 }
 
+io_result tls_pipe::try_read(void *buff, size_t len) const
+{
+  auto ret = SSL_read(ssl_, buff, len);
+  if (ret <= 0)
+    return ssl_io_result_(ssl_, SSL_get_rbio(ssl_), ret);
+  return io_result{(size_t)ret, 0};
+}
+
+io_result tls_pipe::try_read_nowait(void *buff, size_t len) const
+{
+  auto fpb = SSL_get_rbio(ssl_);
+  auto p = reinterpret_cast<fp_pipe *>(BIO_get_data(fpb));
+  p->nowait_ = true;
+  auto ret = SSL_read(ssl_, buff, len);
+  p->nowait_ = false;
+  if (ret > 0)
+    return io_result{(size_t)ret, 0};
+  if (SSL_get_error(ssl_, ret) == SSL_ERROR_WANT_READ)
+    return io_result{0, EAGAIN};
+  return ssl_io_result_(ssl_, fpb, ret);
+}
+
 void tls_pipe::shutdown()
 {
   SSL_shutdown(ssl_);
@@ -472,6 +517,24 @@ void tls_pipe::write(const void *buff, size_t len) const
   }
 }
 
+io_result tls_pipe::try_write(const void *buff, size_t len) const
+{
+  size_t tot_bytes = 0;
+  const char *buf = (const char *)buff;
+  while (tot_bytes < len)
+  {
+    auto written = SSL_write(ssl_, &buf[tot_bytes], len - tot_bytes);
+    if (written <= 0)
+    {
+      auto res = ssl_io_result_(ssl_, SSL_get_wbio(ssl_), written);
+      res.bytes = tot_bytes;
+      return res;
+    }
+    tot_bytes += written;
+  }
+  return io_result{tot_bytes, 0};
+}
+
 void tls_pipe::limit_io_block_time(int seconds)
 {
   fp_->limit_io_block_time(seconds);
@@ -40,6 +40,8 @@ public:
 
   virtual size_t read(void *buff, size_t len) const;
   virtual void write(const void *buff, size_t len) const;
+  virtual io_result try_read(void *buff, size_t len) const;
+  virtual io_result try_write(const void *buff, size_t len) const;
   virtual void limit_io_block_time(int seconds);
   virtual int get_fd() const { return fp_->get_fd(); }
   virtual void set_hibernating(bool hibernating) { fp_->set_hibernating(hibernating); }
@@ -47,6 +49,28 @@ public:
 
   void shutdown();
 
+  fiber_pipe *get_fiber_pipe() const { return fp_; }
+
+  // like try_read, but never waits for the socket.  If only part of
+  // a tls record has arrived so far it returns io_result{0, EAGAIN},
+  // and the caller should wait for POLLIN on get_fiber_pipe() before
+  // calling again.
+  io_result try_read_nowait(void *buff, size_t len) const;
+
+  // true if openssl is holding data that has been read from the
+  // socket but not yet returned by read/try_read
+  bool has_buffered_data() const { return SSL_has_pending(ssl_) != 0; }
+
+  // the application protocol agreed in the handshake (see
+  // tls_context::set_alpn_protocols), or "" if there wasn't one
+  std::string alpn_protocol() const
+  {
+    const unsigned char *proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(ssl_, &proto, &len);
+    return proto ? std::string((const char *)proto, len) : std::string();
+  }
+
 private:
   SSL *ssl_;
   fiber_pipe *fp_;
@@ -0,0 +1,966 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "websocket.h"
+#include "tls_pipe.h"
+#include <algorithm>
+#include <random>
+#include <poll.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ANON_WEBSOCKET_SIMD 1
+#endif
+
+namespace
+{
+
+// 'key' is the 4 mask bytes, in memory order, that apply to p[0]
+void mask_scalar(uint8_t *p, size_t len, uint32_t key)
+{
+  uint64_t key64 = ((uint64_t)key << 32) | key;
+  while (len >= 8)
+  {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    v ^= key64;
+    memcpy(p, &v, 8);
+    p += 8;
+    len -= 8;
+  }
+  uint8_t k[4];
+  memcpy(k, &key, 4);
+  for (size_t i = 0; i < len; i++)
+    p[i] ^= k[i & 3];
+}
+
+#if defined(ANON_WEBSOCKET_SIMD)
+
+__attribute__((target("sse2")))
+void mask_sse2(uint8_t *p, size_t len, uint32_t key)
+{
+  auto k = _mm_set1_epi32((int)key);
+  while (len >= 16)
+  {
+    auto v = _mm_loadu_si128((const __m128i *)p);
+    _mm_storeu_si128((__m128i *)p, _mm_xor_si128(v, k));
+    p += 16;
+    len -= 16;
+  }
+  mask_scalar(p, len, key);
+}
+
+__attribute__((target("avx2")))
+void mask_avx2(uint8_t *p, size_t len, uint32_t key)
+{
+  auto k = _mm256_set1_epi32((int)key);
+  while (len >= 64)
+  {
+    auto v0 = _mm256_loadu_si256((const __m256i *)p);
+    auto v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+    _mm256_storeu_si256((__m256i *)p, _mm256_xor_si256(v0, k));
+    _mm256_storeu_si256((__m256i *)(p + 32), _mm256_xor_si256(v1, k));
+    p += 64;
+    len -= 64;
+  }
+  if (len >= 32)
+  {
+    auto v = _mm256_loadu_si256((const __m256i *)p);
+    _mm256_storeu_si256((__m256i *)p, _mm256_xor_si256(v, k));
+    p += 32;
+    len -= 32;
+  }
+  mask_scalar(p, len, key);
+}
+
+#endif
+
+struct masker
+{
+  void (*mask)(uint8_t *p, size_t len, uint32_t key);
+  const char *name;
+};
+
+masker pick_masker()
+{
+#if defined(ANON_WEBSOCKET_SIMD)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return {mask_avx2, "avx2"};
+  if (__builtin_cpu_supports("sse2"))
+    return {mask_sse2, "sse2"};
+#endif
+  return {mask_scalar, "scalar"};
+}
+
+const masker masking = pick_masker();
+
+// RFC 3629 - no overlong forms, no surrogates, nothing past U+10FFFF
+bool valid_utf8(const uint8_t *p, size_t len)
+{
+  auto end = p + len;
+  while (p < end)
+  {
+    if (end - p >= 8)
+    {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      if (!(v & 0x8080808080808080ull))
+      {
+        p += 8;
+        continue;
+      }
+    }
+    auto c = *p;
+    if (c < 0x80)
+    {
+      ++p;
+      continue;
+    }
+    size_t n;
+    uint32_t lo = 0x80, hi = 0xbf; // allowed range of the second byte
+    if (c >= 0xc2 && c <= 0xdf)
+      n = 1;
+    else if (c >= 0xe0 && c <= 0xef)
+    {
+      n = 2;
+      if (c == 0xe0)
+        lo = 0xa0;
+      else if (c == 0xed)
+        hi = 0x9f;
+    }
+    else if (c >= 0xf0 && c <= 0xf4)
+    {
+      n = 3;
+      if (c == 0xf0)
+        lo = 0x90;
+      else if (c == 0xf4)
+        hi = 0x8f;
+    }
+    else
+      return false;
+    if ((size_t)(end - p) <= n || p[1] < lo || p[1] > hi)
+      return false;
+    for (size_t i = 2; i <= n; i++)
+      if ((p[i] & 0xc0) != 0x80)
+        return false;
+    p += n + 1;
+  }
+  return true;
+}
+
+bool valid_close_code(int code)
+{
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+}
+
+// the 4 bytes that permessage-deflate drops from the end of each
+// message, and the reader puts back before inflating (RFC 7692 7.2.1)
+const uint8_t deflate_tail[4] = {0x00, 0x00, 0xff, 0xff};
+
+// compresses the frames posted to a websocket_group, each on its own
+struct frame_deflater
+{
+  frame_deflater()
+  {
+    memset(&zs, 0, sizeof(zs));
+    ok = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+  ~frame_deflater()
+  {
+    if (ok)
+      deflateEnd(&zs);
+  }
+
+  z_stream zs;
+  bool ok;
+};
+
+thread_local frame_deflater frame_zs;
+
+} // namespace
+
+struct websocket::zstate
+{
+  zstate(bool deflater, int level, int window_bits)
+      : deflater(deflater)
+  {
+    memset(&zs, 0, sizeof(zs));
+    auto ret = deflater ? deflateInit2(&zs, level, Z_DEFLATED, -window_bits, 8, Z_DEFAULT_STRATEGY)
+                        : inflateInit2(&zs, -window_bits);
+    if (ret != Z_OK)
+      anon_throw(std::runtime_error, "zlib init failed: " << ret);
+  }
+
+  ~zstate()
+  {
+    if (deflater)
+      deflateEnd(&zs);
+    else
+      inflateEnd(&zs);
+  }
+
+  bool deflater;
+  z_stream zs;
+};
+
+void websocket::apply_mask(void *data, size_t len, const uint8_t key[4], size_t pos)
+{
+  uint8_t k[4];
+  for (int i = 0; i < 4; i++)
+    k[i] = key[(pos + i) & 3];
+  uint32_t key32;
+  memcpy(&key32, k, 4);
+  masking.mask((uint8_t *)data, len, key32);
+}
+
+const char *websocket::mask_engine_name()
+{
+  return masking.name;
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+websocket::websocket(::pipe_t *pipe, bool client, const options &opts,
+                     const websocket_deflate &deflate, std::vector<char> &&buffered)
+    : pipe_(pipe),
+      tls_(dynamic_cast<tls_pipe *>(pipe)),
+      client_(client),
+      opts_(opts),
+      deflate_(deflate),
+      in_(std::move(buffered))
+{
+  fp_ = tls_ ? tls_->get_fiber_pipe() : dynamic_cast<fiber_pipe *>(pipe);
+  if (!fp_)
+    anon_throw(std::runtime_error, "websocket needs a fiber_pipe or tls_pipe");
+  in_end_ = in_.size();
+  pipe_->limit_io_block_time(opts_.write_timeout_seconds);
+}
+
+websocket::~websocket()
+{
+  try
+  {
+    close();
+  }
+  catch (const std::exception &)
+  {
+  }
+  fiber_lock lock(out_mtx_);
+  while (writing_ || drainers_ > 0)
+    out_cond_.wait(lock);
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+// read what is available, after waiting for something to be.
+// Returns 0 if the connection has ended, or the peer has gone
+// quiet for two ping intervals.
+size_t websocket::read_some(void *buff, size_t len)
+{
+  // over tls we can only read while holding io_mtx_, and must
+  // not hold it while waiting, so wait for the socket first and
+  // then read without letting the tls layer wait for the rest of
+  // a partly received record
+  auto need_socket = !tls_ || !tls_->has_buffered_data();
+  while (true)
+  {
+    if (need_socket && !wait_readable())
+      return 0;
+
+    io_result res;
+    if (tls_)
+    {
+      fiber_lock lock(io_mtx_);
+      res = tls_->try_read_nowait(buff, len);
+    }
+    else
+      res = pipe_->try_read(buff, len);
+    if (res.err == EAGAIN)
+    {
+      need_socket = true;
+      continue;
+    }
+    if (!res)
+      return 0;
+    awaiting_pong_ = false;
+    return res.bytes;
+  }
+}
+
+// wait for the socket to become readable, pinging the peer when it
+// is quiet.  Returns false if it doesn't answer the ping in time.
+bool websocket::wait_readable()
+{
+  int timeout_ms = opts_.ping_interval_seconds > 0 ? opts_.ping_interval_seconds * 1000 : -1;
+  pipe_wait w{fp_, POLLIN, 0};
+  while (fiber::wait_any(&w, 1, timeout_ms) == 0)
+  {
+    if (awaiting_pong_)
+    {
+#if ANON_LOG_NET_TRAFFIC > 2
+      anon_log("websocket peer did not answer ping, dropping the connection");
+#endif
+      return false;
+    }
+    awaiting_pong_ = true;
+    try
+    {
+      ping();
+    }
+    catch (const std::exception &)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool websocket::fill(size_t needed)
+{
+  while (in_end_ - in_start_ < needed)
+  {
+    if (in_start_ + needed > in_.size())
+    {
+      memmove(&in_[0], &in_[in_start_], in_end_ - in_start_);
+      in_end_ -= in_start_;
+      in_start_ = 0;
+      if (in_.size() < needed || in_.size() < 16384)
+        in_.resize(std::max(needed, (size_t)16384));
+    }
+    auto n = read_some(&in_[in_end_], in_.size() - in_end_);
+    if (n == 0)
+      return false;
+    in_end_ += n;
+  }
+  return true;
+}
+
+// append 'len' bytes of payload to 'dest', from in_ and then straight
+// from the connection, and unmask them.  'dest' is grown as the bytes
+// arrive rather than all at once, since 'len' is whatever the peer
+// claimed in the frame header.
+bool websocket::read_payload(std::vector<char> &dest, size_t len, const uint8_t *key)
+{
+  auto start = dest.size();
+  auto have = std::min(len, in_end_ - in_start_);
+  dest.resize(start + have);
+  if (have)
+    memcpy(&dest[start], &in_[in_start_], have);
+  in_start_ += have;
+  while (have < len)
+  {
+    auto chunk = std::min(len - have, (size_t)k_payload_chunk);
+    dest.resize(start + have + chunk);
+    auto n = read_some(&dest[start + have], chunk);
+    if (n == 0)
+    {
+      dest.resize(start + have);
+      return false;
+    }
+    have += n;
+    dest.resize(start + have);
+  }
+  if (key)
+    apply_mask(&dest[start], len, key);
+  return true;
+}
+
+bool websocket::read(message &msg)
+{
+  msg.data.clear();
+  try
+  {
+    while (!close_received_)
+    {
+      if (!fill(2))
+        return false;
+      auto h = (const uint8_t *)&in_[in_start_];
+      bool fin = h[0] & 0x80;
+      bool rsv1 = h[0] & 0x40;
+      int opcode = h[0] & 0x0f;
+      bool masked = h[1] & 0x80;
+      uint64_t len = h[1] & 0x7f;
+      size_t hdr_len = 2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + (masked ? 4 : 0);
+      if (!fill(hdr_len))
+        return false;
+      h = (const uint8_t *)&in_[in_start_];
+      auto p = h + 2;
+      if (len == 126)
+      {
+        len = (p[0] << 8) | p[1];
+        p += 2;
+      }
+      else if (len == 127)
+      {
+        len = 0;
+        for (int i = 0; i < 8; i++)
+          len = (len << 8) | p[i];
+        p += 8;
+        if (len >> 63)
+          throw protocol_error{k_protocol_error, "frame length has its high bit set"};
+      }
+      uint8_t key[4];
+      if (masked)
+        memcpy(key, p, 4);
+
+      if (h[0] & 0x30)
+        throw protocol_error{k_protocol_error, "RSV2 or RSV3 set"};
+      if (masked == client_)
+        throw protocol_error{k_protocol_error, client_ ? "masked frame from server" : "unmasked frame from client"};
+
+      if (opcode & 0x08)
+      {
+        if (!fin || len > 125)
+          throw protocol_error{k_protocol_error, "fragmented or oversized control frame"};
+        if (rsv1)
+          throw protocol_error{k_protocol_error, "RSV1 set on a control frame"};
+        if (!fill(hdr_len + len))
+          return false;
+        auto payload = (uint8_t *)&in_[in_start_ + hdr_len];
+        in_start_ += hdr_len + len;
+        if (masked)
+          apply_mask(payload, len, key);
+        on_control(opcode, payload, len);
+        continue;
+      }
+
+      in_start_ += hdr_len;
+      if (opcode == k_continuation)
+      {
+        if (!msg_opcode_)
+          throw protocol_error{k_protocol_error, "continuation frame with no message to continue"};
+        if (rsv1)
+          throw protocol_error{k_protocol_error, "RSV1 set on a continuation frame"};
+      }
+      else if (opcode == k_text || opcode == k_binary)
+      {
+        if (msg_opcode_)
+          throw protocol_error{k_protocol_error, "new message before the last one finished"};
+        if (rsv1 && !deflate_.enabled)
+          throw protocol_error{k_protocol_error, "RSV1 set without permessage-deflate"};
+        msg_opcode_ = opcode;
+        msg_deflated_ = rsv1;
+        zin_.clear();
+      }
+      else
+        throw protocol_error{k_protocol_error, "unknown opcode"};
+
+      auto &dest = msg_deflated_ ? zin_ : msg.data;
+      if (dest.size() + len > opts_.max_message_size)
+        throw protocol_error{k_message_too_big, "message too big"};
+      if (!read_payload(dest, len, masked ? key : 0))
+        return false;
+
+      if (fin)
+      {
+        msg.opcode = msg_opcode_;
+        msg_opcode_ = 0;
+        if (msg_deflated_)
+          inflate_message(msg);
+        if (msg.is_text() && !valid_utf8((const uint8_t *)msg.data.data(), msg.data.size()))
+          throw protocol_error{k_invalid_payload, "text message is not valid UTF-8"};
+        return true;
+      }
+    }
+  }
+  catch (const protocol_error &e)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("websocket protocol error: " << e.what << ", closing with " << e.code);
+#endif
+    close_received_ = true;
+    close_code_ = k_abnormal_closure;
+    try
+    {
+      close(e.code);
+    }
+    catch (const std::exception &)
+    {
+    }
+  }
+  return false;
+}
+
+void websocket::on_control(int opcode, const uint8_t *payload, size_t len)
+{
+  switch (opcode)
+  {
+  case k_ping:
+    try
+    {
+      queue_frame(k_pong, payload, len, true);
+    }
+    catch (const fiber_io_error &)
+    {
+      // we have already sent our close frame
+    }
+    break;
+
+  case k_pong:
+    break;
+
+  case k_close:
+  {
+    int code = k_no_status;
+    if (len == 1)
+      throw protocol_error{k_protocol_error, "close frame with a 1 byte payload"};
+    if (len >= 2)
+    {
+      code = (payload[0] << 8) | payload[1];
+      if (!valid_close_code(code))
+        throw protocol_error{k_protocol_error, "invalid close code"};
+      if (!valid_utf8(payload + 2, len - 2))
+        throw protocol_error{k_invalid_payload, "close reason is not valid UTF-8"};
+    }
+    close_received_ = true;
+    close_code_ = code;
+    try
+    {
+      close(code == k_no_status ? k_normal_closure : code);
+    }
+    catch (const std::exception &)
+    {
+    }
+    break;
+  }
+
+  default:
+    throw protocol_error{k_protocol_error, "unknown control opcode"};
+  }
+}
+
+void websocket::inflate_message(message &msg)
+{
+  if (!inflater_)
+    inflater_.reset(new zstate(false, 0, 15));
+  auto &zs = inflater_->zs;
+  zin_.insert(zin_.end(), deflate_tail, deflate_tail + sizeof(deflate_tail));
+  zs.next_in = (Bytef *)&zin_[0];
+  zs.avail_in = zin_.size();
+  size_t out = 0;
+  bool reset = client_ ? deflate_.server_no_context_takeover : deflate_.client_no_context_takeover;
+  while (true)
+  {
+    if (msg.data.size() - out < 16384)
+      msg.data.resize(std::max(msg.data.size() * 2, out + 16384));
+    zs.next_out = (Bytef *)&msg.data[out];
+    zs.avail_out = msg.data.size() - out;
+    auto ret = ::inflate(&zs, Z_SYNC_FLUSH);
+    out = msg.data.size() - zs.avail_out;
+    if (out > opts_.max_message_size)
+      throw protocol_error{k_message_too_big, "message too big"};
+
+    // the peer may end a message with a final block (7.2.3.3),
+    // after which the next one starts a new stream
+    if (ret == Z_STREAM_END)
+    {
+      reset = true;
+      break;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+      throw protocol_error{k_invalid_payload, "bad deflate data"};
+    if (zs.avail_in == 0 && zs.avail_out > 0)
+      break;
+    if (ret == Z_BUF_ERROR && zs.avail_out > 0)
+      throw protocol_error{k_invalid_payload, "bad deflate data"};
+  }
+  msg.data.resize(out);
+  zin_.clear();
+  if (reset)
+    inflateReset(&zs);
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+void websocket::append_frame(std::string &out, int opcode, bool rsv1, const void *data, size_t len)
+{
+  uint8_t h[14];
+  size_t hl = 2;
+  h[0] = 0x80 | (rsv1 ? 0x40 : 0) | opcode;
+  if (len < 126)
+    h[1] = len;
+  else if (len < 65536)
+  {
+    h[1] = 126;
+    h[2] = len >> 8;
+    h[3] = len;
+    hl = 4;
+  }
+  else
+  {
+    h[1] = 127;
+    for (int i = 0; i < 8; i++)
+      h[2 + i] = (uint64_t)len >> (56 - 8 * i);
+    hl = 10;
+  }
+
+  // clients mask everything they send (section 5.3)
+  uint8_t key[4];
+  if (client_)
+  {
+    static thread_local std::mt19937 rng{std::random_device()()};
+    uint32_t k = rng();
+    memcpy(key, &k, 4);
+    h[1] |= 0x80;
+    memcpy(&h[hl], key, 4);
+    hl += 4;
+  }
+
+  auto start = out.size();
+  out.reserve(start + hl + len);
+  out.append((const char *)h, hl);
+  out.append((const char *)data, len);
+  if (client_)
+    apply_mask(&out[start + hl], len, key);
+}
+
+// 'data' compressed the permessage-deflate way.  Called with out_mtx_
+// locked, so the messages go through the compressor in the order they
+// are queued.
+void websocket::deflate_payload(std::string &out, const void *data, size_t len)
+{
+  if (!deflater_)
+    deflater_.reset(new zstate(true, opts_.deflate_level, client_ ? deflate_.client_max_window_bits : deflate_.server_max_window_bits));
+  auto &zs = deflater_->zs;
+  out.resize(deflateBound(&zs, len) + 16);
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = len;
+  size_t used = 0;
+  while (true)
+  {
+    zs.next_out = (Bytef *)&out[used];
+    zs.avail_out = out.size() - used;
+    ::deflate(&zs, Z_SYNC_FLUSH);
+    used = out.size() - zs.avail_out;
+    if (zs.avail_in == 0 && zs.avail_out > 0)
+      break;
+    out.resize(out.size() * 2);
+  }
+
+  // a sync flush always ends with the 4 byte tail, which isn't sent
+  out.resize(used - sizeof(deflate_tail));
+  if (client_ ? deflate_.client_no_context_takeover : deflate_.server_no_context_takeover)
+    deflateReset(&zs);
+}
+
+void websocket::queue_frame(int opcode, const void *data, size_t len, bool wait)
+{
+  auto f = std::make_shared<std::string>();
+  fiber_lock lock(out_mtx_);
+  if (close_sent_)
+    throw fiber_io_error("websocket closed");
+  if (deflate_.enabled && !(opcode & 0x08) && len >= opts_.deflate_min_size)
+  {
+    std::string z;
+    deflate_payload(z, data, len);
+    append_frame(*f, opcode, true, z.data(), z.size());
+  }
+  else
+    append_frame(*f, opcode, false, data, len);
+  if (opcode == k_close)
+    close_sent_ = true;
+  out_bytes_ += f->size();
+  out_.push_back(std::move(f));
+  write_queued(lock, wait);
+}
+
+// write what is queued, unless another fiber is already doing that,
+// in which case it writes ours too.  With 'wait', a fiber that would
+// otherwise add to out_ faster than it can be written waits for it to
+// drain first.  Called with out_mtx_ locked.
+void websocket::write_queued(fiber_lock &lock, bool wait)
+{
+  if (write_failed_)
+    throw fiber_io_error("websocket write failed");
+  if (writing_)
+  {
+    while (wait && writing_ && out_bytes_ > k_max_out && !write_failed_)
+      out_cond_.wait(lock);
+    return;
+  }
+
+  writing_ = true;
+  std::string batch;
+  while (!out_.empty())
+  {
+    // small frames are written together, big ones as they are
+    std::shared_ptr<const std::string> big;
+    batch.clear();
+    while (!out_.empty() && batch.size() + out_.front()->size() <= k_max_batch)
+    {
+      batch += *out_.front();
+      out_bytes_ -= out_.front()->size();
+      out_.pop_front();
+    }
+    if (batch.empty())
+    {
+      big = std::move(out_.front());
+      out_bytes_ -= big->size();
+      out_.pop_front();
+    }
+    out_cond_.notify_all();
+    lock.unlock();
+    try
+    {
+      if (big)
+        write_out(big->data(), big->size());
+      else
+        write_out(batch.data(), batch.size());
+    }
+    catch (...)
+    {
+      lock.lock();
+      writing_ = false;
+      write_failed_ = true;
+      out_.clear();
+      out_bytes_ = 0;
+      out_cond_.notify_all();
+      throw;
+    }
+    lock.lock();
+  }
+  writing_ = false;
+  out_cond_.notify_all();
+}
+
+void websocket::write_out(const void *data, size_t len)
+{
+  if (tls_)
+  {
+    fiber_lock lock(io_mtx_);
+    pipe_->write(data, len);
+  }
+  else
+    pipe_->write(data, len);
+}
+
+void websocket::send(const void *data, size_t len, int opcode)
+{
+  if (opcode != k_text && opcode != k_binary)
+    anon_throw(std::runtime_error, "websocket::send called with opcode " << opcode);
+  queue_frame(opcode, data, len, true);
+}
+
+void websocket::ping(const void *data, size_t len)
+{
+  if (len > 125)
+    anon_throw(std::runtime_error, "websocket ping payload longer than 125 bytes");
+  queue_frame(k_ping, data, len, true);
+}
+
+void websocket::close(int code, const std::string &reason)
+{
+  {
+    fiber_lock lock(out_mtx_);
+    if (close_sent_ || write_failed_)
+      return;
+  }
+  char payload[125];
+  size_t len = 0;
+  if (code != k_no_status)
+  {
+    payload[0] = code >> 8;
+    payload[1] = code;
+    len = 2 + std::min(reason.size(), sizeof(payload) - 2);
+    memcpy(&payload[2], reason.data(), len - 2);
+  }
+  try
+  {
+    queue_frame(k_close, payload, len, true);
+  }
+  catch (const fiber_io_error &)
+  {
+    // someone else closed it first
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+websocket::frame::frame(const void *data, size_t len, int opcode, bool compress)
+{
+  uint8_t h[10];
+  size_t hl = 2;
+  auto header = [&](bool rsv1, size_t len) {
+    h[0] = 0x80 | (rsv1 ? 0x40 : 0) | opcode;
+    if (len < 126)
+    {
+      h[1] = len;
+      hl = 2;
+    }
+    else if (len < 65536)
+    {
+      h[1] = 126;
+      h[2] = len >> 8;
+      h[3] = len;
+      hl = 4;
+    }
+    else
+    {
+      h[1] = 127;
+      for (int i = 0; i < 8; i++)
+        h[2 + i] = (uint64_t)len >> (56 - 8 * i);
+      hl = 10;
+    }
+  };
+
+  auto plain = std::make_shared<std::string>();
+  header(false, len);
+  plain->reserve(hl + len);
+  plain->append((const char *)h, hl);
+  plain->append((const char *)data, len);
+  plain_ = std::move(plain);
+
+  // compressed with a fresh window, so any connection that agreed
+  // to permessage-deflate (with the default window size) can read it
+  if (compress && len >= websocket_options().deflate_min_size && frame_zs.ok)
+  {
+    auto &zs = frame_zs.zs;
+    deflateReset(&zs);
+    std::string z(deflateBound(&zs, len) + 16, 0);
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)&z[0];
+    zs.avail_out = z.size();
+    if (::deflate(&zs, Z_SYNC_FLUSH) == Z_OK && zs.avail_in == 0 && zs.avail_out > 0)
+    {
+      z.resize(z.size() - zs.avail_out - sizeof(deflate_tail));
+      if (z.size() < len)
+      {
+        auto deflated = std::make_shared<std::string>();
+        header(true, z.size());
+        deflated->reserve(hl + z.size());
+        deflated->append((const char *)h, hl);
+        deflated->append(z);
+        deflated_ = std::move(deflated);
+      }
+    }
+  }
+}
+
+bool websocket::post(const frame &f)
+{
+  fiber_lock lock(out_mtx_);
+  if (close_sent_ || write_failed_)
+    return false;
+  if (out_bytes_ > opts_.max_queued)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("websocket has " << out_bytes_ << " bytes queued, dropping the connection");
+#endif
+    write_failed_ = true;
+    out_.clear();
+    out_bytes_ = 0;
+    shutdown(fp_->get_fd(), SHUT_RDWR);
+    return false;
+  }
+
+  if (client_)
+  {
+    // has to be masked, differently for each connection
+    lock.unlock();
+    auto &p = *f.plain_;
+    size_t hl = 2 + ((uint8_t)p[1] == 126 ? 2 : (uint8_t)p[1] == 127 ? 8 : 0);
+    try
+    {
+      queue_frame(p[0] & 0x0f, p.data() + hl, p.size() - hl, false);
+    }
+    catch (const fiber_io_error &)
+    {
+      return false;
+    }
+    return true;
+  }
+
+  int window_bits = deflate_.server_max_window_bits;
+  if (f.deflated_ && deflate_.enabled && window_bits == 15)
+  {
+    out_.push_back(f.deflated_);
+    out_bytes_ += f.deflated_->size();
+
+    // the peer's window now holds this message, which our compressor
+    // never saw, so it mustn't refer back past it
+    if (deflater_)
+      deflateReset(&deflater_->zs);
+  }
+  else
+  {
+    out_.push_back(f.plain_);
+    out_bytes_ += f.plain_->size();
+  }
+
+  if (!writing_)
+  {
+    ++drainers_;
+    fiber::run_in_fiber(
+        [this] {
+          fiber_lock lock(out_mtx_);
+          try
+          {
+            write_queued(lock, false);
+          }
+          catch (const std::exception &)
+          {
+          }
+          --drainers_;
+          out_cond_.notify_all();
+        },
+        opts_.stack_size, "websocket post");
+  }
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+void websocket_group::add(websocket *ws)
+{
+  fiber_lock lock(mtx_);
+  sockets_.push_back(ws);
+}
+
+void websocket_group::remove(websocket *ws)
+{
+  fiber_lock lock(mtx_);
+  auto it = std::find(sockets_.begin(), sockets_.end(), ws);
+  if (it != sockets_.end())
+  {
+    *it = sockets_.back();
+    sockets_.pop_back();
+  }
+}
+
+size_t websocket_group::size()
+{
+  fiber_lock lock(mtx_);
+  return sockets_.size();
+}
+
+size_t websocket_group::broadcast(const websocket::frame &f)
+{
+  fiber_lock lock(mtx_);
+  size_t sent = 0;
+  for (auto ws : sockets_)
+    if (ws->post(f))
+      ++sent;
+  return sent;
+}
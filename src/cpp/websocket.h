@@ -0,0 +1,289 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "fiber.h"
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+class tls_pipe;
+
+// the settings of a websocket connection, see below
+struct websocket_options
+{
+  // a message bigger than this (after decompression) closes
+  // the connection with k_message_too_big
+  size_t max_message_size{16 * 1024 * 1024};
+
+  // accept permessage-deflate (RFC 7692) when the client offers it.
+  // Without context takeover each message is compressed on its own,
+  // which compresses worse but keeps no compressor state between
+  // messages.
+  bool permessage_deflate{true};
+  bool deflate_context_takeover{true};
+  int deflate_level{6};
+
+  // messages shorter than this are sent uncompressed
+  size_t deflate_min_size{128};
+
+  // an idle connection is pinged this often, and dropped if the
+  // peer hasn't sent anything by the next time.  0 turns that off.
+  int ping_interval_seconds{30};
+
+  // a write blocked for longer than this drops the connection
+  int write_timeout_seconds{30};
+
+  // a connection with more than this many bytes queued by post
+  // (a client that isn't keeping up with broadcasts) is dropped
+  size_t max_queued{4 * 1024 * 1024};
+
+  // the subprotocols (Sec-WebSocket-Protocol) the server speaks,
+  // most preferred first
+  std::vector<std::string> protocols;
+
+  size_t stack_size{fiber::k_default_stack_size};
+};
+
+// the permessage-deflate parameters agreed in the handshake
+struct websocket_deflate
+{
+  bool enabled{false};
+  bool server_no_context_takeover{false};
+  bool client_no_context_takeover{false};
+  int server_max_window_bits{15};
+  int client_max_window_bits{15};
+};
+
+// one WebSocket (RFC 6455) connection, from either end.  A server gets
+// these through websocket_handler.
+//
+// read blocks the calling fiber until a whole message has arrived,
+// answering pings and reassembling fragmented messages along the way,
+// and unmasks client data in place.  Any number of fibers can send at
+// once.  Frames are queued and written by whichever fiber finds nothing
+// being written, so frames sent by several fibers go out in a few
+// writes.  A tls_pipe can't be read and written from two fibers at once,
+// so over tls the reader waits for the socket to be readable before it
+// takes the lock that writers use.
+class websocket
+{
+public:
+  typedef websocket_options options;
+
+  // 'pipe' is the connection, which the caller still owns.  'buffered'
+  // is anything already read from it, after the handshake.
+  websocket(::pipe_t *pipe, bool client, const options &opts = options(),
+            const websocket_deflate &deflate = websocket_deflate(),
+            std::vector<char> &&buffered = std::vector<char>());
+
+  // sends a close frame, if one hasn't been sent, and waits for
+  // anything still queued to be written
+  ~websocket();
+
+  // opcodes, from section 5.2 of RFC 6455
+  enum
+  {
+    k_continuation = 0x0,
+    k_text = 0x1,
+    k_binary = 0x2,
+    k_close = 0x8,
+    k_ping = 0x9,
+    k_pong = 0xa
+  };
+
+  // close codes, from section 7.4.1
+  enum
+  {
+    k_normal_closure = 1000,
+    k_going_away = 1001,
+    k_protocol_error = 1002,
+    k_unsupported_data = 1003,
+    k_no_status = 1005,
+    k_abnormal_closure = 1006,
+    k_invalid_payload = 1007,
+    k_policy_violation = 1008,
+    k_message_too_big = 1009,
+    k_internal_error = 1011
+  };
+
+  struct message
+  {
+    int opcode{k_binary}; // k_text or k_binary
+    std::vector<char> data;
+
+    bool is_text() const { return opcode == k_text; }
+    std::string str() const { return std::string(data.begin(), data.end()); }
+  };
+
+  // wait for the next message.  Returns false once the connection has
+  // closed - the peer sent a close frame, broke the protocol, or went
+  // away - see close_code.  Only one fiber at a time may call this.
+  // Text messages have been checked to be valid UTF-8.
+  bool read(message &msg);
+
+  // send a message, waiting while more than a little is already
+  // queued.  Throws fiber_io_error if the connection has closed.
+  void send(const void *data, size_t len, int opcode = k_binary);
+  void send(const std::string &text)
+  {
+    send(text.data(), text.size(), k_text);
+  }
+
+  void ping(const void *data = 0, size_t len = 0);
+
+  // start the closing handshake.  The peer answers with a close frame
+  // of its own, which read sees.  Nothing can be sent after this.
+  void close(int code = k_normal_closure, const std::string &reason = std::string());
+
+  // a message serialized (and compressed) once, that can then be
+  // posted to any number of connections, see websocket_group
+  class frame
+  {
+  public:
+    frame(const void *data, size_t len, int opcode = k_binary, bool compress = true);
+
+  private:
+    friend class websocket;
+    std::shared_ptr<const std::string> plain_;
+    std::shared_ptr<const std::string> deflated_; // null when not compressed
+  };
+
+  // queue 'f' without waiting for it to be written - that is done by a
+  // fiber of its own if nothing else is writing.  Returns false if the
+  // connection has closed.  A connection with more than max_queued
+  // bytes waiting is dropped.
+  bool post(const frame &f);
+
+  // the code the peer closed with, k_no_status if it didn't give one,
+  // or k_abnormal_closure if the connection ended without a close frame
+  int close_code() const { return close_code_; }
+
+  const websocket_deflate &deflate() const { return deflate_; }
+
+  // the subprotocol agreed in the handshake, or ""
+  const std::string &protocol() const { return protocol_; }
+  void set_protocol(const std::string &protocol) { protocol_ = protocol; }
+
+  // xor 'len' bytes of 'data' with the 4 byte masking 'key', where
+  // data[0] is byte 'pos' of the frame payload (section 5.3)
+  static void apply_mask(void *data, size_t len, const uint8_t key[4], size_t pos = 0);
+
+  // the SIMD engine apply_mask uses on this cpu
+  static const char *mask_engine_name();
+
+private:
+  websocket(const websocket &) = delete;
+  websocket &operator=(const websocket &) = delete;
+
+  struct protocol_error
+  {
+    int code;
+    const char *what;
+  };
+
+  size_t read_some(void *buff, size_t len);
+  bool wait_readable();
+  bool fill(size_t needed);
+  bool read_payload(std::vector<char> &dest, size_t len, const uint8_t *key);
+  void on_control(int opcode, const uint8_t *payload, size_t len);
+  void inflate_message(message &msg);
+
+  void append_frame(std::string &out, int opcode, bool rsv1, const void *data, size_t len);
+  void deflate_payload(std::string &out, const void *data, size_t len);
+  void queue_frame(int opcode, const void *data, size_t len, bool wait);
+  void write_queued(fiber_lock &lock, bool wait);
+  void write_out(const void *data, size_t len);
+
+  struct zstate;
+
+  ::pipe_t *pipe_;
+  tls_pipe *tls_;
+  fiber_pipe *fp_;
+  bool client_;
+  options opts_;
+  websocket_deflate deflate_;
+  std::string protocol_;
+
+  // read side - only touched by the fiber in read
+  std::vector<char> in_;
+  size_t in_start_{0};
+  size_t in_end_{0};
+  int msg_opcode_{0}; // of a fragmented message being read
+  bool msg_deflated_{false};
+  std::vector<char> zin_;
+  std::unique_ptr<zstate> inflater_;
+  bool awaiting_pong_{false};
+  bool close_received_{false};
+  int close_code_{k_abnormal_closure};
+
+  // write side, all under out_mtx_
+  fiber_mutex out_mtx_;
+  fiber_cond out_cond_;
+  std::deque<std::shared_ptr<const std::string>> out_;
+  size_t out_bytes_{0};
+  bool writing_{false};
+  bool write_failed_{false};
+  bool close_sent_{false};
+  int drainers_{0};
+  std::unique_ptr<zstate> deflater_;
+
+  fiber_mutex io_mtx_;
+
+  enum
+  {
+    k_max_out = 256 * 1024,
+    k_max_batch = 64 * 1024,
+
+    // how much read_payload grows its destination by at a time, so a
+    // frame that claims to be huge only costs memory as it arrives
+    k_payload_chunk = 64 * 1024
+  };
+};
+
+// a set of connections that can all be sent the same message, which
+// is serialized and compressed once however many there are.  Sockets
+// that have fallen behind are dropped rather than holding up the rest.
+class websocket_group
+{
+public:
+  void add(websocket *ws);
+  void remove(websocket *ws);
+  size_t size();
+
+  // returns the number of connections the message was queued for
+  size_t broadcast(const websocket::frame &f);
+  size_t broadcast(const void *data, size_t len, int opcode = websocket::k_binary)
+  {
+    return broadcast(websocket::frame(data, len, opcode));
+  }
+  size_t broadcast(const std::string &text)
+  {
+    return broadcast(text.data(), text.size(), websocket::k_text);
+  }
+
+private:
+  fiber_mutex mtx_;
+  std::vector<websocket *> sockets_;
+};
@@ -0,0 +1,250 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#include "websocket_handler.h"
+#include "b64.h"
+#include <openssl/sha.h>
+#include <ctype.h>
+#include <strings.h>
+
+namespace
+{
+
+bool is_space(char c)
+{
+  return c == ' ' || c == '\t';
+}
+
+// split 'val' at each 'sep' (outside of quotes), trimming
+// the white space from around the pieces
+std::vector<std::string> split(const char *p, const char *end, char sep)
+{
+  std::vector<std::string> pieces;
+  while (p < end)
+  {
+    auto start = p;
+    bool quoted = false;
+    while (p < end && (quoted || *p != sep))
+    {
+      if (*p == '"')
+        quoted = !quoted;
+      ++p;
+    }
+    auto e = p;
+    while (start < e && is_space(*start))
+      ++start;
+    while (e > start && is_space(e[-1]))
+      --e;
+    if (e > start)
+      pieces.push_back(std::string(start, e));
+    ++p;
+  }
+  return pieces;
+}
+
+// the window bits of a max_window_bits parameter, -1 if it isn't valid
+int window_bits(const std::string &val)
+{
+  auto v = val;
+  if (v.size() >= 2 && v[0] == '"' && v.back() == '"')
+    v = v.substr(1, v.size() - 2);
+  if (v.size() < 1 || v.size() > 2 || v.find_first_not_of("0123456789") != std::string::npos)
+    return -1;
+  auto bits = atoi(v.c_str());
+  return bits >= 8 && bits <= 15 ? bits : -1;
+}
+
+// pick the first permessage-deflate offer (RFC 7692 section 7) that we
+// can accept from the client's Sec-WebSocket-Extensions headers.
+// Returns the value of our Sec-WebSocket-Extensions response header,
+// or "" if we aren't using it.
+std::string negotiate_deflate(const http_request &request, const websocket::options &opts, websocket_deflate &agreed)
+{
+  if (!opts.permessage_deflate)
+    return std::string();
+
+  for (auto &fv : request.headers.headers)
+  {
+    if (fv.first.len() != 24 || memcmp(fv.first.ptr(), "sec-websocket-extensions", 24))
+      continue;
+    for (auto &offer : split(fv.second.ptr(), fv.second.ptr() + fv.second.len(), ','))
+    {
+      auto params = split(offer.data(), offer.data() + offer.size(), ';');
+      if (params.empty() || strcasecmp(params[0].c_str(), "permessage-deflate"))
+        continue;
+
+      websocket_deflate d;
+      d.enabled = true;
+      bool ok = true;
+      int seen = 0;
+      for (size_t i = 1; ok && i < params.size(); i++)
+      {
+        auto eq = params[i].find('=');
+        auto name = params[i].substr(0, eq);
+        while (!name.empty() && is_space(name.back()))
+          name.pop_back();
+        std::string val;
+        if (eq != std::string::npos)
+        {
+          val = params[i].substr(eq + 1);
+          while (!val.empty() && is_space(val[0]))
+            val.erase(0, 1);
+        }
+        int bit;
+        if (name == "server_no_context_takeover" && eq == std::string::npos)
+        {
+          bit = 1;
+          d.server_no_context_takeover = true;
+        }
+        else if (name == "client_no_context_takeover" && eq == std::string::npos)
+        {
+          bit = 2;
+          d.client_no_context_takeover = true;
+        }
+        else if (name == "server_max_window_bits")
+        {
+          bit = 4;
+          // zlib can't compress with a 256 byte window
+          d.server_max_window_bits = window_bits(val);
+          ok = d.server_max_window_bits >= 9;
+        }
+        else if (name == "client_max_window_bits")
+        {
+          // we inflate with the biggest window, which reads
+          // whatever window size the client uses
+          bit = 8;
+          if (eq != std::string::npos)
+            ok = window_bits(val) > 0;
+        }
+        else
+          bit = 0;
+        ok = ok && bit && !(seen & bit);
+        seen |= bit;
+      }
+      if (!ok)
+        continue;
+
+      if (!opts.deflate_context_takeover)
+        d.server_no_context_takeover = true;
+      agreed = d;
+      std::string resp = "permessage-deflate";
+      if (d.server_no_context_takeover)
+        resp += "; server_no_context_takeover";
+      if (d.client_no_context_takeover)
+        resp += "; client_no_context_takeover";
+      if (d.server_max_window_bits < 15)
+        resp += "; server_max_window_bits=" + std::to_string(d.server_max_window_bits);
+      return resp;
+    }
+  }
+  return std::string();
+}
+
+// the first of our protocols that the client offers
+std::string negotiate_protocol(const http_request &request, const websocket::options &opts)
+{
+  for (auto &ours : opts.protocols)
+    for (auto &fv : request.headers.headers)
+    {
+      if (fv.first.len() != 22 || memcmp(fv.first.ptr(), "sec-websocket-protocol", 22))
+        continue;
+      for (auto &theirs : split(fv.second.ptr(), fv.second.ptr() + fv.second.len(), ','))
+        if (theirs == ours)
+          return ours;
+    }
+  return std::string();
+}
+
+void refuse(http_server::pipe_t &pipe, const char *status, const char *why, const char *version = 0)
+{
+  http_response response;
+  response.set_status_code(status);
+  response.add_header("content-type", "text/plain");
+  if (version)
+    response.add_header("sec-websocket-version", version);
+  response << why << "\n";
+  pipe.respond(response);
+}
+
+} // namespace
+
+void websocket_handler::upgrade(http_server::pipe_t &pipe, const http_request &request)
+{
+  // section 4.2.1 of the spec
+  if (request.method != HTTP_GET || request.http_major < 1 || (request.http_major == 1 && request.http_minor < 1))
+  {
+    refuse(pipe, "400 Bad Request", "websocket upgrade requires an HTTP/1.1 GET");
+    return;
+  }
+  auto version = request.headers.get_header("sec-websocket-version");
+  if (version.len() != 2 || memcmp(version.ptr(), "13", 2))
+  {
+    refuse(pipe, "426 Upgrade Required", "unsupported websocket version", "13");
+    return;
+  }
+  // 16 bytes, base64 encoded
+  auto key = request.headers.get_header("sec-websocket-key");
+  bool key_ok = key.len() == 24 && !memcmp(key.ptr() + 22, "==", 2);
+  for (size_t i = 0; key_ok && i < 22; i++)
+    key_ok = isalnum((unsigned char)key.ptr()[i]) || key.ptr()[i] == '+' || key.ptr()[i] == '/';
+  if (!key_ok)
+  {
+    refuse(pipe, "400 Bad Request", "missing or invalid sec-websocket-key");
+    return;
+  }
+
+  // the key, with the GUID from section 1.3, hashed
+  auto accept_src = key.str() + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  unsigned char sha[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char *)accept_src.data(), accept_src.size(), sha);
+
+  websocket_deflate deflate;
+  auto extensions = negotiate_deflate(request, opts_, deflate);
+  auto protocol = negotiate_protocol(request, opts_);
+
+  http_response resp;
+  resp.set_status_code("101 Switching Protocols");
+  resp.add_header("upgrade", "websocket");
+  resp.add_header("connection", "Upgrade");
+  resp.add_header("sec-websocket-accept", b64_encode((const char *)sha, sizeof(sha), '='));
+  if (!extensions.empty())
+    resp.add_header("sec-websocket-extensions", extensions);
+  if (!protocol.empty())
+    resp.add_header("sec-websocket-protocol", protocol);
+  pipe.respond(resp);
+
+  std::vector<char> buffered;
+  auto conn_pipe = pipe.detach(buffered);
+  websocket ws(conn_pipe, false /*client*/, opts_, deflate, std::move(buffered));
+  ws.set_protocol(protocol);
+  try
+  {
+    f_(ws, request);
+  }
+  catch (const std::exception &e)
+  {
+#if ANON_LOG_NET_TRAFFIC > 1
+    anon_log("websocket handler threw: " << e.what());
+#endif
+    ws.close(websocket::k_internal_error);
+  }
+}
@@ -0,0 +1,63 @@
+/*
+ Copyright (c) 2026 Anon authors, see AUTHORS file.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+*/
+
+#pragma once
+
+#include "http_server.h"
+#include "websocket.h"
+#include <functional>
+
+// answers WebSocket (RFC 6455) upgrade requests on an http_server,
+// handling the opening handshake - including permessage-deflate and
+// subprotocol negotiation - and then calling 'f' with the connection.
+// 'f' runs in the fiber that served the upgrade request, and the
+// connection is closed when it returns.  Its signature must be:
+//
+//    void f(websocket &ws, const http_request &request)
+//
+// and it would typically look like:
+//
+//    websocket::message msg;
+//    while (ws.read(msg))
+//      ws.send(... a reply to msg ...);
+//
+// Must be constructed before the server's start, and last for as long
+// as the server does.
+class websocket_handler
+{
+public:
+  template <typename Fn>
+  websocket_handler(http_server &serv, Fn f, const websocket::options &opts = websocket::options())
+      : f_(f),
+        opts_(opts)
+  {
+    auto upgrade = [this](http_server::pipe_t &pipe, const http_request &request) { this->upgrade(pipe, request); };
+    serv.add_upgrade_handler("websocket", upgrade);
+    serv.add_upgrade_handler("WebSocket", upgrade);
+  }
+
+private:
+  void upgrade(http_server::pipe_t &pipe, const http_request &request);
+
+  std::function<void(websocket &, const http_request &)> f_;
+  websocket::options opts_;
+};